@@ -0,0 +1,1758 @@
+#include "bptree.h"
+#include "bptsearch.h"
+#include "bptfile.h"
+#include "bptwal.h"
+#include "bptpack.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+using namespace std;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t rng_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/*
+ * Time one in-node search kernel over a batch of sorted key arrays.
+ */
+static double time_kernel(bpt_rank_fn fn, const vector<uint64_t>& keys,
+                          int n, const vector<uint64_t>& probes)
+{
+    const int nr_nodes = keys.size() / n;
+    volatile int sink = 0;
+    double start = now();
+    for (size_t i=0; i < probes.size(); ++i) {
+        const uint64_t* node = keys.data() + (i % nr_nodes) * n;
+        sink += fn(node, n, probes[i]);
+    }
+    (void) sink;
+    return (now() - start) * 1e9 / probes.size();
+}
+
+/*
+ * Compare the in-node search kernels at several fanouts.
+ */
+static void bench_search()
+{
+    struct kernel {
+        const char* name;
+        bpt_rank_fn fn;
+        int usable;
+    };
+
+    int avx2 = 0, avx512 = 0;
+#if BPT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f");
+#endif
+
+    const struct kernel kernels[] = {
+        { "bisect", bpt_rank_bisect, 1 },
+        { "scan", bpt_scan_scalar, 1 },
+        { "hybrid", bpt_rank_scalar, 1 },
+#if BPT_HAVE_X86_SIMD
+        { "avx2-scan", bpt_scan_avx2, avx2 },
+        { "avx2-hybrid", bpt_rank_avx2, avx2 },
+        { "avx512-scan", bpt_scan_avx512, avx512 },
+        { "avx512-hybrid", bpt_rank_avx512, avx512 },
+#endif
+    };
+    const int nr_kernels = sizeof(kernels) / sizeof(kernels[0]);
+    const int fanouts[] = { 4, 8, 16, 32, 64, 128, 256 };
+
+    printf("# in-node search, ns/search (selected: %s)\n",
+           bpt_rank_select() == bpt_rank_scalar ? "hybrid" :
+           avx512 ? "avx512-hybrid" : "avx2-hybrid");
+    printf("%-8s", "fanout");
+    for (int k=0; k < nr_kernels; ++k) {
+        if (kernels[k].usable) {
+            printf(" %14s", kernels[k].name);
+        }
+    }
+    printf("\n");
+
+    for (size_t f=0; f < sizeof(fanouts) / sizeof(fanouts[0]); ++f) {
+        // Enough nodes to spill out of L1, with probes spread over them.
+        const int n = fanouts[f] - 1;
+        const int nr_nodes = (1 << 16) / n;
+        vector<uint64_t> keys(nr_nodes * n);
+        for (size_t i=0; i < keys.size(); ++i) {
+            keys[i] = rng();
+        }
+        for (int i=0; i < nr_nodes; ++i) {
+            sort(keys.begin() + i * n, keys.begin() + (i + 1) * n);
+        }
+        vector<uint64_t> probes(1 << 22);
+        for (size_t i=0; i < probes.size(); ++i) {
+            probes[i] = rng();
+        }
+
+        printf("%-8d", fanouts[f]);
+        for (int k=0; k < nr_kernels; ++k) {
+            if (kernels[k].usable) {
+                printf(" %14.2f",
+                       time_kernel(kernels[k].fn, keys, n, probes));
+            }
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Compare heap-backed and arena-backed trees on insert and teardown.
+ */
+static void bench_alloc(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+
+    printf("# node allocation, %ld random inserts\n", n);
+    printf("%-8s %14s %14s\n", "backing", "insert Mops/s", "teardown ms");
+    for (int arena=0; arena < 2; ++arena) {
+        struct bptree* bpt = arena ?
+            bptree_alloc_arena(keys[0], NULL, NULL) :
+            bptree_alloc(keys[0], NULL);
+        double start = now();
+        for (long i=1; i < n; ++i) {
+            bptree_insert(&bpt, keys[i], (void*) keys[i]);
+        }
+        double mid = now();
+        bptree_free(bpt);
+        double end = now();
+        printf("%-8s %14.2f %14.1f\n", arena ? "arena" : "heap",
+               (n - 1) / (mid - start) / 1e6, (end - mid) * 1e3);
+    }
+}
+
+/*
+ * Compare building a tree key by key against tearing it down key by key, in
+ * ascending and random order.
+ */
+static void bench_delete(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = 2 * i;
+    }
+
+    printf("# %ld inserts then %ld deletes, ORDER=%d\n", n, n, ORDER);
+    printf("%-8s %-12s %14s %14s %8s\n", "backing", "order",
+           "insert Mops/s", "delete Mops/s", "ratio");
+    for (int arena=0; arena < 2; ++arena) {
+        for (int shuffled=0; shuffled < 2; ++shuffled) {
+            if (shuffled) {
+                for (long i=n - 1; i > 0; --i) {
+                    swap(keys[i], keys[rng() % (i + 1)]);
+                }
+            } else {
+                sort(keys.begin(), keys.end());
+            }
+            struct bptree* bpt = arena ?
+                bptree_alloc_arena(keys[0], NULL, NULL) :
+                bptree_alloc(keys[0], NULL);
+            double start = now();
+            for (long i=1; i < n; ++i) {
+                bptree_insert(&bpt, keys[i], (void*) keys[i]);
+            }
+            double mid = now();
+            for (long i=1; i < n; ++i) {
+                bptree_delete(&bpt, keys[i]);
+            }
+            double end = now();
+            bptree_free(bpt);
+            double ins = (n - 1) / (mid - start) / 1e6;
+            double del = (n - 1) / (end - mid) / 1e6;
+            printf("%-8s %-12s %14.2f %14.2f %8.2f\n",
+                   arena ? "arena" : "heap",
+                   shuffled ? "random" : "ascending", ins, del, del / ins);
+        }
+    }
+}
+
+static int count_run(void* ctx, const uint64_t* keys, void* const* vals,
+                     int n)
+{
+    (void) keys;
+    (void) vals;
+    *(size_t*) ctx += n;
+    return 0;
+}
+
+/*
+ * Expire the oldest keys of a tree in windows, as a TTL sweep would: one
+ * delete per key against a single range delete per window.
+ */
+static void bench_expire(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = i + 1;
+    }
+    const long windows[] = { 100, 10000, n / 10 };
+
+    printf("# expiring %ld keys oldest first, ORDER=%d, Mkeys/s\n", n, ORDER);
+    printf("%-10s %14s %14s %8s\n", "window", "delete", "delete_range",
+           "speedup");
+    for (int w=0; w < 3; ++w) {
+        long window = windows[w];
+        if (window < 1 || (w > 0 && window <= windows[w - 1])) {
+            continue;
+        }
+        double rates[2];
+        for (int ranged=0; ranged < 2; ++ranged) {
+            struct bptree* bpt = bptree_bulk_load(keys.data(),
+                                                  (void* const*) keys.data(),
+                                                  n, 0.7);
+            size_t freed = 0;
+            double start = now();
+            for (long lo=1; lo <= n; lo += window) {
+                uint64_t hi = min(lo + window, n + 1);
+                if (ranged) {
+                    bptree_delete_range(&bpt, lo, hi, count_run, &freed);
+                } else {
+                    for (uint64_t k=lo; k < hi; ++k) {
+                        freed += bptree_delete(&bpt, k) != NULL;
+                    }
+                }
+            }
+            rates[ranged] = freed / (now() - start) / 1e6;
+            bptree_free(bpt);
+        }
+        printf("%-10ld %14.2f %14.2f %8.1f\n", window, rates[0], rates[1],
+               rates[1] / rates[0]);
+    }
+}
+
+/*
+ * Ingest sorted batches of fresh random keys into a large existing tree,
+ * one insert per key against one batch insert per batch.
+ */
+static void bench_ingest(long n)
+{
+    vector<uint64_t> base(n);
+    for (long i=0; i < n; ++i) {
+        base[i] = 2 * i;
+    }
+    const long batches[] = { 100, 10000, 100000 };
+    const long total = n / 2;
+
+    printf("# %ld keys ingested into a tree of %ld, ORDER=%d, Mkeys/s\n",
+           total, n, ORDER);
+    printf("%-10s %14s %14s %8s\n", "batch", "insert", "sorted_batch",
+           "speedup");
+    for (int b=0; b < 3; ++b) {
+        long size = min(batches[b], total);
+        vector<vector<uint64_t> > runs;
+        for (long done=0; done < total; done += size) {
+            vector<uint64_t> run(min(size, total - done));
+            for (size_t i=0; i < run.size(); ++i) {
+                run[i] = 2 * (rng() % n) + 1;
+            }
+            sort(run.begin(), run.end());
+            runs.push_back(run);
+        }
+
+        double rates[2];
+        for (int batched=0; batched < 2; ++batched) {
+            struct bptree* bpt = bptree_bulk_load(base.data(), NULL, n, 0.7);
+            double start = now();
+            for (size_t r=0; r < runs.size(); ++r) {
+                if (batched) {
+                    bptree_insert_sorted_batch(&bpt, runs[r].data(),
+                                               (void* const*) runs[r].data(),
+                                               runs[r].size());
+                } else {
+                    for (size_t i=0; i < runs[r].size(); ++i) {
+                        bptree_insert(&bpt, runs[r][i], (void*) runs[r][i]);
+                    }
+                }
+            }
+            rates[batched] = total / (now() - start) / 1e6;
+            bptree_free(bpt);
+        }
+        printf("%-10ld %14.2f %14.2f %8.1f\n", size, rates[0], rates[1],
+               rates[1] / rates[0]);
+    }
+}
+
+/*
+ * Insert and then look up a stream of keys, from the root every time and
+ * through a finger, for sequential, nearly sorted and random streams.
+ */
+static void bench_finger(long n)
+{
+    static const char* streams[] = { "sequential", "nearly", "random" };
+
+    printf("# %ld keys per stream, ORDER=%d, Mops/s\n", n, ORDER);
+    printf("%-12s %10s %10s %10s %10s\n", "stream", "insert", "+finger",
+           "lookup", "+finger");
+    for (int st=0; st < 3; ++st) {
+        // Nearly sorted: ascending, but each key is swapped with one of the
+        // next few.
+        vector<uint64_t> keys(n);
+        for (long i=0; i < n; ++i) {
+            keys[i] = st == 2 ? rng() : (uint64_t) i + 1;
+        }
+        if (st == 1) {
+            for (long i=0; i + 1 < n; ++i) {
+                swap(keys[i], keys[i + rng() % min(8L, n - i)]);
+            }
+        }
+
+        double rates[4];
+        for (int fingered=0; fingered < 2; ++fingered) {
+            struct bptree_finger f;
+            bptree_finger_init(&f);
+            struct bptree* bpt = bptree_alloc(0, NULL);
+            volatile uint64_t sink = 0;
+            double start = now();
+            for (long i=0; i < n; ++i) {
+                if (fingered) {
+                    bptree_finger_insert(&bpt, &f, keys[i], (void*) keys[i]);
+                } else {
+                    bptree_insert(&bpt, keys[i], (void*) keys[i]);
+                }
+            }
+            double mid = now();
+            for (long i=0; i < n; ++i) {
+                sink += (uint64_t) (fingered ?
+                    bptree_finger_lookup(bpt, &f, keys[i]) :
+                    bptree_lookup(bpt, keys[i]));
+            }
+            double end = now();
+            rates[fingered] = n / (mid - start) / 1e6;
+            rates[2 + fingered] = n / (end - mid) / 1e6;
+            bptree_free(bpt);
+        }
+        printf("%-12s %10.2f %10.2f %10.2f %10.2f\n", streams[st],
+               rates[0], rates[1], rates[2], rates[3]);
+    }
+
+    // Sequential streams into several trees at once, taking turns: splits
+    // in one tree leave the fingers on the others alone.
+    double rates[2];
+    for (int fingered=0; fingered < 2; ++fingered) {
+        struct bptree* trees[4];
+        struct bptree_finger fingers[4];
+        for (int t=0; t < 4; ++t) {
+            trees[t] = bptree_alloc(0, NULL);
+            bptree_finger_init(&fingers[t]);
+        }
+        double start = now();
+        for (long i=0; i < n; ++i) {
+            struct bptree** bpt = &trees[i % 4];
+            if (fingered) {
+                bptree_finger_insert(bpt, &fingers[i % 4], i + 1, NULL);
+            } else {
+                bptree_insert(bpt, i + 1, NULL);
+            }
+        }
+        rates[fingered] = n / (now() - start) / 1e6;
+        for (int t=0; t < 4; ++t) {
+            bptree_free(trees[t]);
+        }
+    }
+    printf("%-12s %10.2f %10.2f\n", "4 trees", rates[0], rates[1]);
+}
+
+/*
+ * Report how full inserts leave the tree, and what that costs in memory, for
+ * ascending, descending, nearly sorted and random streams.
+ */
+static void bench_fill(long n)
+{
+    static const char* streams[] = {
+        "ascending", "descending", "nearly", "random"
+    };
+
+    printf("# %ld keys per stream, ORDER=%d\n", n, ORDER);
+    printf("%-12s %10s %10s %10s %12s %10s\n", "stream", "avg_fill",
+           "min_fill", "leaves", "bytes/key", "Mops/s");
+    for (int st=0; st < 4; ++st) {
+        vector<uint64_t> keys(n);
+        for (long i=0; i < n; ++i) {
+            keys[i] = st == 3 ? rng() : (uint64_t) (st == 1 ? n - i : i + 1);
+        }
+        if (st == 2) {
+            for (long i=0; i + 1 < n; ++i) {
+                swap(keys[i], keys[i + rng() % min(8L, n - i)]);
+            }
+        }
+
+        struct bptree* bpt = bptree_alloc(keys[0], (void*) keys[0]);
+        double start = now();
+        for (long i=1; i < n; ++i) {
+            bptree_insert(&bpt, keys[i], (void*) keys[i]);
+        }
+        double elapsed = now() - start;
+
+        struct bptree_stats stats;
+        bptree_stats(bpt, &stats);
+        printf("%-12s %10.3f %10.3f %10zu %12.1f %10.2f\n", streams[st],
+               stats.avg_fill, stats.min_fill, stats.nr_leaves,
+               (double) stats.bytes / stats.nr_keys, n / elapsed / 1e6);
+        bptree_free(bpt);
+    }
+}
+
+/*
+ * Thin out a tree with random deletes, then compact it in one go and in
+ * bounded slices. Reports the shape before and after, lookup speed, and the
+ * longest pause a slice causes.
+ */
+static void bench_compact(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+
+    printf("# %ld random inserts, 2/3 deleted again, ORDER=%d\n", n, ORDER);
+    printf("%-10s %8s %10s %10s %10s %12s %10s\n", "state", "height",
+           "nodes", "avg_fill", "bytes/key", "lookup Mops", "ms");
+    for (long budget=0; budget <= 256; budget += 256) {
+        struct bptree* bpt = bptree_alloc(keys[0], NULL);
+        for (long i=1; i < n; ++i) {
+            bptree_insert(&bpt, keys[i], (void*) keys[i]);
+        }
+        for (long i=1; i < n; ++i) {
+            if (i % 3) {
+                bptree_delete(&bpt, keys[i]);
+            }
+        }
+
+        double elapsed = 0, longest = 0;
+        long slices = 0;
+        for (int pass=0; pass < 2; ++pass) {
+            if (pass) {
+                struct bptree_compaction c = { 1.0, 0, 0, 0, 0 };
+                double start = now();
+                for (int more=1; more; ++slices) {
+                    double t = now();
+                    more = budget ?
+                        bptree_compact_step(&bpt, &c, budget) :
+                        (bptree_compact(&bpt, 1.0), 0);
+                    longest = max(longest, now() - t);
+                }
+                elapsed = now() - start;
+            }
+
+            struct bptree_stats st;
+            bptree_stats(bpt, &st);
+            volatile uint64_t sink = 0;
+            double start = now();
+            for (long i=0; i < n; ++i) {
+                sink += (uint64_t) bptree_lookup(bpt, keys[i]);
+            }
+            double rate = n / (now() - start) / 1e6;
+            const char* state = !pass ? "thinned" :
+                                budget ? "sliced" : "compacted";
+            printf("%-10s %8d %10zu %10.3f %10.1f %12.2f %10.1f\n", state,
+                   st.height, st.nr_nodes, st.avg_fill,
+                   (double) st.bytes / st.nr_keys, rate, elapsed * 1e3);
+        }
+        if (budget) {
+            printf("# %ld slices of %ld nodes, longest %.1f us\n", slices,
+                   budget, longest * 1e6);
+        }
+        bptree_free(bpt);
+    }
+}
+
+/*
+ * Time inserts, deletes and the order statistic queries. Build with and
+ * without BPT_COUNTS to compare; without it the queries scan.
+ */
+static void bench_rank(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng() >> 1;
+    }
+    const long nr_queries = BPT_COUNTS ? 100000 : 200;
+
+    printf("# %ld random keys, ORDER=%d, BPT_COUNTS=%d, node %zu bytes\n", n,
+           ORDER, BPT_COUNTS, sizeof(struct bptree));
+    double start = now();
+    struct bptree* bpt = bptree_alloc(keys[0], NULL);
+    for (long i=1; i < n; ++i) {
+        bptree_insert(&bpt, keys[i], (void*) keys[i]);
+    }
+    printf("%-16s %10.3f us/op\n", "insert", (now() - start) * 1e6 / n);
+
+    volatile uint64_t sink = 0;
+    start = now();
+    for (long i=0; i < nr_queries; ++i) {
+        sink += bptree_rank(bpt, keys[i]);
+    }
+    printf("%-16s %10.3f us/op\n", "rank", (now() - start) * 1e6 / nr_queries);
+
+    start = now();
+    for (long i=0; i < nr_queries; ++i) {
+        uint64_t key;
+        void* val;
+        sink += bptree_select(bpt, rng() % n, &key, &val) ? key : 0;
+    }
+    printf("%-16s %10.3f us/op\n", "select",
+           (now() - start) * 1e6 / nr_queries);
+
+    const uint64_t widths[] = { 1ULL << 40, 1ULL << 56 };
+    for (int w=0; w < 2; ++w) {
+        start = now();
+        for (long i=0; i < nr_queries; ++i) {
+            uint64_t lo = keys[i] - min(keys[i], widths[w] / 2);
+            sink += bptree_count_range(bpt, lo, lo + widths[w]);
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "count 1/%llu",
+                 (unsigned long long) ((1ULL << 63) / widths[w]));
+        printf("%-16s %10.3f us/op\n", name,
+               (now() - start) * 1e6 / nr_queries);
+    }
+
+    start = now();
+    for (long i=1; i < n; ++i) {
+        bptree_delete(&bpt, keys[i]);
+    }
+    printf("%-16s %10.3f us/op\n", "delete", (now() - start) * 1e6 / n);
+    bptree_free(bpt);
+}
+
+/*
+ * Look up absent and present keys with and without a negative-lookup filter,
+ * at a few filter sizes.
+ */
+static void bench_filter(long n)
+{
+    vector<uint64_t> keys(n), absent(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng() & ~1ULL;
+        absent[i] = rng() | 1;
+    }
+    struct bptree* bpt = bptree_alloc(keys[0], (void*) keys[0]);
+    for (long i=1; i < n; ++i) {
+        bptree_insert(&bpt, keys[i], (void*) keys[i]);
+    }
+    random_shuffle(keys.begin(), keys.end());
+    struct bptree_stats st;
+    bptree_stats(bpt, &st);
+
+    printf("# %ld random keys, ORDER=%d, tree %.1f bytes/key, Mops/s\n", n,
+           ORDER, (double) st.bytes / st.nr_keys);
+    printf("%-8s %6s %10s %10s %10s %10s %8s\n", "bits/key", "probes",
+           "bytes/key", "false+ %", "miss", "hit", "speedup");
+
+    volatile uint64_t sink = 0;
+    double base[2];
+    for (int hit=0; hit < 2; ++hit) {
+        const vector<uint64_t>& probe = hit ? keys : absent;
+        double start = now();
+        for (long i=0; i < n; ++i) {
+            sink += (uint64_t) bptree_lookup(bpt, probe[i]);
+        }
+        base[hit] = n / (now() - start) / 1e6;
+    }
+    printf("%-8s %6s %10s %10s %10.2f %10.2f %8s\n", "none", "-", "-", "-",
+           base[0], base[1], "-");
+
+    const double sizes[] = { 6, 10, 16 };
+    struct bptree_filter f = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+    for (int s=0; s < 3; ++s) {
+        bptree_filter_build(&f, bpt, sizes[s]);
+        double rate[2];
+        for (int hit=0; hit < 2; ++hit) {
+            const vector<uint64_t>& probe = hit ? keys : absent;
+            double start = now();
+            for (long i=0; i < n; ++i) {
+                sink += (uint64_t) bptree_filter_lookup(bpt, &f, probe[i]);
+            }
+            rate[hit] = n / (now() - start) / 1e6;
+        }
+        long passed = 0;
+        for (long i=0; i < n; ++i) {
+            passed += bptree_filter_may_contain(&f, absent[i]);
+        }
+        printf("%-8.0f %6d %10.2f %10.2f %10.2f %10.2f %8.1f\n", sizes[s],
+               f.nr_probes, (double) f.nr_blocks * 64 / st.nr_keys,
+               100.0 * passed / n, rate[0], rate[1], rate[0] / base[0]);
+    }
+    bptree_filter_free(&f);
+    bptree_free(bpt);
+}
+
+/*
+ * Random lookups on a tree file, mapped and through pools larger and smaller
+ * than the tree, over the whole tree and over a hot 1% of its key range. The
+ * file stays in the page cache, so a pool miss costs a read system call and
+ * a copy rather than a trip to the disk.
+ */
+static void bench_file(long n)
+{
+    char path[] = "/tmp/bptbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+    unlink(path);
+
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+    struct bptree_file* f = bptree_file_open(path, 0);
+    double start = now();
+    for (long i=0; i < n; ++i) {
+        bptree_file_insert(f, keys[i], i);
+    }
+    double build = now() - start;
+    struct bptree_file_stats st;
+    bptree_file_stats(f, &st);
+    bptree_file_close(f);
+    // The hot keys are a run of neighbours, so they share their pages.
+    sort(keys.begin(), keys.end());
+
+    printf("# %ld random keys in %llu pages of %d bytes, height %d, "
+           "built mapped at %.2f Minserts/s\n", n,
+           (unsigned long long) st.nr_pages, BPT_PAGE_SIZE, st.height,
+           n / build / 1e6);
+    printf("%-14s %-8s %12s %10s\n", "pool", "keys", "Mlookups/s",
+           "hit %");
+    const size_t pools[] = { 0, (size_t) st.nr_pages * 2,
+                             (size_t) st.nr_pages / 10 };
+    for (int p=0; p < 3; ++p) {
+        for (int hot=0; hot < 2; ++hot) {
+            f = bptree_file_open(path, pools[p]);
+            long span = hot ? max(n / 100, 1L) : n;
+            long base = hot ? n / 2 : 0;
+            long nr_ops = min(n, 1000000L);
+            uint64_t val;
+            volatile uint64_t sink = 0;
+            // One pass to warm up, one to measure.
+            for (int pass=0; pass < 2; ++pass) {
+                struct bptree_file_stats before;
+                bptree_file_stats(f, &before);
+                start = now();
+                for (long i=0; i < nr_ops; ++i) {
+                    sink += bptree_file_lookup(f, keys[base + rng() % span],
+                                              &val);
+                }
+                double rate = nr_ops / (now() - start) / 1e6;
+                if (!pass) {
+                    continue;
+                }
+                bptree_file_stats(f, &st);
+                uint64_t hits = st.hits - before.hits;
+                uint64_t misses = st.misses - before.misses;
+                if (pools[p]) {
+                    char name[32];
+                    snprintf(name, sizeof(name), "%zu pages", pools[p]);
+                    printf("%-14s %-8s %12.2f %10.1f\n", name,
+                           hot ? "hot 1%" : "all", rate,
+                           100.0 * hits / (hits + misses));
+                } else {
+                    printf("%-14s %-8s %12.2f %10s\n", "mapped",
+                           hot ? "hot 1%" : "all", rate, "-");
+                }
+            }
+            bptree_file_close(f);
+        }
+    }
+    unlink(path);
+}
+
+/*
+ * Save a tree to a snapshot and load it back, next to rebuilding it by
+ * replaying its inserts.
+ */
+static void bench_snapshot(long n)
+{
+    char path[] = "/tmp/bptbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    unlink(path);
+
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+    struct bptree* bpt = bptree_alloc(keys[0], (void*) 1);
+    for (long i=1; i < n; ++i) {
+        bptree_insert(&bpt, keys[i], (void*) (i + 1));
+    }
+
+    double start = now();
+    struct bptree* replay = bptree_alloc(keys[0], (void*) 1);
+    for (long i=1; i < n; ++i) {
+        bptree_insert(&replay, keys[i], (void*) (i + 1));
+    }
+    double replay_time = now() - start;
+    bptree_free(replay);
+
+    start = now();
+    if (bptree_save(bpt, fd, NULL)) {
+        perror("bptree_save");
+        return;
+    }
+    fsync(fd);
+    double save_time = now() - start;
+    double mb = lseek(fd, 0, SEEK_CUR) / 1e6;
+
+    lseek(fd, 0, SEEK_SET);
+    start = now();
+    struct bptree* copy = bptree_load(fd, NULL);
+    double load_time = now() - start;
+    if (!copy) {
+        perror("bptree_load");
+        return;
+    }
+
+    printf("# %ld random keys, %.1f MB snapshot\n", n, mb);
+    printf("%-10s %10s %10s %12s\n", "", "secs", "MB/s", "Mkeys/s");
+    printf("%-10s %10.3f %10.1f %12.2f\n", "save", save_time,
+           mb / save_time, n / save_time / 1e6);
+    printf("%-10s %10.3f %10.1f %12.2f\n", "load", load_time,
+           mb / load_time, n / load_time / 1e6);
+    printf("%-10s %10.3f %10s %12.2f\n", "replay", replay_time, "-",
+           n / replay_time / 1e6);
+    bptree_free(copy);
+    bptree_free(bpt);
+    close(fd);
+}
+
+struct view_scan {
+    struct bptree* snap;
+    volatile int* stop;
+    size_t scanned;
+};
+
+static int view_count(void* ctx, const uint64_t* keys, void* const* vals,
+                      int n)
+{
+    (void) keys;
+    (void) vals;
+    *(size_t*) ctx += n;
+    return 0;
+}
+
+static void* view_run(void* arg)
+{
+    struct view_scan* vs = (struct view_scan*) arg;
+    while (!*vs->stop) {
+        bptree_scan(vs->snap, 0, ~0ULL, view_count, &vs->scanned);
+    }
+    return NULL;
+}
+
+/*
+ * Random upserts into a tree while snapshots are taken at various intervals,
+ * each released when the next is taken: the first write to a path after a
+ * snapshot copies it. Then the same upserts with a thread scanning a
+ * snapshot over and over.
+ */
+static void bench_cow(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = 2 * i;
+    }
+    const long nr_ops = 2000000;
+    const long intervals[] = { 0, nr_ops, 100000, 1000, 10 };
+
+    printf("# %ld keys, %ld random upserts\n", n, nr_ops);
+    printf("%-16s %12s\n", "snapshot every", "Mupserts/s");
+    for (int t=0; t < 5; ++t) {
+        struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, n, 0.7);
+        struct bptree* snap = NULL;
+        double start = now();
+        for (long i=0; i < nr_ops; ++i) {
+            if (intervals[t] && i % intervals[t] == 0) {
+                if (snap) {
+                    bptree_snapshot_release(snap);
+                }
+                snap = bptree_snapshot(bpt);
+            }
+            bptree_upsert(&bpt, keys[rng() % n], (void*) 1, NULL);
+        }
+        double elapsed = now() - start;
+        if (snap) {
+            bptree_snapshot_release(snap);
+        }
+        bptree_free(bpt);
+        if (intervals[t]) {
+            printf("%-16ld %12.2f\n", intervals[t], nr_ops / elapsed / 1e6);
+        } else {
+            printf("%-16s %12.2f\n", "never", nr_ops / elapsed / 1e6);
+        }
+    }
+
+    struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, n, 0.7);
+    volatile int stop = 0;
+    struct view_scan vs = { bptree_snapshot(bpt), &stop, 0 };
+    pthread_t tid;
+    double start = now();
+    pthread_create(&tid, NULL, view_run, &vs);
+    for (long i=0; i < nr_ops; ++i) {
+        bptree_upsert(&bpt, keys[rng() % n], (void*) 1, NULL);
+    }
+    double elapsed = now() - start;
+    stop = 1;
+    pthread_join(tid, NULL);
+    printf("# beside a scanning thread: %.2f Mupserts/s, "
+           "%.1f Mkeys/s scanned\n", nr_ops / elapsed / 1e6,
+           vs.scanned / (now() - start) / 1e6);
+    bptree_snapshot_release(vs.snap);
+    bptree_free(bpt);
+}
+
+struct wal_work {
+    struct bptree_wal* w;
+    const uint64_t* keys;
+    long n;
+};
+
+static void* wal_run(void* arg)
+{
+    struct wal_work* ww = (struct wal_work*) arg;
+    for (long i=0; i < ww->n; ++i) {
+        bptree_wal_insert(ww->w, ww->keys[i], (void*) (i + 1));
+    }
+    return NULL;
+}
+
+/*
+ * Logged inserts at each durability level, from one thread and from several,
+ * then the cost of a checkpoint and of recovering from it and from the log.
+ * Synchronous levels are slow enough that they get fewer inserts.
+ */
+static void bench_wal(long n)
+{
+    char path[] = "/tmp/bptbench.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    close(fd);
+    string log = string(path) + ".log";
+
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+    const char* names[] = { "op", "group", "async" };
+    const enum bptree_durability levels[] = {
+        BPT_DURABLE_OP, BPT_DURABLE_GROUP, BPT_DURABLE_ASYNC
+    };
+    const int threads[] = { 1, 8 };
+
+    printf("# logged inserts of random keys\n");
+    printf("%-8s %-8s %10s %12s %14s\n", "level", "threads", "inserts",
+           "Kinserts/s", "inserts/sync");
+    for (int l=0; l < 3; ++l) {
+        for (int t=0; t < 2; ++t) {
+            long nr = levels[l] == BPT_DURABLE_OP ? min(n, 20000L) :
+                      levels[l] == BPT_DURABLE_GROUP ? min(n, 100000L) : n;
+            unlink(path);
+            unlink(log.c_str());
+            struct bptree_wal* w = bptree_wal_open(path, NULL, levels[l]);
+            if (!w) {
+                perror("bptree_wal_open");
+                return;
+            }
+            vector<pthread_t> tids(threads[t]);
+            vector<struct wal_work> work(threads[t]);
+            double start = now();
+            for (int i=0; i < threads[t]; ++i) {
+                long lo = nr * i / threads[t];
+                long hi = nr * (i + 1) / threads[t];
+                struct wal_work ww = { w, &keys[lo], hi - lo };
+                work[i] = ww;
+                pthread_create(&tids[i], NULL, wal_run, &work[i]);
+            }
+            for (int i=0; i < threads[t]; ++i) {
+                pthread_join(tids[i], NULL);
+            }
+            bptree_wal_sync(w);
+            double elapsed = now() - start;
+            struct bptree_wal_stats st;
+            bptree_wal_stats(w, &st);
+            printf("%-8s %-8d %10ld %12.1f %14.1f\n", names[l], threads[t],
+                   nr, nr / elapsed / 1e3,
+                   (double) st.records / max(st.syncs, (uint64_t) 1));
+            bptree_wal_close(w);
+        }
+    }
+
+    // The last run left n inserts in the log.
+    double start = now();
+    struct bptree_wal* w = bptree_wal_open(path, NULL, BPT_DURABLE_GROUP);
+    double replay = now() - start;
+    start = now();
+    bptree_wal_checkpoint(w);
+    double checkpoint = now() - start;
+    bptree_wal_close(w);
+    start = now();
+    w = bptree_wal_open(path, NULL, BPT_DURABLE_GROUP);
+    double load = now() - start;
+    bptree_wal_close(w);
+    printf("# %ld keys: replay log %.3fs, checkpoint %.3fs, "
+           "load checkpoint %.3fs\n", n, replay, checkpoint, load);
+    unlink(path);
+    unlink(log.c_str());
+}
+
+/*
+ * Compare the size and lookup speed of a bulk-loaded tree with a packed copy
+ * of it, for keys spaced closely enough for one-, two- and four-byte deltas
+ * and for random keys which need all eight.
+ */
+static void bench_pack(long n)
+{
+    const char* names[] = { "dense", "gaps<1K", "gaps<32M", "random" };
+    const uint64_t gaps[] = { 1, 1000, 1 << 25, 0 };
+    const long nr_probes = 4000000;
+
+    printf("# %ld keys, %ld random lookups of present keys\n", n, nr_probes);
+    printf("%-10s %-8s %10s %10s %12s\n", "keys", "layout", "bytes/key",
+           "key bytes", "Mlookups/s");
+    for (int d=0; d < 4; ++d) {
+        vector<uint64_t> keys(n);
+        uint64_t key = 1ULL << 40;
+        for (long i=0; i < n; ++i) {
+            keys[i] = gaps[d] ? key : rng();
+            key += 1 + rng() % (gaps[d] | 1);
+        }
+        sort(keys.begin(), keys.end());
+        keys.erase(unique(keys.begin(), keys.end()), keys.end());
+        long nr = keys.size();
+        vector<uint64_t> probes(nr_probes);
+        for (long i=0; i < nr_probes; ++i) {
+            probes[i] = keys[rng() % nr];
+        }
+
+        struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, nr, 1.0);
+        struct bptree_stats st;
+        bptree_stats(bpt, &st);
+        volatile uint64_t sink = 0;
+        double start = now();
+        for (long i=0; i < nr_probes; ++i) {
+            sink += bptree_exists(bpt, probes[i]) != NULL;
+        }
+        double elapsed = now() - start;
+        // The tree's key bytes are the key arrays of all its nodes.
+        printf("%-10s %-8s %10.2f %10.2f %12.2f\n", names[d], "tree",
+               (double) st.bytes / nr,
+               (double) st.nr_nodes * (ORDER - 1) * 8 / nr,
+               nr_probes / elapsed / 1e6);
+
+        struct bptree_packed* p = bptree_pack(bpt);
+        struct bptree_packed_stats ps;
+        bptree_packed_stats(p, &ps);
+        start = now();
+        for (long i=0; i < nr_probes; ++i) {
+            sink += bptree_packed_find(p, probes[i], NULL);
+        }
+        elapsed = now() - start;
+        printf("%-10s %-8s %10.2f %10.2f %12.2f\n", names[d], "packed",
+               (double) ps.bytes / nr, (double) ps.key_bytes / nr,
+               nr_probes / elapsed / 1e6);
+        printf("# leaves by delta width 1/2/4/8: %zu/%zu/%zu/%zu\n",
+               ps.leaves_by_width[0], ps.leaves_by_width[1],
+               ps.leaves_by_width[2], ps.leaves_by_width[3]);
+        (void) sink;
+        bptree_packed_free(p);
+        bptree_free(bpt);
+    }
+}
+
+/*
+ * Compare building a tree from sorted input by repeated inserts and by bulk
+ * loading.
+ */
+static void bench_bulk(long n)
+{
+    vector<uint64_t> keys(n);
+    vector<void*> vals(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = 2 * i;
+        vals[i] = (void*) (i + 1);
+    }
+
+    printf("# building from %ld sorted keys\n", n);
+    printf("%-12s %14s %14s\n", "method", "ms", "Mkeys/s");
+
+    double start = now();
+    struct bptree* bpt = bptree_alloc(keys[0], vals[0]);
+    for (long i=1; i < n; ++i) {
+        bptree_insert(&bpt, keys[i], vals[i]);
+    }
+    double elapsed = now() - start;
+    printf("%-12s %14.1f %14.2f\n", "insert", elapsed * 1e3,
+           n / elapsed / 1e6);
+    bptree_free(bpt);
+
+    const double fills[] = { 1.0, 0.7 };
+    for (int f=0; f < 2; ++f) {
+        char name[32];
+        snprintf(name, sizeof(name), "bulk@%.1f", fills[f]);
+        start = now();
+        bpt = bptree_bulk_load(keys.data(), vals.data(), n, fills[f]);
+        elapsed = now() - start;
+        printf("%-12s %14.1f %14.2f\n", name, elapsed * 1e3,
+               n / elapsed / 1e6);
+        bptree_free(bpt);
+    }
+}
+
+/*
+ * Compare single lookups against batched lookups of several sizes.
+ */
+static void bench_batch(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = rng();
+    }
+    sort(keys.begin(), keys.end());
+    keys.erase(unique(keys.begin(), keys.end()), keys.end());
+    struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, keys.size(), 0.7);
+
+    const long nr_probes = 4000000;
+    vector<uint64_t> probes(nr_probes);
+    for (long i=0; i < nr_probes; ++i) {
+        probes[i] = keys[rng() % keys.size()];
+    }
+    vector<void*> vals(nr_probes);
+
+    printf("# batched lookups over %ld keys\n", n);
+    printf("%-8s %14s %14s\n", "batch", "Mops/s", "speedup");
+
+    double start = now();
+    for (long i=0; i < nr_probes; ++i) {
+        vals[i] = bptree_lookup(bpt, probes[i]);
+    }
+    double single = now() - start;
+    printf("%-8s %14.2f %14.2f\n", "single", nr_probes / single / 1e6, 1.0);
+
+    const int sizes[] = { 1, 4, 8, 16, 32, 64, 256 };
+    for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        start = now();
+        for (long i=0; i < nr_probes; i += sizes[s]) {
+            long m = min((long) sizes[s], nr_probes - i);
+            bptree_lookup_batch(bpt, &probes[i], m, &vals[i]);
+        }
+        double elapsed = now() - start;
+        printf("%-8d %14.2f %14.2f\n", sizes[s], nr_probes / elapsed / 1e6,
+               single / elapsed);
+    }
+    bptree_free(bpt);
+}
+
+static int sum_run(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    uint64_t* sum = (uint64_t*) ctx;
+    for (int i=0; i < n; ++i) {
+        *sum += keys[i] + (uint64_t) vals[i];
+    }
+    return 0;
+}
+
+/*
+ * Compare ways of scanning ranges of several lengths.
+ */
+static void bench_scan(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = 2 * i;
+    }
+    struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, n, 0.7);
+
+    printf("# range scans over %ld keys, Mkeys/s\n", n);
+    printf("%-8s %14s %14s %14s\n", "length", "leaf walk", "iterator",
+           "scan");
+
+    const long lengths[] = { 10, 100, 1000, 100000 };
+    for (size_t l=0; l < sizeof(lengths) / sizeof(lengths[0]); ++l) {
+        const long len = min(lengths[l], n);
+        const long nr_scans = max(1L, 20000000 / len);
+        vector<uint64_t> starts(nr_scans);
+        for (long i=0; i < nr_scans; ++i) {
+            starts[i] = 2 * (rng() % (n - len + 1));
+        }
+        volatile uint64_t sink = 0;
+        double t[3];
+
+        // The old way: search, then walk the leaves by hand.
+        double start = now();
+        for (long i=0; i < nr_scans; ++i) {
+            uint64_t lo = starts[i], hi = lo + 2 * len, sum = 0;
+            struct bptree* leaf = bptree_search(bpt, lo);
+            for (; leaf; leaf = bptree_next(leaf)) {
+                int k = 0;
+                for (; k < leaf->nr_keys; ++k) {
+                    if (leaf->keys[k] >= hi) {
+                        break;
+                    }
+                    if (leaf->keys[k] >= lo) {
+                        sum += leaf->keys[k] + (uint64_t) leaf->pointers[k + 1];
+                    }
+                }
+                if (k < leaf->nr_keys) {
+                    break;
+                }
+            }
+            sink += sum;
+        }
+        t[0] = now() - start;
+
+        start = now();
+        for (long i=0; i < nr_scans; ++i) {
+            struct bptree_iter it;
+            uint64_t key, sum = 0;
+            void* val;
+            bptree_iter_seek(&it, bpt, starts[i], starts[i] + 2 * len);
+            while (bptree_iter_next(&it, &key, &val)) {
+                sum += key + (uint64_t) val;
+            }
+            sink += sum;
+        }
+        t[1] = now() - start;
+
+        start = now();
+        for (long i=0; i < nr_scans; ++i) {
+            uint64_t sum = 0;
+            bptree_scan(bpt, starts[i], starts[i] + 2 * len, sum_run, &sum);
+            sink += sum;
+        }
+        t[2] = now() - start;
+
+        printf("%-8ld", len);
+        for (int k=0; k < 3; ++k) {
+            printf(" %14.1f", nr_scans * len / t[k] / 1e6);
+        }
+        printf("\n");
+    }
+    bptree_free(bpt);
+}
+
+struct thread_work {
+    struct bptree* bpt;
+    pthread_mutex_t* lock;
+    long n;
+    long nr_ops;
+    int write_pct;
+    uint64_t seed;
+};
+
+/*
+ * Random lookups over [0, 2n) (half of them hits), with write_pct percent of
+ * operations replaced by an insert or a delete of a random key. With a lock,
+ * every operation is serialised through it.
+ */
+static void* thread_run(void* arg)
+{
+    struct thread_work* w = (struct thread_work*) arg;
+    uint64_t s = w->seed;
+    uint64_t hits = 0;
+    for (long i=0; i < w->nr_ops; ++i) {
+        s ^= s << 13;
+        s ^= s >> 7;
+        s ^= s << 17;
+        uint64_t key = s % (2 * w->n);
+        int write = (long) ((s >> 40) % 100) < w->write_pct;
+        if (w->lock) {
+            pthread_mutex_lock(w->lock);
+        }
+        if (!write) {
+            hits += bptree_lookup(w->bpt, key) != NULL;
+        } else if (s & (1ULL << 32)) {
+            bptree_insert(&w->bpt, key | 1, (void*) 1);
+        } else {
+            bptree_delete(&w->bpt, key | 1);
+        }
+        if (w->lock) {
+            pthread_mutex_unlock(w->lock);
+        }
+    }
+    w->seed = hits;
+    return NULL;
+}
+
+/*
+ * Measure how lookups and mixed workloads scale with the number of threads,
+ * against the same tree with every operation behind one global mutex.
+ */
+static void bench_threads(long n)
+{
+    vector<uint64_t> keys(n);
+    for (long i=0; i < n; ++i) {
+        keys[i] = 2 * i;
+    }
+    const long nr_ops = 2000000;
+    const int write_pcts[] = { 0, 5, 50 };
+    const int threads[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+    printf("# %ld keys, %ld ops split over the threads, Mops/s\n", n, nr_ops);
+    printf("%-8s", "threads");
+    for (int w=0; w < 3; ++w) {
+        char olc[32], mutex[32];
+        snprintf(olc, sizeof(olc), "olc %d%%wr", write_pcts[w]);
+        snprintf(mutex, sizeof(mutex), "mutex %d%%wr", write_pcts[w]);
+        printf(" %14s %14s", olc, mutex);
+    }
+    printf("\n");
+
+    for (size_t t=0; t < sizeof(threads) / sizeof(threads[0]); ++t) {
+        const int nr_threads = threads[t];
+        printf("%-8d", nr_threads);
+        for (int w=0; w < 3; ++w) {
+            for (int locked=0; locked < 2; ++locked) {
+                pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+                struct bptree* bpt = bptree_bulk_load(keys.data(), NULL, n,
+                                                      0.7);
+                if (!locked) {
+                    bptree_make_concurrent(bpt);
+                }
+                vector<pthread_t> tids(nr_threads);
+                vector<struct thread_work> work(nr_threads);
+                double start = now();
+                for (int i=0; i < nr_threads; ++i) {
+                    struct thread_work tw = {
+                        bpt, locked ? &lock : NULL, n,
+                        nr_ops / nr_threads, write_pcts[w], rng() | 1
+                    };
+                    work[i] = tw;
+                    pthread_create(&tids[i], NULL, thread_run, &work[i]);
+                }
+                for (int i=0; i < nr_threads; ++i) {
+                    pthread_join(tids[i], NULL);
+                }
+                double elapsed = now() - start;
+                printf(" %14.2f", nr_ops / elapsed / 1e6);
+                bptree_free(bpt);
+            }
+        }
+        printf("\n");
+    }
+}
+
+/*
+ * Zipfian ranks in [0, n), after Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases" (as used by YCSB). Rank 0 is the
+ * hottest; ranks are scrambled before use so hot keys are spread out.
+ */
+struct zipf {
+    long n;
+    double theta, alpha, zetan, eta;
+
+    zipf(long n, double theta) : n(n), theta(theta)
+    {
+        double zeta2 = 1 + pow(0.5, theta);
+        zetan = 0;
+        for (long i=1; i <= n; ++i) {
+            zetan += 1 / pow((double) i, theta);
+        }
+        alpha = 1 / (1 - theta);
+        eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    long next()
+    {
+        double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + pow(0.5, theta)) {
+            return 1;
+        }
+        long r = (long) (n * pow(eta * u - eta + 1, alpha));
+        return r < n ? r : n - 1;
+    }
+};
+
+static uint64_t scramble(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Counts the bytes a standard container holds, to compare space per key.
+ */
+static size_t container_bytes = 0;
+
+template <typename T>
+struct counting_allocator {
+    typedef T value_type;
+
+    counting_allocator() {}
+    template <typename U>
+    counting_allocator(const counting_allocator<U>&) {}
+
+    T* allocate(size_t n)
+    {
+        container_bytes += n * sizeof(T);
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        container_bytes -= n * sizeof(T);
+        ::operator delete(p);
+    }
+};
+
+template <typename T, typename U>
+static bool operator==(const counting_allocator<T>&,
+                       const counting_allocator<U>&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+static bool operator!=(const counting_allocator<T>&,
+                       const counting_allocator<U>&)
+{
+    return false;
+}
+
+struct scan_budget {
+    long left;
+    uint64_t sum;
+};
+
+static int scan_some(void* ctx, const uint64_t* keys, void* const* vals,
+                     int n)
+{
+    struct scan_budget* b = (struct scan_budget*) ctx;
+    for (int i=0; i < n && b->left > 0; ++i, --b->left) {
+        b->sum += keys[i] + (uint64_t) vals[i];
+    }
+    return b->left <= 0;
+}
+
+/*
+ * The structures under test, behind one interface. Every key is even when
+ * loaded; inserts add odd keys, or append past the end for sequential runs.
+ */
+struct bptree_store {
+    struct bptree* bpt;
+    size_t nr_keys;
+
+    void load(const vector<uint64_t>& keys, const vector<void*>& vals)
+    {
+        bpt = bptree_bulk_load(keys.data(), vals.data(), keys.size(), 0.7);
+        nr_keys = keys.size();
+    }
+    void* get(uint64_t key) { return bptree_lookup(bpt, key); }
+    void put(uint64_t key, void* val)
+    {
+        nr_keys += bptree_upsert(&bpt, key, val, NULL) == BPTREE_INSERTED;
+    }
+    void erase(uint64_t key)
+    {
+        nr_keys -= bptree_delete(&bpt, key) != NULL;
+    }
+    uint64_t scan(uint64_t lo, long len)
+    {
+        struct scan_budget b = { len, 0 };
+        bptree_scan(bpt, lo, ~0ULL, scan_some, &b);
+        return b.sum;
+    }
+    size_t bytes()
+    {
+        struct bptree_stats st;
+        bptree_stats(bpt, &st);
+        return st.bytes;
+    }
+    size_t size() { return nr_keys; }
+    void clear() { bptree_free(bpt); }
+};
+
+struct map_store {
+    typedef map<uint64_t, void*, less<uint64_t>,
+                counting_allocator<pair<const uint64_t, void*> > > map_t;
+    map_t* m;
+
+    void load(const vector<uint64_t>& keys, const vector<void*>& vals)
+    {
+        m = new map_t;
+        for (size_t i=0; i < keys.size(); ++i) {
+            m->insert(m->end(), make_pair(keys[i], vals[i]));
+        }
+    }
+    void* get(uint64_t key)
+    {
+        map_t::iterator it = m->find(key);
+        return it == m->end() ? NULL : it->second;
+    }
+    void put(uint64_t key, void* val) { (*m)[key] = val; }
+    void erase(uint64_t key) { m->erase(key); }
+    uint64_t scan(uint64_t lo, long len)
+    {
+        uint64_t sum = 0;
+        map_t::iterator it = m->lower_bound(lo);
+        for (; it != m->end() && len-- > 0; ++it) {
+            sum += it->first + (uint64_t) it->second;
+        }
+        return sum;
+    }
+    size_t bytes() { return container_bytes; }
+    size_t size() { return m->size(); }
+    void clear() { delete m; }
+};
+
+struct vector_store {
+    typedef pair<uint64_t, void*> entry;
+    vector<entry, counting_allocator<entry> >* v;
+
+    void load(const vector<uint64_t>& keys, const vector<void*>& vals)
+    {
+        v = new vector<entry, counting_allocator<entry> >;
+        v->reserve(keys.size());
+        for (size_t i=0; i < keys.size(); ++i) {
+            v->push_back(entry(keys[i], vals[i]));
+        }
+    }
+    vector<entry, counting_allocator<entry> >::iterator find(uint64_t key)
+    {
+        return lower_bound(v->begin(), v->end(), entry(key, NULL),
+            [](const entry& a, const entry& b) { return a.first < b.first; });
+    }
+    void* get(uint64_t key)
+    {
+        auto it = find(key);
+        return it != v->end() && it->first == key ? it->second : NULL;
+    }
+    void put(uint64_t key, void* val)
+    {
+        auto it = find(key);
+        if (it != v->end() && it->first == key) {
+            it->second = val;
+        } else {
+            v->insert(it, entry(key, val));
+        }
+    }
+    void erase(uint64_t key)
+    {
+        auto it = find(key);
+        if (it != v->end() && it->first == key) {
+            v->erase(it);
+        }
+    }
+    uint64_t scan(uint64_t lo, long len)
+    {
+        uint64_t sum = 0;
+        for (auto it = find(lo); it != v->end() && len-- > 0; ++it) {
+            sum += it->first + (uint64_t) it->second;
+        }
+        return sum;
+    }
+    size_t bytes() { return container_bytes; }
+    size_t size() { return v->size(); }
+    void clear() { delete v; }
+};
+
+enum dist { UNIFORM, ZIPF, SEQUENTIAL };
+static const char* dist_names[] = { "uniform", "zipf", "sequential" };
+
+/*
+ * A workload mix: percentages of reads, updates, inserts and deletes (the
+ * rest are scans of scan_len keys).
+ */
+struct mix {
+    const char* name;
+    int read, update, insert, erase;
+    long scan_len;
+};
+
+static const struct mix mixes[] = {
+    { "read", 100, 0, 0, 0, 0 },
+    { "95/5", 95, 5, 0, 0, 0 },
+    { "50/50", 50, 50, 0, 0, 0 },
+    { "insert", 0, 0, 100, 0, 0 },
+    { "delete", 0, 0, 0, 100, 0 },
+    { "scan10", 0, 0, 0, 0, 10 },
+    { "scan100", 0, 0, 0, 0, 100 },
+    { "scan1000", 0, 0, 0, 0, 1000 },
+};
+
+/*
+ * The operations of one run, generated up front so that every structure
+ * sees the same sequence. op is 0-3 for read, update, insert, delete and
+ * 4 for a scan.
+ */
+struct ycsb_op {
+    uint64_t key;
+    int op;
+};
+
+static vector<struct ycsb_op> ycsb_ops(long n, long nr_ops, enum dist d,
+                                       const struct mix& m, zipf* z)
+{
+    vector<struct ycsb_op> ops(nr_ops);
+    long seq = 0, appended = 0;
+    for (long i=0; i < nr_ops; ++i) {
+        long idx;
+        if (d == UNIFORM) {
+            idx = rng() % n;
+        } else if (d == ZIPF) {
+            idx = scramble(z->next()) % n;
+        } else {
+            idx = seq++ % n;
+        }
+
+        int p = rng() % 100;
+        int op = p < m.read ? 0 : p < m.read + m.update ? 1 :
+                 p < m.read + m.update + m.insert ? 2 :
+                 p < m.read + m.update + m.insert + m.erase ? 3 : 4;
+        ops[i].op = op;
+        ops[i].key = 2 * idx;
+        if (op == 2) {
+            ops[i].key = d == SEQUENTIAL ? 2 * (n + appended++) : 2 * idx + 1;
+        }
+    }
+    return ops;
+}
+
+/*
+ * Run one workload against one structure, timing every operation.
+ */
+template <typename Store>
+static void ycsb_run(const char* name, const vector<uint64_t>& keys,
+                     const vector<void*>& vals,
+                     const vector<struct ycsb_op>& ops, const struct mix& m)
+{
+    Store store;
+    container_bytes = 0;
+    store.load(keys, vals);
+
+    vector<uint32_t> lat(ops.size());
+    volatile uint64_t sink = 0;
+    double start = now();
+    for (size_t i=0; i < ops.size(); ++i) {
+        double t0 = now();
+        uint64_t key = ops[i].key;
+        switch (ops[i].op) {
+        case 0:
+            sink += (uint64_t) store.get(key);
+            break;
+        case 1:
+        case 2:
+            store.put(key, (void*) (key + 1));
+            break;
+        case 3:
+            store.erase(key);
+            break;
+        default:
+            sink += store.scan(key, m.scan_len);
+            break;
+        }
+        lat[i] = (uint32_t) min((now() - t0) * 1e9, 4e9);
+    }
+    double elapsed = now() - start;
+    double per_key = (double) store.bytes() / max(store.size(), (size_t) 1);
+    store.clear();
+
+    sort(lat.begin(), lat.end());
+    size_t nr = lat.size();
+    printf("  %-8s %12.3f %10u %10u %10u %10.1f\n", name,
+           nr / elapsed / 1e6, lat[nr / 2], lat[nr * 99 / 100],
+           lat[nr * 999 / 1000], per_key);
+}
+
+/*
+ * YCSB-style workloads over trees of 10K keys up to n, for each key
+ * distribution and operation mix, against std::map and a sorted vector.
+ * Optional filters pick one distribution and one mix.
+ */
+static void bench_ycsb(long n, const char* dist_filter, const char* mix_filter)
+{
+    const long nr_ops = 200000;
+    const int nr_mixes = sizeof(mixes) / sizeof(mixes[0]);
+
+    long size = min(n, 10000L);
+    for (;;) {
+        vector<uint64_t> keys(size);
+        vector<void*> vals(size);
+        for (long i=0; i < size; ++i) {
+            keys[i] = 2 * i;
+            vals[i] = (void*) (keys[i] + 1);
+        }
+        zipf z(size, 0.99);
+
+        printf("# ycsb, ORDER=%d, %ld keys, %ld ops per run (latency in ns, "
+               "including the timer; space after the run)\n", ORDER, size,
+               nr_ops);
+        for (int d=0; d < 3; ++d) {
+            if (dist_filter && strcmp(dist_filter, dist_names[d])) {
+                continue;
+            }
+            for (int k=0; k < nr_mixes; ++k) {
+                const struct mix& m = mixes[k];
+                if (mix_filter && strcmp(mix_filter, m.name)) {
+                    continue;
+                }
+                vector<struct ycsb_op> ops =
+                    ycsb_ops(size, nr_ops, (enum dist) d, m, &z);
+
+                printf("%s %s\n", dist_names[d], m.name);
+                printf("  %-8s %12s %10s %10s %10s %10s\n", "", "Mops/s",
+                       "p50", "p99", "p999", "bytes/key");
+                ycsb_run<bptree_store>("bptree", keys, vals, ops, m);
+                ycsb_run<map_store>("map", keys, vals, ops, m);
+                // Every insert or delete in a sorted vector is O(n).
+                if (m.insert + m.erase == 0) {
+                    ycsb_run<vector_store>("vector", keys, vals, ops, m);
+                }
+            }
+        }
+        if (size >= n) {
+            break;
+        }
+        size = min(size * 10, n);
+    }
+}
+
+static void usage(const char* argv0)
+{
+    fprintf(stderr,
+            "usage: %s [search|alloc|delete|expire|ingest|finger|fill|"
+            "compact|rank|filter|file|snapshot|wal|cow|pack|bulk|batch|"
+            "scan|threads] [nr_keys]\n"
+            "       %s ycsb [max_keys] [uniform|zipf|sequential] "
+            "[read|95/5|50/50|insert|delete|scan10|scan100|scan1000]\n",
+            argv0, argv0);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    const char* which = argc > 1 ? argv[1] : "all";
+    int all = !strcmp(which, "all");
+    long n = argc > 2 ? atol(argv[2]) : 1000000;
+    int ran = 0;
+
+    if (all || !strcmp(which, "search")) {
+        bench_search();
+        ran = 1;
+    }
+    if (all || !strcmp(which, "alloc")) {
+        bench_alloc(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "delete")) {
+        bench_delete(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "expire")) {
+        bench_expire(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "ingest")) {
+        bench_ingest(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "finger")) {
+        bench_finger(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "fill")) {
+        bench_fill(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "compact")) {
+        bench_compact(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "rank")) {
+        bench_rank(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "filter")) {
+        bench_filter(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "file")) {
+        bench_file(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "snapshot")) {
+        bench_snapshot(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "wal")) {
+        bench_wal(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "cow")) {
+        bench_cow(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "pack")) {
+        bench_pack(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "bulk")) {
+        bench_bulk(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "batch")) {
+        bench_batch(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "scan")) {
+        bench_scan(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "threads")) {
+        bench_threads(n);
+        ran = 1;
+    }
+    if (all || !strcmp(which, "ycsb")) {
+        bench_ycsb(n, argc > 3 && strcmp(argv[3], "all") ? argv[3] : NULL,
+                   argc > 4 ? argv[4] : NULL);
+        ran = 1;
+    }
+    if (!ran) {
+        usage(argv[0]);
+    }
+    return 0;
+}
@@ -0,0 +1,792 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "bptfile.h"
+#include "bptsearch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BPT_FILE_MAGIC 0x31454c4946545042ULL	/* "BPTFILE1" */
+#define BPT_FILE_VERSION 1
+
+/*
+ * Mapped files grow by at least this much at a time, and in multiples of it,
+ * so each new piece is mapped at an offset aligned to any page size.
+ */
+#define BPT_FILE_GROWTH (1 << 20)
+
+/* Pages other than the root never hold fewer keys than this. */
+#define BPT_PAGE_MIN (BPT_PAGE_ORDER / 2 - 1)
+
+/*
+ * Page 0 of the file. Page numbers start at 1 everywhere else, so 0 also
+ * stands for no page.
+ */
+struct bpt_file_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t order;
+	uint32_t height;
+	uint64_t root;
+	uint64_t nr_pages;
+	uint64_t free_list;
+	uint64_t nr_keys;
+};
+
+/*
+ * Every other page is a node. Leaves keep the value of keys[i] in ptrs[i];
+ * inner nodes keep nr_keys + 1 children there.
+ */
+struct bpt_page {
+	uint16_t is_leaf;
+	uint16_t nr_keys;
+	uint32_t unused;
+	uint64_t next;		/* The next leaf, or the next free page. */
+	uint64_t keys[BPT_PAGE_ORDER - 1];
+	uint64_t ptrs[BPT_PAGE_ORDER];
+};
+
+typedef char bpt_page_fits[sizeof(struct bpt_page) <= BPT_PAGE_SIZE ? 1 : -1];
+
+/*
+ * A frame of the buffer pool. Unused frames hold page 0, which is never
+ * read through the pool.
+ */
+struct bpt_frame {
+	uint64_t id;
+	int chain;		/* The next frame in the same bucket, or -1. */
+	uint32_t pins;
+	uint8_t dirty;
+	uint8_t ref;		/* Set on use, cleared as the clock hand passes. */
+};
+
+struct bptree_file {
+	int fd;
+	struct bpt_file_header hdr;
+	off_t file_size;
+
+	/* Mapped files. */
+	char* base;
+	size_t mapped;
+
+	/* Pooled files. */
+	size_t nr_frames;
+	char* pool;
+	struct bpt_frame* frames;
+	int* buckets;
+	int bucket_bits;
+	size_t hand;
+
+	struct bptree_file_stats stats;
+};
+
+static bpt_rank_fn bpt_page_rank = bpt_rank_scalar;
+
+__attribute__((constructor))
+static void bpt_file_init_search(void)
+{
+	bpt_page_rank = bpt_rank_select();
+}
+
+static int bpt_page_index(const struct bpt_page* page, uint64_t key)
+{
+	return bpt_page_rank(page->keys, page->nr_keys, key);
+}
+
+/* The position of the first key >= key in a leaf. */
+static int bpt_page_lower_bound(const struct bpt_page* page, uint64_t key)
+{
+	int rank = bpt_page_index(page, key);
+	return rank > 0 && page->keys[rank - 1] == key ? rank - 1 : rank;
+}
+
+static void bpt_file_read(struct bptree_file* f, uint64_t id, void* buf)
+{
+	ssize_t got = pread(f->fd, buf, BPT_PAGE_SIZE,
+			    (off_t) id * BPT_PAGE_SIZE);
+	if (got < 0) {
+		abort();
+	}
+	/* Pages past the end of the file have never been written. */
+	memset((char*) buf + got, 0, BPT_PAGE_SIZE - got);
+}
+
+static int bpt_file_write(struct bptree_file* f, uint64_t id, const void* buf)
+{
+	++f->stats.writes;
+	return pwrite(f->fd, buf, BPT_PAGE_SIZE, (off_t) id * BPT_PAGE_SIZE) ==
+		BPT_PAGE_SIZE ? 0 : -1;
+}
+
+/*
+ * Extend the mapping of a mapped file to cover nr_pages, growing the file
+ * as well when it is too short. The address space is reserved already, so
+ * pages never move.
+ */
+static void bpt_file_grow(struct bptree_file* f, uint64_t nr_pages)
+{
+	size_t need = nr_pages * BPT_PAGE_SIZE;
+	size_t size = f->mapped * 2;
+	if (need <= f->mapped) {
+		return;
+	}
+	if (size < f->mapped + BPT_FILE_GROWTH) {
+		size = f->mapped + BPT_FILE_GROWTH;
+	}
+	if (size < need) {
+		size = need;
+	}
+	size = (size + BPT_FILE_GROWTH - 1) & ~((size_t) BPT_FILE_GROWTH - 1);
+	if (size > BPT_FILE_MAX_MAP) {
+		size = BPT_FILE_MAX_MAP;
+	}
+	if (need > size) {
+		abort();
+	}
+	if ((off_t) size > f->file_size) {
+		if (ftruncate(f->fd, size)) {
+			abort();
+		}
+		f->file_size = size;
+	}
+	if (mmap(f->base + f->mapped, size - f->mapped, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, f->fd, f->mapped) == MAP_FAILED) {
+		abort();
+	}
+	f->mapped = size;
+}
+
+static struct bpt_page* bpt_frame_page(struct bptree_file* f, size_t i)
+{
+	return (struct bpt_page*) (f->pool + i * BPT_PAGE_SIZE);
+}
+
+static int* bpt_bucket(struct bptree_file* f, uint64_t id)
+{
+	return &f->buckets[(id * 0x9e3779b97f4a7c15ULL) >> (64 - f->bucket_bits)];
+}
+
+/*
+ * Pick a frame to reuse with the clock algorithm: recently used frames get
+ * a second chance, and pinned ones are skipped. Dirty pages are written
+ * back first.
+ */
+static size_t bpt_evict(struct bptree_file* f)
+{
+	for (size_t tries = 0; tries <= 2 * f->nr_frames; ++tries) {
+		size_t i = f->hand;
+		struct bpt_frame* fr = &f->frames[i];
+		f->hand = (i + 1) % f->nr_frames;
+		if (fr->pins) {
+			continue;
+		}
+		if (fr->ref) {
+			fr->ref = 0;
+			continue;
+		}
+		if (fr->id) {
+			if (fr->dirty &&
+			    bpt_file_write(f, fr->id, bpt_frame_page(f, i))) {
+				abort();
+			}
+			int* link = bpt_bucket(f, fr->id);
+			while (*link != (int) i) {
+				link = &f->frames[*link].chain;
+			}
+			*link = fr->chain;
+			++f->stats.evictions;
+		}
+		return i;
+	}
+	/* Every frame is pinned. */
+	abort();
+	return 0;
+}
+
+/*
+ * Get a page into memory and keep it there until it is unpinned. A fresh
+ * page is not read, since the caller is about to overwrite it.
+ */
+static struct bpt_page* bpt_pin_page(struct bptree_file* f, uint64_t id,
+				     int fresh)
+{
+	if (!f->nr_frames) {
+		return (struct bpt_page*) (f->base + id * BPT_PAGE_SIZE);
+	}
+
+	int* bucket = bpt_bucket(f, id);
+	for (int i = *bucket; i >= 0; i = f->frames[i].chain) {
+		if (f->frames[i].id == id) {
+			++f->frames[i].pins;
+			f->frames[i].ref = 1;
+			++f->stats.hits;
+			return bpt_frame_page(f, i);
+		}
+	}
+
+	++f->stats.misses;
+	size_t i = bpt_evict(f);
+	struct bpt_frame* fr = &f->frames[i];
+	fr->id = id;
+	fr->pins = 1;
+	fr->ref = 1;
+	fr->dirty = 0;
+	fr->chain = *bucket;
+	*bucket = i;
+	if (!fresh) {
+		bpt_file_read(f, id, bpt_frame_page(f, i));
+	}
+	return bpt_frame_page(f, i);
+}
+
+static struct bpt_page* bpt_pin(struct bptree_file* f, uint64_t id)
+{
+	return bpt_pin_page(f, id, 0);
+}
+
+static struct bpt_frame* bpt_frame_of(struct bptree_file* f,
+				      struct bpt_page* page)
+{
+	return &f->frames[((char*) page - f->pool) / BPT_PAGE_SIZE];
+}
+
+static void bpt_unpin(struct bptree_file* f, struct bpt_page* page)
+{
+	if (f->nr_frames) {
+		--bpt_frame_of(f, page)->pins;
+	}
+}
+
+/* Note that a pinned page has changed. Mapped pages need no help. */
+static void bpt_dirty(struct bptree_file* f, struct bpt_page* page)
+{
+	if (f->nr_frames) {
+		bpt_frame_of(f, page)->dirty = 1;
+	}
+}
+
+/* Allocate an empty, pinned page, reusing freed pages first. */
+static struct bpt_page* bpt_page_alloc(struct bptree_file* f, uint64_t* id,
+				       int is_leaf)
+{
+	struct bpt_page* page;
+	if (f->hdr.free_list) {
+		*id = f->hdr.free_list;
+		page = bpt_pin(f, *id);
+		f->hdr.free_list = page->next;
+	} else {
+		*id = f->hdr.nr_pages++;
+		if (!f->nr_frames) {
+			bpt_file_grow(f, f->hdr.nr_pages);
+		}
+		page = bpt_pin_page(f, *id, 1);
+	}
+	memset(page, 0, BPT_PAGE_SIZE);
+	page->is_leaf = is_leaf;
+	bpt_dirty(f, page);
+	return page;
+}
+
+/* Put a pinned page on the free list, and unpin it. */
+static void bpt_page_free(struct bptree_file* f, uint64_t id,
+			  struct bpt_page* page)
+{
+	page->nr_keys = 0;
+	page->next = f->hdr.free_list;
+	f->hdr.free_list = id;
+	bpt_dirty(f, page);
+	bpt_unpin(f, page);
+}
+
+struct bptree_file* bptree_file_open(const char* path, size_t pool_pages)
+{
+	struct bptree_file* f = calloc(1, sizeof(struct bptree_file));
+	struct stat st;
+	int fresh;
+	uint64_t pages;
+	if (!f) {
+		abort();
+	}
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (f->fd < 0) {
+		free(f);
+		return NULL;
+	}
+	if (fstat(f->fd, &st)) {
+		goto fail;
+	}
+	f->file_size = st.st_size;
+
+	fresh = st.st_size == 0;
+	if (fresh) {
+		f->hdr.magic = BPT_FILE_MAGIC;
+		f->hdr.version = BPT_FILE_VERSION;
+		f->hdr.page_size = BPT_PAGE_SIZE;
+		f->hdr.order = BPT_PAGE_ORDER;
+		f->hdr.height = 1;
+		f->hdr.root = 1;
+		f->hdr.nr_pages = 2;
+	} else if (pread(f->fd, &f->hdr, sizeof(f->hdr), 0) != sizeof(f->hdr) ||
+		   f->hdr.magic != BPT_FILE_MAGIC ||
+		   f->hdr.version != BPT_FILE_VERSION ||
+		   f->hdr.page_size != BPT_PAGE_SIZE ||
+		   f->hdr.order != BPT_PAGE_ORDER) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	if (pool_pages) {
+		void* mem;
+		if (pool_pages < BPT_FILE_MIN_FRAMES) {
+			pool_pages = BPT_FILE_MIN_FRAMES;
+		}
+		f->nr_frames = pool_pages;
+		f->bucket_bits = 1;
+		while ((1UL << f->bucket_bits) < 2 * pool_pages) {
+			++f->bucket_bits;
+		}
+		if (posix_memalign(&mem, BPT_PAGE_SIZE,
+				   pool_pages * BPT_PAGE_SIZE)) {
+			abort();
+		}
+		f->pool = mem;
+		f->frames = calloc(pool_pages, sizeof(struct bpt_frame));
+		f->buckets = malloc(sizeof(int) << f->bucket_bits);
+		if (!f->frames || !f->buckets) {
+			abort();
+		}
+		memset(f->buckets, 0xff, sizeof(int) << f->bucket_bits);
+	} else {
+		f->base = mmap(NULL, BPT_FILE_MAX_MAP, PROT_NONE,
+			       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (f->base == MAP_FAILED) {
+			goto fail;
+		}
+		pages = (st.st_size + BPT_PAGE_SIZE - 1) / BPT_PAGE_SIZE;
+		bpt_file_grow(f, pages > f->hdr.nr_pages ?
+				 pages : f->hdr.nr_pages);
+	}
+
+	if (fresh) {
+		struct bpt_page* root = bpt_pin_page(f, 1, 1);
+		memset(root, 0, BPT_PAGE_SIZE);
+		root->is_leaf = 1;
+		bpt_dirty(f, root);
+		bpt_unpin(f, root);
+		if (bptree_file_sync(f)) {
+			bptree_file_close(f);
+			return NULL;
+		}
+	}
+	return f;
+
+fail:
+	close(f->fd);
+	free(f);
+	return NULL;
+}
+
+int bptree_file_sync(struct bptree_file* f)
+{
+	char buf[BPT_PAGE_SIZE];
+	for (size_t i = 0; i < f->nr_frames; ++i) {
+		struct bpt_frame* fr = &f->frames[i];
+		if (fr->id && fr->dirty) {
+			if (bpt_file_write(f, fr->id, bpt_frame_page(f, i))) {
+				return -1;
+			}
+			fr->dirty = 0;
+		}
+	}
+	if (f->mapped && msync(f->base, f->mapped, MS_SYNC)) {
+		return -1;
+	}
+
+	/* The header goes last, once everything it points to is written. */
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &f->hdr, sizeof(f->hdr));
+	if (pwrite(f->fd, buf, BPT_PAGE_SIZE, 0) != BPT_PAGE_SIZE) {
+		return -1;
+	}
+	return fsync(f->fd);
+}
+
+int bptree_file_close(struct bptree_file* f)
+{
+	int ret = bptree_file_sync(f);
+	if (f->base) {
+		munmap(f->base, BPT_FILE_MAX_MAP);
+	}
+	free(f->pool);
+	free(f->frames);
+	free(f->buckets);
+	close(f->fd);
+	free(f);
+	return ret;
+}
+
+int bptree_file_lookup(struct bptree_file* f, uint64_t key, uint64_t* val)
+{
+	struct bpt_page* page = bpt_pin(f, f->hdr.root);
+	while (!page->is_leaf) {
+		uint64_t child = page->ptrs[bpt_page_index(page, key)];
+		bpt_unpin(f, page);
+		page = bpt_pin(f, child);
+	}
+	int rank = bpt_page_index(page, key);
+	int found = rank > 0 && page->keys[rank - 1] == key;
+	if (found && val) {
+		*val = page->ptrs[rank - 1];
+	}
+	bpt_unpin(f, page);
+	return found;
+}
+
+/*
+ * Split a full child about its median, and add the new page to the parent
+ * after pidx. Leaves copy the median up, inner pages move it up.
+ */
+static void bpt_page_split(struct bptree_file* f, struct bpt_page* parent,
+			   int pidx, struct bpt_page* child)
+{
+	int keep = (BPT_PAGE_ORDER - 1) / 2;
+	uint64_t sid, sep;
+	struct bpt_page* sib = bpt_page_alloc(f, &sid, child->is_leaf);
+
+	if (child->is_leaf) {
+		sib->nr_keys = child->nr_keys - keep;
+		memcpy(sib->keys, child->keys + keep,
+		       sizeof(uint64_t) * sib->nr_keys);
+		memcpy(sib->ptrs, child->ptrs + keep,
+		       sizeof(uint64_t) * sib->nr_keys);
+		sib->next = child->next;
+		child->next = sid;
+		sep = sib->keys[0];
+	} else {
+		sep = child->keys[keep];
+		sib->nr_keys = child->nr_keys - keep - 1;
+		memcpy(sib->keys, child->keys + keep + 1,
+		       sizeof(uint64_t) * sib->nr_keys);
+		memcpy(sib->ptrs, child->ptrs + keep + 1,
+		       sizeof(uint64_t) * (sib->nr_keys + 1));
+	}
+	child->nr_keys = keep;
+
+	int n = parent->nr_keys;
+	memmove(parent->keys + pidx + 1, parent->keys + pidx,
+		sizeof(uint64_t) * (n - pidx));
+	memmove(parent->ptrs + pidx + 2, parent->ptrs + pidx + 1,
+		sizeof(uint64_t) * (n - pidx));
+	parent->keys[pidx] = sep;
+	parent->ptrs[pidx + 1] = sid;
+	parent->nr_keys = n + 1;
+
+	bpt_dirty(f, parent);
+	bpt_dirty(f, child);
+	bpt_unpin(f, sib);
+}
+
+/*
+ * Full pages are split on the way down, so the leaf always has room and no
+ * page above it has to be revisited.
+ */
+int bptree_file_insert(struct bptree_file* f, uint64_t key, uint64_t val)
+{
+	struct bpt_page* page = bpt_pin(f, f->hdr.root);
+	if (page->nr_keys == BPT_PAGE_ORDER - 1) {
+		uint64_t rid;
+		struct bpt_page* root = bpt_page_alloc(f, &rid, 0);
+		root->ptrs[0] = f->hdr.root;
+		bpt_page_split(f, root, 0, page);
+		bpt_unpin(f, page);
+		page = root;
+		f->hdr.root = rid;
+		++f->hdr.height;
+	}
+
+	while (!page->is_leaf) {
+		int pidx = bpt_page_index(page, key);
+		struct bpt_page* child = bpt_pin(f, page->ptrs[pidx]);
+		if (child->nr_keys == BPT_PAGE_ORDER - 1) {
+			bpt_page_split(f, page, pidx, child);
+			if (key >= page->keys[pidx]) {
+				bpt_unpin(f, child);
+				child = bpt_pin(f, page->ptrs[pidx + 1]);
+			}
+		}
+		bpt_unpin(f, page);
+		page = child;
+	}
+
+	int rank = bpt_page_index(page, key);
+	if (rank > 0 && page->keys[rank - 1] == key) {
+		bpt_unpin(f, page);
+		return 0;
+	}
+	int n = page->nr_keys;
+	memmove(page->keys + rank + 1, page->keys + rank,
+		sizeof(uint64_t) * (n - rank));
+	memmove(page->ptrs + rank + 1, page->ptrs + rank,
+		sizeof(uint64_t) * (n - rank));
+	page->keys[rank] = key;
+	page->ptrs[rank] = val;
+	page->nr_keys = n + 1;
+	bpt_dirty(f, page);
+	bpt_unpin(f, page);
+	++f->hdr.nr_keys;
+	return 1;
+}
+
+/* Move the last entry of the left sibling into ptrs[pidx]. */
+static void bpt_page_borrow_left(struct bpt_page* parent, int pidx,
+				 struct bpt_page* left, struct bpt_page* curr)
+{
+	int n = curr->nr_keys;
+	int last = left->nr_keys - 1;
+	memmove(curr->keys + 1, curr->keys, sizeof(uint64_t) * n);
+	if (curr->is_leaf) {
+		memmove(curr->ptrs + 1, curr->ptrs, sizeof(uint64_t) * n);
+		curr->keys[0] = left->keys[last];
+		curr->ptrs[0] = left->ptrs[last];
+		parent->keys[pidx - 1] = curr->keys[0];
+	} else {
+		memmove(curr->ptrs + 1, curr->ptrs, sizeof(uint64_t) * (n + 1));
+		curr->keys[0] = parent->keys[pidx - 1];
+		curr->ptrs[0] = left->ptrs[last + 1];
+		parent->keys[pidx - 1] = left->keys[last];
+	}
+	--left->nr_keys;
+	++curr->nr_keys;
+}
+
+/* Move the first entry of the right sibling into ptrs[pidx]. */
+static void bpt_page_borrow_right(struct bpt_page* parent, int pidx,
+				  struct bpt_page* curr, struct bpt_page* right)
+{
+	int n = curr->nr_keys;
+	int m = right->nr_keys;
+	if (curr->is_leaf) {
+		curr->keys[n] = right->keys[0];
+		curr->ptrs[n] = right->ptrs[0];
+		memmove(right->keys, right->keys + 1, sizeof(uint64_t) * (m - 1));
+		memmove(right->ptrs, right->ptrs + 1, sizeof(uint64_t) * (m - 1));
+		parent->keys[pidx] = right->keys[0];
+	} else {
+		curr->keys[n] = parent->keys[pidx];
+		curr->ptrs[n + 1] = right->ptrs[0];
+		parent->keys[pidx] = right->keys[0];
+		memmove(right->keys, right->keys + 1, sizeof(uint64_t) * (m - 1));
+		memmove(right->ptrs, right->ptrs + 1, sizeof(uint64_t) * m);
+	}
+	--right->nr_keys;
+	++curr->nr_keys;
+}
+
+/*
+ * Merge ptrs[pidx + 1] into ptrs[pidx], and free it. Merging inner pages
+ * pulls the separating key down from the parent.
+ */
+static void bpt_page_merge(struct bptree_file* f, struct bpt_page* parent,
+			   int pidx, struct bpt_page* left,
+			   struct bpt_page* right)
+{
+	uint64_t rid = parent->ptrs[pidx + 1];
+	int end = left->nr_keys;
+	int m = right->nr_keys;
+	if (left->is_leaf) {
+		memcpy(left->keys + end, right->keys, sizeof(uint64_t) * m);
+		memcpy(left->ptrs + end, right->ptrs, sizeof(uint64_t) * m);
+		left->next = right->next;
+		left->nr_keys = end + m;
+	} else {
+		left->keys[end] = parent->keys[pidx];
+		memcpy(left->keys + end + 1, right->keys, sizeof(uint64_t) * m);
+		memcpy(left->ptrs + end + 1, right->ptrs,
+		       sizeof(uint64_t) * (m + 1));
+		left->nr_keys = end + 1 + m;
+	}
+
+	int n = parent->nr_keys;
+	memmove(parent->keys + pidx, parent->keys + pidx + 1,
+		sizeof(uint64_t) * (n - pidx - 1));
+	memmove(parent->ptrs + pidx + 1, parent->ptrs + pidx + 2,
+		sizeof(uint64_t) * (n - pidx - 1));
+	parent->nr_keys = n - 1;
+	bpt_page_free(f, rid, right);
+}
+
+/*
+ * Give the (pinned) child at pidx a key to spare, by borrowing from a
+ * sibling or merging with one. Returns the page the child's keys are now in,
+ * still pinned.
+ */
+static struct bpt_page* bpt_page_fill(struct bptree_file* f,
+				      struct bpt_page* parent, int pidx,
+				      struct bpt_page* child)
+{
+	struct bpt_page* left = NULL;
+	struct bpt_page* right = NULL;
+	struct bpt_page* ret = child;
+
+	bpt_dirty(f, parent);
+	bpt_dirty(f, child);
+	if (pidx > 0) {
+		left = bpt_pin(f, parent->ptrs[pidx - 1]);
+		bpt_dirty(f, left);
+		if (left->nr_keys > BPT_PAGE_MIN) {
+			bpt_page_borrow_left(parent, pidx, left, child);
+			bpt_unpin(f, left);
+			return child;
+		}
+	}
+	if (pidx < parent->nr_keys) {
+		right = bpt_pin(f, parent->ptrs[pidx + 1]);
+		bpt_dirty(f, right);
+		if (right->nr_keys > BPT_PAGE_MIN) {
+			bpt_page_borrow_right(parent, pidx, child, right);
+			bpt_unpin(f, right);
+		} else if (!left) {
+			bpt_page_merge(f, parent, pidx, child, right);
+		} else {
+			bpt_unpin(f, right);
+		}
+	}
+	if (left) {
+		if (ret->nr_keys <= BPT_PAGE_MIN) {
+			bpt_page_merge(f, parent, pidx - 1, left, child);
+			ret = left;
+		} else {
+			bpt_unpin(f, left);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Pages on the way down are topped up past the minimum before the descent
+ * moves into them, so the key comes out of the leaf without any changes
+ * rippling back up.
+ */
+int bptree_file_delete(struct bptree_file* f, uint64_t key, uint64_t* val)
+{
+	struct bpt_page* page = bpt_pin(f, f->hdr.root);
+	while (!page->is_leaf) {
+		int pidx = bpt_page_index(page, key);
+		struct bpt_page* child = bpt_pin(f, page->ptrs[pidx]);
+		if (child->nr_keys <= BPT_PAGE_MIN) {
+			child = bpt_page_fill(f, page, pidx, child);
+			if (page->nr_keys == 0) {
+				/* The root gave its last key to a merge. */
+				uint64_t old = f->hdr.root;
+				f->hdr.root = page->ptrs[0];
+				--f->hdr.height;
+				bpt_page_free(f, old, page);
+				page = child;
+				continue;
+			}
+		}
+		bpt_unpin(f, page);
+		page = child;
+	}
+
+	int rank = bpt_page_index(page, key);
+	if (rank == 0 || page->keys[rank - 1] != key) {
+		bpt_unpin(f, page);
+		return 0;
+	}
+	if (val) {
+		*val = page->ptrs[rank - 1];
+	}
+	int n = page->nr_keys;
+	memmove(page->keys + rank - 1, page->keys + rank,
+		sizeof(uint64_t) * (n - rank));
+	memmove(page->ptrs + rank - 1, page->ptrs + rank,
+		sizeof(uint64_t) * (n - rank));
+	page->nr_keys = n - 1;
+	bpt_dirty(f, page);
+	bpt_unpin(f, page);
+	--f->hdr.nr_keys;
+	return 1;
+}
+
+size_t bptree_file_scan(struct bptree_file* f, uint64_t lo, uint64_t hi,
+			bptree_file_scan_fn fn, void* ctx)
+{
+	size_t total = 0;
+	if (lo >= hi) {
+		return 0;
+	}
+	struct bpt_page* page = bpt_pin(f, f->hdr.root);
+	while (!page->is_leaf) {
+		uint64_t child = page->ptrs[bpt_page_index(page, lo)];
+		bpt_unpin(f, page);
+		page = bpt_pin(f, child);
+	}
+
+	int start = bpt_page_lower_bound(page, lo);
+	for (;;) {
+		int end = page->nr_keys;
+		int stop = 0;
+		if (end > 0 && page->keys[end - 1] >= hi) {
+			end = bpt_page_lower_bound(page, hi);
+			stop = 1;
+		}
+		if (start < end) {
+			total += end - start;
+			stop |= fn(ctx, page->keys + start, page->ptrs + start,
+				   end - start);
+		}
+		uint64_t next = page->next;
+		bpt_unpin(f, page);
+		if (stop || !next) {
+			return total;
+		}
+		page = bpt_pin(f, next);
+		start = 0;
+	}
+}
+
+void bptree_file_stats(struct bptree_file* f, struct bptree_file_stats* st)
+{
+	*st = f->stats;
+	st->height = f->hdr.height;
+	st->nr_keys = f->hdr.nr_keys;
+	st->nr_pages = f->hdr.nr_pages;
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * A B+ tree stored in a file.
+ *
+ * Nodes are fixed-size pages which refer to each other by page number, and
+ * values are 64-bit words rather than pointers. Pages are reached either
+ * through a mapping of the whole file or through a bounded pool of page
+ * frames with clock eviction. Inserts and deletes work top-down in a single
+ * pass, like those on a concurrent in-memory tree, so an operation never
+ * needs more than a handful of pages at once.
+ *
+ * The file is only consistent once bptree_file_sync() (or close) returns; a
+ * crash in between can leave it half written. I/O errors in the middle of
+ * an operation abort.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The size of a page, on disk and in memory. */
+#define BPT_PAGE_SIZE 4096
+
+/* The maximum number of children per page (it must be even). */
+#define BPT_PAGE_ORDER (((BPT_PAGE_SIZE - 16) / 16) & ~1)
+
+/* Mapped files reserve this much address space up front, so they can grow. */
+#define BPT_FILE_MAX_MAP (1ULL << 40)
+
+/* Pooled files need at least this many frames. */
+#define BPT_FILE_MIN_FRAMES 8
+
+struct bptree_file;
+
+/*
+ * Open a tree file, creating an empty tree if the file is empty or missing.
+ * With pool_pages zero the file is mapped; otherwise pages are read into a
+ * pool of that many frames. Returns NULL (with errno set) if the file cannot
+ * be opened or is not a tree file of this version.
+ */
+struct bptree_file* bptree_file_open(const char* path, size_t pool_pages);
+
+/* Write every change out and fsync the file. Returns 0, or -1 on error. */
+int bptree_file_sync(struct bptree_file* f);
+
+/* Sync and close a tree file. Returns 0, or -1 if the sync failed. */
+int bptree_file_close(struct bptree_file* f);
+
+/* Lookup a key, returning 1 and its value if it exists. */
+int bptree_file_lookup(struct bptree_file* f, uint64_t key, uint64_t* val);
+
+/* Insert a tuple unless the key exists. Returns 1 if it was new. */
+int bptree_file_insert(struct bptree_file* f, uint64_t key, uint64_t val);
+
+/* Delete a key, returning 1 and its old value (if val is not NULL). */
+int bptree_file_delete(struct bptree_file* f, uint64_t key, uint64_t* val);
+
+/*
+ * Receives a run of n consecutive tuples from one page. Returning nonzero
+ * stops the scan.
+ */
+typedef int (*bptree_file_scan_fn)(void* ctx, const uint64_t* keys,
+				   const uint64_t* vals, int n);
+
+/* Pass every tuple in [lo, hi) to fn, returning the number visited. */
+size_t bptree_file_scan(struct bptree_file* f, uint64_t lo, uint64_t hi,
+			bptree_file_scan_fn fn, void* ctx);
+
+struct bptree_file_stats {
+	int height;
+	uint64_t nr_keys;
+	uint64_t nr_pages;	/* Including free ones and the header. */
+	uint64_t hits;		/* Pool lookups which found their page, ... */
+	uint64_t misses;	/* ... and ones which had to read it. */
+	uint64_t evictions;
+	uint64_t writes;	/* Pages written back. */
+};
+
+void bptree_file_stats(struct bptree_file* f, struct bptree_file_stats* st);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
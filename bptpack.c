@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "bptpack.h"
+#include "bptsearch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Enough fence levels for 2^64 keys. */
+#define BPT_PACK_MAX_LEVELS 12
+
+/*
+ * Leaf i holds keys [i * BPT_PACK_LEAF, (i + 1) * BPT_PACK_LEAF). Its deltas
+ * start offsets[i] words into the delta area, and its values at
+ * vals[i * BPT_PACK_LEAF]. Fence level 0 is the leaf bases.
+ */
+struct bptree_packed {
+	size_t nr_keys;
+	size_t nr_leaves;
+	uint64_t* bases;
+	uint32_t* offsets;	/* In 8-byte words, so each leaf is aligned. */
+	uint8_t* widths;	/* Delta widths, in bytes. */
+	uint64_t* deltas;
+	size_t nr_words;
+	void** vals;
+
+	int nr_levels;
+	uint64_t* fences[BPT_PACK_MAX_LEVELS];
+	size_t fence_keys[BPT_PACK_MAX_LEVELS];
+};
+
+static bpt_rank_fn bpt_pack_rank_fence = bpt_rank_scalar;
+static bpt_scan_narrow_fn bpt_pack_scan[3] = {
+	bpt_scan_u8, bpt_scan_u16, bpt_scan_u32
+};
+
+__attribute__((constructor))
+static void bpt_pack_init_search(void)
+{
+	bpt_pack_rank_fence = bpt_rank_select();
+	bpt_pack_scan[0] = bpt_scan_narrow_select(1);
+	bpt_pack_scan[1] = bpt_scan_narrow_select(2);
+	bpt_pack_scan[2] = bpt_scan_narrow_select(4);
+}
+
+static void* bpt_pack_alloc(size_t size)
+{
+	void* mem;
+	if (posix_memalign(&mem, 64, size ? size : 1)) {
+		abort();
+	}
+	return mem;
+}
+
+/* The fewest bytes which hold every delta in a leaf spanning span. */
+static int bpt_pack_width(uint64_t span)
+{
+	if (span <= UINT8_MAX) {
+		return 1;
+	} else if (span <= UINT16_MAX) {
+		return 2;
+	} else if (span <= UINT32_MAX) {
+		return 4;
+	}
+	return 8;
+}
+
+static int bpt_pack_leaf_keys(const struct bptree_packed* p, size_t leaf)
+{
+	if (leaf + 1 < p->nr_leaves) {
+		return BPT_PACK_LEAF;
+	}
+	return (int) (p->nr_keys - leaf * BPT_PACK_LEAF);
+}
+
+static const void* bpt_pack_leaf_deltas(const struct bptree_packed* p,
+					size_t leaf)
+{
+	return p->deltas + p->offsets[leaf];
+}
+
+static uint64_t bpt_pack_delta(const struct bptree_packed* p, size_t leaf,
+			       int i)
+{
+	const void* d = bpt_pack_leaf_deltas(p, leaf);
+	switch (p->widths[leaf]) {
+	case 1:
+		return ((const uint8_t*) d)[i];
+	case 2:
+		return ((const uint16_t*) d)[i];
+	case 4:
+		return ((const uint32_t*) d)[i];
+	}
+	return ((const uint64_t*) d)[i];
+}
+
+/* Expand a leaf's keys into out. */
+static void bpt_pack_decode(const struct bptree_packed* p, size_t leaf,
+			    uint64_t* out)
+{
+	int n = bpt_pack_leaf_keys(p, leaf);
+	uint64_t base = p->bases[leaf];
+	for (int i = 0; i < n; ++i) {
+		out[i] = base + bpt_pack_delta(p, leaf, i);
+	}
+}
+
+/* The number of keys in a leaf which are <= key, where key >= its base. */
+static int bpt_pack_rank(const struct bptree_packed* p, size_t leaf,
+			 uint64_t key)
+{
+	int n = bpt_pack_leaf_keys(p, leaf);
+	int width = p->widths[leaf];
+	uint64_t delta = key - p->bases[leaf];
+
+	if (width == 8) {
+		return bpt_pack_rank_fence(
+			(const uint64_t*) bpt_pack_leaf_deltas(p, leaf), n,
+			delta);
+	}
+	if (delta >> (8 * width)) {
+		return n;
+	}
+	return bpt_pack_scan[width >> 1](bpt_pack_leaf_deltas(p, leaf), n,
+					 (uint32_t) delta);
+}
+
+/*
+ * Walk down the fences to the last leaf whose base is <= key. Returns 0 if
+ * key precedes every leaf, and the leaf's index plus one otherwise.
+ */
+static size_t bpt_pack_find_leaf(const struct bptree_packed* p, uint64_t key)
+{
+	int level = p->nr_levels - 1;
+	size_t idx = bpt_pack_rank_fence(p->fences[level],
+					 (int) p->fence_keys[level], key);
+	if (idx == 0) {
+		return 0;
+	}
+	--idx;
+	while (level-- > 0) {
+		size_t start = idx * BPT_PACK_FANOUT;
+		size_t n = p->fence_keys[level] - start;
+		if (n > BPT_PACK_FANOUT) {
+			n = BPT_PACK_FANOUT;
+		}
+		idx = start + bpt_pack_rank_fence(p->fences[level] + start,
+						  (int) n, key) - 1;
+	}
+	return idx + 1;
+}
+
+struct bptree_packed* bptree_pack_sorted(const uint64_t* keys,
+					 void* const* vals, size_t n)
+{
+	struct bptree_packed* p;
+	size_t word = 0;
+
+	if (n == 0) {
+		return NULL;
+	}
+	p = calloc(1, sizeof(struct bptree_packed));
+	if (!p) {
+		abort();
+	}
+	p->nr_keys = n;
+	p->nr_leaves = (n + BPT_PACK_LEAF - 1) / BPT_PACK_LEAF;
+	p->bases = bpt_pack_alloc(p->nr_leaves * sizeof(uint64_t));
+	p->offsets = bpt_pack_alloc(p->nr_leaves * sizeof(uint32_t));
+	p->widths = bpt_pack_alloc(p->nr_leaves);
+
+	/* Size every leaf first, so the deltas go in one block. */
+	for (size_t leaf = 0; leaf < p->nr_leaves; ++leaf) {
+		size_t first = leaf * BPT_PACK_LEAF;
+		int nr = bpt_pack_leaf_keys(p, leaf);
+		int width = bpt_pack_width(keys[first + nr - 1] - keys[first]);
+
+		p->bases[leaf] = keys[first];
+		p->widths[leaf] = (uint8_t) width;
+		if (word > UINT32_MAX) {
+			abort();
+		}
+		p->offsets[leaf] = (uint32_t) word;
+		word += ((size_t) nr * width + 7) / 8;
+	}
+	p->nr_words = word;
+	p->deltas = bpt_pack_alloc(word * sizeof(uint64_t));
+	memset(p->deltas, 0, word * sizeof(uint64_t));
+
+	for (size_t leaf = 0; leaf < p->nr_leaves; ++leaf) {
+		const uint64_t* k = keys + leaf * BPT_PACK_LEAF;
+		void* d = p->deltas + p->offsets[leaf];
+		int nr = bpt_pack_leaf_keys(p, leaf);
+		for (int i = 0; i < nr; ++i) {
+			uint64_t delta = k[i] - k[0];
+			switch (p->widths[leaf]) {
+			case 1:
+				((uint8_t*) d)[i] = (uint8_t) delta;
+				break;
+			case 2:
+				((uint16_t*) d)[i] = (uint16_t) delta;
+				break;
+			case 4:
+				((uint32_t*) d)[i] = (uint32_t) delta;
+				break;
+			default:
+				((uint64_t*) d)[i] = delta;
+			}
+		}
+	}
+
+	p->vals = bpt_pack_alloc(n * sizeof(void*));
+	if (vals) {
+		memcpy(p->vals, vals, n * sizeof(void*));
+	} else {
+		memset(p->vals, 0, n * sizeof(void*));
+	}
+
+	p->fences[0] = p->bases;
+	p->fence_keys[0] = p->nr_leaves;
+	p->nr_levels = 1;
+	while (p->fence_keys[p->nr_levels - 1] > BPT_PACK_FANOUT) {
+		const uint64_t* below = p->fences[p->nr_levels - 1];
+		size_t nr_below = p->fence_keys[p->nr_levels - 1];
+		size_t nr = (nr_below + BPT_PACK_FANOUT - 1) / BPT_PACK_FANOUT;
+		uint64_t* fence = bpt_pack_alloc(nr * sizeof(uint64_t));
+		for (size_t i = 0; i < nr; ++i) {
+			fence[i] = below[i * BPT_PACK_FANOUT];
+		}
+		p->fences[p->nr_levels] = fence;
+		p->fence_keys[p->nr_levels] = nr;
+		++p->nr_levels;
+	}
+	return p;
+}
+
+struct bpt_pack_buf {
+	uint64_t* keys;
+	void** vals;
+	size_t n;
+	size_t cap;
+};
+
+static void bpt_pack_push(struct bpt_pack_buf* b, uint64_t key, void* val)
+{
+	if (b->n == b->cap) {
+		b->cap = b->cap ? 2 * b->cap : 1024;
+		b->keys = realloc(b->keys, b->cap * sizeof(uint64_t));
+		b->vals = realloc(b->vals, b->cap * sizeof(void*));
+		if (!b->keys || !b->vals) {
+			abort();
+		}
+	}
+	b->keys[b->n] = key;
+	b->vals[b->n] = val;
+	++b->n;
+}
+
+static int bpt_pack_collect(void* ctx, const uint64_t* keys,
+			    void* const* vals, int n)
+{
+	struct bpt_pack_buf* b = ctx;
+	for (int i = 0; i < n; ++i) {
+		bpt_pack_push(b, keys[i], vals[i]);
+	}
+	return 0;
+}
+
+struct bptree_packed* bptree_pack(struct bptree* root)
+{
+	struct bpt_pack_buf b = { NULL, NULL, 0, 0 };
+	struct bptree_packed* p;
+
+	bptree_scan(root, 0, UINT64_MAX, bpt_pack_collect, &b);
+	if (bptree_exists(root, UINT64_MAX)) {
+		bpt_pack_push(&b, UINT64_MAX, bptree_lookup(root, UINT64_MAX));
+	}
+	p = bptree_pack_sorted(b.keys, b.vals, b.n);
+	free(b.keys);
+	free(b.vals);
+	return p;
+}
+
+void bptree_packed_free(struct bptree_packed* p)
+{
+	if (!p) {
+		return;
+	}
+	for (int level = 1; level < p->nr_levels; ++level) {
+		free(p->fences[level]);
+	}
+	free(p->bases);
+	free(p->offsets);
+	free(p->widths);
+	free(p->deltas);
+	free(p->vals);
+	free(p);
+}
+
+int bptree_packed_find(const struct bptree_packed* p, uint64_t key,
+		       void** val)
+{
+	size_t leaf = p ? bpt_pack_find_leaf(p, key) : 0;
+	int rank;
+
+	if (leaf-- == 0) {
+		return 0;
+	}
+	/* The leaf's base is <= key, so rank is at least 1. */
+	rank = bpt_pack_rank(p, leaf, key);
+	if (bpt_pack_delta(p, leaf, rank - 1) != key - p->bases[leaf]) {
+		return 0;
+	}
+	if (val) {
+		*val = p->vals[leaf * BPT_PACK_LEAF + rank - 1];
+	}
+	return 1;
+}
+
+void* bptree_packed_lookup(const struct bptree_packed* p, uint64_t key)
+{
+	void* val = NULL;
+	bptree_packed_find(p, key, &val);
+	return val;
+}
+
+size_t bptree_packed_scan(const struct bptree_packed* p, uint64_t lo,
+			  uint64_t hi, bptree_scan_fn fn, void* ctx)
+{
+	uint64_t keys[BPT_PACK_LEAF];
+	size_t total = 0;
+	size_t leaf;
+	int start = 0;
+
+	if (!p || lo >= hi) {
+		return 0;
+	}
+	leaf = bpt_pack_find_leaf(p, lo);
+	if (leaf-- == 0) {
+		leaf = 0;
+	} else {
+		start = bpt_pack_rank(p, leaf, lo);
+		if (bpt_pack_delta(p, leaf, start - 1) == lo - p->bases[leaf]) {
+			--start;
+		}
+	}
+
+	for (; leaf < p->nr_leaves; ++leaf, start = 0) {
+		int n = bpt_pack_leaf_keys(p, leaf);
+		int end = n;
+		if (start == n) {
+			continue;
+		}
+		if (p->bases[leaf] >= hi) {
+			break;
+		}
+		if (p->bases[leaf] + bpt_pack_delta(p, leaf, n - 1) >= hi) {
+			end = bpt_pack_rank(p, leaf, hi - 1);
+		}
+		bpt_pack_decode(p, leaf, keys);
+		if (start < end) {
+			total += end - start;
+			if (fn(ctx, keys + start,
+			       (void* const*) p->vals + leaf * BPT_PACK_LEAF +
+			       start, end - start)) {
+				break;
+			}
+		}
+		if (end < n) {
+			break;
+		}
+	}
+	return total;
+}
+
+void bptree_packed_stats(const struct bptree_packed* p,
+			 struct bptree_packed_stats* st)
+{
+	memset(st, 0, sizeof(*st));
+	if (!p) {
+		return;
+	}
+	st->nr_keys = p->nr_keys;
+	st->nr_leaves = p->nr_leaves;
+	for (size_t leaf = 0; leaf < p->nr_leaves; ++leaf) {
+		int width = p->widths[leaf];
+		++st->leaves_by_width[width == 1 ? 0 : width == 2 ? 1 :
+				      width == 4 ? 2 : 3];
+	}
+	st->key_bytes = p->nr_words * sizeof(uint64_t) +
+		p->nr_leaves * (sizeof(uint64_t) + sizeof(uint32_t) + 1);
+	for (int level = 1; level < p->nr_levels; ++level) {
+		st->key_bytes += p->fence_keys[level] * sizeof(uint64_t);
+	}
+	st->bytes = sizeof(*p) + st->key_bytes + p->nr_keys * sizeof(void*);
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
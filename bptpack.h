@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * A packed, read-only copy of a tree.
+ *
+ * Leaves hold BPT_PACK_LEAF keys (the last may hold fewer) as deltas from
+ * the leaf's first key, in the fewest bytes that fit them all: 1, 2, 4, or 8
+ * when the leaf spans more than 32 bits. Dense keys, such as IDs and
+ * timestamps which differ only in their low bits, take one or two bytes
+ * instead of eight, and a whole leaf's keys fit in a cache line or two.
+ * Leaves are found through levels of fence keys, each holding every
+ * BPT_PACK_FANOUT-th key of the one below.
+ */
+
+#pragma once
+
+#include "bptree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Keys per packed leaf. */
+#define BPT_PACK_LEAF 64
+
+/* Keys per block of fences. */
+#define BPT_PACK_FANOUT 64
+
+struct bptree_packed;
+
+/*
+ * Pack n strictly increasing keys and their values (vals may be NULL).
+ * Returns NULL if n is 0.
+ */
+struct bptree_packed* bptree_pack_sorted(const uint64_t* keys,
+					 void* const* vals, size_t n);
+
+/*
+ * Pack the tuples of a tree (or a snapshot) that no other thread is
+ * modifying.
+ */
+struct bptree_packed* bptree_pack(struct bptree* root);
+
+void bptree_packed_free(struct bptree_packed* p);
+
+/* Lookup a key, returning 1 and its value (if val is not NULL) if it exists. */
+int bptree_packed_find(const struct bptree_packed* p, uint64_t key,
+		       void** val);
+
+/* Lookup the value corresponding to a key (NULL if nonexistent). */
+void* bptree_packed_lookup(const struct bptree_packed* p, uint64_t key);
+
+/*
+ * Pass every tuple in [lo, hi) to fn, one leaf's run at a time, returning the
+ * number visited.
+ */
+size_t bptree_packed_scan(const struct bptree_packed* p, uint64_t lo,
+			  uint64_t hi, bptree_scan_fn fn, void* ctx);
+
+struct bptree_packed_stats {
+	size_t nr_keys;
+	size_t nr_leaves;
+	size_t leaves_by_width[4];	/* With 1, 2, 4 and 8-byte deltas. */
+	size_t key_bytes;		/* Deltas, leaf bases and fences, ... */
+	size_t bytes;			/* ... and everything, with values. */
+};
+
+void bptree_packed_stats(const struct bptree_packed* p,
+			 struct bptree_packed_stats* st);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
@@ -20,12 +20,21 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include "bptree.h"
+#include "bptsearch.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <assert.h>
 
-#ifdef __cplusplus__
+#ifdef __cplusplus
 extern "C" {
 #endif
 
@@ -34,467 +43,4083 @@ extern "C" {
 #define BPT_P(bpt, pidx) ((struct bptree*) (bpt)->pointers[(pidx)])
 #define BPT_PREF(bpt, pidx) ((struct bptree**) &((*bpt)->pointers[(pidx)]))
 
-static struct bptree* bpt_alloc()
+/*
+ * Structural event counters, shared by every tree in the process. They are
+ * compiled out unless BPT_STATS is set.
+ */
+enum {
+	BPT_SPLITS,
+	BPT_MERGES,
+	BPT_ROTATIONS,
+	BPT_ROOT_CHANGES,
+	BPT_NR_COUNTERS
+};
+
+#if BPT_STATS
+static uint64_t bpt_counters[BPT_NR_COUNTERS]
+	__attribute__((aligned(BPT_ALIGN)));
+#define BPT_COUNT(c) \
+	__atomic_fetch_add(&bpt_counters[(c)], 1, __ATOMIC_RELAXED)
+#else
+#define BPT_COUNT(c) ((void) 0)
+#endif
+
+/*
+ * Shape stamps, for fingers. A node's stamp is bumped whenever it is split,
+ * rebalanced, merged, replaced or freed: the events that can move the key
+ * bounds a finger remembers for its leaf, or take the leaf away from its
+ * parent. Nodes have no room for a stamp of their own, so they share a table
+ * of them by address; a collision only sends a finger back to the root.
+ * Concurrent trees ignore fingers and skip the stamps.
+ */
+#define BPT_SHAPE_BITS 10
+
+static uint64_t bpt_shape[1 << BPT_SHAPE_BITS]
+	__attribute__((aligned(BPT_ALIGN)));
+
+static inline uint64_t* bpt_shape_of(const struct bptree* bpt)
 {
-	struct bptree* bpt = malloc(sizeof(struct bptree));
-	if (!bpt) {
-		return NULL;
-	}
+	uint64_t h = (uintptr_t) bpt * 0x9e3779b97f4a7c15ULL;
+	return &bpt_shape[h >> (64 - BPT_SHAPE_BITS)];
+}
 
-	bpt->keys = malloc(sizeof(uint64_t) * (ORDER - 1));
-	if (!bpt->keys) {
-		goto release0;
+static inline void bpt_reshaped(struct bptree* bpt)
+{
+	if (!(bpt->flags & BPT_SYNC)) {
+		__atomic_fetch_add(bpt_shape_of(bpt), 1, __ATOMIC_RELAXED);
 	}
+}
+
+/*
+ * Node version words, for concurrent trees.
+ *
+ * Writers lock the nodes they modify. Readers take no locks: they note a
+ * node's version, read it, and then check that the version is unchanged,
+ * restarting their operation if it is not. Unlocking bumps the version, and
+ * a node which has been unlinked from the tree is marked obsolete for good.
+ */
+#define BPT_OBSOLETE 0x1
+#define BPT_LOCKED 0x2
 
-	bpt->pointers = calloc(ORDER, sizeof(void*));
-	if (!bpt->pointers) {
-		goto release1;
+/*
+ * Wait for another thread to release a node. Spin briefly, then give up the
+ * CPU in case the holder has been preempted.
+ */
+static inline void bpt_pause(int* spins)
+{
+	if (++*spins < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} else {
+		sched_yield();
 	}
+}
 
-	bpt->is_leaf = 1;
-	bpt->nr_keys = 0;
-	bpt->bpt_next = NULL;
-	return bpt;
+static inline void bpt_spin_lock(uint32_t* lock)
+{
+	int spins = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		bpt_pause(&spins);
+	}
+}
 
-release1:
-	free(bpt->keys);
-release0:
-	free(bpt);
-	abort();
-	return NULL;
+static inline void bpt_spin_unlock(uint32_t* lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
 }
 
 /*
- * Create a B+ tree with one mapping in the root.
+ * Begin an optimistic read of a node, returning 0 if it is obsolete.
  */
-struct bptree* bptree_alloc(uint64_t key, void* val)
+static inline int bpt_read_begin(struct bptree* bpt, uint32_t* version)
 {
-	struct bptree* bpt = bpt_alloc();
-	bpt->nr_keys = 1;
-	bpt->keys[0] = key;
-	bpt->pointers[1] = val;
-	return bpt;
+	uint32_t v;
+	int spins = 0;
+	while ((v = __atomic_load_n(&bpt->version, __ATOMIC_ACQUIRE)) &
+	       BPT_LOCKED) {
+		bpt_pause(&spins);
+	}
+	*version = v;
+	return !(v & BPT_OBSOLETE);
 }
 
 /*
- * Halve an index with adjustment for odd numbers.
+ * Check that nothing has changed a node since bpt_read_begin().
  */
-static inline int split(int x)
+static inline int bpt_read_valid(struct bptree* bpt, uint32_t version)
 {
-	return (x >> 1) + (x & 1);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&bpt->version, __ATOMIC_RELAXED) == version;
 }
 
 /*
- * Find the key index for the given key, assuming that the key is in the range
- * [bpt.min, bpt.max) ((-inf, bpt.min) and [bpt.max, inf) must be handled
- * separately). 
+ * Move an optimistic read from a node to one of its children. The parent is
+ * checked before the child is touched, as a node of an arena tree can be
+ * recycled as a leaf at any time and a stale pointer read from it may be a
+ * value. It is checked again once the child's version is read, to be sure
+ * the child was still its child then.
  */
-static int bpt_bisect(struct bptree* bpt, uint64_t key)
+static inline int bpt_read_child(struct bptree* bpt, uint32_t version,
+				 struct bptree* child, uint32_t* child_version)
 {
-	int low = 0;
-	int high = bpt->nr_keys - 2;
-	int mid = low + ((high - low) / 2);
-	while (!(bpt->keys[mid] <= key && key < bpt->keys[mid + 1])) {
-		assert(low < high);
-		assert(bpt->keys[mid] != bpt->keys[mid + 1]);
-		if (bpt->keys[mid] < key) {
-			low = mid;
-		} else if (bpt->keys[mid] > key) {
-			high = mid - 1;
-		} else {
-			return mid;
-		}
-		mid = low == mid ? (mid + 1) : low + ((high - low) / 2);
-	}
-	return mid;
+	return child && bpt_read_valid(bpt, version) &&
+	       bpt_read_begin(child, child_version) &&
+	       bpt_read_valid(bpt, version);
 }
 
 /*
- * Find the key and pointer indices of a search key.
+ * Turn an optimistic read into a write lock, failing if the node changed.
  */
-static void bpt_index(struct bptree* bpt, uint64_t key, int* k, int* p)
+static inline int bpt_upgrade(struct bptree* bpt, uint32_t version)
 {
-	assert(bpt->nr_keys > 0);
-	const int last_idx = bpt->nr_keys - 1;
-	if (key < bpt->keys[0]) {
-		*k = *p = 0;
-	} else if (key >= bpt->keys[last_idx]) {
-		*k = last_idx;
-		*p = last_idx + 1;
-	} else {
-		*k = bpt_bisect(bpt, key);
-		*p = *k + 1;
+	if (__atomic_compare_exchange_n(&bpt->version, &version,
+					version + BPT_LOCKED, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		return 1;
 	}
+	return 0;
 }
 
 /*
- * Find the leaf which contains the start of the range [key, inf).
+ * Write-lock a node (a no-op unless the tree is concurrent).
  */
-struct bptree* bptree_search(struct bptree* bpt, uint64_t key)
+static inline void bpt_lock(struct bptree* bpt)
 {
-	int kidx, pidx;
-	while (!bpt->is_leaf) {
-		bpt_index(bpt, key, &kidx, &pidx);
-		bpt = bpt->pointers[pidx];
-		assert(bpt);
-		assert(bpt->nr_keys >= split(ORDER) - 1);
+	if (!(bpt->flags & BPT_SYNC)) {
+		return;
+	}
+	for (;;) {
+		uint32_t v;
+		if (bpt_read_begin(bpt, &v) && bpt_upgrade(bpt, v)) {
+			return;
+		}
+		assert(!(v & BPT_OBSOLETE));
 	}
-	return bpt;
 }
 
 /*
- * Finds the successor leaf for the given node.
+ * Release a write lock, bumping the node's version.
  */
-struct bptree* bptree_next(struct bptree* bpt)
+static inline void bpt_unlock(struct bptree* bpt)
 {
-	while (!bpt->is_leaf) {
-		bpt = bpt->pointers[0];
+	if (bpt->flags & BPT_SYNC) {
+		__atomic_fetch_add(&bpt->version, BPT_LOCKED, __ATOMIC_RELEASE);
 	}
-	return bpt->bpt_next;
 }
 
 /*
- * Find the leaf which contains the given key, or return NULL.
+ * Epoch-based reclamation of heap nodes unlinked from concurrent trees.
+ *
+ * Every operation on a concurrent tree runs inside a critical section which
+ * announces the global epoch it started in. A retired node is tagged with the
+ * epoch current at the time, and stashed in a per-thread limbo list. The
+ * global epoch only moves on once every thread inside a critical section has
+ * seen the current one, so a node tagged e is out of every reader's reach
+ * once the epoch reaches e + 2. Limbo lists are collected once per
+ * BPT_EPOCH_BATCH retirements, keeping the cost off individual deletes.
  */
-struct bptree* bptree_exists(struct bptree* bpt, uint64_t key)
+struct bpt_retired {
+	struct bptree* node;
+	uint64_t epoch;
+};
+
+struct bpt_limbo {
+	struct bpt_retired* items;
+	size_t nr_items;
+	size_t capacity;
+};
+
+/*
+ * A thread's announcement (zero outside critical sections) and limbo list.
+ * Records are never freed, only handed on to later threads.
+ */
+struct bpt_epoch_rec {
+	uint64_t epoch;
+	struct bpt_epoch_rec* next;
+	int in_use;
+	int depth;
+	unsigned nr_retired;
+	struct bpt_limbo limbo;
+} __attribute__((aligned(BPT_ALIGN)));
+
+static uint64_t bpt_global_epoch = 1;
+static struct bpt_epoch_rec* bpt_epoch_recs;
+
+/* Nodes left behind by threads which have exited. */
+static struct bpt_limbo bpt_orphans;
+static uint32_t bpt_orphans_lock;
+
+static pthread_key_t bpt_epoch_key;
+static pthread_once_t bpt_epoch_once = PTHREAD_ONCE_INIT;
+static __thread struct bpt_epoch_rec* bpt_self;
+
+static void bpt_limbo_push(struct bpt_limbo* limbo, struct bptree* node,
+			   uint64_t epoch)
 {
-	int kidx, pidx;
-	bpt = bptree_search(bpt, key);
-	bpt_index(bpt, key, &kidx, &pidx);
-	return (bpt && bpt->keys[kidx] == key) ? bpt : NULL;
+	if (limbo->nr_items == limbo->capacity) {
+		size_t capacity = limbo->capacity ? 2 * limbo->capacity :
+					BPT_EPOCH_BATCH;
+		void* items = realloc(limbo->items,
+			capacity * sizeof(struct bpt_retired));
+		if (!items) {
+			abort();
+			return;
+		}
+		limbo->items = items;
+		limbo->capacity = capacity;
+	}
+	limbo->items[limbo->nr_items].node = node;
+	limbo->items[limbo->nr_items].epoch = epoch;
+	++limbo->nr_items;
 }
 
 /*
- * Key/value lookup. 
+ * Free the oldest nodes in a limbo list, up to those retired in epoch
+ * safe - 1. Entries are in retirement order, so that is a prefix.
  */
-void* bptree_lookup(struct bptree* bpt, uint64_t key)
+static size_t bpt_limbo_free(struct bpt_limbo* limbo, uint64_t safe)
 {
-	int kidx, pidx;
-	bpt = bptree_search(bpt, key);
-	if (bpt) {
-		bpt_index(bpt, key, &kidx, &pidx);
-		return bpt->keys[kidx] == key ? bpt->pointers[pidx] : NULL;
-	} else {
-		return NULL;
+	size_t i = 0;
+	while (i < limbo->nr_items && limbo->items[i].epoch + 2 <= safe) {
+		free(limbo->items[i].node);
+		++i;
 	}
+	memmove(limbo->items, limbo->items + i,
+		(limbo->nr_items - i) * sizeof(struct bpt_retired));
+	limbo->nr_items -= i;
+	return i;
 }
 
 /*
- * Update the value of an existing key.
+ * Advance the global epoch if every thread in a critical section has caught
+ * up with it. Returns the (possibly new) global epoch.
  */
-void bptree_modify(struct bptree* bpt, uint64_t key, void* val)
+static uint64_t bpt_epoch_advance(void)
 {
-	int kidx, pidx;
-	bpt = bptree_search(bpt, key);
-	if (bpt) {
-		bpt_index(bpt, key, &kidx, &pidx);
-		if (bpt->keys[kidx] == key) {
-			bpt->pointers[pidx] = val;
+	uint64_t epoch = __atomic_load_n(&bpt_global_epoch, __ATOMIC_SEQ_CST);
+	struct bpt_epoch_rec* rec = __atomic_load_n(&bpt_epoch_recs,
+						    __ATOMIC_ACQUIRE);
+	for (; rec; rec = rec->next) {
+		uint64_t e = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST);
+		if (e && e != epoch) {
+			return epoch;
 		}
-	}	
+	}
+	if (__atomic_compare_exchange_n(&bpt_global_epoch, &epoch, epoch + 1,
+					0, __ATOMIC_SEQ_CST,
+					__ATOMIC_SEQ_CST)) {
+		return epoch + 1;
+	}
+	return epoch;
 }
 
 /*
- * Add an entry into a nonfull node after pidx.
+ * Free what the calling thread (and any exited thread) retired long enough
+ * ago. Returns the number of nodes freed.
  */
-static void bpt_inject(struct bptree* bpt, int pidx, uint64_t key, void* val)
+static size_t bpt_epoch_collect(struct bpt_epoch_rec* self)
 {
-	assert(bpt->nr_keys < ORDER - 1);
-	for (int i = bpt->nr_keys; i > pidx; --i) {
-		bpt->pointers[i + 1] = bpt->pointers[i];
+	uint64_t safe = bpt_epoch_advance();
+	size_t freed = bpt_limbo_free(&self->limbo, safe);
+	if (__atomic_load_n(&bpt_orphans.nr_items, __ATOMIC_RELAXED) &&
+	    !__atomic_exchange_n(&bpt_orphans_lock, 1, __ATOMIC_ACQUIRE)) {
+		freed += bpt_limbo_free(&bpt_orphans, safe);
+		bpt_spin_unlock(&bpt_orphans_lock);
 	}
-	bpt->pointers[pidx + 1] = val;
-	for (int i = bpt->nr_keys - 1; i >= pidx; --i) {
-		bpt->keys[i + 1] = bpt->keys[i];
+	return freed;
+}
+
+/*
+ * On thread exit, hand whatever is still in limbo to the orphan list and
+ * free the record up for the next thread.
+ */
+static void bpt_epoch_exit(void* arg)
+{
+	struct bpt_epoch_rec* self = arg;
+	bpt_epoch_collect(self);
+	if (self->limbo.nr_items) {
+		bpt_spin_lock(&bpt_orphans_lock);
+		for (size_t i = 0; i < self->limbo.nr_items; ++i) {
+			bpt_limbo_push(&bpt_orphans, self->limbo.items[i].node,
+				       self->limbo.items[i].epoch);
+		}
+		bpt_spin_unlock(&bpt_orphans_lock);
+		self->limbo.nr_items = 0;
 	}
-	bpt->keys[pidx] = key;
-	++bpt->nr_keys;
+	__atomic_store_n(&self->in_use, 0, __ATOMIC_RELEASE);
+}
 
-	struct bptree* pred = bpt->pointers[pidx];
-	if (!bpt->is_leaf && pred && pred->is_leaf) {
-		struct bptree* succ = bpt->pointers[pidx + 1];
-		succ->bpt_next = pred->bpt_next;
-		pred->bpt_next = succ;
+static void bpt_epoch_init(void)
+{
+	if (pthread_key_create(&bpt_epoch_key, bpt_epoch_exit)) {
+		abort();
 	}
 }
 
 /*
- * Split a full child into two nodes about the median key.
+ * Find the calling thread's record, claiming one on first use.
  */
-static void bpt_split_child(struct bptree* parent, int pidx)
+static struct bpt_epoch_rec* bpt_epoch_self(void)
 {
-	struct bptree* succ = bpt_alloc();
-	struct bptree* pred = parent->pointers[pidx];
-	succ->is_leaf = pred->is_leaf;
-	succ->nr_keys = split(ORDER - 1);
-	pred->nr_keys = (ORDER - 1) - succ->nr_keys;
+	struct bpt_epoch_rec* rec = bpt_self;
+	if (rec) {
+		return rec;
+	}
 
-	for (int i = 0; i < succ->nr_keys; ++i) {
-		succ->keys[i] = pred->keys[i + pred->nr_keys];
+	pthread_once(&bpt_epoch_once, bpt_epoch_init);
+	for (rec = __atomic_load_n(&bpt_epoch_recs, __ATOMIC_ACQUIRE); rec;
+	     rec = rec->next) {
+		int idle = 0;
+		if (!__atomic_load_n(&rec->in_use, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&rec->in_use, &idle, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
 	}
-	for (int i = 1; i <= succ->nr_keys; ++i) {
-		succ->pointers[i] = pred->pointers[i + pred->nr_keys];
+	if (!rec) {
+		if (posix_memalign((void**) &rec, BPT_ALIGN, sizeof(*rec))) {
+			abort();
+			return NULL;
+		}
+		memset(rec, 0, sizeof(*rec));
+		rec->in_use = 1;
+		rec->next = __atomic_load_n(&bpt_epoch_recs, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&bpt_epoch_recs, &rec->next,
+						    rec, 0, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+		}
 	}
-	bpt_inject(parent, pidx, succ->keys[0], succ);
+	pthread_setspecific(bpt_epoch_key, rec);
+	bpt_self = rec;
+	return rec;
 }
 
 /*
- * Insert an entry into a nonfull parent.
+ * Enter a critical section (they nest). No node reachable from the tree at
+ * this point will be freed until the matching bpt_epoch_leave().
  */
-static void bpt_insert_nonfull(struct bptree* bpt, uint64_t key, void* val)
+static struct bpt_epoch_rec* bpt_epoch_enter(void)
 {
-	int kidx, pidx;
-	while (!bpt->is_leaf) {
-		bpt_index(bpt, key, &kidx, &pidx);
-		if (BPT_P(bpt, pidx)->nr_keys == ORDER - 1) {
-			bpt_split_child(bpt, pidx);
-			bpt_index(bpt, key, &kidx, &pidx);
-		}
-
-		assert(kidx < bpt->nr_keys);
-		if (bpt->keys[kidx] == key) {
-			return;
-		}
-
-		bpt = bpt->pointers[pidx];
-		assert(bpt->nr_keys >= split(ORDER) - 1);
-		assert(bpt->nr_keys < ORDER);
+	struct bpt_epoch_rec* self = bpt_epoch_self();
+	if (self->depth++ == 0) {
+		__atomic_store_n(&self->epoch,
+			__atomic_load_n(&bpt_global_epoch, __ATOMIC_SEQ_CST),
+			__ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
 	}
+	return self;
+}
 
-	bpt_index(bpt, key, &kidx, &pidx);
-	assert(kidx < bpt->nr_keys);
-	if (bpt->keys[kidx] != key) {
-		bpt_inject(bpt, pidx, key, val);
+static void bpt_epoch_leave(struct bpt_epoch_rec* self)
+{
+	if (--self->depth == 0) {
+		__atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
 	}
 }
 
 /*
- * Perform inserts, splitting the root node if necessary.
+ * Queue an unlinked heap node to be freed once no reader can reach it.
  */
-void bptree_insert(struct bptree** root, uint64_t key, void* val)
+static void bpt_epoch_retire(struct bptree* bpt)
 {
-	if ((*root)->nr_keys == ORDER - 1) {
-		struct bptree* new_root = bpt_alloc();
-		new_root->is_leaf = 0;
-		new_root->pointers[0] = *root;
-		bpt_split_child(new_root, 0);
-		*root = new_root;
-		bpt_insert_nonfull(new_root, key, val);
-	} else {
-		bpt_insert_nonfull(*root, key, val);
+	struct bpt_epoch_rec* self = bpt_epoch_self();
+	bpt_limbo_push(&self->limbo, bpt,
+		__atomic_load_n(&bpt_global_epoch, __ATOMIC_SEQ_CST));
+	if (++self->nr_retired % BPT_EPOCH_BATCH == 0) {
+		bpt_epoch_collect(self);
 	}
 }
 
-static void* bpt_delete(struct bptree* bpt, uint64_t key);
+/*
+ * A per-tree node arena. Nodes are bump-allocated out of slabs, nodes freed by
+ * merges are recycled through a free list, and the whole arena goes away at
+ * once when the tree is destroyed. The lock is only taken for concurrent
+ * trees.
+ */
+struct bpt_arena {
+	struct bptree_allocator allocator;
+	struct bpt_slab* slabs;
+	char* bump;
+	char* end;
+	struct bptree* free_list;
+	uint32_t lock;
+};
+
+/*
+ * Every slab is aligned to its size, so a node can find its arena by masking
+ * its own address.
+ */
+struct bpt_slab {
+	struct bpt_arena* arena;
+	struct bpt_slab* next;
+} __attribute__((aligned(BPT_ALIGN)));
+
+static void* bpt_heap_alloc(void* ctx, size_t size, size_t align)
+{
+	(void) ctx;
+	void* mem;
+	return posix_memalign(&mem, align, size) ? NULL : mem;
+}
+
+static void bpt_heap_free(void* ctx, void* ptr, size_t size)
+{
+	(void) ctx;
+	(void) size;
+	free(ptr);
+}
+
+static const struct bptree_allocator bpt_heap = {
+	bpt_heap_alloc, bpt_heap_free, NULL
+};
+
+static struct bpt_arena* bpt_arena_of(struct bptree* bpt)
+{
+	uintptr_t slab = (uintptr_t) bpt & ~((uintptr_t) BPT_SLAB_SIZE - 1);
+	return ((struct bpt_slab*) slab)->arena;
+}
 
 /*
- * Remove a key-value pair contained within a node.
+ * Recycled nodes keep counting up from their old version, so that a reader
+ * still holding one can tell that it has changed underneath it.
  */
-static void bpt_eject(struct bptree* bpt, int kidx, int pidx)
+static struct bptree* bpt_arena_alloc(struct bpt_arena* arena, int sync)
 {
-	for (int i = kidx; i < bpt->nr_keys; ++i) {
-		bpt->keys[i] = bpt->keys[i + 1];
+	if (sync) {
+		bpt_spin_lock(&arena->lock);
+	}
+
+	struct bptree* bpt = arena->free_list;
+	if (bpt) {
+		arena->free_list = bpt->pointers[0];
+		bpt->version = (bpt->version | (BPT_LOCKED | BPT_OBSOLETE)) + 1;
+		goto out;
 	}
-	for (int i = pidx; i <= bpt->nr_keys; ++i) {
-		bpt->pointers[i] = bpt->pointers[i + 1];
+
+	if (arena->end - arena->bump < (ptrdiff_t) sizeof(struct bptree)) {
+		struct bpt_slab* slab = arena->allocator.alloc(
+			arena->allocator.ctx, BPT_SLAB_SIZE, BPT_SLAB_SIZE);
+		if (!slab) {
+			abort();
+			return NULL;
+		}
+		assert(((uintptr_t) slab & (BPT_SLAB_SIZE - 1)) == 0);
+		slab->arena = arena;
+		slab->next = arena->slabs;
+		arena->slabs = slab;
+		arena->bump = (char*) (slab + 1);
+		arena->end = (char*) slab + BPT_SLAB_SIZE;
 	}
-	struct bptree* succ = bpt->pointers[pidx];
-	if (!bpt->is_leaf && pidx > 0 && succ && succ->is_leaf) {
-		struct bptree* pred = bpt->pointers[pidx - 1];
-		pred->bpt_next = succ;
+
+	bpt = (struct bptree*) arena->bump;
+	bpt->version = 0;
+	arena->bump += sizeof(struct bptree);
+out:
+	if (sync) {
+		bpt_spin_unlock(&arena->lock);
 	}
-	--bpt->nr_keys;
+	return bpt;
 }
 
-/*
- * Move the last key in the left donor into the parent at kidx.
- */
-static void bpt_rotate_right(struct bptree* parent, int kidx, int donor_pidx)
+static void bpt_arena_free(struct bpt_arena* arena, struct bptree* bpt,
+			   int sync)
 {
-	struct bptree* donor = BPT_P(parent, donor_pidx);
-	uint64_t kprime = donor->keys[donor->nr_keys - 1];
-	parent->keys[kidx] = kprime;
-	void* val = bpt_delete(BPT_P(parent, donor_pidx), kprime);
-	bpt_insert_nonfull(BPT_P(parent, donor_pidx + 1), kprime, val);
+	if (sync) {
+		bpt_spin_lock(&arena->lock);
+	}
+	bpt->pointers[0] = arena->free_list;
+	arena->free_list = bpt;
+	if (sync) {
+		bpt_spin_unlock(&arena->lock);
+	}
 }
 
-/*
- * Move the second key in the right donor into the parent at kidx.
- */
-static void bpt_rotate_left(struct bptree* parent, int kidx, int donor_pidx)
+static void bpt_arena_destroy(struct bpt_arena* arena)
+{
+	struct bptree_allocator allocator = arena->allocator;
+	struct bpt_slab* slab = arena->slabs;
+	while (slab) {
+		struct bpt_slab* next = slab->next;
+		allocator.free(allocator.ctx, slab, BPT_SLAB_SIZE);
+		slab = next;
+	}
+	allocator.free(allocator.ctx, arena, sizeof(struct bpt_arena));
+}
+
+static struct bptree* bpt_init(struct bptree* bpt, uint8_t flags)
 {
-	struct bptree* donor = BPT_P(parent, donor_pidx);
-	uint64_t kprime = donor->keys[0];
-	parent->keys[kidx] = donor->keys[1];
-	void* val = bpt_delete(BPT_P(parent, donor_pidx), kprime);
-	bpt_insert_nonfull(BPT_P(parent, donor_pidx - 1), kprime, val);
+	bpt->is_leaf = 1;
+	bpt->nr_keys = 0;
+	bpt->flags = flags;
+	bpt->filter = 0;
+	memset(bpt->pointers, 0, sizeof(bpt->pointers));
+#if BPT_COUNTS
+	memset(bpt->counts, 0, sizeof(bpt->counts));
+#endif
+	return bpt;
 }
 
 /*
- * Free a bptree structure without touching any of its data.
+ * Allocate a node from the same place as an existing node of the tree (or
+ * from the heap when there is none). The new node inherits the tree's flags,
+ * except the ones that only mean anything on a root.
  */
-static void bpt_free(struct bptree* bpt)
+static struct bptree* bpt_alloc(struct bptree* sibling)
 {
-	free(bpt->pointers);
-	free(bpt->keys);
-	free(bpt);
+	uint8_t flags = sibling ? sibling->flags & ~(BPT_SHARED | BPT_FROZEN) : 0;
+	struct bptree* bpt;
+	if (flags & BPT_ARENA) {
+		bpt = bpt_init(bpt_arena_alloc(bpt_arena_of(sibling),
+					       flags & BPT_SYNC), flags);
+	} else {
+		void* mem;
+		if (posix_memalign(&mem, BPT_ALIGN, sizeof(struct bptree))) {
+			abort();
+			return NULL;
+		}
+		((struct bptree*) mem)->version = 0;
+		bpt = bpt_init(mem, flags);
+	}
+	bpt->filter = sibling ? sibling->filter : 0;
+	return bpt;
 }
 
 /*
- * Merge parent.kidx0 and parent.kidx1 together.
+ * Filters attached to trees, by number; every node of a tree carries its
+ * filter's number. A number stays taken until its tree is freed or gets
+ * another filter, even if the filter itself goes first.
  */
-static void bpt_merge(struct bptree* parent, int kidx1, int pidx1)
+static struct bptree_filter* bpt_filters[BPT_MAX_FILTERS + 1];
+static uint8_t bpt_filter_taken[BPT_MAX_FILTERS + 1];
+static uint32_t bpt_filter_lock;
+
+static void bpt_filter_set(struct bptree_filter* f, uint64_t key);
+static void bpt_filter_tend(struct bptree* root);
+
+/* Set the bits of a new key, before it goes into the leaf. */
+static inline void bpt_filter_insert(const struct bptree* leaf, uint64_t key)
 {
-	struct bptree* pred = parent->pointers[pidx1 - 1];
-	struct bptree* succ = parent->pointers[pidx1];
-	assert(pred->nr_keys >= split(ORDER) - 1);
-	assert(succ->nr_keys >= split(ORDER) - 1);
-	assert(succ->nr_keys + pred->nr_keys <= ORDER - 1);
-	assert(succ->is_leaf || succ->pointers[0] == NULL);
-	bpt_eject(parent, kidx1, pidx1);
-	for (int i = 0; i < succ->nr_keys; ++i) {
-		bpt_inject(pred, pred->nr_keys, succ->keys[i],
-			succ->pointers[i + 1]);
+	struct bptree_filter* f;
+	if (leaf->filter && (f = bpt_filters[leaf->filter])) {
+		bpt_filter_set(f, key);
+		++f->nr_keys;
 	}
-	bpt_free(succ);
 }
 
-static void* bpt_delete_noindex(struct bptree* bpt, uint64_t key,
-				int kidx, int pidx);
+/* Note keys deleted from a tree, whose bits stay behind. */
+static inline void bpt_filter_remove(const struct bptree* bpt, size_t n)
+{
+	struct bptree_filter* f;
+	if (bpt->filter && (f = bpt_filters[bpt->filter])) {
+		f->nr_stale += n;
+	}
+}
 
 /*
- * Perform deletions on subtrees.
+ * Create a B+ tree with one mapping in the root.
  */
-static void* bpt_delete(struct bptree* bpt, uint64_t key)
+struct bptree* bptree_alloc(uint64_t key, void* val)
 {
-	int kidx, pidx;
-	bpt_index(bpt, key, &kidx, &pidx);
-	return bpt_delete_noindex(bpt, key, kidx, pidx);
-}
-
-/*
- * Perform deletions using the provided indices for victim nodes.
- */
-static void* bpt_delete_noindex(struct bptree* bpt, uint64_t key, 
-				int kidx, int pidx)
-{
-	void* val = NULL;
-	int match = bpt->keys[kidx] == key;
-	if (match && bpt->is_leaf) {
-		val = bpt->pointers[pidx];
-		bpt_eject(bpt, kidx, pidx);
-	} else if (match && !bpt->is_leaf) {
-		assert(bpt->nr_keys >= 1);
-		assert(pidx <= bpt->nr_keys);
-		struct bptree* curr = BPT_P(bpt, pidx);
-		struct bptree* pred = pidx == 0 ?
-					NULL : BPT_P(bpt, pidx - 1);
-		struct bptree* succ = pidx == bpt->nr_keys ? 
-					NULL : BPT_P(bpt, pidx + 1);
-		if (curr->nr_keys >= split(ORDER)) {
-			val = bpt_delete(BPT_P(bpt, pidx), key);
-			bpt->keys[kidx] = BPT_P(bpt, pidx)->keys[0];
-		} else if (pred && pred->nr_keys >= split(ORDER)) {
-			bpt_rotate_right(bpt, kidx, pidx - 1);
-			val = bpt_delete(BPT_P(bpt, pidx), key);
-		} else if (succ && succ->nr_keys >= split(ORDER)) {
-			assert(!pred || pred->nr_keys == split(ORDER) - 1);
-			bpt_rotate_left(bpt, kidx + 1, pidx + 1);
-			val = bpt_delete(BPT_P(bpt, pidx), key);
-			bpt->keys[kidx] = BPT_P(bpt, pidx)->keys[0];
-		} else if (pred) {
-			bpt_merge(bpt, kidx, pidx);
-			val = bpt_delete(BPT_P(bpt, pidx - 1), key);
-		} else if (succ) {
-			bpt_merge(bpt, kidx + 1, pidx + 1);
-			val = bpt_delete(BPT_P(bpt, pidx), key);
-		} else {
-			assert(!"Internal node key deletion failed!");
-		}
-	} else if (!bpt->is_leaf) {
-		struct bptree *rhs = NULL, *lhs = NULL;
-		struct bptree* child = BPT_P(bpt, pidx);
-		if (!child) {
-			return NULL;
-		}
-
-		if (child->nr_keys == split(ORDER) - 1) {
-			int lhs_donor = pidx - 1 >= 0 && 
-				(lhs = bpt->pointers[pidx - 1]) &&
-				lhs->nr_keys >= split(ORDER);
-			int rhs_donor = pidx + 1 <= bpt->nr_keys &&
-				(rhs = bpt->pointers[pidx + 1]) &&
-				rhs->nr_keys >= split(ORDER);
-			if (lhs_donor) {
-				bpt_rotate_right(bpt, kidx, pidx - 1);
-			} else if (rhs_donor) {
-				bpt_rotate_left(bpt, kidx, pidx + 1);
-			} else if (rhs) {
-				bpt_merge(bpt, kidx + 1, pidx + 1);
-			} else if (lhs) {
-				bpt_merge(bpt, kidx, pidx);
-			} else {
-				assert(!"Internal node is degenerate!");
-				return NULL;
-			}
-		}
+	struct bptree* bpt = bpt_alloc(NULL);
+	bpt->nr_keys = 1;
+	bpt->keys[0] = key;
+	bpt->pointers[1] = val;
+	return bpt;
+}
 
-		val = bpt_delete(BPT_P(bpt, pidx), key);
+/*
+ * Create a B+ tree with one mapping in the root, backed by a new arena.
+ */
+struct bptree* bptree_alloc_arena(uint64_t key, void* val,
+				  const struct bptree_allocator* allocator)
+{
+	if (!allocator) {
+		allocator = &bpt_heap;
+	}
+	struct bpt_arena* arena = allocator->alloc(allocator->ctx,
+		sizeof(struct bpt_arena), BPT_ALIGN);
+	if (!arena) {
+		abort();
+		return NULL;
 	}
+	arena->allocator = *allocator;
+	arena->slabs = NULL;
+	arena->bump = arena->end = NULL;
+	arena->free_list = NULL;
+	arena->lock = 0;
 
-	return val;
+	struct bptree* bpt = bpt_init(bpt_arena_alloc(arena, 0), BPT_ARENA);
+	bpt->nr_keys = 1;
+	bpt->keys[0] = key;
+	bpt->pointers[1] = val;
+	return bpt;
 }
 
 /*
- * Remove a key, restructuring the tree as needed.
+ * Halve an index with adjustment for odd numbers.
  */
-void* bptree_delete(struct bptree** bpt, uint64_t key)
+static inline int split(int x)
 {
-	void* val = NULL;
-	struct bptree* root = *bpt;
-	int kidx, pidx;
-	bpt_index(root, key, &kidx, &pidx);
-	int match = root->keys[kidx] == key;
-
-	if (root->is_leaf) {
-		if (match) {
-			val = root->pointers[pidx];
-			if (root->nr_keys == 1) {
-				root->keys[kidx] = 0;
-				root->pointers[pidx] = NULL;
-			} else {
-				bpt_eject(root, kidx, pidx);
-			}
-		}
-	} else {
-		if (root->nr_keys == 1) {
-			assert(root->pointers[0] && root->pointers[1]);
-			bpt_merge(root, 0, 1);
-			*bpt = root->pointers[0];
-			bpt_free(root);
-			root = *bpt;
-			val = bpt_delete(root, key);
-		} else {
-			val = bpt_delete_noindex(root, key, kidx, pidx);
-		}
-	}
-	return val;
+	return (x >> 1) + (x & 1);
 }
 
-void bptree_free(struct bptree* bpt)
+/*
+ * The in-node search kernel, chosen for the running CPU at load time.
+ */
+static bpt_rank_fn bpt_rank = bpt_rank_scalar;
+
+__attribute__((constructor))
+static void bpt_init_search(void)
 {
-	if (bpt->is_leaf) {
+	bpt_rank = bpt_rank_select();
+}
+
+/*
+ * Find the key and pointer indices of a search key.
+ */
+static void bpt_index(struct bptree* bpt, uint64_t key, int* k, int* p)
+{
+	assert(bpt->nr_keys > 0);
+	int rank = bpt_rank(bpt->keys, bpt->nr_keys, key);
+	*k = rank ? rank - 1 : 0;
+	*p = rank;
+}
+
+/*
+ * Copy-on-write. In a plain tree a node's version word counts the references
+ * to it beyond the first: a snapshot holds one to each child of its root, and
+ * a node is shared exactly when its count is nonzero (or an ancestor's is,
+ * which writers rule out by copying from the top down). Releases may happen in
+ * any thread, so the counts are atomic. The last reference to go frees the
+ * node and drops its own references to its children.
+ *
+ * Leaf chains only describe the live tree. A copied leaf takes over its
+ * original's place in the chain, even if that means changing the next
+ * pointer of a leaf that snapshots share; snapshots never follow it.
+ */
+static inline int bpt_is_shared(struct bptree* bpt)
+{
+	return __atomic_load_n(&bpt->version, __ATOMIC_ACQUIRE) != 0;
+}
+
+static void bpt_ref(struct bptree* bpt)
+{
+	__atomic_fetch_add(&bpt->version, 1, __ATOMIC_RELAXED);
+}
+
+static void bpt_unref(struct bptree* bpt)
+{
+	if (__atomic_fetch_sub(&bpt->version, 1, __ATOMIC_ACQ_REL) != 0) {
+		return;
+	}
+	if (!bpt->is_leaf) {
+		for (int i = 0; i <= bpt->nr_keys; ++i) {
+			bpt_unref(bpt->pointers[i]);
+		}
+	}
+	/* Only heap trees are snapshotted. */
+	free(bpt);
+}
+
+/*
+ * Replace the shared child at pidx of a private node with a private copy.
+ */
+static struct bptree* bpt_cow_copy(struct bptree* parent, int pidx)
+{
+	struct bptree* old = parent->pointers[pidx];
+	struct bptree* copy = bpt_alloc(old);
+	memcpy(copy, old, sizeof(struct bptree));
+	copy->version = 0;
+	if (!copy->is_leaf) {
+		for (int i = 0; i <= copy->nr_keys; ++i) {
+			bpt_ref(copy->pointers[i]);
+		}
+	}
+	parent->pointers[pidx] = copy;
+	bpt_reshaped(old);
+	bpt_unref(old);
+	return copy;
+}
+
+/*
+ * Point the leaf before a copied leaf at the copy. The copy hangs off
+ * path[depth - 1] at pidx, with the path above it given by slot[].
+ */
+static void bpt_cow_relink(struct bptree** path, int* slot, int depth,
+			   int pidx, struct bptree* copy)
+{
+	struct bptree* prev = NULL;
+	if (pidx > 0) {
+		prev = path[depth - 1]->pointers[pidx - 1];
+	} else {
+		while (--depth > 0 && slot[depth - 1] == 0) {
+		}
+		if (depth > 0) {
+			prev = path[depth - 1]->pointers[slot[depth - 1] - 1];
+			while (!prev->is_leaf) {
+				prev = prev->pointers[prev->nr_keys];
+			}
+		}
+	}
+	if (prev) {
+		prev->bpt_next = copy;
+	}
+}
+
+/*
+ * Copy the shared children lo..hi of path[depth - 1], a private node, which
+ * the path and slots above lead to.
+ */
+static void bpt_cow_children(struct bptree** path, int* slot, int depth,
+			     int lo, int hi)
+{
+	struct bptree* bpt = path[depth - 1];
+	lo = lo < 0 ? 0 : lo;
+	hi = hi > bpt->nr_keys ? bpt->nr_keys : hi;
+	for (int i = lo; i <= hi; ++i) {
+		if (bpt_is_shared(bpt->pointers[i])) {
+			struct bptree* copy = bpt_cow_copy(bpt, i);
+			if (copy->is_leaf) {
+				bpt_cow_relink(path, slot, depth, i, copy);
+			}
+		}
+	}
+}
+
+/* What an update is about to do to the path it copies. */
+enum {
+	BPT_COW_LEAF,		/* Change a value in place. */
+	BPT_COW_INSERT,		/* Full nodes may spill into or split beside
+				   their siblings. */
+	BPT_COW_DELETE,		/* Minimal nodes may borrow from or merge with
+				   their siblings. */
+};
+
+/*
+ * Copy the shared nodes on the path to a key, and the siblings of any path
+ * node that the update may rebalance with, so that the update can work in
+ * place as usual. The root of a live tree is never shared.
+ */
+static void bpt_cow_path(struct bptree* root, uint64_t key, int op)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	struct bptree* bpt = root;
+	int depth = 0;
+
+	while (!bpt->is_leaf) {
+		int pidx = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		struct bptree* child = bpt->pointers[pidx];
+		int near = (op == BPT_COW_INSERT &&
+			    child->nr_keys == ORDER - 1) ||
+			   (op == BPT_COW_DELETE &&
+			    child->nr_keys <= split(ORDER) - 1);
+		assert(depth < BPT_MAX_HEIGHT);
+		path[depth] = bpt;
+		slot[depth++] = pidx;
+		bpt_cow_children(path, slot, depth, pidx - near, pidx + near);
+		bpt = bpt->pointers[pidx];
+	}
+}
+
+static void bpt_unshare_walk(struct bptree* bpt, struct bptree** prev)
+{
+	if (bpt->is_leaf) {
+		if (*prev) {
+			(*prev)->bpt_next = bpt;
+		}
+		*prev = bpt;
+		return;
+	}
+	for (int i = 0; i <= bpt->nr_keys; ++i) {
+		if (bpt_is_shared(bpt->pointers[i])) {
+			bpt_cow_copy(bpt, i);
+		}
+		bpt_unshare_walk(bpt->pointers[i], prev);
+	}
+}
+
+/*
+ * Copy every shared node of a live tree, for updates that may reach any part
+ * of it. The tree then shares nothing with its snapshots.
+ */
+static void bpt_unshare(struct bptree* root)
+{
+	struct bptree* prev = NULL;
+	if (root->flags & BPT_SHARED) {
+		bpt_unshare_walk(root, &prev);
+		root->flags &= ~BPT_SHARED;
+	}
+}
+
+/*
+ * A snapshot gets its own copy of the root, so the live root never moves
+ * for it and is never shared.
+ */
+struct bptree* bptree_snapshot(struct bptree* root)
+{
+	if (root->flags & (BPT_SYNC | BPT_ARENA)) {
+		return NULL;
+	}
+	struct bptree* snap = bpt_alloc(root);
+	memcpy(snap, root, sizeof(struct bptree));
+	snap->version = 0;
+	snap->flags = (root->flags & ~BPT_SHARED) | BPT_FROZEN;
+	snap->filter = 0;
+	if (!snap->is_leaf) {
+		for (int i = 0; i <= snap->nr_keys; ++i) {
+			bpt_ref(snap->pointers[i]);
+		}
+		root->flags |= BPT_SHARED;
+	}
+	return snap;
+}
+
+void bptree_snapshot_release(struct bptree* snap)
+{
+	assert(snap->flags & BPT_FROZEN);
+	bpt_unref(snap);
+}
+
+/*
+ * Find the leaf which contains the start of the range [key, inf).
+ */
+struct bptree* bptree_search(struct bptree* bpt, uint64_t key)
+{
+	int kidx, pidx;
+	while (!bpt->is_leaf) {
+		bpt_index(bpt, key, &kidx, &pidx);
+		bpt = bpt->pointers[pidx];
+		assert(bpt);
+		assert(bpt->nr_keys >= split(ORDER) - 1);
+	}
+	return bpt;
+}
+
+/*
+ * Finds the successor leaf for the given node.
+ */
+struct bptree* bptree_next(struct bptree* bpt)
+{
+	while (!bpt->is_leaf) {
+		bpt = bpt->pointers[0];
+	}
+	return bpt->bpt_next;
+}
+
+/*
+ * Optimistically descend to the leaf for a key in a concurrent tree. Returns
+ * NULL if a writer got in the way, in which case the caller must restart.
+ * Otherwise the caller validates its reads of the leaf against *version.
+ */
+static struct bptree* bpt_search_sync(struct bptree* bpt, uint64_t key,
+				      uint32_t* version)
+{
+	uint32_t v, cv;
+	if (!bpt_read_begin(bpt, &v)) {
+		return NULL;
+	}
+	while (!bpt->is_leaf) {
+		int n = bpt->nr_keys;
+		if (n > ORDER - 1) {
+			return NULL;
+		}
+		struct bptree* child = bpt->pointers[bpt_rank(bpt->keys, n, key)];
+		if (!bpt_read_child(bpt, v, child, &cv)) {
+			return NULL;
+		}
+		bpt = child;
+		v = cv;
+	}
+	*version = v;
+	return bpt;
+}
+
+/*
+ * Find the leaf holding a key in a concurrent tree, and the key's value.
+ */
+static struct bptree* bpt_find_sync(struct bptree* bpt, uint64_t key,
+				    void** val)
+{
+	for (;;) {
+		uint32_t v;
+		struct bptree* leaf = bpt_search_sync(bpt, key, &v);
+		if (!leaf) {
+			continue;
+		}
+		int n = leaf->nr_keys;
+		if (n > ORDER - 1) {
+			continue;
+		}
+		int rank = bpt_rank(leaf->keys, n, key);
+		int found = rank > 0 && leaf->keys[rank - 1] == key;
+		*val = found ? leaf->pointers[rank] : NULL;
+		if (bpt_read_valid(leaf, v)) {
+			return found ? leaf : NULL;
+		}
+	}
+}
+
+/*
+ * Find the leaf which contains the given key, or return NULL.
+ */
+struct bptree* bptree_exists(struct bptree* bpt, uint64_t key)
+{
+	int kidx, pidx;
+	if (bpt->flags & BPT_SYNC) {
+		void* val;
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		bpt = bpt_find_sync(bpt, key, &val);
+		bpt_epoch_leave(self);
+		return bpt;
+	}
+	bpt = bptree_search(bpt, key);
+	bpt_index(bpt, key, &kidx, &pidx);
+	return (bpt && bpt->keys[kidx] == key) ? bpt : NULL;
+}
+
+/*
+ * Key/value lookup. 
+ */
+void* bptree_lookup(struct bptree* bpt, uint64_t key)
+{
+	int kidx, pidx;
+	if (bpt->flags & BPT_SYNC) {
+		void* val;
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		bpt_find_sync(bpt, key, &val);
+		bpt_epoch_leave(self);
+		return val;
+	}
+	bpt = bptree_search(bpt, key);
+	if (bpt) {
+		bpt_index(bpt, key, &kidx, &pidx);
+		return bpt->keys[kidx] == key ? bpt->pointers[pidx] : NULL;
+	} else {
+		return NULL;
+	}
+}
+
+/*
+ * Pull in the part of a node a search reads: the header and the keys.
+ */
+static inline void bpt_prefetch(const struct bptree* bpt)
+{
+	const char* mem = (const char*) bpt;
+	for (size_t off = 0; off < offsetof(struct bptree, pointers);
+	     off += BPT_ALIGN) {
+		__builtin_prefetch(mem + off);
+	}
+}
+
+/*
+ * Key/value lookups for a batch of keys. Descents are advanced in groups,
+ * one level at a time, and each child is prefetched as soon as it is known,
+ * so the cache misses of a whole group overlap instead of being paid one
+ * after the other.
+ */
+void bptree_lookup_batch(struct bptree* bpt, const uint64_t* keys, size_t n,
+			 void** vals)
+{
+	struct bptree* curr[BPT_LOOKUP_GROUP];
+	int kidx, pidx;
+
+	/* Lockstep descents cannot restart one at a time. */
+	if (bpt->flags & BPT_SYNC) {
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		for (size_t i = 0; i < n; ++i) {
+			vals[i] = bptree_lookup(bpt, keys[i]);
+		}
+		bpt_epoch_leave(self);
+		return;
+	}
+
+	for (size_t base = 0; base < n; base += BPT_LOOKUP_GROUP) {
+		const uint64_t* group = keys + base;
+		size_t m = n - base;
+		if (m > BPT_LOOKUP_GROUP) {
+			m = BPT_LOOKUP_GROUP;
+		}
+
+		/* Every leaf is at the same depth. */
+		for (size_t i = 0; i < m; ++i) {
+			curr[i] = bpt;
+		}
+		while (!curr[0]->is_leaf) {
+			for (size_t i = 0; i < m; ++i) {
+				bpt_index(curr[i], group[i], &kidx, &pidx);
+				curr[i] = curr[i]->pointers[pidx];
+				bpt_prefetch(curr[i]);
+			}
+		}
+
+		for (size_t i = 0; i < m; ++i) {
+			bpt_index(curr[i], group[i], &kidx, &pidx);
+			vals[base + i] = curr[i]->keys[kidx] == group[i] ?
+				curr[i]->pointers[pidx] : NULL;
+		}
+	}
+}
+
+/*
+ * Find the index of the first key >= key in a sorted run.
+ */
+static int bpt_lower_bound_keys(const uint64_t* keys, int n, uint64_t key)
+{
+	int rank = bpt_rank(keys, n, key);
+	return rank > 0 && keys[rank - 1] == key ? rank - 1 : rank;
+}
+
+static int bpt_lower_bound(struct bptree* leaf, uint64_t key)
+{
+	return bpt_lower_bound_keys(leaf->keys, leaf->nr_keys, key);
+}
+
+/*
+ * Position an iterator on the first key >= lo.
+ */
+void bptree_iter_seek(struct bptree_iter* it, struct bptree* bpt,
+		      uint64_t lo, uint64_t hi)
+{
+	assert(!(bpt->flags & BPT_FROZEN));
+	it->leaf = bptree_search(bpt, lo);
+	it->idx = bpt_lower_bound(it->leaf, lo);
+	it->hi = hi;
+	if (it->leaf->bpt_next) {
+		bpt_prefetch(it->leaf->bpt_next);
+	}
+}
+
+/*
+ * Step an iterator, crossing into the next leaf when this one runs out.
+ */
+int bptree_iter_next(struct bptree_iter* it, uint64_t* key, void** val)
+{
+	while (it->leaf && it->idx >= it->leaf->nr_keys) {
+		it->leaf = it->leaf->bpt_next;
+		it->idx = 0;
+		if (it->leaf && it->leaf->bpt_next) {
+			bpt_prefetch(it->leaf->bpt_next);
+		}
+	}
+	if (!it->leaf || it->leaf->keys[it->idx] >= it->hi) {
+		it->leaf = NULL;
+		return 0;
+	}
+
+	*key = it->leaf->keys[it->idx];
+	*val = it->leaf->pointers[it->idx + 1];
+	++it->idx;
+	return 1;
+}
+
+/*
+ * Scan a concurrent tree. Each leaf is copied out and validated before its
+ * run is handed to the callback; if a writer intervenes, the scan descends
+ * again from just past the last key it delivered.
+ */
+static size_t bpt_scan_sync(struct bptree* bpt, uint64_t lo, uint64_t hi,
+			    bptree_scan_fn fn, void* ctx)
+{
+	uint64_t keys[ORDER - 1];
+	void* vals[ORDER - 1];
+	size_t total = 0;
+
+restart:
+	if (lo >= hi) {
+		return total;
+	}
+	uint32_t v, nv = 0;
+	struct bptree* leaf = bpt_search_sync(bpt, lo, &v);
+	if (!leaf) {
+		goto restart;
+	}
+	for (;;) {
+		int n = leaf->nr_keys;
+		if (n > ORDER - 1) {
+			goto restart;
+		}
+		memcpy(keys, leaf->keys, sizeof(uint64_t) * n);
+		memcpy(vals, leaf->pointers + 1, sizeof(void*) * n);
+		struct bptree* next = leaf->bpt_next;
+		if ((next && !bpt_read_begin(next, &nv)) ||
+		    !bpt_read_valid(leaf, v)) {
+			goto restart;
+		}
+
+		int start = bpt_lower_bound_keys(keys, n, lo);
+		int end = n;
+		if (end > 0 && keys[end - 1] >= hi) {
+			end = bpt_lower_bound_keys(keys, n, hi);
+			next = NULL;
+		}
+		if (start < end) {
+			total += end - start;
+			if (fn(ctx, keys + start, vals + start, end - start)) {
+				break;
+			}
+			lo = keys[end - 1] + 1;
+		}
+		if (!next) {
+			break;
+		}
+		leaf = next;
+		v = nv;
+	}
+	return total;
+}
+
+/*
+ * Scan [lo, hi) in a snapshot, whose leaf chain cannot be trusted, by walking
+ * down the tree instead. Returns nonzero once fn asks to stop.
+ */
+static int bpt_scan_frozen(struct bptree* bpt, uint64_t lo, uint64_t hi,
+			   bptree_scan_fn fn, void* ctx, size_t* total)
+{
+	if (bpt->is_leaf) {
+		int start = bpt_lower_bound(bpt, lo);
+		int end = bpt_lower_bound(bpt, hi);
+		if (start >= end) {
+			return 0;
+		}
+		*total += end - start;
+		return fn(ctx, bpt->keys + start,
+			  (void* const*) bpt->pointers + start + 1, end - start);
+	}
+	int first = bpt_rank(bpt->keys, bpt->nr_keys, lo);
+	int last = bpt_rank(bpt->keys, bpt->nr_keys, hi - 1);
+	for (int i = first; i <= last; ++i) {
+		if (bpt_scan_frozen(bpt->pointers[i], lo, hi, fn, ctx, total)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Scan [lo, hi) one leaf at a time. The upper bound is only checked once per
+ * leaf, and each callback gets a whole run of keys and values.
+ */
+size_t bptree_scan(struct bptree* bpt, uint64_t lo, uint64_t hi,
+		   bptree_scan_fn fn, void* ctx)
+{
+	size_t total = 0;
+	if (lo >= hi) {
+		return 0;
+	}
+	if (bpt->flags & BPT_SYNC) {
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		total = bpt_scan_sync(bpt, lo, hi, fn, ctx);
+		bpt_epoch_leave(self);
+		return total;
+	}
+	if (bpt->flags & BPT_FROZEN) {
+		bpt_scan_frozen(bpt, lo, hi, fn, ctx, &total);
+		return total;
+	}
+
+	struct bptree* leaf = bptree_search(bpt, lo);
+	int start = bpt_lower_bound(leaf, lo);
+	while (leaf) {
+		struct bptree* next = leaf->bpt_next;
+		if (next) {
+			bpt_prefetch(next);
+		}
+
+		int end = leaf->nr_keys;
+		if (end > 0 && leaf->keys[end - 1] >= hi) {
+			end = bpt_lower_bound(leaf, hi);
+			next = NULL;
+		}
+		if (start < end) {
+			total += end - start;
+			if (fn(ctx, leaf->keys + start,
+			       (void* const*) leaf->pointers + start + 1,
+			       end - start)) {
+				break;
+			}
+		}
+		leaf = next;
+		start = 0;
+	}
+	return total;
+}
+
+/*
+ * Update the value of an existing key.
+ */
+void bptree_modify(struct bptree* bpt, uint64_t key, void* val)
+{
+	int kidx, pidx;
+	if (bpt->flags & BPT_SYNC) {
+		uint32_t v;
+		struct bptree* leaf;
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		do {
+			leaf = bpt_search_sync(bpt, key, &v);
+		} while (!leaf || !bpt_upgrade(leaf, v));
+		bpt_index(leaf, key, &kidx, &pidx);
+		if (leaf->keys[kidx] == key) {
+			leaf->pointers[pidx] = val;
+		}
+		bpt_unlock(leaf);
+		bpt_epoch_leave(self);
+		return;
+	}
+	if (bpt->flags & BPT_SHARED) {
+		bpt_cow_path(bpt, key, BPT_COW_LEAF);
+	}
+	bpt = bptree_search(bpt, key);
+	if (bpt) {
+		bpt_index(bpt, key, &kidx, &pidx);
+		if (bpt->keys[kidx] == key) {
+			bpt->pointers[pidx] = val;
+		}
+	}	
+}
+
+/*
+ * Subtree counts. Inner nodes of trees built with BPT_COUNTS record how many
+ * tuples lie below each of their children. Concurrent trees lock too little
+ * to keep them exact, so they go without.
+ */
+#if BPT_COUNTS
+static inline int bpt_counted(const struct bptree* bpt)
+{
+	return !(bpt->flags & BPT_SYNC);
+}
+
+/* The number of tuples below a node. */
+static size_t bpt_weight(const struct bptree* bpt)
+{
+	if (bpt->is_leaf) {
+		return bpt->nr_keys;
+	}
+	size_t w = 0;
+	for (int i = 0; i <= bpt->nr_keys; ++i) {
+		w += bpt->counts[i];
+	}
+	return w;
+}
+
+/* Recount an inner node from its children. */
+static void bpt_tally(struct bptree* bpt)
+{
+	if (bpt->is_leaf || !bpt_counted(bpt)) {
+		return;
+	}
+	for (int i = 0; i <= bpt->nr_keys; ++i) {
+		bpt->counts[i] = bpt_weight(bpt->pointers[i]);
+	}
+}
+
+/*
+ * Recount children lo..hi of a node after entries have moved between them.
+ * Inner children are recounted from their own children first.
+ */
+static void bpt_recount(struct bptree* parent, int lo, int hi)
+{
+	if (!bpt_counted(parent)) {
+		return;
+	}
+	for (int i = lo; i <= hi; ++i) {
+		bpt_tally(parent->pointers[i]);
+		parent->counts[i] = bpt_weight(parent->pointers[i]);
+	}
+}
+
+/* Add delta to the count of one child. */
+static inline void bpt_count_add(struct bptree* bpt, int pidx, size_t delta)
+{
+	if (bpt_counted(bpt)) {
+		bpt->counts[pidx] += delta;
+	}
+}
+
+/* Move n counts of a node from one slot to another, alongside its pointers. */
+static inline void bpt_slide_counts(struct bptree* bpt, int to, int from,
+				    int n)
+{
+	if (n > 0) {
+		memmove(bpt->counts + to, bpt->counts + from,
+			sizeof(size_t) * n);
+	}
+}
+#else
+static inline void bpt_tally(struct bptree* bpt)
+{
+	(void) bpt;
+}
+
+static inline void bpt_recount(struct bptree* parent, int lo, int hi)
+{
+	(void) parent; (void) lo; (void) hi;
+}
+
+static inline void bpt_count_add(struct bptree* bpt, int pidx, size_t delta)
+{
+	(void) bpt; (void) pidx; (void) delta;
+}
+
+static inline void bpt_slide_counts(struct bptree* bpt, int to, int from,
+				    int n)
+{
+	(void) bpt; (void) to; (void) from; (void) n;
+}
+#endif
+
+/*
+ * Add an entry into a nonfull node after pidx.
+ */
+static void bpt_inject(struct bptree* bpt, int pidx, uint64_t key, void* val)
+{
+	assert(bpt->nr_keys < ORDER - 1);
+	if (!bpt->is_leaf) {
+		bpt_slide_counts(bpt, pidx + 2, pidx + 1, bpt->nr_keys - pidx);
+	}
+	for (int i = bpt->nr_keys; i > pidx; --i) {
+		bpt->pointers[i + 1] = bpt->pointers[i];
+	}
+	bpt->pointers[pidx + 1] = val;
+	for (int i = bpt->nr_keys - 1; i >= pidx; --i) {
+		bpt->keys[i + 1] = bpt->keys[i];
+	}
+	bpt->keys[pidx] = key;
+	++bpt->nr_keys;
+
+	struct bptree* pred = bpt->pointers[pidx];
+	if (!bpt->is_leaf && pred && pred->is_leaf) {
+		struct bptree* succ = bpt->pointers[pidx + 1];
+		succ->bpt_next = pred->bpt_next;
+		pred->bpt_next = succ;
+	}
+}
+
+/*
+ * Split a full child into two nodes about the median key. Leaves copy the
+ * median up into the parent, inner nodes move it up.
+ */
+static void bpt_split_child(struct bptree* parent, int pidx)
+{
+	struct bptree* pred = parent->pointers[pidx];
+	struct bptree* succ = bpt_alloc(pred);
+	uint64_t sep;
+	succ->is_leaf = pred->is_leaf;
+
+	if (pred->is_leaf) {
+		succ->nr_keys = split(ORDER - 1);
+		pred->nr_keys = (ORDER - 1) - succ->nr_keys;
+		memcpy(succ->keys, pred->keys + pred->nr_keys,
+			sizeof(uint64_t) * succ->nr_keys);
+		memcpy(succ->pointers + 1, pred->pointers + pred->nr_keys + 1,
+			sizeof(void*) * succ->nr_keys);
+		sep = succ->keys[0];
+	} else {
+		pred->nr_keys = (ORDER - 1) / 2;
+		succ->nr_keys = (ORDER - 1) - pred->nr_keys - 1;
+		sep = pred->keys[pred->nr_keys];
+		memcpy(succ->keys, pred->keys + pred->nr_keys + 1,
+			sizeof(uint64_t) * succ->nr_keys);
+		memcpy(succ->pointers, pred->pointers + pred->nr_keys + 1,
+			sizeof(void*) * (succ->nr_keys + 1));
+	}
+	bpt_inject(parent, pidx, sep, succ);
+	bpt_recount(parent, pidx, pidx + 1);
+	bpt_reshaped(pred);
+	BPT_COUNT(BPT_SPLITS);
+}
+
+/*
+ * Move the first cnt entries of pointers[pidx] to the end of its left
+ * sibling, rotating separators through the parent.
+ */
+static void bpt_shift_left(struct bptree* parent, int pidx, int cnt)
+{
+	struct bptree* pred = parent->pointers[pidx - 1];
+	struct bptree* curr = parent->pointers[pidx];
+	int end = pred->nr_keys;
+	int n = curr->nr_keys;
+
+	if (curr->is_leaf) {
+		memcpy(pred->keys + end, curr->keys, sizeof(uint64_t) * cnt);
+		memcpy(pred->pointers + end + 1, curr->pointers + 1,
+			sizeof(void*) * cnt);
+		memmove(curr->keys, curr->keys + cnt,
+			sizeof(uint64_t) * (n - cnt));
+		memmove(curr->pointers + 1, curr->pointers + cnt + 1,
+			sizeof(void*) * (n - cnt));
+		parent->keys[pidx - 1] = curr->keys[0];
+	} else {
+		pred->keys[end] = parent->keys[pidx - 1];
+		memcpy(pred->keys + end + 1, curr->keys,
+			sizeof(uint64_t) * (cnt - 1));
+		memcpy(pred->pointers + end + 1, curr->pointers,
+			sizeof(void*) * cnt);
+		parent->keys[pidx - 1] = curr->keys[cnt - 1];
+		memmove(curr->keys, curr->keys + cnt,
+			sizeof(uint64_t) * (n - cnt));
+		memmove(curr->pointers, curr->pointers + cnt,
+			sizeof(void*) * (n - cnt + 1));
+	}
+	pred->nr_keys = end + cnt;
+	curr->nr_keys = n - cnt;
+	bpt_recount(parent, pidx - 1, pidx);
+	bpt_reshaped(pred);
+	bpt_reshaped(curr);
+	BPT_COUNT(BPT_ROTATIONS);
+}
+
+/*
+ * Move the last cnt entries of pointers[pidx] to the front of its right
+ * sibling, rotating separators through the parent.
+ */
+static void bpt_shift_right(struct bptree* parent, int pidx, int cnt)
+{
+	struct bptree* curr = parent->pointers[pidx];
+	struct bptree* succ = parent->pointers[pidx + 1];
+	int n = curr->nr_keys;
+	int m = succ->nr_keys;
+
+	memmove(succ->keys + cnt, succ->keys, sizeof(uint64_t) * m);
+	if (curr->is_leaf) {
+		memmove(succ->pointers + cnt + 1, succ->pointers + 1,
+			sizeof(void*) * m);
+		memcpy(succ->keys, curr->keys + n - cnt,
+			sizeof(uint64_t) * cnt);
+		memcpy(succ->pointers + 1, curr->pointers + n - cnt + 1,
+			sizeof(void*) * cnt);
+		parent->keys[pidx] = succ->keys[0];
+	} else {
+		memmove(succ->pointers + cnt, succ->pointers,
+			sizeof(void*) * (m + 1));
+		succ->keys[cnt - 1] = parent->keys[pidx];
+		memcpy(succ->keys, curr->keys + n - cnt + 1,
+			sizeof(uint64_t) * (cnt - 1));
+		memcpy(succ->pointers, curr->pointers + n - cnt + 1,
+			sizeof(void*) * cnt);
+		parent->keys[pidx] = curr->keys[n - cnt];
+	}
+	curr->nr_keys = n - cnt;
+	succ->nr_keys = m + cnt;
+	bpt_recount(parent, pidx, pidx + 1);
+	bpt_reshaped(curr);
+	bpt_reshaped(succ);
+	BPT_COUNT(BPT_ROTATIONS);
+}
+
+/*
+ * Make room in the full child at pidx for a key. A key past the end of the
+ * child is what a run of ascending keys looks like, and a median split would
+ * leave the node behind it half empty for good; so the child first spills
+ * as much as it can into its left sibling, and is split only when that is
+ * full. Descending keys spill to the right in the same way. Anything else
+ * gets a median split. The parent and child must be locked; a sibling is
+ * locked here.
+ */
+static void bpt_make_room(struct bptree* parent, int pidx, uint64_t key)
+{
+	struct bptree* curr = parent->pointers[pidx];
+	int spare = curr->nr_keys - (split(ORDER) - 1);
+	struct bptree* sib = NULL;
+	int left = 0;
+	int cnt = 0;
+
+	if (key > curr->keys[curr->nr_keys - 1] && pidx > 0) {
+		sib = parent->pointers[pidx - 1];
+		left = 1;
+	} else if (key < curr->keys[0] && pidx < parent->nr_keys) {
+		sib = parent->pointers[pidx + 1];
+	}
+	if (sib) {
+		bpt_lock(sib);
+		cnt = ORDER - 1 - sib->nr_keys;
+		cnt = cnt < spare ? cnt : spare;
+		if (cnt > 0 && left) {
+			bpt_shift_left(parent, pidx, cnt);
+		} else if (cnt > 0) {
+			bpt_shift_right(parent, pidx, cnt);
+		}
+		bpt_unlock(sib);
+	}
+	if (cnt <= 0) {
+		bpt_split_child(parent, pidx);
+	}
+}
+
+/*
+ * Insert an entry into a nonfull leaf. If the key is already there, report
+ * its value through old and overwrite it only if asked to. Returns 1 if the
+ * key was new.
+ */
+static int bpt_put_leaf(struct bptree* leaf, uint64_t key, void* val,
+			int replace, void** old)
+{
+	int kidx, pidx;
+	bpt_index(leaf, key, &kidx, &pidx);
+	if (leaf->keys[kidx] == key) {
+		if (old) {
+			*old = leaf->pointers[pidx];
+		}
+		if (replace) {
+			leaf->pointers[pidx] = val;
+		}
+		return 0;
+	}
+	bpt_filter_insert(leaf, key);
+	bpt_inject(leaf, pidx, key, val);
+	if (old) {
+		*old = NULL;
+	}
+	return 1;
+}
+
+/*
+ * Insert an entry into a nonfull parent. Separators may outlive the keys
+ * they were copied from, so only the leaf can tell whether the key exists.
+ */
+static int bpt_insert_nonfull(struct bptree* bpt, uint64_t key, void* val,
+			      int replace, void** old)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	int depth = 0;
+	int kidx, pidx;
+	while (!bpt->is_leaf) {
+		bpt_index(bpt, key, &kidx, &pidx);
+		if (BPT_P(bpt, pidx)->nr_keys == ORDER - 1) {
+			bpt_make_room(bpt, pidx, key);
+			bpt_index(bpt, key, &kidx, &pidx);
+		}
+
+		assert(depth < BPT_MAX_HEIGHT);
+		path[depth] = bpt;
+		slot[depth++] = pidx;
+		bpt = bpt->pointers[pidx];
+		assert(bpt->nr_keys >= split(ORDER) - 1);
+		assert(bpt->nr_keys < ORDER);
+	}
+	if (!bpt_put_leaf(bpt, key, val, replace, old)) {
+		return 0;
+	}
+	while (depth-- > 0) {
+		bpt_count_add(path[depth], slot[depth], 1);
+	}
+	return 1;
+}
+
+/*
+ * Split a full root in place, by moving its contents into a new child. The
+ * root of a concurrent tree never moves.
+ */
+static void bpt_split_root(struct bptree* root)
+{
+	struct bptree* child = bpt_alloc(root);
+	child->is_leaf = root->is_leaf;
+	child->nr_keys = root->nr_keys;
+	memcpy(child->keys, root->keys, sizeof(root->keys));
+	memcpy(child->pointers, root->pointers, sizeof(root->pointers));
+	root->is_leaf = 0;
+	root->nr_keys = 0;
+	memset(root->pointers, 0, sizeof(root->pointers));
+	root->pointers[0] = child;
+	bpt_split_child(root, 0);
+	BPT_COUNT(BPT_ROOT_CHANGES);
+}
+
+/*
+ * Insert into a concurrent tree. The descent is optimistic, like a lookup.
+ * A full node on the way down is split (locking just it and its parent) and
+ * the descent restarts, so the leaf is the only node an insert locks.
+ */
+static int bpt_insert_sync(struct bptree* root, uint64_t key, void* val,
+			   int replace, void** old)
+{
+	struct bptree *parent, *bpt;
+	uint32_t pv, v, cv;
+	int pidx, n, inserted;
+
+restart:
+	parent = NULL;
+	pv = pidx = 0;
+	bpt = root;
+	if (!bpt_read_begin(bpt, &v)) {
+		goto restart;
+	}
+	for (;;) {
+		n = bpt->nr_keys;
+		if (n > ORDER - 1) {
+			goto restart;
+		}
+		/* A full leaf which already has the key needs no split. */
+		if (n == ORDER - 1 && bpt->is_leaf) {
+			int rank = bpt_rank(bpt->keys, n, key);
+			if (rank > 0 && bpt->keys[rank - 1] == key) {
+				break;
+			}
+		}
+		if (n == ORDER - 1) {
+			if (!parent) {
+				if (bpt_upgrade(bpt, v)) {
+					bpt_split_root(bpt);
+					bpt_unlock(bpt);
+				}
+			} else if (bpt_upgrade(parent, pv)) {
+				if (bpt_upgrade(bpt, v)) {
+					bpt_make_room(parent, pidx, key);
+					bpt_unlock(bpt);
+				}
+				bpt_unlock(parent);
+			}
+			goto restart;
+		}
+		if (bpt->is_leaf) {
+			break;
+		}
+
+		int i = bpt_rank(bpt->keys, n, key);
+		struct bptree* child = bpt->pointers[i];
+		if (!bpt_read_child(bpt, v, child, &cv)) {
+			goto restart;
+		}
+		parent = bpt;
+		pv = v;
+		pidx = i;
+		bpt = child;
+		v = cv;
+	}
+
+	if (!bpt_upgrade(bpt, v)) {
+		goto restart;
+	}
+	inserted = bpt_put_leaf(bpt, key, val, replace, old);
+	bpt_unlock(bpt);
+	return inserted;
+}
+
+/*
+ * Perform inserts in a single descent. Nothing is split on the way down: an
+ * existing key is dealt with in its leaf, and only a new key landing in a
+ * full leaf splits the chain of full nodes above it (growing a new root if
+ * the chain reaches the top). Returns 1 if the key was new.
+ */
+static int bpt_put(struct bptree** root, uint64_t key, void* val,
+		   int replace, void** old)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	struct bptree* bpt = *root;
+	int depth = 0;
+
+	if (bpt->flags & BPT_SYNC) {
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		int inserted = bpt_insert_sync(bpt, key, val, replace, old);
+		bpt_epoch_leave(self);
+		return inserted;
+	}
+	if (bpt->flags & BPT_SHARED) {
+		bpt_cow_path(bpt, key, BPT_COW_INSERT);
+	}
+
+	while (!bpt->is_leaf) {
+		assert(depth < BPT_MAX_HEIGHT);
+		path[depth] = bpt;
+		slot[depth] = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		bpt = bpt->pointers[slot[depth++]];
+	}
+	int rank = bpt_rank(bpt->keys, bpt->nr_keys, key);
+	if (bpt->nr_keys < ORDER - 1 ||
+	    (rank > 0 && bpt->keys[rank - 1] == key)) {
+		if (!bpt_put_leaf(bpt, key, val, replace, old)) {
+			return 0;
+		}
+		while (depth-- > 0) {
+			bpt_count_add(path[depth], slot[depth], 1);
+		}
+		bpt_filter_tend(*root);
+		return 1;
+	}
+
+	/*
+	 * The key is new. The nodes above the chain of full ones keep their
+	 * shape, so their counts go up along the recorded path; the insert
+	 * below them counts its own way down.
+	 */
+	while (depth > 0 && path[depth - 1]->nr_keys == ORDER - 1) {
+		--depth;
+	}
+	if (depth == 0) {
+		struct bptree* new_root = bpt_alloc(*root);
+		new_root->is_leaf = 0;
+		new_root->pointers[0] = *root;
+		new_root->flags |= (*root)->flags & BPT_SHARED;
+		(*root)->flags &= ~BPT_SHARED;
+		bpt_split_child(new_root, 0);
+		*root = new_root;
+		bpt = new_root;
+		BPT_COUNT(BPT_ROOT_CHANGES);
+	} else {
+		bpt = path[depth - 1];
+	}
+	if (!bpt_insert_nonfull(bpt, key, val, replace, old)) {
+		return 0;
+	}
+	for (int d = 0; d < depth - 1; ++d) {
+		bpt_count_add(path[d], slot[d], 1);
+	}
+	bpt_filter_tend(*root);
+	return 1;
+}
+
+void bptree_insert(struct bptree** root, uint64_t key, void* val)
+{
+	bpt_put(root, key, val, 0, NULL);
+}
+
+enum bptree_outcome bptree_upsert(struct bptree** root, uint64_t key,
+				  void* val, void** old)
+{
+	return bpt_put(root, key, val, 1, old) ?
+		BPTREE_INSERTED : BPTREE_UPDATED;
+}
+
+enum bptree_outcome bptree_insert_or_get(struct bptree** root, uint64_t key,
+					 void* val, void** existing)
+{
+	return bpt_put(root, key, val, 0, existing) ?
+		BPTREE_INSERTED : BPTREE_EXISTS;
+}
+
+/*
+ * Swap in a new value only if the key holds the expected one. The leaf is
+ * found like a lookup, and concurrent trees lock only that leaf.
+ */
+enum bptree_outcome bptree_cas(struct bptree* bpt, uint64_t key,
+			       void* expected, void* desired, void** actual)
+{
+	struct bpt_epoch_rec* self = NULL;
+	struct bptree* leaf;
+	enum bptree_outcome outcome = BPTREE_MISSING;
+	int kidx, pidx;
+
+	if (bpt->flags & BPT_SYNC) {
+		uint32_t v;
+		self = bpt_epoch_enter();
+		do {
+			leaf = bpt_search_sync(bpt, key, &v);
+		} while (!leaf || !bpt_upgrade(leaf, v));
+	} else {
+		if (bpt->flags & BPT_SHARED) {
+			bpt_cow_path(bpt, key, BPT_COW_LEAF);
+		}
+		leaf = bptree_search(bpt, key);
+	}
+
+	bpt_index(leaf, key, &kidx, &pidx);
+	if (leaf->keys[kidx] == key) {
+		void* cur = leaf->pointers[pidx];
+		if (actual) {
+			*actual = cur;
+		}
+		if (cur == expected) {
+			leaf->pointers[pidx] = desired;
+			outcome = BPTREE_UPDATED;
+		} else {
+			outcome = BPTREE_EXISTS;
+		}
+	}
+
+	if (self) {
+		bpt_unlock(leaf);
+		bpt_epoch_leave(self);
+	}
+	return outcome;
+}
+
+/*
+ * The stamps only ever go up, so their sum changes whenever either does.
+ */
+static inline uint64_t bpt_finger_stamp(const struct bptree_finger* f)
+{
+	uint64_t stamp = __atomic_load_n(bpt_shape_of(f->leaf),
+					 __ATOMIC_RELAXED);
+	if (f->parent) {
+		stamp += __atomic_load_n(bpt_shape_of(f->parent),
+					 __ATOMIC_RELAXED);
+	}
+	return stamp;
+}
+
+#if BPT_COUNTS
+/*
+ * Only inserts, which count along the path, care about the nodes above the
+ * parent.
+ */
+static inline uint64_t bpt_finger_path_stamp(const struct bptree_finger* f)
+{
+	uint64_t stamp = 0;
+	for (int d = 0; d + 1 < f->depth; ++d) {
+		stamp += __atomic_load_n(bpt_shape_of(f->path[d]),
+					 __ATOMIC_RELAXED);
+	}
+	return stamp;
+}
+
+/*
+ * Add delta to the counts on a finger's path. None of its nodes has changed
+ * shape, but splits and merges of their siblings can still move the slots.
+ */
+static void bpt_finger_count(struct bptree_finger* f, uint64_t key,
+			     int delta)
+{
+	for (int d = 0; d < f->depth; ++d) {
+		struct bptree* bpt = f->path[d];
+		struct bptree* child = d + 1 < f->depth ? f->path[d + 1] :
+			f->leaf;
+		if (f->slot[d] > bpt->nr_keys ||
+		    bpt->pointers[f->slot[d]] != child) {
+			f->slot[d] = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		}
+		bpt->counts[f->slot[d]] += delta;
+	}
+}
+
+/*
+ * A step along the leaf chain loses the path, which is only needed below
+ * the root.
+ */
+static inline int bpt_finger_path_valid(const struct bptree_finger* f,
+					const struct bptree* root)
+{
+	return (f->parent || f->leaf == root) &&
+	       f->path_gen == bpt_finger_path_stamp(f);
+}
+#else
+static inline void bpt_finger_count(struct bptree_finger* f, uint64_t key,
+				    int delta)
+{
+	(void) f; (void) key; (void) delta;
+}
+
+static inline int bpt_finger_path_valid(const struct bptree_finger* f,
+					const struct bptree* root)
+{
+	(void) f; (void) root;
+	return 1;
+}
+#endif
+
+/*
+ * Descend to the leaf for a key, narrowing the bounds of the finger to the
+ * separators on either side of the path.
+ */
+static struct bptree* bpt_finger_seek(struct bptree* bpt, uint64_t key,
+				      struct bptree_finger* f)
+{
+	struct bptree* parent = NULL;
+	uint64_t lo = 0;
+	uint64_t hi = ~0ULL;
+#if BPT_COUNTS
+	f->depth = 0;
+#endif
+	while (!bpt->is_leaf) {
+		int rank = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		if (rank > 0) {
+			lo = bpt->keys[rank - 1];
+		}
+		if (rank < bpt->nr_keys) {
+			hi = bpt->keys[rank];
+		}
+#if BPT_COUNTS
+		assert(f->depth < BPT_MAX_HEIGHT);
+		f->path[f->depth] = bpt;
+		f->slot[f->depth++] = rank;
+#endif
+		parent = bpt;
+		bpt = bpt->pointers[rank];
+	}
+	f->leaf = bpt;
+	f->parent = parent;
+	f->lo = lo;
+	f->hi = hi;
+	f->gen = bpt_finger_stamp(f);
+#if BPT_COUNTS
+	f->path_gen = bpt_finger_path_stamp(f);
+#endif
+	return bpt;
+}
+
+static inline int bpt_finger_valid(const struct bptree_finger* f)
+{
+	return f->leaf && f->gen == bpt_finger_stamp(f);
+}
+
+void bptree_finger_init(struct bptree_finger* f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+/*
+ * A full leaf whose parent has room is split right there, and the finger
+ * moves to whichever half the key belongs in. Only a split that has to go
+ * further up starts over from the root.
+ */
+void bptree_finger_insert(struct bptree** root, struct bptree_finger* f,
+			  uint64_t key, void* val)
+{
+	struct bptree* leaf;
+	if ((*root)->flags & (BPT_SYNC | BPT_SHARED)) {
+		/* A finger does not know which nodes above it are shared. */
+		bptree_insert(root, key, val);
+		return;
+	}
+
+	if (bpt_finger_valid(f) && key >= f->lo && key < f->hi &&
+	    bpt_finger_path_valid(f, *root)) {
+		leaf = f->leaf;
+	} else {
+		leaf = bpt_finger_seek(*root, key, f);
+	}
+	int n = leaf->nr_keys;
+	int rank = bpt_rank(leaf->keys, n, key);
+	if (n < ORDER - 1 || (rank > 0 && leaf->keys[rank - 1] == key)) {
+		if (bpt_put_leaf(leaf, key, val, 0, NULL)) {
+			bpt_finger_count(f, key, 1);
+			bpt_filter_tend(*root);
+		}
+		return;
+	}
+
+	struct bptree* parent = f->parent;
+	if (parent && parent->nr_keys < ORDER - 1) {
+		int pidx = bpt_rank(parent->keys, parent->nr_keys, key);
+		assert(parent->pointers[pidx] == leaf);
+		bpt_make_room(parent, pidx, key);
+		pidx = bpt_rank(parent->keys, parent->nr_keys, key);
+		f->leaf = parent->pointers[pidx];
+		if (pidx > 0) {
+			f->lo = parent->keys[pidx - 1];
+		}
+		if (pidx < parent->nr_keys) {
+			f->hi = parent->keys[pidx];
+		}
+#if BPT_COUNTS
+		f->slot[f->depth - 1] = pidx;
+#endif
+		f->gen = bpt_finger_stamp(f);
+		bpt_put_leaf(f->leaf, key, val, 0, NULL);
+		bpt_finger_count(f, key, 1);
+		bpt_filter_tend(*root);
+		return;
+	}
+
+	/* The path is still cached when the finger is reset. */
+	bpt_put(root, key, val, 0, NULL);
+	bpt_finger_seek(*root, key, f);
+}
+
+void* bptree_finger_lookup(struct bptree* root, struct bptree_finger* f,
+			   uint64_t key)
+{
+	struct bptree* leaf;
+	if (root->flags & BPT_SYNC) {
+		return bptree_lookup(root, key);
+	}
+
+	if (!bpt_finger_valid(f)) {
+		leaf = bpt_finger_seek(root, key, f);
+	} else if (key >= f->lo && key < f->hi) {
+		leaf = f->leaf;
+	} else if (!(root->flags & BPT_FROZEN) && key >= f->hi &&
+		   (leaf = f->leaf->bpt_next) &&
+		   key >= leaf->keys[0] &&
+		   key <= leaf->keys[leaf->nr_keys - 1]) {
+		/*
+		 * Neither the separator nor the parent is known; the keys are
+		 * safe bounds, and inserts will find the parent again.
+		 */
+		f->leaf = leaf;
+		f->parent = NULL;
+		f->lo = leaf->keys[0];
+		f->hi = leaf->keys[leaf->nr_keys - 1] + 1;
+#if BPT_COUNTS
+		f->depth = 0;
+		f->path_gen = 0;
+#endif
+		f->gen = bpt_finger_stamp(f);
+	} else {
+		leaf = bpt_finger_seek(root, key, f);
+	}
+
+	int rank = bpt_rank(leaf->keys, leaf->nr_keys, key);
+	return rank > 0 && leaf->keys[rank - 1] == key ?
+		leaf->pointers[rank] : NULL;
+}
+
+/*
+ * One level of a tree under construction by bptree_bulk_load().
+ */
+struct bpt_level {
+	struct bptree* node;	/* The node currently being filled. */
+	uint64_t min;		/* The smallest key beneath it. */
+	size_t nr_nodes;	/* Nodes on this level. */
+	size_t nr_done;		/* Nodes completed so far. */
+	int fill;		/* Entries per node ... */
+	size_t nr_extra;	/* ... plus one for the first few nodes. */
+};
+
+/*
+ * Spread nr_entries over as few nodes as the fill level allows, while keeping
+ * every node above the minimum occupancy.
+ */
+static void bpt_level_plan(struct bpt_level* lvl, size_t nr_entries,
+			   int per_node, int min_per_node)
+{
+	size_t nodes = (nr_entries + per_node - 1) / per_node;
+	size_t most = nr_entries / min_per_node;
+	if (nodes > most) {
+		nodes = most;
+	}
+	if (nodes == 0) {
+		nodes = 1;
+	}
+	lvl->node = NULL;
+	lvl->nr_nodes = nodes;
+	lvl->nr_done = 0;
+	lvl->fill = nr_entries / nodes;
+	lvl->nr_extra = nr_entries % nodes;
+}
+
+static int bpt_level_quota(struct bpt_level* lvl)
+{
+	return lvl->fill + (lvl->nr_done < lvl->nr_extra);
+}
+
+/*
+ * Append a finished child to the inner node being filled at the given level,
+ * passing the inner node up once it is full.
+ */
+static void bpt_level_push(struct bpt_level* levels, int lvl,
+			   struct bptree* child, uint64_t min)
+{
+	struct bpt_level* l = &levels[lvl];
+	if (!l->node) {
+		l->node = bpt_alloc(NULL);
+		l->node->is_leaf = 0;
+		l->node->pointers[0] = child;
+		l->min = min;
+	} else {
+		l->node->keys[l->node->nr_keys++] = min;
+		l->node->pointers[l->node->nr_keys] = child;
+	}
+	bpt_recount(l->node, l->node->nr_keys, l->node->nr_keys);
+
+	/* The single node on the top level stays put: it is the root. */
+	if (l->node->nr_keys + 1 == bpt_level_quota(l)) {
+		++l->nr_done;
+		if (l->nr_nodes > 1) {
+			struct bptree* done = l->node;
+			l->node = NULL;
+			bpt_level_push(levels, lvl + 1, done, l->min);
+		}
+	}
+}
+
+/*
+ * Build a tree from strictly increasing keys in a single left-to-right pass.
+ * Leaves are filled first and each one is handed up to the level above as
+ * soon as it is complete, so only one partial node per level is live.
+ */
+struct bptree* bptree_bulk_load(const uint64_t* keys, void* const* vals,
+				size_t n, double fill_factor)
+{
+	struct bpt_level levels[BPT_MAX_HEIGHT];
+	int height = 0;
+
+	if (n == 0) {
+		return NULL;
+	}
+	if (fill_factor <= 0 || fill_factor > 1) {
+		fill_factor = 1;
+	}
+
+	int leaf_fill = (int) (fill_factor * (ORDER - 1) + 0.5);
+	int inner_fill = (int) (fill_factor * ORDER + 0.5);
+	leaf_fill = leaf_fill < 1 ? 1 : leaf_fill;
+	inner_fill = inner_fill < 2 ? 2 : inner_fill;
+
+	bpt_level_plan(&levels[0], n, leaf_fill, split(ORDER) - 1);
+	while (levels[height].nr_nodes > 1) {
+		assert(height + 1 < BPT_MAX_HEIGHT);
+		bpt_level_plan(&levels[height + 1], levels[height].nr_nodes,
+			inner_fill, split(ORDER));
+		++height;
+	}
+
+	struct bptree* prev = NULL;
+	struct bptree* leaf = NULL;
+	size_t k = 0;
+	for (size_t i = 0; i < levels[0].nr_nodes; ++i) {
+		leaf = bpt_alloc(NULL);
+		int quota = bpt_level_quota(&levels[0]);
+		for (int j = 0; j < quota; ++j, ++k) {
+			assert(k == 0 || keys[k - 1] < keys[k]);
+			leaf->keys[j] = keys[k];
+			leaf->pointers[j + 1] = vals ? vals[k] : NULL;
+		}
+		leaf->nr_keys = quota;
+		++levels[0].nr_done;
+
+		if (prev) {
+			prev->bpt_next = leaf;
+		}
+		prev = leaf;
+
+		if (height) {
+			bpt_level_push(levels, 1, leaf, leaf->keys[0]);
+		}
+	}
+	assert(k == n);
+	return height ? levels[height].node : leaf;
+}
+
+/*
+ * A node split off by a batch insert, waiting to be linked into its parent
+ * right after the child at index "after".
+ */
+struct bpt_split {
+	uint64_t sep;
+	struct bptree* node;
+	int after;
+};
+
+struct bpt_splits {
+	struct bpt_split* v;
+	size_t n;
+	size_t cap;
+};
+
+static void bpt_splits_push(struct bpt_splits* s, uint64_t sep,
+			    struct bptree* node, int after)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? 2 * s->cap : 16;
+		s->v = realloc(s->v, sizeof(struct bpt_split) * s->cap);
+		if (!s->v) {
+			abort();
+		}
+	}
+	s->v[s->n].sep = sep;
+	s->v[s->n].node = node;
+	s->v[s->n].after = after;
+	++s->n;
+}
+
+/*
+ * Scratch space for merging a leaf with its share of a batch, big enough for
+ * any leaf plus the whole batch.
+ */
+struct bpt_batch {
+	uint64_t* keys;
+	void** vals;
+	size_t inserted;
+};
+
+/* The number of keys in a sorted run that are < key. */
+static size_t bpt_run_bound(const uint64_t* keys, size_t n, uint64_t key)
+{
+	size_t low = 0;
+	size_t high = n;
+	while (low < high) {
+		size_t mid = low + ((high - low) >> 1);
+		if (keys[mid] < key) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+ * Merge a sorted run of keys into a leaf. Keys already present (or repeated
+ * in the run) keep their first value. If the result does not fit, it is
+ * spread evenly over as many leaves as it needs, and the new ones are queued
+ * for the parent.
+ */
+static void bpt_batch_leaf(struct bptree* leaf, const uint64_t* keys,
+			   void* const* vals, size_t m, int after,
+			   struct bpt_batch* b, struct bpt_splits* out)
+{
+	uint64_t* K = b->keys;
+	void** V = b->vals;
+	size_t t = 0;
+	size_t j = 0;
+	int i = 0;
+	int n = leaf->nr_keys;
+
+	while (i < n || j < m) {
+		if (j == m || (i < n && leaf->keys[i] <= keys[j])) {
+			K[t] = leaf->keys[i];
+			V[t++] = leaf->pointers[i + 1];
+			++i;
+		} else {
+			if (t == 0 || K[t - 1] != keys[j]) {
+				bpt_filter_insert(leaf, keys[j]);
+				K[t] = keys[j];
+				V[t++] = vals ? vals[j] : NULL;
+				++b->inserted;
+			}
+			++j;
+		}
+	}
+
+	size_t k = (t + ORDER - 2) / (ORDER - 1);
+	struct bptree* next = leaf->bpt_next;
+	struct bptree* prev = leaf;
+	size_t at = 0;
+	for (size_t g = 0; g < k; ++g) {
+		int cnt = t / k + (g < t % k);
+		struct bptree* node = leaf;
+		if (g) {
+			node = bpt_alloc(leaf);
+			prev->bpt_next = node;
+			bpt_splits_push(out, K[at], node, after);
+			BPT_COUNT(BPT_SPLITS);
+		}
+		memcpy(node->keys, K + at, sizeof(uint64_t) * cnt);
+		memcpy(node->pointers + 1, V + at, sizeof(void*) * cnt);
+		node->nr_keys = cnt;
+		prev = node;
+		at += cnt;
+	}
+	prev->bpt_next = next;
+	if (k > 1) {
+		bpt_reshaped(leaf);
+	}
+}
+
+/*
+ * Link the nodes split off below an inner node into it, in order. If they do
+ * not all fit, its children are spread evenly over as many inner nodes as
+ * they need, and the new ones are queued for the parent in turn.
+ */
+static void bpt_absorb(struct bptree* bpt, const struct bpt_splits* in,
+		       int after, struct bpt_splits* out)
+{
+	uint64_t kbuf[2 * ORDER];
+	struct bptree* cbuf[2 * ORDER];
+	int n = bpt->nr_keys;
+	size_t c = n + 1 + in->n;
+	uint64_t* K = kbuf;
+	struct bptree** C = cbuf;
+	size_t t = 1;
+	size_t j = 0;
+	if (c > 2 * ORDER) {
+		K = malloc(sizeof(uint64_t) * c);
+		C = malloc(sizeof(struct bptree*) * c);
+		if (!K || !C) {
+			abort();
+		}
+	}
+
+	C[0] = bpt->pointers[0];
+	for (int i = 0; i <= n; ++i) {
+		for (; j < in->n && in->v[j].after == i; ++j, ++t) {
+			K[t - 1] = in->v[j].sep;
+			C[t] = in->v[j].node;
+		}
+		if (i < n) {
+			K[t - 1] = bpt->keys[i];
+			C[t++] = bpt->pointers[i + 1];
+		}
+	}
+	assert(t == c && j == in->n);
+
+	size_t k = (c + ORDER - 1) / ORDER;
+	size_t at = 0;
+	for (size_t g = 0; g < k; ++g) {
+		int cnt = c / k + (g < c % k);
+		struct bptree* node = bpt;
+		if (g) {
+			node = bpt_alloc(bpt);
+			node->is_leaf = 0;
+			bpt_splits_push(out, K[at - 1], node, after);
+			BPT_COUNT(BPT_SPLITS);
+		}
+		memcpy(node->keys, K + at, sizeof(uint64_t) * (cnt - 1));
+		memcpy(node->pointers, C + at, sizeof(void*) * cnt);
+		node->nr_keys = cnt - 1;
+		bpt_tally(node);
+		at += cnt;
+	}
+	if (k > 1) {
+		bpt_reshaped(bpt);
+	}
+	if (K != kbuf) {
+		free(K);
+		free(C);
+	}
+}
+
+/*
+ * Copy the shared nodes a sorted run reaches below path[depth - 1], before
+ * the batch changes any of them. A batch only splits nodes, so siblings can
+ * stay shared.
+ */
+static void bpt_cow_run(struct bptree** path, int* slot, int depth,
+			const uint64_t* keys, size_t m)
+{
+	struct bptree* bpt = path[depth - 1];
+	size_t pos = 0;
+	assert(depth < BPT_MAX_HEIGHT);
+	for (int i = 0; i <= bpt->nr_keys && pos < m; ++i) {
+		size_t end = i < bpt->nr_keys ?
+			pos + bpt_run_bound(keys + pos, m - pos, bpt->keys[i]) : m;
+		if (end > pos) {
+			slot[depth - 1] = i;
+			bpt_cow_children(path, slot, depth, i, i);
+			struct bptree* child = bpt->pointers[i];
+			if (!child->is_leaf) {
+				path[depth] = child;
+				bpt_cow_run(path, slot, depth + 1, keys + pos,
+					    end - pos);
+			}
+		}
+		pos = end;
+	}
+}
+
+/*
+ * Route a sorted run down a subtree, visiting only the children some of its
+ * keys fall into, and queue any nodes split off at the top of the subtree.
+ */
+static void bpt_batch_merge(struct bptree* bpt, const uint64_t* keys,
+			    void* const* vals, size_t m, int after,
+			    struct bpt_batch* b, struct bpt_splits* out)
+{
+	if (bpt->is_leaf) {
+		bpt_batch_leaf(bpt, keys, vals, m, after, b, out);
+		return;
+	}
+
+	/*
+	 * Split the run between the children first, so the misses on all the
+	 * children it reaches can overlap.
+	 */
+	struct bpt_splits mine = { NULL, 0, 0 };
+	size_t bound[ORDER + 1];
+	int n = bpt->nr_keys;
+	bound[0] = 0;
+	for (int i = 0; i <= n; ++i) {
+		size_t pos = bound[i];
+		bound[i + 1] = i < n && pos < m ?
+			pos + bpt_run_bound(keys + pos, m - pos, bpt->keys[i]) : m;
+		if (bound[i + 1] > pos) {
+			bpt_prefetch(bpt->pointers[i]);
+		}
+	}
+	for (int i = 0; i <= n; ++i) {
+		size_t pos = bound[i];
+		if (bound[i + 1] > pos) {
+			size_t before = b->inserted;
+			bpt_batch_merge(bpt->pointers[i], keys + pos,
+					vals ? vals + pos : NULL,
+					bound[i + 1] - pos, i, b, &mine);
+			bpt_count_add(bpt, i, b->inserted - before);
+		}
+	}
+	if (mine.n) {
+		bpt_absorb(bpt, &mine, after, out);
+	}
+	free(mine.v);
+}
+
+size_t bptree_insert_sorted_batch(struct bptree** root, const uint64_t* keys,
+				  void* const* vals, size_t n)
+{
+	if (n == 0) {
+		return 0;
+	}
+	if ((*root)->flags & BPT_SYNC) {
+		size_t inserted = 0;
+		for (size_t i = 0; i < n; ++i) {
+			inserted += bptree_insert_or_get(root, keys[i],
+				vals ? vals[i] : NULL, NULL) == BPTREE_INSERTED;
+		}
+		return inserted;
+	}
+	if (((*root)->flags & BPT_SHARED) && !(*root)->is_leaf) {
+		struct bptree* path[BPT_MAX_HEIGHT];
+		int slot[BPT_MAX_HEIGHT];
+		path[0] = *root;
+		bpt_cow_run(path, slot, 1, keys, n);
+	}
+
+	struct bpt_batch b;
+	struct bpt_splits top = { NULL, 0, 0 };
+	b.keys = malloc(sizeof(uint64_t) * (n + ORDER));
+	b.vals = malloc(sizeof(void*) * (n + ORDER));
+	b.inserted = 0;
+	if (!b.keys || !b.vals) {
+		abort();
+	}
+
+	bpt_batch_merge(*root, keys, vals, n, 0, &b, &top);
+	while (top.n) {
+		struct bpt_splits up = { NULL, 0, 0 };
+		struct bptree* new_root = bpt_alloc(*root);
+		new_root->is_leaf = 0;
+		new_root->pointers[0] = *root;
+		new_root->flags |= (*root)->flags & BPT_SHARED;
+		(*root)->flags &= ~BPT_SHARED;
+		bpt_absorb(new_root, &top, 0, &up);
+		*root = new_root;
+		free(top.v);
+		top = up;
+		BPT_COUNT(BPT_ROOT_CHANGES);
+	}
+	free(top.v);
+	free(b.keys);
+	free(b.vals);
+	bpt_filter_tend(*root);
+	return b.inserted;
+}
+
+/*
+ * Free a bptree structure without touching any of its data. Arena nodes go
+ * back on their arena's free list.
+ */
+static void bpt_free(struct bptree* bpt)
+{
+	bpt_reshaped(bpt);
+	if (bpt->flags & BPT_ARENA) {
+		bpt_arena_free(bpt_arena_of(bpt), bpt, 0);
+	} else {
+		free(bpt);
+	}
+}
+
+/*
+ * Dispose of a node unlinked from a tree. Nodes of plain trees are freed on
+ * the spot.
+ *
+ * In a concurrent tree, readers may still be looking at it, and marking it
+ * obsolete sends them back to the root. Arena memory is never handed back to
+ * the system while the tree lives, so arena nodes can be recycled right away:
+ * their versions keep counting up. Heap nodes wait in limbo until no reader
+ * can reach them.
+ */
+static void bpt_retire(struct bptree* bpt)
+{
+	if (!(bpt->flags & BPT_SYNC)) {
+		bpt_free(bpt);
+		return;
+	}
+	__atomic_fetch_add(&bpt->version, BPT_LOCKED | BPT_OBSOLETE,
+			   __ATOMIC_RELEASE);
+	if (bpt->flags & BPT_ARENA) {
+		bpt_arena_free(bpt_arena_of(bpt), bpt, 1);
+	} else {
+		bpt_epoch_retire(bpt);
+	}
+}
+
+/*
+ * Take a key out of a leaf, returning its value (or NULL if it is missing).
+ * A root leaf keeps its last slot, zeroed, rather than going empty.
+ */
+static void* bpt_remove(struct bptree* leaf, uint64_t key, int is_root)
+{
+	int n = leaf->nr_keys;
+	int rank = bpt_rank(leaf->keys, n, key);
+	void* val;
+	if (rank == 0 || leaf->keys[rank - 1] != key) {
+		return NULL;
+	}
+	val = leaf->pointers[rank];
+	bpt_filter_remove(leaf, 1);
+	if (is_root && n == 1) {
+		leaf->keys[0] = 0;
+		leaf->pointers[1] = NULL;
+		return val;
+	}
+	memmove(leaf->keys + rank - 1, leaf->keys + rank,
+		sizeof(uint64_t) * (n - rank));
+	memmove(leaf->pointers + rank, leaf->pointers + rank + 1,
+		sizeof(void*) * (n - rank));
+	--leaf->nr_keys;
+	return val;
+}
+
+/*
+ * Move the last entry of pointers[pidx - 1] into pointers[pidx].
+ */
+static void bpt_borrow_left(struct bptree* parent, int pidx)
+{
+	struct bptree* pred = parent->pointers[pidx - 1];
+	struct bptree* curr = parent->pointers[pidx];
+	int last = pred->nr_keys - 1;
+
+	memmove(curr->keys + 1, curr->keys, sizeof(uint64_t) * curr->nr_keys);
+	if (curr->is_leaf) {
+		memmove(curr->pointers + 2, curr->pointers + 1,
+			sizeof(void*) * curr->nr_keys);
+		curr->keys[0] = pred->keys[last];
+		curr->pointers[1] = pred->pointers[last + 1];
+		parent->keys[pidx - 1] = curr->keys[0];
+	} else {
+		memmove(curr->pointers + 1, curr->pointers,
+			sizeof(void*) * (curr->nr_keys + 1));
+		curr->keys[0] = parent->keys[pidx - 1];
+		curr->pointers[0] = pred->pointers[last + 1];
+		parent->keys[pidx - 1] = pred->keys[last];
+	}
+	--pred->nr_keys;
+	++curr->nr_keys;
+	bpt_recount(parent, pidx - 1, pidx);
+	bpt_reshaped(pred);
+	bpt_reshaped(curr);
+	BPT_COUNT(BPT_ROTATIONS);
+}
+
+/*
+ * Move the first entry of pointers[pidx + 1] into pointers[pidx].
+ */
+static void bpt_borrow_right(struct bptree* parent, int pidx)
+{
+	struct bptree* curr = parent->pointers[pidx];
+	struct bptree* succ = parent->pointers[pidx + 1];
+	int end = curr->nr_keys;
+
+	if (curr->is_leaf) {
+		curr->keys[end] = succ->keys[0];
+		curr->pointers[end + 1] = succ->pointers[1];
+		memmove(succ->keys, succ->keys + 1,
+			sizeof(uint64_t) * (succ->nr_keys - 1));
+		memmove(succ->pointers + 1, succ->pointers + 2,
+			sizeof(void*) * (succ->nr_keys - 1));
+		parent->keys[pidx] = succ->keys[0];
+	} else {
+		curr->keys[end] = parent->keys[pidx];
+		curr->pointers[end + 1] = succ->pointers[0];
+		parent->keys[pidx] = succ->keys[0];
+		memmove(succ->keys, succ->keys + 1,
+			sizeof(uint64_t) * (succ->nr_keys - 1));
+		memmove(succ->pointers, succ->pointers + 1,
+			sizeof(void*) * succ->nr_keys);
+	}
+	--succ->nr_keys;
+	++curr->nr_keys;
+	bpt_recount(parent, pidx, pidx + 1);
+	bpt_reshaped(curr);
+	bpt_reshaped(succ);
+	BPT_COUNT(BPT_ROTATIONS);
+}
+
+/*
+ * Merge pointers[pidx + 1] into pointers[pidx] and retire it. Merging inner
+ * nodes pulls the separating key down from the parent.
+ */
+static void bpt_coalesce(struct bptree* parent, int pidx)
+{
+	struct bptree* pred = parent->pointers[pidx];
+	struct bptree* succ = parent->pointers[pidx + 1];
+	int end = pred->nr_keys;
+
+	if (pred->is_leaf) {
+		memcpy(pred->keys + end, succ->keys,
+			sizeof(uint64_t) * succ->nr_keys);
+		memcpy(pred->pointers + end + 1, succ->pointers + 1,
+			sizeof(void*) * succ->nr_keys);
+		pred->bpt_next = succ->bpt_next;
+		pred->nr_keys = end + succ->nr_keys;
+	} else {
+		pred->keys[end] = parent->keys[pidx];
+		memcpy(pred->keys + end + 1, succ->keys,
+			sizeof(uint64_t) * succ->nr_keys);
+		memcpy(pred->pointers + end + 1, succ->pointers,
+			sizeof(void*) * (succ->nr_keys + 1));
+		pred->nr_keys = end + 1 + succ->nr_keys;
+	}
+	assert(pred->nr_keys <= ORDER - 1);
+
+	memmove(parent->keys + pidx, parent->keys + pidx + 1,
+		sizeof(uint64_t) * (parent->nr_keys - pidx - 1));
+	memmove(parent->pointers + pidx + 1, parent->pointers + pidx + 2,
+		sizeof(void*) * (parent->nr_keys - pidx - 1));
+	bpt_slide_counts(parent, pidx + 1, pidx + 2, parent->nr_keys - pidx - 1);
+	parent->pointers[parent->nr_keys] = NULL;
+	--parent->nr_keys;
+	bpt_recount(parent, pidx, pidx);
+	bpt_reshaped(pred);
+	bpt_retire(succ);
+	BPT_COUNT(BPT_MERGES);
+}
+
+/*
+ * Make sure pointers[pidx] can lose a key, by borrowing from a sibling or by
+ * merging with one. The parent and the child must be locked; siblings are
+ * locked here. Returns the child's new index, with that child still locked.
+ */
+static int bpt_fill_child(struct bptree* parent, int pidx)
+{
+	struct bptree* pred = pidx > 0 ? parent->pointers[pidx - 1] : NULL;
+	struct bptree* succ = pidx < parent->nr_keys ?
+				parent->pointers[pidx + 1] : NULL;
+
+	if (pred) {
+		bpt_lock(pred);
+		if (pred->nr_keys > split(ORDER) - 1) {
+			bpt_borrow_left(parent, pidx);
+			bpt_unlock(pred);
+			return pidx;
+		}
+	}
+	if (succ) {
+		bpt_lock(succ);
+		if (succ->nr_keys > split(ORDER) - 1) {
+			bpt_borrow_right(parent, pidx);
+			bpt_unlock(succ);
+			if (pred) {
+				bpt_unlock(pred);
+			}
+			return pidx;
+		}
+	}
+	if (pred) {
+		if (succ) {
+			bpt_unlock(succ);
+		}
+		bpt_coalesce(parent, pidx - 1);
+		return pidx - 1;
+	}
+	bpt_coalesce(parent, pidx);
+	return pidx;
+}
+
+/*
+ * Pull the only (locked) child of an emptied root up into it. The root stays
+ * put.
+ */
+static void bpt_collapse_root(struct bptree* root)
+{
+	struct bptree* child = root->pointers[0];
+	assert(root->nr_keys == 0);
+	root->is_leaf = child->is_leaf;
+	root->nr_keys = child->nr_keys;
+	memcpy(root->keys, child->keys, sizeof(root->keys));
+	memcpy(root->pointers, child->pointers, sizeof(root->pointers));
+	bpt_retire(child);
+	BPT_COUNT(BPT_ROOT_CHANGES);
+}
+
+/*
+ * Delete from a concurrent tree. Like an insert, the descent is optimistic;
+ * a child with too few keys to lose one is topped up (locking it, its
+ * parent and its siblings) before the descent restarts, so the key comes out
+ * of the leaf without any changes rippling back up.
+ */
+static void* bpt_delete_sync(struct bptree* root, uint64_t key)
+{
+	struct bptree* bpt;
+	uint32_t v, cv;
+	void* val;
+
+restart:
+	bpt = root;
+	if (!bpt_read_begin(bpt, &v)) {
+		goto restart;
+	}
+	while (!bpt->is_leaf) {
+		int n = bpt->nr_keys;
+		if (n > ORDER - 1) {
+			goto restart;
+		}
+		int pidx = bpt_rank(bpt->keys, n, key);
+		struct bptree* child = bpt->pointers[pidx];
+		if (!bpt_read_child(bpt, v, child, &cv)) {
+			goto restart;
+		}
+		if (child->nr_keys <= split(ORDER) - 1) {
+			if (bpt_upgrade(bpt, v)) {
+				if (bpt_upgrade(child, cv)) {
+					pidx = bpt_fill_child(bpt, pidx);
+					if (bpt->nr_keys == 0) {
+						assert(bpt == root);
+						bpt_collapse_root(bpt);
+					} else {
+						bpt_unlock(bpt->pointers[pidx]);
+					}
+				}
+				bpt_unlock(bpt);
+			}
+			goto restart;
+		}
+		bpt = child;
+		v = cv;
+	}
+
+	if (!bpt_upgrade(bpt, v)) {
+		goto restart;
+	}
+	val = bpt_remove(bpt, key, bpt == root);
+	bpt_unlock(bpt);
+	return val;
+}
+
+/*
+ * Delete from a plain tree. The key comes out of its leaf first; only then
+ * are nodes left with too few keys topped up from a sibling or merged into
+ * one, walking back up the recorded path as far as the damage goes. Both
+ * move keys and pointers across in bulk.
+ */
+static void* bpt_delete(struct bptree** root, uint64_t key)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	struct bptree* bpt = *root;
+	int depth = 0;
+
+	if (bpt->flags & BPT_SHARED) {
+		bpt_cow_path(bpt, key, BPT_COW_DELETE);
+	}
+	while (!bpt->is_leaf) {
+		assert(depth < BPT_MAX_HEIGHT);
+		path[depth] = bpt;
+		slot[depth] = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		bpt = bpt->pointers[slot[depth++]];
+	}
+	int n = bpt->nr_keys;
+	void* val = bpt_remove(bpt, key, depth == 0);
+	for (int d = 0; d < depth && bpt->nr_keys < n; ++d) {
+		bpt_count_add(path[d], slot[d], (size_t) -1);
+	}
+	while (depth > 0 && bpt->nr_keys < split(ORDER) - 1) {
+		bpt = path[--depth];
+		bpt_fill_child(bpt, slot[depth]);
+	}
+	bpt = *root;
+	if (!bpt->is_leaf && bpt->nr_keys == 0) {
+		*root = bpt->pointers[0];
+		(*root)->flags |= bpt->flags & BPT_SHARED;
+		bpt_free(bpt);
+		BPT_COUNT(BPT_ROOT_CHANGES);
+	}
+	bpt_filter_tend(*root);
+	return val;
+}
+
+/*
+ * Remove a key, restructuring the tree as needed.
+ */
+void* bptree_delete(struct bptree** root, uint64_t key)
+{
+	void* val;
+	if ((*root)->flags & BPT_SYNC) {
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		val = bpt_delete_sync(*root, key);
+		bpt_epoch_leave(self);
+		return val;
+	}
+	return bpt_delete(root, key);
+}
+
+/*
+ * Free a subtree lying wholly inside a deleted range, passing its tuples to fn
+ * leaf by leaf. Returns the number of tuples. Parts that snapshots share are
+ * only released; below a shared node, nothing is the tree's own to free.
+ */
+static size_t bpt_drop_shared(struct bptree* bpt, int kept,
+			      bptree_scan_fn fn, void* ctx)
+{
+	size_t total = 0;
+	int shared = kept || (!(bpt->flags & (BPT_SYNC | BPT_ARENA)) &&
+			      bpt_is_shared(bpt));
+	if (bpt->is_leaf) {
+		total = bpt->nr_keys;
+		if (fn && total) {
+			fn(ctx, bpt->keys, (void* const*) bpt->pointers + 1,
+			   bpt->nr_keys);
+		}
+	} else {
+		for (int i = 0; i <= bpt->nr_keys; ++i) {
+			total += bpt_drop_shared(bpt->pointers[i], shared, fn,
+						 ctx);
+		}
+	}
+	if (!shared) {
+		bpt_free(bpt);
+	} else {
+		bpt_reshaped(bpt);
+		if (!kept) {
+			bpt_unref(bpt);
+		}
+	}
+	return total;
+}
+
+static size_t bpt_drop(struct bptree* bpt, bptree_scan_fn fn, void* ctx)
+{
+	return bpt_drop_shared(bpt, 0, fn, ctx);
+}
+
+/*
+ * Cut the tuples in [lo, hi) out of a subtree that the path to lo (if on_lo)
+ * and the path to hi (if on_hi) run through. Without one of the paths, the
+ * range extends past that edge of the subtree. Children strictly between the
+ * paths are dropped whole and the ones on the paths are cut recursively, so
+ * only nodes on the two paths can be left short of keys (or without any).
+ */
+static size_t bpt_cut(struct bptree* bpt, uint64_t lo, uint64_t hi,
+		      int on_lo, int on_hi, bptree_scan_fn fn, void* ctx)
+{
+	int n = bpt->nr_keys;
+
+	if (bpt->is_leaf) {
+		int start = on_lo ? bpt_lower_bound(bpt, lo) : 0;
+		int end = on_hi ? bpt_lower_bound(bpt, hi) : n;
+		if (start >= end) {
+			return 0;
+		}
+		if (fn) {
+			fn(ctx, bpt->keys + start,
+			   (void* const*) bpt->pointers + start + 1, end - start);
+		}
+		memmove(bpt->keys + start, bpt->keys + end,
+			sizeof(uint64_t) * (n - end));
+		memmove(bpt->pointers + start + 1, bpt->pointers + end + 1,
+			sizeof(void*) * (n - end));
+		bpt->nr_keys = n - (end - start);
+		return end - start;
+	}
+
+	int a = on_lo ? bpt_rank(bpt->keys, n, lo) : -1;
+	int b = on_hi ? bpt_rank(bpt->keys, n, hi) : n + 1;
+	if (a == b) {
+		size_t cut = bpt_cut(bpt->pointers[a], lo, hi, 1, 1, fn, ctx);
+		bpt_count_add(bpt, a, -cut);
+		return cut;
+	}
+
+	size_t total = 0;
+	size_t left = 0;
+	size_t right = 0;
+	if (a >= 0) {
+		left = bpt_cut(bpt->pointers[a], lo, hi, 1, 0, fn, ctx);
+	}
+	for (int i = a + 1; i < b; ++i) {
+		total += bpt_drop(bpt->pointers[i], fn, ctx);
+	}
+	if (b <= n) {
+		right = bpt_cut(bpt->pointers[b], lo, hi, 0, 1, fn, ctx);
+	}
+
+	/*
+	 * Close the gap. When both paths pass through, the separator that
+	 * sat just left of b now divides them.
+	 */
+	int dst = a >= 0 ? a : 0;
+	int src = a >= 0 ? b - 1 : b;
+	memmove(bpt->keys + dst, bpt->keys + src, sizeof(uint64_t) * (n - src));
+	memmove(bpt->pointers + a + 1, bpt->pointers + b,
+		sizeof(void*) * (n + 1 - b));
+	bpt_slide_counts(bpt, a + 1, b, n + 1 - b);
+	if (a >= 0) {
+		bpt_count_add(bpt, a, -left);
+	}
+	if (b <= n) {
+		bpt_count_add(bpt, a + 1, -right);
+	}
+	bpt->nr_keys = dst + n - src;
+	return total + left + right;
+}
+
+/*
+ * Walk down the path to a key, topping up every node on it that a cut left
+ * short. As in a concurrent delete, inner nodes are topped up past the
+ * minimum, so that merging their children below cannot leave them short in
+ * turn. Then drop any roots left with a single child.
+ */
+static void bpt_mend(struct bptree** root, uint64_t key)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	struct bptree* bpt = *root;
+	int shared = bpt->flags & BPT_SHARED;
+	int depth = 0;
+	while (!bpt->is_leaf) {
+		int pidx = bpt_rank(bpt->keys, bpt->nr_keys, key);
+		struct bptree* child = bpt->pointers[pidx];
+		int need = split(ORDER) - child->is_leaf;
+		assert(depth < BPT_MAX_HEIGHT);
+		path[depth] = bpt;
+		slot[depth++] = pidx;
+		while (bpt->nr_keys > 0 && child->nr_keys < need) {
+			/* Each step may reach a sibling further out. */
+			if (shared) {
+				slot[depth - 1] = pidx;
+				bpt_cow_children(path, slot, depth, pidx - 1,
+						 pidx + 1);
+			}
+			pidx = bpt_fill_child(bpt, pidx);
+			child = bpt->pointers[pidx];
+		}
+		slot[depth - 1] = pidx;
+		bpt = child;
+	}
+
+	bpt = *root;
+	while (!bpt->is_leaf && bpt->nr_keys == 0) {
+		*root = bpt->pointers[0];
+		(*root)->flags |= bpt->flags & BPT_SHARED;
 		bpt_free(bpt);
+		bpt = *root;
+		BPT_COUNT(BPT_ROOT_CHANGES);
+	}
+	if (bpt->nr_keys == 0) {
+		bpt->keys[0] = 0;
+		bpt->pointers[1] = NULL;
+		bpt->nr_keys = 1;
+	}
+}
+
+struct bpt_pending {
+	uint64_t keys[BPT_LOOKUP_GROUP];
+	int n;
+};
+
+static int bpt_pend(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+	struct bpt_pending* p = ctx;
+	int take = n < BPT_LOOKUP_GROUP - p->n ? n : BPT_LOOKUP_GROUP - p->n;
+	(void) vals;
+	memcpy(p->keys + p->n, keys, sizeof(uint64_t) * take);
+	p->n += take;
+	return p->n == BPT_LOOKUP_GROUP;
+}
+
+/*
+ * Concurrent trees take the range out a batch of keys at a time, each key
+ * with an ordinary delete.
+ */
+static size_t bpt_delete_range_sync(struct bptree* root, uint64_t lo,
+				    uint64_t hi, bptree_scan_fn fn, void* ctx)
+{
+	struct bpt_pending p;
+	void* vals[BPT_LOOKUP_GROUP];
+	size_t total = 0;
+	for (;;) {
+		p.n = 0;
+		bptree_scan(root, lo, hi, bpt_pend, &p);
+		if (p.n == 0) {
+			return total;
+		}
+		struct bpt_epoch_rec* self = bpt_epoch_enter();
+		for (int i = 0; i < p.n; ++i) {
+			vals[i] = bpt_delete_sync(root, p.keys[i]);
+		}
+		bpt_epoch_leave(self);
+		if (fn) {
+			fn(ctx, p.keys, vals, p.n);
+		}
+		total += p.n;
+		lo = p.keys[p.n - 1] + 1;
+	}
+}
+
+size_t bptree_delete_range(struct bptree** root, uint64_t lo, uint64_t hi,
+			   bptree_scan_fn fn, void* ctx)
+{
+	if (lo >= hi) {
+		return 0;
+	}
+	if ((*root)->flags & BPT_SYNC) {
+		return bpt_delete_range_sync(*root, lo, hi, fn, ctx);
+	}
+	if ((*root)->flags & BPT_SHARED) {
+		bpt_cow_path(*root, lo, BPT_COW_LEAF);
+		bpt_cow_path(*root, hi, BPT_COW_LEAF);
+	}
+
+	/*
+	 * Everything between the two boundary leaves is about to go, and the
+	 * nodes on the paths to them may change their bounds.
+	 */
+	struct bptree* left = *root;
+	struct bptree* right = *root;
+	bpt_reshaped(*root);
+	while (!left->is_leaf) {
+		left = left->pointers[bpt_rank(left->keys, left->nr_keys, lo)];
+		bpt_reshaped(left);
+	}
+	while (!right->is_leaf) {
+		right = right->pointers[bpt_rank(right->keys, right->nr_keys,
+						 hi)];
+		bpt_reshaped(right);
+	}
+	if (left != right) {
+		left->bpt_next = right;
+	}
+
+	size_t total = bpt_cut(*root, lo, hi, 1, 1, fn, ctx);
+	if (total) {
+		bpt_mend(root, lo);
+		bpt_mend(root, hi);
+		bpt_filter_remove(*root, total);
+		bpt_filter_tend(*root);
+	}
+	return total;
+}
+
+static int bpt_skip(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+	(void) ctx; (void) keys; (void) vals; (void) n;
+	return 0;
+}
+
+/*
+ * Sum the counts of the children left of the path to a key, then finish
+ * with the position of the key in its leaf.
+ */
+size_t bptree_rank(struct bptree* bpt, uint64_t key)
+{
+#if BPT_COUNTS
+	if (bpt_counted(bpt)) {
+		size_t rank = 0;
+		while (!bpt->is_leaf) {
+			int pidx = bpt_rank(bpt->keys, bpt->nr_keys, key);
+			for (int i = 0; i < pidx; ++i) {
+				rank += bpt->counts[i];
+			}
+			bpt = bpt->pointers[pidx];
+		}
+		return rank + bpt_lower_bound(bpt, key);
+	}
+#endif
+	return bptree_scan(bpt, 0, key, bpt_skip, NULL);
+}
+
+struct bpt_select {
+	size_t k;
+	uint64_t key;
+	void* val;
+	int found;
+};
+
+static int bpt_select_run(void* ctx, const uint64_t* keys, void* const* vals,
+			  int n)
+{
+	struct bpt_select* s = ctx;
+	if (s->k >= (size_t) n) {
+		s->k -= n;
+		return 0;
+	}
+	s->key = keys[s->k];
+	s->val = vals[s->k];
+	s->found = 1;
+	return 1;
+}
+
+/*
+ * Skip whole children by their counts on the way down.
+ */
+int bptree_select(struct bptree* bpt, size_t k, uint64_t* key, void** val)
+{
+#if BPT_COUNTS
+	if (bpt_counted(bpt)) {
+		while (!bpt->is_leaf) {
+			int pidx = 0;
+			while (pidx < bpt->nr_keys && k >= bpt->counts[pidx]) {
+				k -= bpt->counts[pidx++];
+			}
+			bpt = bpt->pointers[pidx];
+		}
+		if (k >= bpt->nr_keys) {
+			return 0;
+		}
+		*key = bpt->keys[k];
+		*val = bpt->pointers[k + 1];
+		return 1;
+	}
+#endif
+	struct bpt_select s = { k, 0, NULL, 0 };
+	bptree_scan(bpt, 0, UINT64_MAX, bpt_select_run, &s);
+	if (!s.found) {
+		/* A scan cannot reach the largest possible key. */
+		if (s.k > 0 || !bptree_exists(bpt, UINT64_MAX)) {
+			return 0;
+		}
+		s.key = UINT64_MAX;
+		s.val = bptree_lookup(bpt, UINT64_MAX);
+	}
+	*key = s.key;
+	*val = s.val;
+	return 1;
+}
+
+size_t bptree_count_range(struct bptree* bpt, uint64_t lo, uint64_t hi)
+{
+	if (lo >= hi) {
+		return 0;
+	}
+#if BPT_COUNTS
+	if (bpt_counted(bpt)) {
+		return bptree_rank(bpt, hi) - bptree_rank(bpt, lo);
+	}
+#endif
+	return bptree_scan(bpt, lo, hi, bpt_skip, NULL);
+}
+
+/*
+ * Negative-lookup filters. The top bits of a key's hash pick its block, and
+ * the low bits give a start and a stride for the probes within it.
+ */
+#define BPT_FILTER_BLOCK 512
+
+static inline uint64_t bpt_hash(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+static inline uint64_t* bpt_filter_block(const struct bptree_filter* f,
+					 uint64_t h)
+{
+	size_t i = (size_t) (((unsigned __int128) h * f->nr_blocks) >> 64);
+	return f->blocks + i * (BPT_FILTER_BLOCK / 64);
+}
+
+static void bpt_filter_set(struct bptree_filter* f, uint64_t key)
+{
+	uint64_t h = bpt_hash(key);
+	uint64_t* block = bpt_filter_block(f, h);
+	unsigned bit = h & (BPT_FILTER_BLOCK - 1);
+	unsigned stride = ((h >> 9) & (BPT_FILTER_BLOCK - 1)) | 1;
+	for (int i = 0; i < f->nr_probes; ++i) {
+		block[bit >> 6] |= 1ULL << (bit & 63);
+		bit = (bit + stride) & (BPT_FILTER_BLOCK - 1);
+	}
+}
+
+int bptree_filter_may_contain(const struct bptree_filter* f, uint64_t key)
+{
+	uint64_t h = bpt_hash(key);
+	const uint64_t* block = bpt_filter_block(f, h);
+	unsigned bit = h & (BPT_FILTER_BLOCK - 1);
+	unsigned stride = ((h >> 9) & (BPT_FILTER_BLOCK - 1)) | 1;
+	for (int i = 0; i < f->nr_probes; ++i) {
+		if (!(block[bit >> 6] & (1ULL << (bit & 63)))) {
+			return 0;
+		}
+		bit = (bit + stride) & (BPT_FILTER_BLOCK - 1);
+	}
+	return 1;
+}
+
+static int bpt_filter_run(void* ctx, const uint64_t* keys, void* const* vals,
+			  int n)
+{
+	(void) vals;
+	for (int i = 0; i < n; ++i) {
+		bpt_filter_set(ctx, keys[i]);
+	}
+	return 0;
+}
+
+static void bpt_filter_mark(struct bptree* bpt, uint8_t id)
+{
+	bpt->filter = id;
+	if (!bpt->is_leaf) {
+		for (int i = 0; i <= bpt->nr_keys; ++i) {
+			bpt_filter_mark(bpt->pointers[i], id);
+		}
+	}
+}
+
+/* Free the number of a tree which is going away. */
+static void bpt_filter_release(uint8_t id)
+{
+	bpt_spin_lock(&bpt_filter_lock);
+	if (bpt_filters[id]) {
+		bpt_filters[id]->id = 0;
+		bpt_filters[id] = NULL;
+	}
+	bpt_filter_taken[id] = 0;
+	bpt_spin_unlock(&bpt_filter_lock);
+}
+
+/*
+ * The filter is sized with half as much room again as the tree needs now,
+ * so that it takes a while to fill up.
+ */
+int bptree_filter_build(struct bptree_filter* f, struct bptree* root,
+			double bits_per_key)
+{
+	int id = root->filter;
+
+	if (root->flags & (BPT_SYNC | BPT_FROZEN)) {
+		return -1;
+	}
+	bpt_spin_lock(&bpt_filter_lock);
+	if (id && bpt_filters[id] && bpt_filters[id] != f) {
+		bpt_spin_unlock(&bpt_filter_lock);
+		return -1;
+	}
+	if (!id) {
+		for (id = 1; id <= BPT_MAX_FILTERS && bpt_filter_taken[id];
+		     ++id) {
+		}
+		if (id > BPT_MAX_FILTERS) {
+			bpt_spin_unlock(&bpt_filter_lock);
+			return -1;
+		}
+		bpt_filter_taken[id] = 1;
+	}
+	if (f->id && f->id != id) {
+		bpt_filters[f->id] = NULL;
+	}
+	bpt_filters[id] = f;
+	f->id = id;
+	bpt_spin_unlock(&bpt_filter_lock);
+	if (!root->filter) {
+		bpt_filter_mark(root, (uint8_t) id);
+	}
+
+	int has_max = bptree_exists(root, UINT64_MAX) != NULL;
+	size_t n = bptree_scan(root, 0, UINT64_MAX, bpt_skip, NULL) + has_max;
+	size_t capacity = n + n / 2 + 64;
+	size_t nr_blocks;
+
+	if (bits_per_key < 1) {
+		bits_per_key = 1;
+	}
+	nr_blocks = (size_t) (capacity * bits_per_key / BPT_FILTER_BLOCK) + 1;
+	if (nr_blocks != f->nr_blocks) {
+		void* mem;
+		free(f->blocks);
+		if (posix_memalign(&mem, BPT_ALIGN,
+				   nr_blocks * (BPT_FILTER_BLOCK / 8))) {
+			abort();
+		}
+		f->blocks = mem;
+		f->nr_blocks = nr_blocks;
+	}
+	memset(f->blocks, 0, nr_blocks * (BPT_FILTER_BLOCK / 8));
+
+	/* k = ln 2 * bits per key minimises false positives. */
+	f->nr_probes = (int) (bits_per_key * 0.693 + 0.5);
+	if (f->nr_probes < 1) {
+		f->nr_probes = 1;
+	} else if (f->nr_probes > 16) {
+		f->nr_probes = 16;
+	}
+	f->bits_per_key = bits_per_key;
+	f->capacity = capacity;
+	f->nr_keys = n;
+	f->nr_stale = 0;
+
+	bptree_scan(root, 0, UINT64_MAX, bpt_filter_run, f);
+	if (has_max) {
+		bpt_filter_set(f, UINT64_MAX);
+	}
+	return 0;
+}
+
+/*
+ * Rebuild a tree's filter once more keys have gone in than it was sized for,
+ * or a quarter of those have been deleted.
+ */
+static void bpt_filter_tend(struct bptree* root)
+{
+	struct bptree_filter* f;
+	if (root->filter && (f = bpt_filters[root->filter]) &&
+	    (f->nr_keys > f->capacity || f->nr_stale > f->capacity / 4)) {
+		bptree_filter_build(f, root, f->bits_per_key);
+	}
+}
+
+void bptree_filter_free(struct bptree_filter* f)
+{
+	bpt_spin_lock(&bpt_filter_lock);
+	if (f->id) {
+		bpt_filters[f->id] = NULL;
+		f->id = 0;
+	}
+	bpt_spin_unlock(&bpt_filter_lock);
+	free(f->blocks);
+	f->blocks = NULL;
+	f->nr_blocks = 0;
+}
+
+void* bptree_filter_lookup(struct bptree* root,
+			   const struct bptree_filter* f, uint64_t key)
+{
+	if (!bptree_filter_may_contain(f, key)) {
+		return NULL;
+	}
+	return bptree_lookup(root, key);
+}
+
+struct bptree* bptree_filter_exists(struct bptree* root,
+				    const struct bptree_filter* f,
+				    uint64_t key)
+{
+	if (!bptree_filter_may_contain(f, key)) {
+		return NULL;
+	}
+	return bptree_exists(root, key);
+}
+
+void* bptree_filter_delete(struct bptree** root, struct bptree_filter* f,
+			   uint64_t key)
+{
+	if (!bptree_filter_may_contain(f, key)) {
+		return NULL;
+	}
+	return bptree_delete(root, key);
+}
+
+/*
+ * Repack the children of a locked node left to right, topping each up to fill
+ * keys from the ones after it and freeing any that empty. Only the last child
+ * can be left short of fill, and it keeps at least the minimum. Returns the
+ * number of children freed.
+ */
+static int bpt_repack(struct bptree* parent, int fill)
+{
+	struct bptree* curr = parent->pointers[0];
+	int freed = 0;
+	int i = 0;
+
+	bpt_lock(curr);
+	while (i < parent->nr_keys) {
+		struct bptree* succ = parent->pointers[i + 1];
+		int want = fill - curr->nr_keys;
+		int keep = i + 1 == parent->nr_keys ? split(ORDER) - 1 : 1;
+		int spare = succ->nr_keys - keep;
+
+		/* Two short nodes at the end always fit in one. */
+		bpt_lock(succ);
+		if ((want > 0 && succ->nr_keys + !curr->is_leaf <= want) ||
+		    curr->nr_keys + spare < split(ORDER) - 1) {
+			bpt_coalesce(parent, i);
+			++freed;
+			continue;
+		}
+		if (want > 0 && spare > 0) {
+			bpt_shift_left(parent, i + 1, want < spare ? want : spare);
+		}
+		bpt_unlock(curr);
+		curr = succ;
+		++i;
+	}
+	bpt_unlock(curr);
+	return freed;
+}
+
+/*
+ * Each step locks the path down to one node at the current level, repacks
+ * that node's children, and then tops the path back up from its siblings on
+ * the way up (a repack can take a node well below the minimum). The key just
+ * past the node is where the next step starts.
+ */
+int bptree_compact_step(struct bptree** root, struct bptree_compaction* c,
+			size_t budget)
+{
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	int sync = (*root)->flags & BPT_SYNC;
+	struct bpt_epoch_rec* self = sync ? bpt_epoch_enter() : NULL;
+	int fill = (int) (c->target_fill * (ORDER - 1) + 0.5);
+
+	if (fill < split(ORDER) - 1) {
+		fill = split(ORDER) - 1;
+	} else if (fill > ORDER - 1) {
+		fill = ORDER - 1;
+	}
+	int shared = (*root)->flags & BPT_SHARED;
+
+	while (!c->done) {
+		int height = 1;
+		for (struct bptree* b = *root; !b->is_leaf; b = b->pointers[0]) {
+			++height;
+		}
+		int depth = height - 2 - c->level;
+		if (depth < 0) {
+			c->done = 1;
+			break;
+		}
+
+		uint64_t hi = 0;
+		int bounded = 0;
+		struct bptree* bpt = *root;
+		int d;
+		bpt_lock(bpt);
+		for (d = 0; d < depth && !bpt->is_leaf; ++d) {
+			path[d] = bpt;
+			slot[d] = bpt_rank(bpt->keys, bpt->nr_keys, c->next);
+			if (slot[d] < bpt->nr_keys) {
+				hi = bpt->keys[slot[d]];
+				bounded = 1;
+			}
+			if (shared) {
+				bpt_cow_children(path, slot, d + 1, slot[d],
+						 slot[d]);
+			}
+			bpt = bpt->pointers[slot[d]];
+			bpt_lock(bpt);
+		}
+		path[d] = bpt;
+
+		/* A concurrent delete may have just made the tree shorter. */
+		if (bpt->is_leaf) {
+			for (; d >= 0; --d) {
+				bpt_unlock(path[d]);
+			}
+			continue;
+		}
+
+		/* Copy what the repack and the top-ups may reach. */
+		if (shared) {
+			for (int i = 0; i <= bpt->nr_keys; ++i) {
+				slot[d] = i;
+				bpt_cow_children(path, slot, d + 1, i, i);
+			}
+		}
+		size_t cost = bpt->nr_keys + 1 + depth;
+		c->freed += bpt_repack(bpt, fill);
+		for (d = depth;
+		     d > 0 && path[d]->nr_keys < split(ORDER) - 1; --d) {
+			struct bptree* parent = path[d - 1];
+			while (parent->nr_keys > 0 &&
+			       path[d]->nr_keys < split(ORDER) - 1) {
+				int n = parent->nr_keys;
+				if (shared) {
+					bpt_cow_children(path, slot, d,
+							 slot[d - 1] - 1,
+							 slot[d - 1] + 1);
+				}
+				slot[d - 1] = bpt_fill_child(parent, slot[d - 1]);
+				path[d] = parent->pointers[slot[d - 1]];
+				c->freed += n - parent->nr_keys;
+			}
+		}
+
+		/* Unlock everything but the node an emptied root gives up. */
+		int gone = -1;
+		if (path[0]->nr_keys == 0) {
+			if (sync) {
+				if (depth == 0) {
+					bpt_lock(path[0]->pointers[0]);
+				}
+				bpt_collapse_root(path[0]);
+				gone = 1;
+			} else {
+				*root = path[0]->pointers[0];
+				(*root)->flags |= path[0]->flags & BPT_SHARED;
+				bpt_free(path[0]);
+				gone = 0;
+				BPT_COUNT(BPT_ROOT_CHANGES);
+			}
+			++c->freed;
+		}
+		for (d = depth; d >= 0; --d) {
+			if (d != gone) {
+				bpt_unlock(path[d]);
+			}
+		}
+
+		if (bounded) {
+			c->next = hi;
+		} else {
+			++c->level;
+			c->next = 0;
+		}
+		if (cost >= budget) {
+			break;
+		}
+		budget -= cost;
+	}
+
+	if (sync) {
+		bpt_epoch_leave(self);
+	}
+	return !c->done;
+}
+
+size_t bptree_compact(struct bptree** root, double target_fill)
+{
+	struct bptree_compaction c = { target_fill, 0, 0, 0, 0 };
+	while (bptree_compact_step(root, &c, SIZE_MAX)) {
+	}
+	return c.freed;
+}
+
+/*
+ * Snapshots. A header with the key count and value size is followed by
+ * blocks of tuples: a count, a CRC32C of the count and the rest of the
+ * block, the keys, then the encoded values. Every block but the last is
+ * full, so where each one starts follows from the key count alone, and a
+ * load can hand whole runs of blocks to different threads. Everything is in
+ * the machine's byte order.
+ */
+#define BPT_SNAPSHOT_MAGIC 0x3150414e53545042ULL	/* "BPTSNAP1" */
+#define BPT_SNAPSHOT_VERSION 1
+
+/* Snapshots are written and read this many bytes at a time. */
+#define BPT_SNAPSHOT_CHUNK (8 << 20)
+
+/* Loads decode on at most this many threads. */
+#define BPT_SNAPSHOT_THREADS 8
+
+/* Loads take headers with larger blocks than this for damage. */
+#define BPT_SNAPSHOT_MAX_BLOCK (1 << 20)
+
+struct bpt_snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t value_size;
+	uint64_t nr_keys;
+	uint32_t block;		/* Tuples per full block. */
+	uint32_t crc;		/* Of the fields above. */
+};
+
+static uint32_t bpt_crc_table[256];
+
+static uint32_t bpt_crc32c_soft(uint32_t crc, const void* buf, size_t n)
+{
+	const unsigned char* p = buf;
+	while (n--) {
+		crc = bpt_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if BPT_HAVE_X86_SIMD
+__attribute__((target("sse4.2")))
+static uint32_t bpt_crc32c_sse42(uint32_t crc, const void* buf, size_t n)
+{
+	const unsigned char* p = buf;
+	uint64_t c = crc;
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t word;
+		memcpy(&word, p, sizeof(word));
+		c = _mm_crc32_u64(c, word);
+	}
+	crc = (uint32_t) c;
+	while (n--) {
+		crc = _mm_crc32_u8(crc, *p++);
+	}
+	return crc;
+}
+#endif
+
+static uint32_t (*bpt_crc32c)(uint32_t, const void*, size_t) =
+	bpt_crc32c_soft;
+
+__attribute__((constructor))
+static void bpt_init_crc(void)
+{
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; ++j) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+		bpt_crc_table[i] = crc;
+	}
+#if BPT_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		bpt_crc32c = bpt_crc32c_sse42;
+	}
+#endif
+}
+
+uint32_t bptree_crc32c(uint32_t crc, const void* buf, size_t n)
+{
+	return ~bpt_crc32c(~crc, buf, n);
+}
+
+/* The checksum of a block: its count, then everything after the checksum. */
+static uint32_t bpt_block_crc(uint32_t count, const unsigned char* body,
+			      size_t len)
+{
+	uint32_t crc = bptree_crc32c(0, &count, sizeof(count));
+	return bptree_crc32c(crc, body, len);
+}
+
+static int bpt_write_all(int fd, const unsigned char* buf, size_t len)
+{
+	while (len) {
+		ssize_t done = write(fd, buf, len);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return -1;
+		}
+		buf += done;
+		len -= done;
+	}
+	return 0;
+}
+
+/* Returns -1 on errors, with errno set to EINVAL if the data ran out. */
+static int bpt_read_all(int fd, unsigned char* buf, size_t len)
+{
+	while (len) {
+		ssize_t done = read(fd, buf, len);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			if (done == 0) {
+				errno = EINVAL;
+			}
+			return -1;
+		}
+		buf += done;
+		len -= done;
+	}
+	return 0;
+}
+
+/*
+ * The leaves of a tree in key order, found by walking down from the root. A
+ * view's leaf chain belongs to the tree, which may have moved on since.
+ */
+struct bpt_leaf_walk {
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	int depth;
+};
+
+static struct bptree* bpt_walk_down(struct bpt_leaf_walk* w,
+				    struct bptree* bpt)
+{
+	while (!bpt->is_leaf) {
+		assert(w->depth < BPT_MAX_HEIGHT);
+		w->path[w->depth] = bpt;
+		w->slot[w->depth++] = 0;
+		bpt = bpt->pointers[0];
+	}
+	return bpt;
+}
+
+static struct bptree* bpt_walk_first(struct bpt_leaf_walk* w,
+				     struct bptree* root)
+{
+	w->depth = 0;
+	return bpt_walk_down(w, root);
+}
+
+static struct bptree* bpt_walk_next(struct bpt_leaf_walk* w)
+{
+	while (w->depth > 0 &&
+	       w->slot[w->depth - 1] == w->path[w->depth - 1]->nr_keys) {
+		--w->depth;
+	}
+	if (w->depth == 0) {
+		return NULL;
+	}
+	int d = w->depth - 1;
+	return bpt_walk_down(w, w->path[d]->pointers[++w->slot[d]]);
+}
+
+/*
+ * The tree is written a leaf at a time, a block at a time, into a buffer
+ * which is written out whenever it fills.
+ */
+int bptree_save(struct bptree* root, int fd, const struct bptree_codec* codec)
+{
+	size_t vs = codec ? codec->value_size : sizeof(void*);
+	size_t block_bytes = 8 + BPT_SNAPSHOT_BLOCK * (sizeof(uint64_t) + vs);
+	size_t cap = BPT_SNAPSHOT_CHUNK > block_bytes ?
+		BPT_SNAPSHOT_CHUNK : block_bytes;
+	struct bpt_snapshot_header hdr;
+	struct bpt_leaf_walk w;
+	struct bptree* leaf;
+	int idx = 0;
+	int ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BPT_SNAPSHOT_MAGIC;
+	hdr.version = BPT_SNAPSHOT_VERSION;
+	hdr.value_size = vs;
+	hdr.block = BPT_SNAPSHOT_BLOCK;
+	for (leaf = bpt_walk_first(&w, root); leaf; leaf = bpt_walk_next(&w)) {
+		hdr.nr_keys += leaf->nr_keys;
+	}
+	leaf = bpt_walk_first(&w, root);
+	hdr.crc = bptree_crc32c(0, &hdr, offsetof(struct bpt_snapshot_header,
+						  crc));
+
+	unsigned char* buf = malloc(cap);
+	if (!buf) {
+		abort();
+	}
+	memcpy(buf, &hdr, sizeof(hdr));
+	size_t used = sizeof(hdr);
+
+	for (uint64_t left = hdr.nr_keys; left > 0 && !ret; ) {
+		uint32_t cnt = left < BPT_SNAPSHOT_BLOCK ? left : BPT_SNAPSHOT_BLOCK;
+		size_t len = cnt * (sizeof(uint64_t) + vs);
+		if (used + 8 + len > cap) {
+			ret = bpt_write_all(fd, buf, used);
+			used = 0;
+		}
+		unsigned char* blk = buf + used;
+		unsigned char* kp = blk + 8;
+		unsigned char* vp = kp + cnt * sizeof(uint64_t);
+		for (uint32_t j = 0; j < cnt; ) {
+			while (idx == leaf->nr_keys) {
+				leaf = bpt_walk_next(&w);
+				idx = 0;
+			}
+			uint32_t run = leaf->nr_keys - idx;
+			if (run > cnt - j) {
+				run = cnt - j;
+			}
+			memcpy(kp + j * sizeof(uint64_t), leaf->keys + idx,
+			       run * sizeof(uint64_t));
+			if (!codec) {
+				memcpy(vp + j * vs, leaf->pointers + idx + 1,
+				       run * vs);
+			} else {
+				for (uint32_t r = 0; r < run; ++r) {
+					codec->encode(codec->ctx,
+						      leaf->pointers[idx + r + 1],
+						      vp + (j + r) * vs);
+				}
+			}
+			idx += run;
+			j += run;
+		}
+		uint32_t crc = bpt_block_crc(cnt, kp, len);
+		memcpy(blk, &cnt, sizeof(cnt));
+		memcpy(blk + 4, &crc, sizeof(crc));
+		used += 8 + len;
+		left -= cnt;
+	}
+	if (!ret && used) {
+		ret = bpt_write_all(fd, buf, used);
+	}
+	free(buf);
+	return ret;
+}
+
+/* A run of blocks from one chunk of a snapshot, for one thread to decode. */
+struct bpt_decoder {
+	const struct bptree_codec* codec;
+	const struct bpt_snapshot_header* hdr;
+	const unsigned char* buf;	/* The chunk, ... */
+	uint64_t first;			/* ... which starts with this block. */
+	size_t lo, hi;			/* The blocks to decode, in the chunk. */
+	uint64_t* keys;
+	void** vals;
+	int bad;
+};
+
+static void* bpt_decode_blocks(void* arg)
+{
+	struct bpt_decoder* d = arg;
+	const struct bptree_codec* codec = d->codec;
+	size_t vs = d->hdr->value_size;
+	size_t block_bytes = 8 + d->hdr->block * (sizeof(uint64_t) + vs);
+
+	for (size_t k = d->lo; k < d->hi; ++k) {
+		const unsigned char* blk = d->buf + k * block_bytes;
+		uint64_t start = (d->first + k) * d->hdr->block;
+		uint64_t cnt = d->hdr->nr_keys - start;
+		uint32_t n, crc;
+		if (cnt > d->hdr->block) {
+			cnt = d->hdr->block;
+		}
+		memcpy(&n, blk, sizeof(n));
+		memcpy(&crc, blk + 4, sizeof(crc));
+		if (n != cnt ||
+		    crc != bpt_block_crc(n, blk + 8, n * (sizeof(uint64_t) + vs))) {
+			d->bad = 1;
+			return NULL;
+		}
+
+		uint64_t* keys = d->keys + start;
+		const unsigned char* vp = blk + 8 + n * sizeof(uint64_t);
+		memcpy(keys, blk + 8, n * sizeof(uint64_t));
+		for (uint32_t j = 1; j < n; ++j) {
+			if (keys[j] <= keys[j - 1]) {
+				d->bad = 1;
+				return NULL;
+			}
+		}
+		if (!codec) {
+			memcpy(d->vals + start, vp, n * sizeof(void*));
+		} else {
+			for (uint32_t j = 0; j < n; ++j) {
+				d->vals[start + j] = codec->decode(codec->ctx,
+								   vp + j * vs);
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Snapshots are read a chunk of whole blocks at a time. The blocks of each
+ * chunk are checked and decoded in parallel, straight into the arrays which
+ * bptree_bulk_load() builds the tree from. The header is not trusted with
+ * sizes: a file must be as long as it says, and the arrays only grow as the
+ * blocks actually arrive.
+ */
+struct bptree* bptree_load(int fd, const struct bptree_codec* codec)
+{
+	struct bpt_snapshot_header hdr;
+	size_t vs = codec ? codec->value_size : sizeof(void*);
+	struct bptree* root = NULL;
+	struct stat st;
+
+	if (bpt_read_all(fd, (unsigned char*) &hdr, sizeof(hdr))) {
+		return NULL;
+	}
+	if (hdr.magic != BPT_SNAPSHOT_MAGIC ||
+	    hdr.version != BPT_SNAPSHOT_VERSION ||
+	    hdr.crc != bptree_crc32c(0, &hdr,
+				     offsetof(struct bpt_snapshot_header, crc)) ||
+	    hdr.value_size != vs || hdr.block == 0 || hdr.nr_keys == 0 ||
+	    hdr.block > BPT_SNAPSHOT_MAX_BLOCK) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t tuple = sizeof(uint64_t) + vs;
+	size_t block_bytes = 8 + hdr.block * tuple;
+	uint64_t nr_blocks = (hdr.nr_keys + hdr.block - 1) / hdr.block;
+	if (hdr.nr_keys > (UINT64_MAX - 8 * nr_blocks) / tuple ||
+	    hdr.nr_keys > SIZE_MAX / sizeof(uint64_t)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	uint64_t payload = 8 * nr_blocks + hdr.nr_keys * tuple;
+	if (fstat(fd, &st)) {
+		return NULL;
+	}
+	if (S_ISREG(st.st_mode)) {
+		off_t at = lseek(fd, 0, SEEK_CUR);
+		if (at >= 0 && (at > st.st_size ||
+				payload > (uint64_t) (st.st_size - at))) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	size_t per_chunk = BPT_SNAPSHOT_CHUNK / block_bytes;
+	if (per_chunk == 0) {
+		per_chunk = 1;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus < 1 ? 1 :
+		cpus > BPT_SNAPSHOT_THREADS ? BPT_SNAPSHOT_THREADS : cpus;
+
+	size_t buf_bytes = per_chunk * block_bytes;
+	if (buf_bytes > payload) {
+		buf_bytes = payload;
+	}
+	unsigned char* buf = malloc(buf_bytes);
+	uint64_t* keys = NULL;
+	void** vals = NULL;
+	uint64_t room = 0;
+	if (!buf) {
+		abort();
+	}
+
+	int bad = 0;
+	for (uint64_t b = 0; b < nr_blocks && !bad; b += per_chunk) {
+		size_t nr = nr_blocks - b < per_chunk ? nr_blocks - b : per_chunk;
+		uint64_t last = (b + nr) * hdr.block;
+		size_t len = nr * block_bytes;
+		if (last > hdr.nr_keys) {
+			/* The final block is short. */
+			len -= (last - hdr.nr_keys) * tuple;
+			last = hdr.nr_keys;
+		}
+		if (bpt_read_all(fd, buf, len)) {
+			goto out;
+		}
+		if (last > room) {
+			room = 2 * room > last ? 2 * room : last;
+			room = room > hdr.nr_keys ? hdr.nr_keys : room;
+			keys = realloc(keys, room * sizeof(uint64_t));
+			vals = realloc(vals, room * sizeof(void*));
+			if (!keys || !vals) {
+				abort();
+			}
+		}
+
+		struct bpt_decoder d[BPT_SNAPSHOT_THREADS];
+		pthread_t tids[BPT_SNAPSHOT_THREADS];
+		int t = (size_t) threads < nr ? threads : (int) nr;
+		for (int i = 0; i < t; ++i) {
+			d[i].codec = codec;
+			d[i].hdr = &hdr;
+			d[i].buf = buf;
+			d[i].first = b;
+			d[i].lo = nr * i / t;
+			d[i].hi = nr * (i + 1) / t;
+			d[i].keys = keys;
+			d[i].vals = vals;
+			d[i].bad = 0;
+			if (i && pthread_create(&tids[i], NULL, bpt_decode_blocks,
+						&d[i])) {
+				abort();
+			}
+		}
+		bpt_decode_blocks(&d[0]);
+		for (int i = 0; i < t; ++i) {
+			if (i) {
+				pthread_join(tids[i], NULL);
+			}
+			bad |= d[i].bad;
+		}
+	}
+	/* The threads checked the order within blocks; check it across them. */
+	for (uint64_t b = 1; b < nr_blocks && !bad; ++b) {
+		bad = keys[b * hdr.block] <= keys[b * hdr.block - 1];
+	}
+	if (bad) {
+		errno = EINVAL;
+	} else {
+		root = bptree_bulk_load(keys, vals, hdr.nr_keys, 1.0);
+	}
+
+out:
+	free(buf);
+	free(keys);
+	free(vals);
+	return root;
+}
+
+static void bpt_stats_walk(struct bptree* bpt, int depth, int root,
+			   struct bptree_stats* st, double* fill_sum)
+{
+	double fill = (double) bpt->nr_keys / (ORDER - 1);
+	assert(depth < BPT_MAX_HEIGHT);
+	if (depth + 1 > st->height) {
+		st->height = depth + 1;
+	}
+	++st->level_nodes[depth];
+	++st->nr_nodes;
+	*fill_sum += fill;
+	if (!root && fill < st->min_fill) {
+		st->min_fill = fill;
+	}
+
+	if (bpt->is_leaf) {
+		++st->nr_leaves;
+		st->nr_keys += bpt->nr_keys;
 	} else {
 		for (int i = 0; i <= bpt->nr_keys; ++i) {
-			if (bpt->pointers[i]) {
-				bptree_free(bpt->pointers[i]);
-			}
+			bpt_stats_walk(bpt->pointers[i], depth + 1, 0, st,
+				       fill_sum);
 		}
-		bpt_free(bpt);
 	}
 }
 
-#ifdef __cplusplus__
+/*
+ * Walk the tree for its shape, and snapshot the event counters.
+ */
+void bptree_stats(struct bptree* bpt, struct bptree_stats* st)
+{
+	double fill_sum = 0;
+	memset(st, 0, sizeof(*st));
+	st->min_fill = 1;
+	bpt_stats_walk(bpt, 0, 1, st, &fill_sum);
+	st->avg_fill = fill_sum / st->nr_nodes;
+	if (st->nr_nodes == 1) {
+		st->min_fill = st->avg_fill;
+	}
+
+	if (bpt->flags & BPT_ARENA) {
+		struct bpt_arena* arena = bpt_arena_of(bpt);
+		st->bytes = sizeof(struct bpt_arena);
+		for (struct bpt_slab* slab = arena->slabs; slab;
+		     slab = slab->next) {
+			st->bytes += BPT_SLAB_SIZE;
+		}
+	} else {
+		st->bytes = st->nr_nodes * sizeof(struct bptree);
+	}
+
+#if BPT_STATS
+	st->splits = __atomic_load_n(&bpt_counters[BPT_SPLITS],
+				     __ATOMIC_RELAXED);
+	st->merges = __atomic_load_n(&bpt_counters[BPT_MERGES],
+				     __ATOMIC_RELAXED);
+	st->rotations = __atomic_load_n(&bpt_counters[BPT_ROTATIONS],
+					__ATOMIC_RELAXED);
+	st->root_changes = __atomic_load_n(&bpt_counters[BPT_ROOT_CHANGES],
+					   __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * Mark every node of a quiescent tree as shared between threads. Nodes
+ * allocated later inherit the flag from their siblings.
+ */
+static void bpt_make_sync(struct bptree* bpt)
+{
+	bpt->flags |= BPT_SYNC;
+	bpt->filter = 0;
+	if (!bpt->is_leaf) {
+		for (int i = 0; i <= bpt->nr_keys; ++i) {
+			bpt_make_sync(bpt->pointers[i]);
+		}
+	}
+}
+
+void bptree_make_concurrent(struct bptree* bpt)
+{
+	if (bpt->filter) {
+		bpt_filter_release(bpt->filter);
+	}
+	bpt_unshare(bpt);
+	bpt_make_sync(bpt);
+}
+
+/*
+ * Free every retired node that no thread can still be reading: everything,
+ * if no other thread is inside a tree operation.
+ */
+size_t bptree_reclaim(void)
+{
+	struct bpt_epoch_rec* self = bpt_epoch_self();
+	size_t freed = 0;
+	assert(self->depth == 0);
+	for (int i = 0; i < 3; ++i) {
+		freed += bpt_epoch_collect(self);
+	}
+	return freed;
+}
+
+void bptree_free(struct bptree* bpt)
+{
+	if (bpt->filter && !(bpt->flags & BPT_FROZEN)) {
+		bpt_filter_release(bpt->filter);
+	}
+	if (bpt->flags & BPT_ARENA) {
+		bpt_arena_destroy(bpt_arena_of(bpt));
+	} else if (bpt->flags & (BPT_SHARED | BPT_FROZEN)) {
+		bpt_unref(bpt);
+	} else {
+		bpt_drop(bpt, NULL, NULL);
+	}
+}
+
+#ifdef __cplusplus
 } /* extern "C" */
 #endif
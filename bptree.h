@@ -22,24 +22,146 @@
 
 #pragma once
 
-#ifdef __cplusplus__
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
 extern "C" {
 #endif
 
-#include <stdint.h>
-
+/*
+ * The maximum number of children per node. Override this at compile time to
+ * trade node size for tree height. One-pass splitting needs an odd number of
+ * keys per node, so it must be even.
+ */
+#ifndef ORDER
 #define ORDER 4
+#endif
+
+#if ORDER < 4 || ORDER % 2 != 0
+#error "ORDER must be an even number no smaller than 4."
+#endif
 
+/* Nodes are allocated on cache line boundaries. */
+#define BPT_ALIGN 64
+
+/* Arena-backed trees carve their nodes out of slabs of this size. */
+#define BPT_SLAB_SIZE (1 << 20)
+
+/* No tree can be taller than this. */
+#define BPT_MAX_HEIGHT 64
+
+/*
+ * Build with BPT_STATS set to count splits, merges, rotations and root
+ * changes. The counters cost nothing when it is not.
+ */
+#ifndef BPT_STATS
+#define BPT_STATS 0
+#endif
+
+/*
+ * Build with BPT_COUNTS set to keep, in every inner node, the number of tuples
+ * below each child. Ranks, selects and range counts then take a descent or
+ * two instead of a scan, at the price of bigger nodes and an extra walk down
+ * the tree on every insert and delete.
+ */
+#ifndef BPT_COUNTS
+#define BPT_COUNTS 0
+#endif
+
+/* Batched lookups keep this many descents in flight. */
+#define BPT_LOOKUP_GROUP 32
+
+/* Concurrent trees try to free retired nodes once per this many. */
+#define BPT_EPOCH_BATCH 64
+
+/* Node flags. */
+#define BPT_ARENA 0x1
+#define BPT_SYNC 0x2
+#define BPT_SHARED 0x4		/* On a root: nodes may be shared with snapshots. */
+#define BPT_FROZEN 0x8		/* On a root: the tree is a snapshot. */
+
+/*
+ * Each node is a single contiguous block: the header, then the keys, then the
+ * pointers. With ORDER = 4 a node fits exactly in one cache line. The version
+ * word is a lock word in concurrent trees, and otherwise counts the extra
+ * references snapshots hold to the node. With BPT_COUNTS, counts[i] of an
+ * inner node is the number of tuples below pointers[i] (concurrent trees
+ * leave them alone).
+ */
 struct bptree {
-	uint64_t* keys;
-	void** pointers;
 	uint16_t is_leaf : 1;
 	uint16_t nr_keys : 15;
-} __attribute__((packed));
+	uint8_t flags;
+	uint8_t filter;		/* The number of the tree's filter, or 0. */
+	uint32_t version;
+	uint64_t keys[ORDER - 1];
+	void* pointers[ORDER];
+#if BPT_COUNTS
+	size_t counts[ORDER];
+#endif
+} __attribute__((aligned(BPT_ALIGN)));
+
+/*
+ * Obtains and releases slabs for arena-backed trees. Slabs are BPT_SLAB_SIZE
+ * bytes and must be aligned to BPT_SLAB_SIZE.
+ */
+struct bptree_allocator {
+	void* (*alloc)(void* ctx, size_t size, size_t align);
+	void (*free)(void* ctx, void* ptr, size_t size);
+	void* ctx;
+};
 
 /* Create a tree with an initial tuple. */
 struct bptree* bptree_alloc(uint64_t key, void* val);
 
+/*
+ * Create a tree with an initial tuple whose nodes come from a private arena.
+ * Slabs come from the given allocator, or the system heap if it is NULL.
+ */
+struct bptree* bptree_alloc_arena(uint64_t key, void* val,
+				  const struct bptree_allocator* allocator);
+
+/*
+ * Let the tree be used from several threads at once. Lookups, modify, insert,
+ * delete and scans may then run concurrently; iterators, bptree_search and
+ * bptree_next still need the tree to be free of writers, and the leaf which
+ * bptree_exists returns is only good as a truth value. The root node stays
+ * put from then on, so every thread can keep using the same root pointer.
+ * A filter attached to the tree is detached, and stops following it. Call
+ * this while no other thread is using the tree.
+ */
+void bptree_make_concurrent(struct bptree* root);
+
+/*
+ * Nodes unlinked from concurrent trees are freed in batches, once no reader
+ * can still be looking at them. Call this to free whatever is safe now (all
+ * of it, when no other thread is inside a tree operation). Returns the
+ * number of nodes freed.
+ */
+size_t bptree_reclaim(void);
+
+/*
+ * Take a read-only, point-in-time view of a tree in constant time, from the
+ * thread that updates it. The view shares its nodes with the tree: updates
+ * copy any shared node on their way down (and the ones beside it that they
+ * may change) before touching it. Lookups, bptree_scan() and the order
+ * statistics work on a view, and may run in other threads while the tree is
+ * updated; leaf chains belong to the tree, so iterators and bptree_next()
+ * do not. Updates copy only the shared nodes they change or rebalance
+ * with: a path for single keys, the boundary paths of a range delete, and
+ * the nodes a batch or compaction step reaches. Finger inserts into a
+ * snapshotted tree go from the root. Concurrent and arena-backed trees
+ * cannot be snapshotted, and get NULL.
+ */
+struct bptree* bptree_snapshot(struct bptree* root);
+
+/*
+ * Release a snapshot, from any thread, freeing the nodes that neither the
+ * tree nor another snapshot still uses.
+ */
+void bptree_snapshot_release(struct bptree* snap);
+
 /* Find the leaf containing a key, or return NULL. */
 struct bptree* bptree_exists(struct bptree* bpt, uint64_t key);
 
@@ -49,9 +171,181 @@ void bptree_modify(struct bptree* bpt, uint64_t key, void* val);
 /* Insert a new tuple into the tree (with a unique key). */
 void bptree_insert(struct bptree** root, uint64_t key, void* val);
 
+/* What a single-descent update did. */
+enum bptree_outcome {
+	BPTREE_INSERTED,	/* The key was new and has been added. */
+	BPTREE_UPDATED,		/* The key existed and its value was replaced. */
+	BPTREE_EXISTS,		/* The key existed and was left alone. */
+	BPTREE_MISSING,		/* The key did not exist. */
+};
+
+/*
+ * Insert a tuple, or replace the value of an existing key. If old is not
+ * NULL it receives the previous value (NULL for a new key). Returns
+ * BPTREE_INSERTED or BPTREE_UPDATED.
+ */
+enum bptree_outcome bptree_upsert(struct bptree** root, uint64_t key,
+				  void* val, void** old);
+
+/*
+ * Insert a tuple unless the key exists, in which case existing (if not
+ * NULL) receives its value. Returns BPTREE_INSERTED or BPTREE_EXISTS.
+ */
+enum bptree_outcome bptree_insert_or_get(struct bptree** root, uint64_t key,
+					 void* val, void** existing);
+
+/*
+ * Replace the value of a key with desired if it is currently expected. If
+ * actual is not NULL it receives the value found. Returns BPTREE_UPDATED on
+ * success, BPTREE_EXISTS if the value did not match, or BPTREE_MISSING.
+ */
+enum bptree_outcome bptree_cas(struct bptree* bpt, uint64_t key,
+			       void* expected, void* desired, void** actual);
+
 /* Lookup the value corresponding to a key (NULL if nonexistent). */
 void* bptree_lookup(struct bptree* bpt, uint64_t key);
 
+/*
+ * A finger remembers the last leaf an operation went through, its parent,
+ * and the range of keys which belong there. Operations on keys in that range
+ * go straight to the leaf; lookups also follow the leaf chain one step to
+ * the right, except in snapshots, whose chains belong to the tree. Anything else, or any split, merge or rebalance of the leaf or
+ * its parent since, sends the operation back to the root, which resets the
+ * finger (with BPT_COUNTS, inserts also watch every node above the leaf). A
+ * finger belongs to one tree: initialize it before its first use, and again
+ * if the tree is freed. Fingers are ignored on concurrent trees.
+ */
+struct bptree_finger {
+	struct bptree* leaf;
+	struct bptree* parent;
+	uint64_t lo;		/* Keys in [lo, hi) belong in leaf. */
+	uint64_t hi;
+	uint64_t gen;
+#if BPT_COUNTS
+	/* The path down to the leaf, whose counts inserts update. */
+	struct bptree* path[BPT_MAX_HEIGHT];
+	int slot[BPT_MAX_HEIGHT];
+	int depth;
+	uint64_t path_gen;
+#endif
+};
+
+/* Reset a finger to point nowhere, whatever fields the build gives it. */
+void bptree_finger_init(struct bptree_finger* f);
+
+/* Like bptree_insert(), starting from a finger. */
+void bptree_finger_insert(struct bptree** root, struct bptree_finger* f,
+			  uint64_t key, void* val);
+
+/* Like bptree_lookup(), starting from a finger. */
+void* bptree_finger_lookup(struct bptree* root, struct bptree_finger* f,
+			   uint64_t key);
+
+/*
+ * A blocked Bloom filter over the keys of a tree, which answers most lookups
+ * for absent keys without a descent. Each key sets a few bits in one 64-byte
+ * block. The filter is attached to its tree, so every insert, however it is
+ * made, sets the new key's bits. Deleted keys leave their bits behind, so the
+ * filter is rebuilt from the tree once too many keys have come or gone since
+ * it was sized. Up to BPT_MAX_FILTERS trees may have filters at once, and
+ * concurrent trees cannot have them: bptree_make_concurrent() detaches one.
+ */
+#define BPT_MAX_FILTERS 255
+
+struct bptree_filter {
+	uint64_t* blocks;
+	size_t nr_blocks;
+	int nr_probes;
+	double bits_per_key;
+	size_t capacity;	/* Keys the filter was sized for, ... */
+	size_t nr_keys;		/* ... keys set in it, ... */
+	size_t nr_stale;	/* ... and how many of those were deleted. */
+	int id;			/* The tree's filter number, or 0. */
+};
+
+/*
+ * Size a filter for the keys in a tree at about bits_per_key bits each, fill
+ * it, and attach it to the tree. Zero a filter before building it the first
+ * time; building it again reuses its memory where it can, and moves it if the
+ * tree is a different one. Returns 0, or -1 if the tree is concurrent or a
+ * snapshot, has another filter, or no more filters can be attached.
+ */
+int bptree_filter_build(struct bptree_filter* f, struct bptree* root,
+			double bits_per_key);
+
+/*
+ * Detach a filter from its tree and release its memory. Its number is only
+ * reused once the tree is freed or gets another filter.
+ */
+void bptree_filter_free(struct bptree_filter* f);
+
+/* Returns 0 if the key is certainly not in the tree. */
+int bptree_filter_may_contain(const struct bptree_filter* f, uint64_t key);
+
+/* Like bptree_lookup(), skipping the descent for keys the filter rules out. */
+void* bptree_filter_lookup(struct bptree* root,
+			   const struct bptree_filter* f, uint64_t key);
+
+/* Like bptree_exists(), skipping the descent for keys the filter rules out. */
+struct bptree* bptree_filter_exists(struct bptree* root,
+				    const struct bptree_filter* f,
+				    uint64_t key);
+
+/* Like bptree_delete(), skipping the descent for keys the filter rules out. */
+void* bptree_filter_delete(struct bptree** root, struct bptree_filter* f,
+			   uint64_t key);
+
+/*
+ * Build a tree bottom-up from n strictly increasing keys and their values
+ * (vals may be NULL). Nodes are packed to fill_factor of their capacity, in
+ * (0, 1]. Returns NULL if n is 0.
+ */
+struct bptree* bptree_bulk_load(const uint64_t* keys, void* const* vals,
+				size_t n, double fill_factor);
+
+/*
+ * Insert n keys, sorted in increasing order, into an existing tree (vals may
+ * be NULL). Each leaf the batch touches is visited once, taking all of its
+ * keys in a single merge. Like bptree_insert(), keys already present keep
+ * their values. Returns the number of keys added.
+ */
+size_t bptree_insert_sorted_batch(struct bptree** root, const uint64_t* keys,
+				  void* const* vals, size_t n);
+
+/*
+ * Lookup the values for n keys at once (NULL for each nonexistent key).
+ * Independent descents are interleaved to overlap their cache misses.
+ */
+void bptree_lookup_batch(struct bptree* bpt, const uint64_t* keys, size_t n,
+			 void** vals);
+
+/*
+ * A cursor over the tuples in [lo, hi), in key order.
+ */
+struct bptree_iter {
+	struct bptree* leaf;
+	int idx;
+	uint64_t hi;
+};
+
+/* Position an iterator on the first key >= lo; keys >= hi end the scan. */
+void bptree_iter_seek(struct bptree_iter* it, struct bptree* bpt,
+		      uint64_t lo, uint64_t hi);
+
+/* Fetch the next tuple, returning 0 once the range is exhausted. */
+int bptree_iter_next(struct bptree_iter* it, uint64_t* key, void** val);
+
+/*
+ * Receives a run of n consecutive tuples from one leaf. Returning nonzero
+ * stops the scan.
+ */
+typedef int (*bptree_scan_fn)(void* ctx, const uint64_t* keys,
+			      void* const* vals, int n);
+
+/* Pass every tuple in [lo, hi) to fn, returning the number visited. */
+size_t bptree_scan(struct bptree* bpt, uint64_t lo, uint64_t hi,
+		   bptree_scan_fn fn, void* ctx);
+
 /* Find the closest leaf node to a key. */
 struct bptree* bptree_search(struct bptree* bpt, uint64_t key);
 
@@ -61,9 +355,126 @@ struct bptree* bptree_next(struct bptree* bpt);
 /* Delete a tuple from the tree, returning its associated value. */
 void* bptree_delete(struct bptree** root, uint64_t key);
 
-/* Destroy the tree. */
+/*
+ * Delete every tuple in [lo, hi), passing them to fn (if not NULL) in key
+ * order; its return value is ignored. Subtrees inside the range are freed
+ * whole. Returns the number of tuples deleted.
+ */
+size_t bptree_delete_range(struct bptree** root, uint64_t lo, uint64_t hi,
+			   bptree_scan_fn fn, void* ctx);
+
+/*
+ * Order statistics. With BPT_COUNTS these take one or two descents; without
+ * it, and on concurrent trees, they scan.
+ */
+
+/* The number of keys in the tree which are smaller than key. */
+size_t bptree_rank(struct bptree* bpt, uint64_t key);
+
+/*
+ * Find the tuple with the given rank (counting from 0 in key order). Returns
+ * 0 if the tree has no more than k tuples.
+ */
+int bptree_select(struct bptree* bpt, size_t k, uint64_t* key, void** val);
+
+/* The number of keys in [lo, hi). */
+size_t bptree_count_range(struct bptree* bpt, uint64_t lo, uint64_t hi);
+
+/*
+ * Repack the tree a level at a time, from the leaves up, so that nodes hold
+ * about target_fill * (ORDER - 1) keys (never fewer than a split leaves).
+ * Emptied nodes are freed, and the tree gets shorter if the root runs out of
+ * keys. Returns the number of nodes freed.
+ */
+size_t bptree_compact(struct bptree** root, double target_fill);
+
+/*
+ * Progress through an incremental compaction. Set target_fill and zero the
+ * rest to start one.
+ */
+struct bptree_compaction {
+	double target_fill;
+	int level;		/* Height of the nodes being repacked. */
+	uint64_t next;		/* Where the next slice picks up. */
+	int done;
+	size_t freed;
+};
+
+/*
+ * Run a slice of a compaction which visits roughly budget nodes, so that the
+ * rest of the program can use the tree in between. Concurrent trees stay
+ * usable during a slice, except for the nodes it has locked. Returns nonzero
+ * while there is work left.
+ */
+int bptree_compact_step(struct bptree** root, struct bptree_compaction* c,
+			size_t budget);
+
+/* Snapshots hold keys in blocks of this many, each with its own checksum. */
+#define BPT_SNAPSHOT_BLOCK 1024
+
+/*
+ * Turns values into value_size bytes for a snapshot, and back again. Loads
+ * may decode on several threads at once. Without a codec, the bits of each
+ * value pointer are saved as they are.
+ */
+struct bptree_codec {
+	size_t value_size;
+	void (*encode)(void* ctx, void* val, void* out);
+	void* (*decode)(void* ctx, const void* in);
+	void* ctx;
+};
+
+/*
+ * Write a snapshot of a tree that no other thread is modifying to fd, in
+ * key order. A view from bptree_snapshot() may be saved from any thread
+ * while its tree is updated. Returns 0, or -1 with errno set if a write
+ * failed.
+ */
+int bptree_save(struct bptree* root, int fd, const struct bptree_codec* codec);
+
+/*
+ * Read a snapshot from fd and build a tree from it bottom-up, with full
+ * nodes. The codec must have the value size the snapshot was saved with.
+ * Returns NULL with errno set if the read failed, or to EINVAL if the
+ * snapshot is damaged or from an unknown version.
+ */
+struct bptree* bptree_load(int fd, const struct bptree_codec* codec);
+
+/*
+ * The CRC32C which snapshots are checked with. Start from 0, and pass the
+ * result back in to continue over more data.
+ */
+uint32_t bptree_crc32c(uint32_t crc, const void* buf, size_t n);
+
+/*
+ * The shape of a tree, and the structural changes made so far. The event
+ * counters are shared by every tree in the process, and stay zero unless
+ * the library was built with BPT_STATS.
+ */
+struct bptree_stats {
+	int height;
+	size_t level_nodes[BPT_MAX_HEIGHT];	/* From the root down. */
+	size_t nr_nodes;
+	size_t nr_leaves;
+	size_t nr_keys;
+	double avg_fill;	/* Keys per node over capacity, ... */
+	double min_fill;	/* ... and the emptiest node below the root. */
+	size_t bytes;		/* Nodes, or whole slabs for arena trees. */
+	uint64_t splits;
+	uint64_t merges;
+	uint64_t rotations;
+	uint64_t root_changes;
+};
+
+/* Gather statistics about a tree that no other thread is modifying. */
+void bptree_stats(struct bptree* bpt, struct bptree_stats* st);
+
+/*
+ * Destroy the tree (arena-backed trees release whole slabs at once). Nodes
+ * still used by snapshots are left to them.
+ */
 void bptree_free(struct bptree* bpt);
 
-#ifdef __cplusplus__
+#ifdef __cplusplus
 } /* extern "C" */
 #endif
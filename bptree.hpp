@@ -0,0 +1,699 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "bptree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace bpt {
+
+/*
+ * Halve an index with adjustment for odd numbers.
+ */
+constexpr int split(int x)
+{
+	return (x >> 1) + (x & 1);
+}
+
+constexpr std::size_t max_size(std::size_t a, std::size_t b)
+{
+	return a > b ? a : b;
+}
+
+constexpr std::size_t round_up(std::size_t x, std::size_t align)
+{
+	return (x + align - 1) / align * align;
+}
+
+/*
+ * The number of bytes taken up by a node with the given fanout (see
+ * bptree::node for the layout this mirrors).
+ */
+template <typename Key, typename Value>
+constexpr std::size_t node_bytes(int order)
+{
+	return round_up(round_up(max_size(alignof(Key), 2) +
+				 (order - 1) * sizeof(Key),
+				 max_size(alignof(void*), alignof(Value))) +
+			max_size(order * sizeof(void*),
+				 round_up(sizeof(void*), alignof(Value)) +
+				 (order - 1) * sizeof(Value)),
+			BPT_ALIGN);
+}
+
+template <typename Key, typename Value>
+constexpr int fit_fanout(int order, std::size_t bytes)
+{
+	return node_bytes<Key, Value>(order + 2) <= bytes ?
+		fit_fanout<Key, Value>(order + 2, bytes) : order;
+}
+
+/*
+ * The largest usable fanout whose nodes fit in the given number of bytes.
+ */
+template <typename Key, typename Value, std::size_t Bytes>
+struct fanout {
+	static constexpr int value = fit_fanout<Key, Value>(4, Bytes);
+};
+
+template <typename Key, typename Value>
+using cache_line_fanout = fanout<Key, Value, BPT_ALIGN>;
+
+template <typename Key, typename Value>
+using page_fanout = fanout<Key, Value, 4096>;
+
+/*
+ * A B+ tree with compile-time key/value types and fanout.
+ *
+ * This uses the same one-pass algorithms as the C core: inserts split full
+ * nodes on the way down and deletes top up minimal nodes on the way down, so
+ * no operation ever has to walk back up the tree. Keys and values are moved
+ * around with memmove, so they must be trivially copyable.
+ */
+template <typename Key, typename Value, int Order,
+	  typename Compare = std::less<Key> >
+class bptree {
+public:
+	static constexpr int order = Order;
+	static constexpr int max_keys = Order - 1;
+	static constexpr int min_keys = split(Order) - 1;
+
+	static_assert(Order >= 4 && Order % 2 == 0,
+		      "One-pass splits need an odd number of keys per node.");
+	static_assert(std::is_trivially_copyable<Key>::value &&
+		      std::is_trivially_copyable<Value>::value,
+		      "Keys and values are moved with memmove.");
+
+private:
+	/*
+	 * Leaves hold a successor link followed by one value per key. Inner
+	 * nodes hold nr_keys + 1 children; keys[i] is the smallest key in the
+	 * subtree at children[i + 1].
+	 */
+	struct node;
+
+	struct leaf_slots {
+		node* next;
+		Value vals[max_keys];
+	};
+
+	struct alignas(BPT_ALIGN) node {
+		uint16_t is_leaf : 1;
+		uint16_t nr_keys : 15;
+		Key keys[max_keys];
+		union {
+			node* children[Order];
+			leaf_slots leaf;
+		};
+	};
+
+public:
+	static constexpr std::size_t node_size = sizeof(node);
+
+	explicit bptree(const Compare& comp = Compare())
+		: root_(nullptr), size_(0), comp_(comp)
+	{
+	}
+
+	bptree(bptree&& other)
+		: root_(other.root_), size_(other.size_), comp_(other.comp_)
+	{
+		other.root_ = nullptr;
+		other.size_ = 0;
+	}
+
+	bptree& operator=(bptree&& other)
+	{
+		std::swap(root_, other.root_);
+		std::swap(size_, other.size_);
+		std::swap(comp_, other.comp_);
+		return *this;
+	}
+
+	bptree(const bptree&) = delete;
+	bptree& operator=(const bptree&) = delete;
+
+	~bptree()
+	{
+		clear();
+	}
+
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	/*
+	 * The number of levels in the tree (0 if it is empty).
+	 */
+	int height() const
+	{
+		int h = 0;
+		for (const node* n = root_; n; ++h) {
+			n = n->is_leaf ? nullptr : n->children[0];
+		}
+		return h;
+	}
+
+	/*
+	 * Lookup the value for a key (nullptr if nonexistent).
+	 */
+	Value* lookup(const Key& key)
+	{
+		if (!root_) {
+			return nullptr;
+		}
+		node* n = search(key);
+		int i = rank(n, key);
+		return i > 0 && equal(n->keys[i - 1], key) ?
+			&n->leaf.vals[i - 1] : nullptr;
+	}
+
+	const Value* lookup(const Key& key) const
+	{
+		return const_cast<bptree*>(this)->lookup(key);
+	}
+
+	bool exists(const Key& key) const
+	{
+		return lookup(key) != nullptr;
+	}
+
+	/*
+	 * Update the value of an existing key.
+	 */
+	bool modify(const Key& key, const Value& val)
+	{
+		Value* slot = lookup(key);
+		if (slot) {
+			*slot = val;
+		}
+		return slot != nullptr;
+	}
+
+	/*
+	 * Insert a new tuple, returning false if the key is already present.
+	 */
+	bool insert(const Key& key, const Value& val)
+	{
+		if (!root_) {
+			root_ = alloc(true);
+			root_->nr_keys = 1;
+			root_->keys[0] = key;
+			root_->leaf.vals[0] = val;
+			size_ = 1;
+			return true;
+		}
+
+		if (root_->nr_keys == max_keys) {
+			node* new_root = alloc(false);
+			new_root->children[0] = root_;
+			split_child(new_root, 0);
+			root_ = new_root;
+		}
+
+		node* n = root_;
+		while (!n->is_leaf) {
+			int i = rank(n, key);
+			if (n->children[i]->nr_keys == max_keys) {
+				split_child(n, i);
+				i += !comp_(key, n->keys[i]);
+			}
+			n = n->children[i];
+		}
+
+		int i = rank(n, key);
+		if (i > 0 && equal(n->keys[i - 1], key)) {
+			return false;
+		}
+		shift_right(n->keys, i, n->nr_keys);
+		shift_right(n->leaf.vals, i, n->nr_keys);
+		n->keys[i] = key;
+		n->leaf.vals[i] = val;
+		++n->nr_keys;
+		++size_;
+		return true;
+	}
+
+	/*
+	 * Remove a key, optionally handing back its value. Returns false if the
+	 * key was not present.
+	 */
+	bool erase(const Key& key, Value* val = nullptr)
+	{
+		if (!root_) {
+			return false;
+		}
+
+		node* n = root_;
+		while (!n->is_leaf) {
+			int i = rank(n, key);
+			if (n->children[i]->nr_keys == min_keys) {
+				i = fill_child(n, i);
+			}
+			node* child = n->children[i];
+			if (n == root_ && n->nr_keys == 0) {
+				free_node(n);
+				root_ = child;
+			}
+			n = child;
+		}
+
+		int i = rank(n, key);
+		if (i == 0 || !equal(n->keys[i - 1], key)) {
+			return false;
+		}
+		if (val) {
+			*val = n->leaf.vals[i - 1];
+		}
+		shift_left(n->keys, i - 1, n->nr_keys);
+		shift_left(n->leaf.vals, i - 1, n->nr_keys);
+		--n->nr_keys;
+		--size_;
+
+		if (n == root_ && n->nr_keys == 0) {
+			free_node(n);
+			root_ = nullptr;
+		}
+		return true;
+	}
+
+	/*
+	 * Visit every tuple in key order.
+	 */
+	template <typename F>
+	void for_each(F f) const
+	{
+		const node* n = root_;
+		while (n && !n->is_leaf) {
+			n = n->children[0];
+		}
+		for (; n; n = n->leaf.next) {
+			for (int i = 0; i < n->nr_keys; ++i) {
+				f(n->keys[i], n->leaf.vals[i]);
+			}
+		}
+	}
+
+	/*
+	 * Destroy every node in the tree.
+	 */
+	void clear()
+	{
+		if (root_) {
+			free_subtree(root_);
+		}
+		root_ = nullptr;
+		size_ = 0;
+	}
+
+private:
+	node* root_;
+	std::size_t size_;
+	Compare comp_;
+
+	static node* alloc(bool is_leaf)
+	{
+		void* mem;
+		if (posix_memalign(&mem, BPT_ALIGN, sizeof(node))) {
+			throw std::bad_alloc();
+		}
+		node* n = static_cast<node*>(mem);
+		memset(mem, 0, sizeof(node));
+		n->is_leaf = is_leaf;
+		return n;
+	}
+
+	static void free_node(node* n)
+	{
+		free(n);
+	}
+
+	static void free_subtree(node* n)
+	{
+		if (!n->is_leaf) {
+			for (int i = 0; i <= n->nr_keys; ++i) {
+				free_subtree(n->children[i]);
+			}
+		}
+		free_node(n);
+	}
+
+	bool equal(const Key& a, const Key& b) const
+	{
+		return !comp_(a, b) && !comp_(b, a);
+	}
+
+	/*
+	 * Count the keys in a node which are <= key. In an inner node this is
+	 * the index of the child to descend into. Small nodes use a fixed-length
+	 * branchless scan which the compiler can fully unroll.
+	 */
+	int rank(const node* n, const Key& key) const
+	{
+		if (max_keys <= 16) {
+			int r = 0;
+			for (int i = 0; i < max_keys; ++i) {
+				r += (i < n->nr_keys) & !comp_(key, n->keys[i]);
+			}
+			return r;
+		}
+
+		int low = 0;
+		int high = n->nr_keys;
+		while (low < high) {
+			int mid = low + ((high - low) >> 1);
+			if (comp_(key, n->keys[mid])) {
+				high = mid;
+			} else {
+				low = mid + 1;
+			}
+		}
+		return low;
+	}
+
+	node* search(const Key& key) const
+	{
+		node* n = root_;
+		while (!n->is_leaf) {
+			n = n->children[rank(n, key)];
+		}
+		return n;
+	}
+
+	/*
+	 * Open a gap at index i in an array holding len items.
+	 */
+	template <typename T>
+	static void shift_right(T* arr, int i, int len)
+	{
+		memmove(arr + i + 1, arr + i, sizeof(T) * (len - i));
+	}
+
+	/*
+	 * Close the gap at index i in an array holding len items.
+	 */
+	template <typename T>
+	static void shift_left(T* arr, int i, int len)
+	{
+		memmove(arr + i, arr + i + 1, sizeof(T) * (len - i - 1));
+	}
+
+	/*
+	 * Split a full child into two nodes. Leaves copy their median up into
+	 * the parent, inner nodes move it up.
+	 */
+	void split_child(node* parent, int pidx)
+	{
+		node* pred = parent->children[pidx];
+		node* succ = alloc(pred->is_leaf);
+		Key sep;
+
+		if (pred->is_leaf) {
+			succ->nr_keys = split(max_keys);
+			pred->nr_keys = max_keys - succ->nr_keys;
+			memcpy(succ->keys, pred->keys + pred->nr_keys,
+			       sizeof(Key) * succ->nr_keys);
+			memcpy(succ->leaf.vals, pred->leaf.vals + pred->nr_keys,
+			       sizeof(Value) * succ->nr_keys);
+			succ->leaf.next = pred->leaf.next;
+			pred->leaf.next = succ;
+			sep = succ->keys[0];
+		} else {
+			pred->nr_keys = max_keys / 2;
+			succ->nr_keys = max_keys - pred->nr_keys - 1;
+			sep = pred->keys[pred->nr_keys];
+			memcpy(succ->keys, pred->keys + pred->nr_keys + 1,
+			       sizeof(Key) * succ->nr_keys);
+			memcpy(succ->children,
+			       pred->children + pred->nr_keys + 1,
+			       sizeof(node*) * (succ->nr_keys + 1));
+		}
+
+		shift_right(parent->keys, pidx, parent->nr_keys);
+		shift_right(parent->children, pidx + 1, parent->nr_keys + 1);
+		parent->keys[pidx] = sep;
+		parent->children[pidx + 1] = succ;
+		++parent->nr_keys;
+	}
+
+	/*
+	 * Move the last entry of children[pidx - 1] into children[pidx].
+	 */
+	void borrow_left(node* parent, int pidx)
+	{
+		node* pred = parent->children[pidx - 1];
+		node* curr = parent->children[pidx];
+		int last = pred->nr_keys - 1;
+
+		shift_right(curr->keys, 0, curr->nr_keys);
+		if (curr->is_leaf) {
+			shift_right(curr->leaf.vals, 0, curr->nr_keys);
+			curr->keys[0] = pred->keys[last];
+			curr->leaf.vals[0] = pred->leaf.vals[last];
+			parent->keys[pidx - 1] = curr->keys[0];
+		} else {
+			shift_right(curr->children, 0, curr->nr_keys + 1);
+			curr->keys[0] = parent->keys[pidx - 1];
+			curr->children[0] = pred->children[last + 1];
+			parent->keys[pidx - 1] = pred->keys[last];
+		}
+		--pred->nr_keys;
+		++curr->nr_keys;
+	}
+
+	/*
+	 * Move the first entry of children[pidx + 1] into children[pidx].
+	 */
+	void borrow_right(node* parent, int pidx)
+	{
+		node* curr = parent->children[pidx];
+		node* succ = parent->children[pidx + 1];
+		int end = curr->nr_keys;
+
+		if (curr->is_leaf) {
+			curr->keys[end] = succ->keys[0];
+			curr->leaf.vals[end] = succ->leaf.vals[0];
+			shift_left(succ->keys, 0, succ->nr_keys);
+			shift_left(succ->leaf.vals, 0, succ->nr_keys);
+			parent->keys[pidx] = succ->keys[0];
+		} else {
+			curr->keys[end] = parent->keys[pidx];
+			curr->children[end + 1] = succ->children[0];
+			parent->keys[pidx] = succ->keys[0];
+			shift_left(succ->keys, 0, succ->nr_keys);
+			shift_left(succ->children, 0, succ->nr_keys + 1);
+		}
+		--succ->nr_keys;
+		++curr->nr_keys;
+	}
+
+	/*
+	 * Merge children[pidx + 1] into children[pidx].
+	 */
+	void merge(node* parent, int pidx)
+	{
+		node* pred = parent->children[pidx];
+		node* succ = parent->children[pidx + 1];
+		int end = pred->nr_keys;
+
+		if (pred->is_leaf) {
+			memcpy(pred->keys + end, succ->keys,
+			       sizeof(Key) * succ->nr_keys);
+			memcpy(pred->leaf.vals + end, succ->leaf.vals,
+			       sizeof(Value) * succ->nr_keys);
+			pred->leaf.next = succ->leaf.next;
+			pred->nr_keys = end + succ->nr_keys;
+		} else {
+			pred->keys[end] = parent->keys[pidx];
+			memcpy(pred->keys + end + 1, succ->keys,
+			       sizeof(Key) * succ->nr_keys);
+			memcpy(pred->children + end + 1, succ->children,
+			       sizeof(node*) * (succ->nr_keys + 1));
+			pred->nr_keys = end + 1 + succ->nr_keys;
+		}
+		assert(pred->nr_keys <= max_keys);
+
+		shift_left(parent->keys, pidx, parent->nr_keys);
+		shift_left(parent->children, pidx + 1, parent->nr_keys + 1);
+		--parent->nr_keys;
+		free_node(succ);
+	}
+
+	/*
+	 * Make sure children[pidx] can lose a key, either by borrowing from a
+	 * sibling or by merging with one. Returns the child's new index.
+	 */
+	int fill_child(node* parent, int pidx)
+	{
+		if (pidx > 0 &&
+		    parent->children[pidx - 1]->nr_keys > min_keys) {
+			borrow_left(parent, pidx);
+		} else if (pidx < parent->nr_keys &&
+			   parent->children[pidx + 1]->nr_keys > min_keys) {
+			borrow_right(parent, pidx);
+		} else if (pidx > 0) {
+			merge(parent, --pidx);
+		} else {
+			merge(parent, pidx);
+		}
+		return pidx;
+	}
+};
+
+template <typename Key, typename Value, int Order, typename Compare>
+constexpr int bptree<Key, Value, Order, Compare>::order;
+template <typename Key, typename Value, int Order, typename Compare>
+constexpr int bptree<Key, Value, Order, Compare>::max_keys;
+template <typename Key, typename Value, int Order, typename Compare>
+constexpr int bptree<Key, Value, Order, Compare>::min_keys;
+template <typename Key, typename Value, int Order, typename Compare>
+constexpr std::size_t bptree<Key, Value, Order, Compare>::node_size;
+
+/*
+ * The C API is the (uint64_t, void*, ORDER) instantiation: this forwards to
+ * the routines in bptree.c so that both front-ends share one tree.
+ */
+template <>
+class bptree<uint64_t, void*, ORDER, std::less<uint64_t> > {
+public:
+	static constexpr int order = ORDER;
+	static constexpr int max_keys = ORDER - 1;
+	static constexpr int min_keys = split(ORDER) - 1;
+	static constexpr std::size_t node_size = sizeof(struct ::bptree);
+
+	bptree() : root_(nullptr), size_(0) {}
+
+	bptree(const bptree&) = delete;
+	bptree& operator=(const bptree&) = delete;
+
+	~bptree()
+	{
+		clear();
+	}
+
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	/*
+	 * The underlying C tree (NULL if it is empty).
+	 */
+	struct ::bptree* root() const { return root_; }
+
+	void** lookup(uint64_t key) const
+	{
+		struct ::bptree* leaf = root_ ? bptree_exists(root_, key) : NULL;
+		if (leaf) {
+			for (int i = 0; i < leaf->nr_keys; ++i) {
+				if (leaf->keys[i] == key) {
+					return &leaf->pointers[i + 1];
+				}
+			}
+		}
+		return nullptr;
+	}
+
+	bool exists(uint64_t key) const
+	{
+		return lookup(key) != nullptr;
+	}
+
+	bool modify(uint64_t key, void* val)
+	{
+		void** slot = lookup(key);
+		if (slot) {
+			*slot = val;
+		}
+		return slot != nullptr;
+	}
+
+	bool insert(uint64_t key, void* val)
+	{
+		if (!root_) {
+			root_ = bptree_alloc(key, val);
+		} else if (bptree_insert_or_get(&root_, key, val, NULL) !=
+			   BPTREE_INSERTED) {
+			return false;
+		}
+		++size_;
+		return true;
+	}
+
+	bool erase(uint64_t key, void** val = nullptr)
+	{
+		void** slot = lookup(key);
+		if (!slot) {
+			return false;
+		}
+		if (val) {
+			*val = *slot;
+		}
+		if (size_ == 1) {
+			bptree_free(root_);
+			root_ = nullptr;
+		} else {
+			bptree_delete(&root_, key);
+		}
+		--size_;
+		return true;
+	}
+
+	template <typename F>
+	void for_each(F f) const
+	{
+		struct ::bptree* leaf = root_ ? bptree_search(root_, 0) : NULL;
+		for (; leaf; leaf = bptree_next(leaf)) {
+			for (int i = 0; i < leaf->nr_keys; ++i) {
+				f(leaf->keys[i], leaf->pointers[i + 1]);
+			}
+		}
+	}
+
+	void clear()
+	{
+		if (root_) {
+			bptree_free(root_);
+		}
+		root_ = nullptr;
+		size_ = 0;
+	}
+
+private:
+	struct ::bptree* root_;
+	std::size_t size_;
+};
+
+constexpr int bptree<uint64_t, void*, ORDER, std::less<uint64_t> >::order;
+constexpr int bptree<uint64_t, void*, ORDER, std::less<uint64_t> >::max_keys;
+constexpr int bptree<uint64_t, void*, ORDER, std::less<uint64_t> >::min_keys;
+constexpr std::size_t
+bptree<uint64_t, void*, ORDER, std::less<uint64_t> >::node_size;
+
+} /* namespace bpt */
@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * In-node key search kernels.
+ *
+ * Every kernel returns the number of keys in a sorted array which are <= the
+ * probe key. In an inner node that is the index of the child to descend into;
+ * in a leaf, the probe is present iff the key just before that index matches.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BPT_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define BPT_HAVE_X86_SIMD 0
+#endif
+
+/*
+ * Hybrid searches bisect down to a window of this many keys, then scan. Wider
+ * vectors make longer scans pay off.
+ */
+#define BPT_SCAN_WINDOW 16
+#define BPT_SCAN_WINDOW_AVX2 32
+#define BPT_SCAN_WINDOW_AVX512 64
+
+typedef int (*bpt_rank_fn)(const uint64_t* keys, int n, uint64_t key);
+
+/*
+ * Plain binary search.
+ */
+static inline int bpt_rank_bisect(const uint64_t* keys, int n, uint64_t key)
+{
+	int low = 0;
+	int high = n;
+	while (low < high) {
+		int mid = low + ((high - low) >> 1);
+		if (key < keys[mid]) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low;
+}
+
+/*
+ * Branch-free linear scan.
+ */
+static inline int bpt_scan_scalar(const uint64_t* keys, int n, uint64_t key)
+{
+	int r = 0;
+	for (int i = 0; i < n; ++i) {
+		r += keys[i] <= key;
+	}
+	return r;
+}
+
+static inline int bpt_rank_scalar(const uint64_t* keys, int n, uint64_t key)
+{
+	int low = 0;
+	int high = n;
+	while (high - low > BPT_SCAN_WINDOW) {
+		int mid = low + ((high - low) >> 1);
+		if (key < keys[mid]) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low + bpt_scan_scalar(keys + low, high - low, key);
+}
+
+#if BPT_HAVE_X86_SIMD
+
+/*
+ * Compare four keys at a time. AVX2 only has signed 64-bit compares, so both
+ * sides are biased by 2^63 first.
+ */
+__attribute__((target("avx2,popcnt")))
+static inline int bpt_scan_avx2(const uint64_t* keys, int n, uint64_t key)
+{
+	const __m256i bias = _mm256_set1_epi64x((long long) (1ULL << 63));
+	const __m256i probe = _mm256_xor_si256(
+		_mm256_set1_epi64x((long long) key), bias);
+	int i = 0;
+	int r = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i k = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i*) (keys + i)), bias);
+		int gt = _mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpgt_epi64(k, probe)));
+		r += 4 - __builtin_popcount(gt);
+	}
+	for (; i < n; ++i) {
+		r += keys[i] <= key;
+	}
+	return r;
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline int bpt_rank_avx2(const uint64_t* keys, int n, uint64_t key)
+{
+	int low = 0;
+	int high = n;
+	while (high - low > BPT_SCAN_WINDOW_AVX2) {
+		int mid = low + ((high - low) >> 1);
+		if (key < keys[mid]) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low + bpt_scan_avx2(keys + low, high - low, key);
+}
+
+/*
+ * Compare eight keys at a time, using a masked load for the tail.
+ */
+__attribute__((target("avx512f,popcnt")))
+static inline int bpt_scan_avx512(const uint64_t* keys, int n, uint64_t key)
+{
+	const __m512i probe = _mm512_set1_epi64((long long) key);
+	int i = 0;
+	int r = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m512i k = _mm512_loadu_si512((const void*) (keys + i));
+		r += __builtin_popcount(_mm512_cmple_epu64_mask(k, probe));
+	}
+	if (i < n) {
+		__mmask8 live = (__mmask8) ((1u << (n - i)) - 1);
+		__m512i k = _mm512_maskz_loadu_epi64(live, keys + i);
+		r += __builtin_popcount(
+			_mm512_mask_cmple_epu64_mask(live, k, probe));
+	}
+	return r;
+}
+
+__attribute__((target("avx512f,popcnt")))
+static inline int bpt_rank_avx512(const uint64_t* keys, int n, uint64_t key)
+{
+	int low = 0;
+	int high = n;
+	while (high - low > BPT_SCAN_WINDOW_AVX512) {
+		int mid = low + ((high - low) >> 1);
+		if (key < keys[mid]) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return low + bpt_scan_avx512(keys + low, high - low, key);
+}
+
+#endif /* BPT_HAVE_X86_SIMD */
+
+/*
+ * Pick the best hybrid search kernel the running CPU supports.
+ */
+static inline bpt_rank_fn bpt_rank_select(void)
+{
+#if BPT_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) {
+		return bpt_rank_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return bpt_rank_avx2;
+	}
+#endif
+	return bpt_rank_scalar;
+}
+
+/*
+ * Kernels for packed leaves, whose keys are stored as 1-, 2- or 4-byte
+ * deltas from a base. They count the deltas <= the probe delta, which must
+ * fit in the same width.
+ */
+typedef int (*bpt_scan_narrow_fn)(const void* deltas, int n, uint32_t delta);
+
+static inline int bpt_scan_u8(const void* deltas, int n, uint32_t delta)
+{
+	const uint8_t* d = (const uint8_t*) deltas;
+	int r = 0;
+	for (int i = 0; i < n; ++i) {
+		r += d[i] <= delta;
+	}
+	return r;
+}
+
+static inline int bpt_scan_u16(const void* deltas, int n, uint32_t delta)
+{
+	const uint16_t* d = (const uint16_t*) deltas;
+	int r = 0;
+	for (int i = 0; i < n; ++i) {
+		r += d[i] <= delta;
+	}
+	return r;
+}
+
+static inline int bpt_scan_u32(const void* deltas, int n, uint32_t delta)
+{
+	const uint32_t* d = (const uint32_t*) deltas;
+	int r = 0;
+	for (int i = 0; i < n; ++i) {
+		r += d[i] <= delta;
+	}
+	return r;
+}
+
+#if BPT_HAVE_X86_SIMD
+
+/*
+ * AVX2 has unsigned min and max but only signed compares, so a lane is <= the
+ * probe when taking the max with the probe leaves the probe. The tails are
+ * done one at a time.
+ */
+__attribute__((target("avx2,popcnt")))
+static inline int bpt_scan_u8_avx2(const void* deltas, int n, uint32_t delta)
+{
+	const uint8_t* d = (const uint8_t*) deltas;
+	const __m256i probe = _mm256_set1_epi8((char) delta);
+	int i = 0;
+	int r = 0;
+	for (; i + 32 <= n; i += 32) {
+		__m256i k = _mm256_loadu_si256((const __m256i*) (d + i));
+		__m256i le = _mm256_cmpeq_epi8(_mm256_max_epu8(k, probe), probe);
+		r += __builtin_popcount((uint32_t) _mm256_movemask_epi8(le));
+	}
+	return r + bpt_scan_u8(d + i, n - i, delta);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline int bpt_scan_u16_avx2(const void* deltas, int n, uint32_t delta)
+{
+	const uint16_t* d = (const uint16_t*) deltas;
+	const __m256i probe = _mm256_set1_epi16((short) delta);
+	int i = 0;
+	int r = 0;
+	for (; i + 16 <= n; i += 16) {
+		__m256i k = _mm256_loadu_si256((const __m256i*) (d + i));
+		__m256i le = _mm256_cmpeq_epi16(_mm256_max_epu16(k, probe),
+						probe);
+		r += __builtin_popcount((uint32_t) _mm256_movemask_epi8(le)) / 2;
+	}
+	return r + bpt_scan_u16(d + i, n - i, delta);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline int bpt_scan_u32_avx2(const void* deltas, int n, uint32_t delta)
+{
+	const uint32_t* d = (const uint32_t*) deltas;
+	const __m256i probe = _mm256_set1_epi32((int) delta);
+	int i = 0;
+	int r = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i k = _mm256_loadu_si256((const __m256i*) (d + i));
+		__m256i le = _mm256_cmpeq_epi32(_mm256_max_epu32(k, probe),
+						probe);
+		r += __builtin_popcount(_mm256_movemask_ps(
+			_mm256_castsi256_ps(le)));
+	}
+	return r + bpt_scan_u32(d + i, n - i, delta);
+}
+
+#endif /* BPT_HAVE_X86_SIMD */
+
+/*
+ * Pick the best kernel for deltas of the given width (1, 2 or 4 bytes).
+ */
+static inline bpt_scan_narrow_fn bpt_scan_narrow_select(int width)
+{
+#if BPT_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return width == 1 ? bpt_scan_u8_avx2 :
+			width == 2 ? bpt_scan_u16_avx2 : bpt_scan_u32_avx2;
+	}
+#endif
+	return width == 1 ? bpt_scan_u8 : width == 2 ? bpt_scan_u16 :
+		bpt_scan_u32;
+}
@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "bptwal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BPT_WAL_MAGIC 0x31304c4157545042ULL	/* "BPTWAL01" */
+#define BPT_WAL_VERSION 1
+
+/* Logs are read back this many bytes at a time. */
+#define BPT_WAL_READ (1 << 20)
+
+/*
+ * A log is this header, then records: a CRC32C of the rest of the record,
+ * an operation, a key, and for puts the encoded value.
+ */
+struct bpt_wal_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t value_size;
+};
+
+enum {
+	BPT_WAL_PUT = 1,
+	BPT_WAL_DEL = 2,
+};
+
+#define BPT_WAL_RECORD_HEAD 13
+
+/* Records waiting to be written. */
+struct bpt_wal_buf {
+	unsigned char* data;
+	size_t used;
+	size_t cap;
+};
+
+struct bptree_wal {
+	struct bptree* root;		/* NULL while the tree is empty. */
+	pthread_rwlock_t tree_lock;
+	pthread_mutex_t checkpoint_lock;
+
+	struct bptree_codec codec;
+	const struct bptree_codec* codec_ptr;	/* NULL, or &codec. */
+	size_t value_size;
+	enum bptree_durability durability;
+	char* path;
+	char* log_path;
+	char* tmp_path;
+	int log_fd;
+
+	/*
+	 * Records are appended to cur. A sync swaps it with spare, so that new
+	 * records can be appended while the old ones are written out.
+	 */
+	pthread_mutex_t lock;
+	pthread_cond_t synced;
+	pthread_cond_t wake;
+	struct bpt_wal_buf cur;
+	struct bpt_wal_buf spare;
+	uint64_t appended;		/* Records appended so far, ... */
+	uint64_t durable;		/* ... and how many are synced. */
+	int syncing;
+	int closing;
+	pthread_t flusher;
+	struct bptree_wal_stats stats;
+};
+
+static int bpt_wal_write(int fd, const unsigned char* buf, size_t len)
+{
+	while (len) {
+		ssize_t done = write(fd, buf, len);
+		if (done < 0 && errno == EINTR) {
+			continue;
+		}
+		if (done <= 0) {
+			return -1;
+		}
+		buf += done;
+		len -= done;
+	}
+	return 0;
+}
+
+/* Sync the directory holding path, so that renames and creations stick. */
+static int bpt_wal_sync_dir(const char* path)
+{
+	const char* slash = strrchr(path, '/');
+	char* dir = slash ? strndup(path, slash == path ? 1 : slash - path) :
+		strdup(".");
+	if (!dir) {
+		abort();
+	}
+	int fd = open(dir, O_RDONLY);
+	free(dir);
+	if (fd < 0) {
+		return -1;
+	}
+	int ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+/*
+ * Wait until the first lsn records are synced, with w->lock held. If no sync
+ * is running, this thread runs one for every record appended so far, and
+ * later arrivals wait for it and then start the next.
+ */
+static void bpt_wal_wait(struct bptree_wal* w, uint64_t lsn)
+{
+	while (w->durable < lsn) {
+		if (w->syncing) {
+			pthread_cond_wait(&w->synced, &w->lock);
+			continue;
+		}
+		struct bpt_wal_buf out = w->cur;
+		uint64_t upto = w->appended;
+		w->cur = w->spare;
+		w->syncing = 1;
+		pthread_mutex_unlock(&w->lock);
+
+		if (bpt_wal_write(w->log_fd, out.data, out.used) ||
+		    fdatasync(w->log_fd)) {
+			abort();
+		}
+
+		pthread_mutex_lock(&w->lock);
+		w->stats.bytes += out.used;
+		++w->stats.syncs;
+		out.used = 0;
+		w->spare = out;
+		w->durable = upto;
+		w->syncing = 0;
+		pthread_cond_broadcast(&w->synced);
+	}
+}
+
+/* Append a record, with the tree locked for writing. Returns its lsn. */
+static uint64_t bpt_wal_log(struct bptree_wal* w, int op, uint64_t key,
+			    void* val)
+{
+	size_t len = BPT_WAL_RECORD_HEAD + (op == BPT_WAL_PUT ? w->value_size : 0);
+	uint8_t code = op;
+	pthread_mutex_lock(&w->lock);
+	if (w->cur.used + len > w->cur.cap) {
+		w->cur.cap = 2 * (w->cur.used + len);
+		w->cur.data = realloc(w->cur.data, w->cur.cap);
+		if (!w->cur.data) {
+			abort();
+		}
+	}
+	unsigned char* rec = w->cur.data + w->cur.used;
+	memcpy(rec + 4, &code, 1);
+	memcpy(rec + 5, &key, sizeof(key));
+	if (op == BPT_WAL_PUT) {
+		if (w->codec_ptr) {
+			w->codec.encode(w->codec.ctx, val, rec + 13);
+		} else {
+			memcpy(rec + 13, &val, sizeof(val));
+		}
+	}
+	uint32_t crc = bptree_crc32c(0, rec + 4, len - 4);
+	memcpy(rec, &crc, sizeof(crc));
+	w->cur.used += len;
+	++w->stats.records;
+	uint64_t lsn = ++w->appended;
+	if (w->durability == BPT_DURABLE_OP) {
+		bpt_wal_wait(w, lsn);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return lsn;
+}
+
+/* Once the tree is unlocked, wait for a record as the durability asks. */
+static void bpt_wal_commit(struct bptree_wal* w, uint64_t lsn)
+{
+	if (!lsn || w->durability == BPT_DURABLE_OP) {
+		return;
+	}
+	pthread_mutex_lock(&w->lock);
+	if (w->durability == BPT_DURABLE_GROUP ||
+	    w->cur.used > BPT_WAL_PENDING_MAX) {
+		bpt_wal_wait(w, lsn);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void* bpt_wal_flusher(void* arg)
+{
+	struct bptree_wal* w = arg;
+	pthread_mutex_lock(&w->lock);
+	while (!w->closing) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += BPT_WAL_ASYNC_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_nsec -= 1000000000L;
+			++ts.tv_sec;
+		}
+		pthread_cond_timedwait(&w->wake, &w->lock, &ts);
+		bpt_wal_wait(w, w->appended);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+static void bpt_wal_put(struct bptree_wal* w, uint64_t key, void* val)
+{
+	if (!w->root) {
+		w->root = bptree_alloc(key, val);
+	} else {
+		bptree_upsert(&w->root, key, val, NULL);
+	}
+}
+
+/*
+ * Delete a key from a nonempty tree. Deleting the last one frees the tree,
+ * rather than leaving the zeroed slot an emptied root leaf keeps.
+ */
+static void* bpt_wal_del(struct bptree_wal* w, uint64_t key)
+{
+	struct bptree* root = w->root;
+	if (root->is_leaf && root->nr_keys == 1) {
+		void* val = root->pointers[1];
+		if (root->keys[0] != key) {
+			return NULL;
+		}
+		bptree_free(root);
+		w->root = NULL;
+		return val;
+	}
+	return bptree_delete(&w->root, key);
+}
+
+/*
+ * Apply the log from the current offset, stopping at its end or at the first
+ * record which is cut short or fails its checksum. The log is truncated
+ * there, so new records follow the last good one.
+ */
+static int bpt_wal_replay(struct bptree_wal* w)
+{
+	unsigned char* buf = malloc(BPT_WAL_READ);
+	off_t pos = sizeof(struct bpt_wal_header);
+	size_t have = 0;
+	int eof = 0;
+	int stop = 0;
+	if (!buf) {
+		abort();
+	}
+	while (!stop) {
+		while (!eof && have < BPT_WAL_READ) {
+			ssize_t got = read(w->log_fd, buf + have,
+					   BPT_WAL_READ - have);
+			if (got < 0 && errno == EINTR) {
+				continue;
+			}
+			if (got < 0) {
+				free(buf);
+				return -1;
+			}
+			eof = got == 0;
+			have += got;
+		}
+
+		size_t off = 0;
+		while (have - off >= BPT_WAL_RECORD_HEAD) {
+			unsigned char* rec = buf + off;
+			size_t len = BPT_WAL_RECORD_HEAD;
+			uint32_t crc;
+			uint64_t key;
+			if (rec[4] == BPT_WAL_PUT) {
+				len += w->value_size;
+			} else if (rec[4] != BPT_WAL_DEL) {
+				stop = 1;
+				break;
+			}
+			if (have - off < len) {
+				break;
+			}
+			memcpy(&crc, rec, sizeof(crc));
+			if (crc != bptree_crc32c(0, rec + 4, len - 4)) {
+				stop = 1;
+				break;
+			}
+			memcpy(&key, rec + 5, sizeof(key));
+			if (rec[4] == BPT_WAL_DEL) {
+				if (w->root) {
+					bpt_wal_del(w, key);
+				}
+			} else if (w->codec_ptr) {
+				bpt_wal_put(w, key, w->codec.decode(w->codec.ctx,
+								    rec + 13));
+			} else {
+				void* val;
+				memcpy(&val, rec + 13, sizeof(val));
+				bpt_wal_put(w, key, val);
+			}
+			++w->stats.replayed;
+			off += len;
+		}
+		pos += off;
+		memmove(buf, buf + off, have - off);
+		have -= off;
+		stop |= eof;
+	}
+	free(buf);
+	if (ftruncate(w->log_fd, pos) || lseek(w->log_fd, pos, SEEK_SET) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static void bpt_wal_free(struct bptree_wal* w)
+{
+	if (w->root) {
+		bptree_free(w->root);
+	}
+	if (w->log_fd >= 0) {
+		close(w->log_fd);
+	}
+	free(w->cur.data);
+	free(w->spare.data);
+	free(w->path);
+	free(w->log_path);
+	free(w->tmp_path);
+	free(w);
+}
+
+struct bptree_wal* bptree_wal_open(const char* path,
+				   const struct bptree_codec* codec,
+				   enum bptree_durability durability)
+{
+	struct bptree_wal* w = calloc(1, sizeof(struct bptree_wal));
+	struct bpt_wal_header hdr;
+	struct stat st;
+	size_t len = strlen(path) + 5;
+	int err;
+	if (!w) {
+		abort();
+	}
+	w->log_fd = -1;
+	w->durability = durability;
+	if (codec) {
+		w->codec = *codec;
+		w->codec_ptr = &w->codec;
+	}
+	w->value_size = codec ? codec->value_size : sizeof(void*);
+	w->path = strdup(path);
+	w->log_path = malloc(len);
+	w->tmp_path = malloc(len);
+	if (!w->path || !w->log_path || !w->tmp_path) {
+		abort();
+	}
+	snprintf(w->log_path, len, "%s.log", path);
+	snprintf(w->tmp_path, len, "%s.tmp", path);
+
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		w->root = bptree_load(fd, codec);
+		err = errno;
+		close(fd);
+		if (!w->root) {
+			errno = err;
+			goto fail;
+		}
+	} else if (errno != ENOENT) {
+		goto fail;
+	}
+
+	w->log_fd = open(w->log_path, O_RDWR | O_CREAT, 0644);
+	if (w->log_fd < 0 || fstat(w->log_fd, &st)) {
+		goto fail;
+	}
+	if ((size_t) st.st_size < sizeof(hdr)) {
+		/* A new log, or one whose creation was cut short. */
+		hdr.magic = BPT_WAL_MAGIC;
+		hdr.version = BPT_WAL_VERSION;
+		hdr.value_size = w->value_size;
+		if (ftruncate(w->log_fd, 0) ||
+		    bpt_wal_write(w->log_fd, (unsigned char*) &hdr, sizeof(hdr)) ||
+		    fdatasync(w->log_fd) || bpt_wal_sync_dir(w->log_path)) {
+			goto fail;
+		}
+	} else {
+		if (pread(w->log_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+			goto fail;
+		}
+		if (hdr.magic != BPT_WAL_MAGIC ||
+		    hdr.version != BPT_WAL_VERSION ||
+		    hdr.value_size != w->value_size) {
+			errno = EINVAL;
+			goto fail;
+		}
+		if (lseek(w->log_fd, sizeof(hdr), SEEK_SET) < 0 ||
+		    bpt_wal_replay(w)) {
+			goto fail;
+		}
+	}
+
+	pthread_rwlock_init(&w->tree_lock, NULL);
+	pthread_mutex_init(&w->checkpoint_lock, NULL);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->synced, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	if (durability == BPT_DURABLE_ASYNC &&
+	    pthread_create(&w->flusher, NULL, bpt_wal_flusher, w)) {
+		abort();
+	}
+	return w;
+
+fail:
+	err = errno;
+	bpt_wal_free(w);
+	errno = err;
+	return NULL;
+}
+
+void bptree_wal_close(struct bptree_wal* w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->closing = 1;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	if (w->durability == BPT_DURABLE_ASYNC) {
+		pthread_join(w->flusher, NULL);
+	}
+	bptree_wal_sync(w);
+	pthread_rwlock_destroy(&w->tree_lock);
+	pthread_mutex_destroy(&w->checkpoint_lock);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->synced);
+	pthread_cond_destroy(&w->wake);
+	bpt_wal_free(w);
+}
+
+void bptree_wal_sync(struct bptree_wal* w)
+{
+	pthread_mutex_lock(&w->lock);
+	bpt_wal_wait(w, w->appended);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * The snapshot is written beside the checkpoint and renamed over it, so a
+ * crash leaves either the old checkpoint and the whole log, or the new one
+ * and a log it already covers. Writers log under the tree's write lock, so
+ * holding it for reading is enough to keep the log still; checkpoints take
+ * turns between themselves.
+ */
+int bptree_wal_checkpoint(struct bptree_wal* w)
+{
+	int ret = 0;
+	pthread_mutex_lock(&w->checkpoint_lock);
+	pthread_rwlock_rdlock(&w->tree_lock);
+	bptree_wal_sync(w);
+	if (w->root) {
+		int fd = open(w->tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			ret = -1;
+		} else {
+			int err;
+			if (bptree_save(w->root, fd, w->codec_ptr) || fsync(fd)) {
+				ret = -1;
+			}
+			err = errno;
+			close(fd);
+			if (!ret) {
+				ret = rename(w->tmp_path, w->path);
+			} else {
+				unlink(w->tmp_path);
+				errno = err;
+			}
+		}
+	} else if (unlink(w->path) && errno != ENOENT) {
+		ret = -1;
+	}
+	if (!ret) {
+		ret = bpt_wal_sync_dir(w->path);
+	}
+	if (!ret) {
+		off_t start = sizeof(struct bpt_wal_header);
+		if (ftruncate(w->log_fd, start) ||
+		    lseek(w->log_fd, start, SEEK_SET) < 0 ||
+		    fdatasync(w->log_fd)) {
+			abort();
+		}
+		pthread_mutex_lock(&w->lock);
+		++w->stats.checkpoints;
+		pthread_mutex_unlock(&w->lock);
+	}
+	pthread_rwlock_unlock(&w->tree_lock);
+	pthread_mutex_unlock(&w->checkpoint_lock);
+	return ret;
+}
+
+void* bptree_wal_lookup(struct bptree_wal* w, uint64_t key)
+{
+	void* val = NULL;
+	pthread_rwlock_rdlock(&w->tree_lock);
+	if (w->root) {
+		val = bptree_lookup(w->root, key);
+	}
+	pthread_rwlock_unlock(&w->tree_lock);
+	return val;
+}
+
+int bptree_wal_insert(struct bptree_wal* w, uint64_t key, void* val)
+{
+	uint64_t lsn = 0;
+	pthread_rwlock_wrlock(&w->tree_lock);
+	if (!w->root) {
+		w->root = bptree_alloc(key, val);
+		lsn = bpt_wal_log(w, BPT_WAL_PUT, key, val);
+	} else if (bptree_insert_or_get(&w->root, key, val, NULL) ==
+		   BPTREE_INSERTED) {
+		lsn = bpt_wal_log(w, BPT_WAL_PUT, key, val);
+	}
+	pthread_rwlock_unlock(&w->tree_lock);
+	bpt_wal_commit(w, lsn);
+	return lsn != 0;
+}
+
+int bptree_wal_modify(struct bptree_wal* w, uint64_t key, void* val)
+{
+	uint64_t lsn = 0;
+	pthread_rwlock_wrlock(&w->tree_lock);
+	if (w->root && bptree_exists(w->root, key)) {
+		bptree_modify(w->root, key, val);
+		lsn = bpt_wal_log(w, BPT_WAL_PUT, key, val);
+	}
+	pthread_rwlock_unlock(&w->tree_lock);
+	bpt_wal_commit(w, lsn);
+	return lsn != 0;
+}
+
+void* bptree_wal_delete(struct bptree_wal* w, uint64_t key)
+{
+	uint64_t lsn = 0;
+	void* val = NULL;
+	pthread_rwlock_wrlock(&w->tree_lock);
+	if (w->root && bptree_exists(w->root, key)) {
+		val = bpt_wal_del(w, key);
+		lsn = bpt_wal_log(w, BPT_WAL_DEL, key, NULL);
+	}
+	pthread_rwlock_unlock(&w->tree_lock);
+	bpt_wal_commit(w, lsn);
+	return val;
+}
+
+void bptree_wal_stats(struct bptree_wal* w, struct bptree_wal_stats* st)
+{
+	pthread_mutex_lock(&w->lock);
+	*st = w->stats;
+	pthread_mutex_unlock(&w->lock);
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
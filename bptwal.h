@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2013 Vedant Kumar <vsk@berkeley.edu>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.  THE SOFTWARE IS
+ * PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED,
+ * INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * A write-ahead log in front of an in-memory tree.
+ *
+ * Every change is applied to the tree and appended to a log as a record
+ * holding the key and its new value (or its removal). A checkpoint saves the
+ * tree as a snapshot and empties the log; opening recovers by loading the
+ * last checkpoint and replaying the log after it. Records hold the effect of
+ * a change rather than the call that made it, so replaying a log over a
+ * checkpoint which already covers part of it gives the same tree.
+ *
+ * Writers take turns; lookups run alongside one another, and may see changes
+ * which are not durable yet. I/O errors in the middle of an operation abort.
+ */
+
+#pragma once
+
+#include "bptree.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* When a change becomes durable. */
+enum bptree_durability {
+	BPT_DURABLE_OP,		/* Each change syncs the log on its own. */
+	BPT_DURABLE_GROUP,	/* Changes wait for a sync, shared by all the
+				   changes which arrived while the last one
+				   was running. */
+	BPT_DURABLE_ASYNC,	/* Changes return at once, and the log is
+				   synced in the background. */
+};
+
+/* Asynchronous logs are synced at least this often. */
+#define BPT_WAL_ASYNC_MS 10
+
+/* Asynchronous writers wait for a sync once this much log is pending. */
+#define BPT_WAL_PENDING_MAX (4 << 20)
+
+struct bptree_wal;
+
+/*
+ * Open the tree checkpointed at path, with its log at path.log, and replay
+ * the log. A missing checkpoint is an empty tree. A torn record at the end
+ * of the log (from a crash during a write) is dropped. Values are encoded as
+ * for snapshots. Returns NULL with errno set if a file cannot be read, or to
+ * EINVAL if it is damaged or was written with a different value size.
+ */
+struct bptree_wal* bptree_wal_open(const char* path,
+				   const struct bptree_codec* codec,
+				   enum bptree_durability durability);
+
+/* Sync the log, then free the tree and close the log. */
+void bptree_wal_close(struct bptree_wal* w);
+
+/* Make every change so far durable. */
+void bptree_wal_sync(struct bptree_wal* w);
+
+/*
+ * Save the tree to the checkpoint and empty the log. Lookups carry on, but
+ * every write waits until it is done. Returns 0, or -1 with errno set if the
+ * checkpoint could not be written, in which case the log is left alone.
+ */
+int bptree_wal_checkpoint(struct bptree_wal* w);
+
+/* Lookup the value corresponding to a key (NULL if nonexistent). */
+void* bptree_wal_lookup(struct bptree_wal* w, uint64_t key);
+
+/* Insert a tuple unless the key exists. Returns 1 if it was new. */
+int bptree_wal_insert(struct bptree_wal* w, uint64_t key, void* val);
+
+/* Update the value of a key. Returns 1 if the key exists. */
+int bptree_wal_modify(struct bptree_wal* w, uint64_t key, void* val);
+
+/* Delete a key, returning its old value. */
+void* bptree_wal_delete(struct bptree_wal* w, uint64_t key);
+
+struct bptree_wal_stats {
+	uint64_t records;	/* Appended since opening, ... */
+	uint64_t syncs;		/* ... the log syncs they took, ... */
+	uint64_t bytes;		/* ... and the bytes written. */
+	uint64_t replayed;	/* Records replayed by the open. */
+	uint64_t checkpoints;
+};
+
+void bptree_wal_stats(struct bptree_wal* w, struct bptree_wal_stats* st);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
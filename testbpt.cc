@@ -1,12 +1,26 @@
 #include "bptree.h"
+#include "bptree.hpp"
+#include "bptsearch.h"
+#include "bptfile.h"
+#include "bptwal.h"
+#include "bptpack.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sys/wait.h>
 #include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <functional>
+#include <map>
 #include <queue>
+#include <set>
+#include <string>
 #include <vector>
 using namespace std;
 
@@ -71,6 +85,21 @@ inline int split(int x)
 	return (x >> 1) + (x & 1);
 }
 
+#if BPT_COUNTS
+size_t bptree_weigh(struct bptree* bpt)
+{
+	if (bpt->is_leaf) {
+		return bpt->nr_keys;
+	}
+	size_t total = 0;
+	for (int i=0; i <= bpt->nr_keys; ++i) {
+		assert(bpt->counts[i] == bptree_weigh(BPT_P(bpt, i)));
+		total += bpt->counts[i];
+	}
+	return total;
+}
+#endif
+
 void bptree_sane(struct bptree* bpt, int root)
 {
 	for (int i=1; i < bpt->nr_keys; ++i) {
@@ -91,6 +120,11 @@ void bptree_sane(struct bptree* bpt, int root)
 	if (!root) {
 		assert(bpt->nr_keys >= split(ORDER) - 1);
 	}
+#if BPT_COUNTS
+	if (root && !(bpt->flags & BPT_SYNC)) {
+		bptree_weigh(bpt);
+	}
+#endif
 }
 
 void bpt_draw(struct bptree* bpt)
@@ -166,6 +200,73 @@ void test_modify()
     bptree_free(bpt);
 }
 
+void test_upsert()
+{
+    for (int sync=0; sync < 2; ++sync) {
+        struct bptree* bpt = bptree_alloc(1, VALUE(1));
+        if (sync) {
+            bptree_make_concurrent(bpt);
+        }
+        map<uint64_t, void*> ref;
+        ref[1] = VALUE(1);
+
+        for (int i=0; i < 20000; ++i) {
+            uint64_t key = rand() % 2000 + 1;
+            void* val = VALUE(rand() % 100 + 1);
+            void* old = MAGIC;
+            map<uint64_t, void*>::iterator it = ref.find(key);
+            switch (i % 3) {
+            case 0:
+                if (it == ref.end()) {
+                    assert(bptree_upsert(&bpt, key, val, &old) ==
+                           BPTREE_INSERTED);
+                    assert(old == NULL);
+                } else {
+                    assert(bptree_upsert(&bpt, key, val, &old) ==
+                           BPTREE_UPDATED);
+                    assert(old == it->second);
+                }
+                ref[key] = val;
+                break;
+            case 1:
+                if (it == ref.end()) {
+                    assert(bptree_insert_or_get(&bpt, key, val, &old) ==
+                           BPTREE_INSERTED);
+                    ref[key] = val;
+                } else {
+                    assert(bptree_insert_or_get(&bpt, key, val, &old) ==
+                           BPTREE_EXISTS);
+                    assert(old == it->second);
+                }
+                break;
+            case 2:
+                if (it == ref.end()) {
+                    assert(bptree_cas(bpt, key, NULL, val, &old) ==
+                           BPTREE_MISSING);
+                    assert(old == MAGIC);
+                } else if (rand() % 2) {
+                    assert(bptree_cas(bpt, key, it->second, val, &old) ==
+                           BPTREE_UPDATED);
+                    assert(old == it->second);
+                    ref[key] = val;
+                } else {
+                    assert(bptree_cas(bpt, key, VALUE(1000), val, &old) ==
+                           BPTREE_EXISTS);
+                    assert(old == it->second);
+                }
+                break;
+            }
+        }
+
+        for (map<uint64_t, void*>::iterator it = ref.begin();
+             it != ref.end(); ++it) {
+            assert(bptree_lookup(bpt, it->first) == it->second);
+        }
+        bptree_sane(bpt, 1);
+        bptree_free(bpt);
+    }
+}
+
 void test_iterate()
 {
     struct bptree* bpt = bptree_alloc(0, NULL);
@@ -263,43 +364,2268 @@ void test_deletes()
     bptree_free(B);
 }
 
-void test_insert_delete_iterate()
+void check_delete_random(struct bptree* bpt)
+{
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 30000;
+        if (!ref.count(key)) {
+            bptree_insert(&bpt, key, VALUE(key + 1));
+            ref[key] = VALUE(key + 1);
+        }
+    }
+
+    // Delete about half the keys, misses included, then walk the leaves.
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 30000;
+        void* val = ref.count(key) ? ref[key] : NULL;
+        assert(bptree_delete(&bpt, key) == val);
+        ref.erase(key);
+        if (i % 5000 == 0) {
+            bptree_sane(bpt, 1);
+        }
+    }
+    bptree_sane(bpt, 1);
+
+    struct bptree_iter it;
+    uint64_t key;
+    void* val;
+    map<uint64_t, void*>::iterator r = ref.begin();
+    bptree_iter_seek(&it, bpt, 0, ~0ULL);
+    while (bptree_iter_next(&it, &key, &val)) {
+        assert(r != ref.end() && r->first == key && r->second == val);
+        ++r;
+    }
+    assert(r == ref.end());
+
+    // Drain from the left, so every leaf borrows from or merges rightwards.
+    while (ref.size() > 1) {
+        assert(bptree_delete(&bpt, ref.begin()->first) ==
+               ref.begin()->second);
+        ref.erase(ref.begin());
+    }
+    assert(bpt->is_leaf && bpt->nr_keys == 1);
+    assert(bptree_lookup(bpt, ref.begin()->first) == ref.begin()->second);
+    bptree_free(bpt);
+}
+
+void test_delete_random()
+{
+    check_delete_random(bptree_alloc(0, VALUE(1)));
+    check_delete_random(bptree_alloc_arena(0, VALUE(1), NULL));
+}
+
+int collect_all(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    typedef vector<pair<uint64_t, void*> > run;
+    run* seen = (run*) ctx;
+    for (int i=0; i < n; ++i) {
+        seen->push_back(make_pair(keys[i], vals[i]));
+    }
+    return 0;
+}
+
+void check_delete_range(struct bptree* bpt)
+{
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    for (int round=0; round < 50; ++round) {
+        for (int i=0; i < 2000; ++i) {
+            uint64_t key = rand() % 100000;
+            if (!ref.count(key)) {
+                bptree_insert(&bpt, key, VALUE(key + 1));
+                ref[key] = VALUE(key + 1);
+            }
+        }
+
+        // Mostly narrow ranges, some spanning many leaves, a few empty.
+        for (int i=0; i < 10; ++i) {
+            uint64_t lo = rand() % 101000;
+            uint64_t hi = lo + rand() % (i % 3 ? 200 : 20000) - (i == 9);
+            vector<pair<uint64_t, void*> > expect, seen;
+            if (lo < hi) {
+                expect.assign(ref.lower_bound(lo), ref.lower_bound(hi));
+                ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+            }
+            assert(bptree_delete_range(&bpt, lo, hi, collect_all, &seen) ==
+                   expect.size());
+            assert(seen == expect);
+            if (!(bpt->flags & BPT_SYNC)) {
+                bptree_sane(bpt, 1);
+            }
+        }
+
+        vector<pair<uint64_t, void*> > all;
+        bptree_scan(bpt, 1, ~0ULL, collect_all, &all);
+        vector<pair<uint64_t, void*> > rest(ref.upper_bound(0), ref.end());
+        assert(all == rest);
+        for (int i=0; i < 100; ++i) {
+            uint64_t key = rand() % 100000;
+            void* val = ref.count(key) ? ref[key] : NULL;
+            assert(bptree_lookup(bpt, key) == val);
+        }
+    }
+
+    // Wipe everything, then make sure the tree is still usable.
+    assert(bptree_delete_range(&bpt, 0, ~0ULL, NULL, NULL) == ref.size());
+    assert(bpt->is_leaf && bpt->nr_keys == 1);
+    for (uint64_t k=1; k < 1000; ++k) {
+        bptree_insert(&bpt, k, VALUE(k));
+    }
+    assert(bptree_delete_range(&bpt, 10, 990, NULL, NULL) == 980);
+    bptree_sane(bpt, 1);
+    for (uint64_t k=1; k < 1000; ++k) {
+        void* val = k < 10 || k >= 990 ? VALUE(k) : NULL;
+        assert(bptree_lookup(bpt, k) == val);
+    }
+    bptree_free(bpt);
+}
+
+void test_delete_range()
+{
+    check_delete_range(bptree_alloc(0, VALUE(1)));
+    check_delete_range(bptree_alloc_arena(0, VALUE(1), NULL));
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    bptree_make_concurrent(bpt);
+    check_delete_range(bpt);
+}
+
+void check_sorted_batch(struct bptree* bpt)
+{
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    const size_t sizes[] = { 1, 7, 100, 3000, 50000 };
+    for (int round=0; round < 20; ++round) {
+        // Sorted, with repeats and keys the tree already has.
+        size_t n = sizes[round % 5];
+        vector<uint64_t> keys(n);
+        vector<void*> vals(n);
+        for (size_t i=0; i < n; ++i) {
+            keys[i] = rand() % (round < 10 ? 200000 : 1000000);
+        }
+        sort(keys.begin(), keys.end());
+        size_t added = 0;
+        for (size_t i=0; i < n; ++i) {
+            vals[i] = VALUE(keys[i] + round);
+            added += ref.insert(make_pair(keys[i], vals[i])).second;
+        }
+        assert(bptree_insert_sorted_batch(&bpt, keys.data(), vals.data(), n)
+               == added);
+        if (!(bpt->flags & BPT_SYNC)) {
+            bptree_sane(bpt, 1);
+        }
+    }
+
+    vector<pair<uint64_t, void*> > all;
+    bptree_scan(bpt, 0, ~0ULL, collect_all, &all);
+    vector<pair<uint64_t, void*> > expect(ref.begin(), ref.end());
+    assert(all == expect);
+    for (map<uint64_t, void*>::iterator it = ref.begin(); it != ref.end();
+         ++it) {
+        assert(bptree_lookup(bpt, it->first) == it->second);
+    }
+    bptree_free(bpt);
+}
+
+void test_sorted_batch()
+{
+    check_sorted_batch(bptree_alloc(0, VALUE(1)));
+    check_sorted_batch(bptree_alloc_arena(0, VALUE(1), NULL));
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    bptree_make_concurrent(bpt);
+    check_sorted_batch(bpt);
+
+    // A single leaf taking a huge batch grows several levels at once.
+    vector<uint64_t> keys(100000);
+    for (size_t i=0; i < keys.size(); ++i) {
+        keys[i] = 3 * i + 1;
+    }
+    bpt = bptree_alloc(0, NULL);
+    assert(bptree_insert_sorted_batch(&bpt, keys.data(), NULL, keys.size())
+           == keys.size());
+    bptree_sane(bpt, 1);
+    for (size_t i=0; i < keys.size(); ++i) {
+        assert(bptree_exists(bpt, keys[i]));
+        assert(!bptree_exists(bpt, keys[i] + 1));
+    }
+    bptree_free(bpt);
+}
+
+void check_finger(struct bptree* bpt, int stream)
+{
+    map<uint64_t, void*> ref;
+    struct bptree_finger f;
+    bptree_finger_init(&f);
+    struct bptree_finger g;
+    bptree_finger_init(&g);
+    ref[0] = VALUE(1);
+
+    // Sequential, nearly sorted and random streams, with deletes and plain
+    // inserts mixed in to move leaves under the fingers' feet.
+    for (uint64_t i=1; i < 30000; ++i) {
+        uint64_t key = stream == 0 ? i :
+                       stream == 1 ? i + rand() % 8 : rand() % 100000;
+        ref.insert(make_pair(key, VALUE(key + 1)));
+        bptree_finger_insert(&bpt, &f, key, VALUE(key + 1));
+        assert(bptree_finger_lookup(bpt, &g, key) == ref[key]);
+
+        if (i % 7 == 0) {
+            uint64_t victim = key - rand() % 20;
+            void* val = ref.count(victim) ? ref[victim] : NULL;
+            assert(bptree_delete(&bpt, victim) == val);
+            ref.erase(victim);
+        } else if (i % 11 == 0) {
+            uint64_t other = rand() % 100000;
+            if (!ref.count(other)) {
+                bptree_insert(&bpt, other, VALUE(other + 1));
+                ref[other] = VALUE(other + 1);
+            }
+        }
+    }
+    bptree_sane(bpt, 1);
+
+    // Lookups in key order walk the leaf chain with the finger.
+    for (uint64_t k=0; k < 110000; k += 1 + rand() % 3) {
+        void* val = ref.count(k) ? ref[k] : NULL;
+        assert(bptree_finger_lookup(bpt, &g, k) == val);
+    }
+    for (map<uint64_t, void*>::iterator it = ref.begin(); it != ref.end();
+         ++it) {
+        assert(bptree_lookup(bpt, it->first) == it->second);
+    }
+    bptree_free(bpt);
+}
+
+void test_finger()
+{
+    for (int stream=0; stream < 3; ++stream) {
+        check_finger(bptree_alloc(0, VALUE(1)), stream);
+        check_finger(bptree_alloc_arena(0, VALUE(1), NULL), stream);
+    }
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    bptree_make_concurrent(bpt);
+    check_finger(bpt, 1);
+
+    // Fingers on different trees, each stream splitting and merging nodes
+    // between the other's inserts.
+    struct bptree* trees[2] = { bptree_alloc(0, NULL), bptree_alloc(0, NULL) };
+    struct bptree_finger fingers[2];
+    bptree_finger_init(&fingers[0]);
+    bptree_finger_init(&fingers[1]);
+    for (uint64_t i=1; i < 20000; ++i) {
+        for (int t=0; t < 2; ++t) {
+            bptree_finger_insert(&trees[t], &fingers[t], i, VALUE(i + t));
+            if (i % 5 == 0) {
+                bptree_delete(&trees[t], i - 3);
+            }
+        }
+    }
+    for (int t=0; t < 2; ++t) {
+        bptree_sane(trees[t], 1);
+        for (uint64_t i=1; i < 20000; ++i) {
+            void* val = (i + 3) % 5 == 0 && i < 19997 ? NULL : VALUE(i + t);
+            assert(bptree_finger_lookup(trees[t], &fingers[t], i) == val);
+        }
+        bptree_free(trees[t]);
+    }
+}
+
+void check_fill(struct bptree* bpt, int descending)
+{
+    const uint64_t n = 20000;
+    for (uint64_t i=1; i < n; ++i) {
+        uint64_t key = descending ? n - i : n + i;
+        bptree_insert(&bpt, key, VALUE(key));
+    }
+    bptree_sane(bpt, 1);
+    for (uint64_t i=1; i < n; ++i) {
+        uint64_t key = descending ? n - i : n + i;
+        assert(bptree_lookup(bpt, key) == VALUE(key));
+    }
+
+    // Runs fill their leaves, rather than leaving a trail of half-full ones.
+    struct bptree_stats st;
+    bptree_stats(bpt, &st);
+    assert(st.nr_keys == n);
+    assert(st.nr_leaves <= n / (ORDER - 1) + st.height + 1);
+    bptree_free(bpt);
+}
+
+void test_fill()
+{
+    for (int descending=0; descending < 2; ++descending) {
+        check_fill(bptree_alloc(20000, VALUE(20000)), descending);
+        check_fill(bptree_alloc_arena(20000, VALUE(20000), NULL),
+                   descending);
+        struct bptree* bpt = bptree_alloc(20000, VALUE(20000));
+        bptree_make_concurrent(bpt);
+        check_fill(bpt, descending);
+    }
+
+    // Random inserts still split at the median.
+    struct bptree* bpt = bptree_alloc(0, NULL);
+    for (int i=0; i < 20000; ++i) {
+        bptree_insert(&bpt, rand() % 100000 + 1, VALUE(1));
+    }
+    bptree_sane(bpt, 1);
+    bptree_free(bpt);
+}
+
+void check_compact(struct bptree* bpt)
+{
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    for (int i=0; i < 30000; ++i) {
+        uint64_t key = rand() % 100000 + 1;
+        bptree_insert(&bpt, key, VALUE(key));
+        ref[key] = VALUE(key);
+    }
+    // Thin the tree out until most nodes are down to the minimum.
+    for (int i=0; i < 60000; ++i) {
+        uint64_t key = rand() % 100000 + 1;
+        bptree_delete(&bpt, key);
+        ref.erase(key);
+    }
+    struct bptree_stats before;
+    bptree_stats(bpt, &before);
+
+    // The lowest target is the minimum the tree already keeps to.
+    bptree_compact(&bpt, 0.0);
+    bptree_sane(bpt, 1);
+
+    // Small slices, with the tree in use between them.
+    struct bptree_compaction c = { 0.9, 0, 0, 0, 0 };
+    int slices = 0;
+    while (bptree_compact_step(&bpt, &c, 16)) {
+        for (int i=0; i < 4; ++i) {
+            uint64_t key = rand() % 100000 + 1;
+            if (rand() % 2) {
+                bptree_insert(&bpt, key, VALUE(key));
+                ref[key] = VALUE(key);
+            } else {
+                bptree_delete(&bpt, key);
+                ref.erase(key);
+            }
+        }
+        bptree_sane(bpt, 1);
+        ++slices;
+    }
+    assert(slices > 1 && c.freed > 0);
+
+    // A full pass over a quiet tree packs it down to the target.
+    bptree_compact(&bpt, 1.0);
+    bptree_sane(bpt, 1);
+    struct bptree_stats after;
+    bptree_stats(bpt, &after);
+    assert(after.nr_keys == ref.size());
+    assert(after.nr_nodes < before.nr_nodes);
+    assert(after.height <= before.height);
+    assert(after.nr_leaves <=
+           after.nr_keys / (ORDER - 1) + after.level_nodes[after.height - 2]);
+
+    vector<pair<uint64_t, void*> > all;
+    bptree_scan(bpt, 0, ~0ULL, collect_all, &all);
+    vector<pair<uint64_t, void*> > expect(ref.begin(), ref.end());
+    assert(all == expect);
+    for (uint64_t key=0; key <= 100000; ++key) {
+        assert(bptree_lookup(bpt, key) == (ref.count(key) ? ref[key] : NULL));
+    }
+    bptree_free(bpt);
+}
+
+void test_compact()
+{
+    check_compact(bptree_alloc(0, VALUE(1)));
+    check_compact(bptree_alloc_arena(0, VALUE(1), NULL));
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    bptree_make_concurrent(bpt);
+    check_compact(bpt);
+
+    // Compacting a lone leaf does nothing.
+    bpt = bptree_alloc(0, VALUE(1));
+    assert(bptree_compact(&bpt, 0.9) == 0);
+    assert(bpt->is_leaf && bptree_lookup(bpt, 0) == VALUE(1));
+    bptree_free(bpt);
+}
+
+void verify_order_stats(struct bptree* bpt, const map<uint64_t, void*>& ref)
 {
-#if 0
     vector<uint64_t> keys;
-    keys.push_back(0);
-    struct bptree* bpt = bptree_alloc(0, MAGIC);
+    for (map<uint64_t, void*>::const_iterator it = ref.begin();
+         it != ref.end(); ++it) {
+        keys.push_back(it->first);
+    }
+    for (size_t k=0; k < keys.size(); k += 1 + rand() % 7) {
+        uint64_t key;
+        void* val;
+        assert(bptree_select(bpt, k, &key, &val));
+        assert(key == keys[k] && val == ref.find(key)->second);
+        assert(bptree_rank(bpt, key) == k);
+        assert(bptree_rank(bpt, key + 1) == k + 1);
+    }
+    uint64_t key;
+    void* val;
+    assert(!bptree_select(bpt, keys.size(), &key, &val));
+    assert(bptree_rank(bpt, ~0ULL) == keys.size());
 
-    for (int i=0; i < 1000000; ++i) {
-        keys.push_back(rand() % (~0UL - keys.back()));
+    for (int i=0; i < 500; ++i) {
+        uint64_t lo = rand() % 110000;
+        uint64_t hi = lo + rand() % 20000;
+        size_t expect = lower_bound(keys.begin(), keys.end(), hi) -
+                        lower_bound(keys.begin(), keys.end(), lo);
+        assert(bptree_count_range(bpt, lo, hi) == expect);
+        assert(bptree_count_range(bpt, hi, lo) == 0);
+    }
+}
 
-        if (i % 10000) {
-            for (uint64_t key : keys) {
-                assert(bptree_lookup(bpt, key) == MAGIC); 
+void check_order_stats(struct bptree* bpt, map<uint64_t, void*>& ref)
+{
+    struct bptree_finger f;
+    bptree_finger_init(&f);
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 100000 + 1;
+        switch (rand() % 3) {
+        case 0:
+            bptree_insert(&bpt, key, VALUE(key));
+            break;
+        case 1:
+            bptree_finger_insert(&bpt, &f, key, VALUE(key));
+            break;
+        default:
+            bptree_upsert(&bpt, key, VALUE(key), NULL);
+            ref[key] = VALUE(key);
+            break;
+        }
+        ref.insert(make_pair(key, VALUE(key)));
+    }
+    // Ascending runs spill into their siblings.
+    for (uint64_t key=100001; key < 104000; ++key) {
+        bptree_insert(&bpt, key, VALUE(key));
+        ref[key] = VALUE(key);
+    }
+    bptree_sane(bpt, 1);
+    verify_order_stats(bpt, ref);
+
+    for (int i=0; i < 15000; ++i) {
+        uint64_t key = rand() % 104000 + 1;
+        bptree_delete(&bpt, key);
+        ref.erase(key);
+    }
+    bptree_sane(bpt, 1);
+    verify_order_stats(bpt, ref);
+
+    for (int i=0; i < 20; ++i) {
+        uint64_t lo = rand() % 104000;
+        uint64_t hi = lo + rand() % 3000;
+        bptree_delete_range(&bpt, lo, hi, NULL, NULL);
+        ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+        bptree_sane(bpt, 1);
+    }
+    verify_order_stats(bpt, ref);
+
+    vector<uint64_t> batch;
+    for (uint64_t key=50000; key < 60000; key += 1 + rand() % 3) {
+        batch.push_back(key);
+        ref.insert(make_pair(key, (void*) NULL));
+    }
+    bptree_insert_sorted_batch(&bpt, &batch[0], NULL, batch.size());
+    bptree_sane(bpt, 1);
+    verify_order_stats(bpt, ref);
+
+    bptree_compact(&bpt, 1.0);
+    bptree_sane(bpt, 1);
+    verify_order_stats(bpt, ref);
+    bptree_free(bpt);
+}
+
+void test_order_stats()
+{
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    check_order_stats(bptree_alloc(0, VALUE(1)), ref);
+
+    ref.clear();
+    ref[0] = VALUE(1);
+    check_order_stats(bptree_alloc_arena(0, VALUE(1), NULL), ref);
+
+    // Concurrent trees keep no counts, and scan instead.
+    ref.clear();
+    ref[0] = VALUE(1);
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    bptree_make_concurrent(bpt);
+    check_order_stats(bpt, ref);
+
+    ref.clear();
+    vector<uint64_t> keys;
+    for (uint64_t key=1; key < 60000; key += 2) {
+        keys.push_back(key);
+        ref[key] = NULL;
+    }
+    check_order_stats(bptree_bulk_load(&keys[0], NULL, keys.size(), 0.7),
+                      ref);
+
+    // A finger counts along its own path, while inserts ahead of it split
+    // the nodes beside that path, and lookups step it along the leaf chain
+    // to fill in the gaps behind.
+    ref.clear();
+    ref[0] = NULL;
+    bpt = bptree_alloc(0, NULL);
+    struct bptree_finger f;
+    bptree_finger_init(&f);
+    for (uint64_t key=2; key < 60000; key += 2) {
+        bptree_finger_insert(&bpt, &f, key, NULL);
+        ref[key] = NULL;
+        if (key % 3 == 0) {
+            uint64_t ahead = 100000 + rand() % 100000;
+            bptree_insert(&bpt, ahead, NULL);
+            ref[ahead] = NULL;
+        }
+        if (key % 2000 == 0) {
+            for (uint64_t k=key - 1998; k < key; k += 2) {
+                assert(bptree_finger_lookup(bpt, &f, k) == NULL);
+                bptree_finger_insert(&bpt, &f, k + 1, NULL);
+                ref[k + 1] = NULL;
             }
             bptree_sane(bpt, 1);
         }
     }
-#endif
+    verify_order_stats(bpt, ref);
+    bptree_free(bpt);
+
+    // The largest key is out of reach of a scan.
+    bpt = bptree_alloc(~0ULL, VALUE(2));
+    bptree_insert(&bpt, 5, VALUE(1));
+    uint64_t key;
+    void* val;
+    assert(bptree_select(bpt, 1, &key, &val));
+    assert(key == ~0ULL && val == VALUE(2));
+    assert(!bptree_select(bpt, 2, &key, &val));
+    assert(bptree_rank(bpt, ~0ULL) == 1);
+    bptree_free(bpt);
 }
 
-int main()
+void check_filter(struct bptree* bpt)
 {
-    srand(time(NULL));
+    map<uint64_t, void*> ref;
+    ref[0] = VALUE(1);
+    struct bptree_filter f = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+    assert(bptree_filter_build(&f, bpt, 10) == 0);
+    size_t first_capacity = f.capacity;
 
-#if 0
-    printf("test_inserts...\n");
-    test_inserts();
+    // Every way into the tree sets the key's bits.
+    struct bptree_finger finger;
+    bptree_finger_init(&finger);
+    for (int i=0; i < 30000; ++i) {
+        uint64_t key = rand() % 100000 + 1;
+        switch (i % 4) {
+        case 0:
+            if (!ref.count(key)) {
+                bptree_insert(&bpt, key, VALUE(key));
+            }
+            break;
+        case 1:
+            bptree_upsert(&bpt, key, VALUE(key), NULL);
+            break;
+        case 2:
+            bptree_insert_or_get(&bpt, key, VALUE(key), NULL);
+            break;
+        default:
+            if (!ref.count(key)) {
+                bptree_finger_insert(&bpt, &finger, key, VALUE(key));
+            }
+            break;
+        }
+        ref.insert(make_pair(key, VALUE(key)));
+        assert(bptree_filter_may_contain(&f, key));
+    }
+    // The filter grew with the tree.
+    assert(f.capacity > first_capacity);
 
-    printf("test_modify...\n");
-    test_modify();
+    vector<uint64_t> batch;
+    for (uint64_t key=200000; key < 210000; key += 3) {
+        batch.push_back(key);
+        ref[key] = NULL;
+    }
+    bptree_insert_sorted_batch(&bpt, &batch[0], NULL, batch.size());
 
-    printf("test_iterate...\n");
-    test_iterate();
-#endif
+    for (int round=0; round < 2; ++round) {
+        size_t misses = 0;
+        size_t passed = 0;
+        for (uint64_t key=0; key < 220000; ++key) {
+            int present = ref.count(key);
+            void* expect = present ? ref[key] : NULL;
+            assert(!present || bptree_filter_may_contain(&f, key));
+            assert(bptree_filter_lookup(bpt, &f, key) == expect);
+            assert(!bptree_filter_exists(bpt, &f, key) == !present);
+            if (!present) {
+                ++misses;
+                passed += bptree_filter_may_contain(&f, key);
+            }
+        }
+        // Ten bits per key should let through only a few percent.
+        assert(passed * 20 < misses);
 
-    printf("test_deletes...\n");
-    test_deletes();
+        // Deletes, through the filter and around it.
+        for (int i=0; i < 40000; ++i) {
+            uint64_t key = rand() % 210000 + 1;
+            if (i % 4) {
+                assert(bptree_filter_delete(&bpt, &f, key) ==
+                       (ref.count(key) ? ref[key] : NULL));
+            } else {
+                bptree_delete(&bpt, key);
+            }
+            ref.erase(key);
+        }
+        uint64_t lo = 1000 + round * 50000;
+        bptree_delete_range(&bpt, lo, lo + 5000, NULL, NULL);
+        ref.erase(ref.lower_bound(lo), ref.lower_bound(lo + 5000));
+        assert(f.nr_stale <= f.capacity / 4);
+        bptree_sane(bpt, 1);
+    }
+
+    // The largest key is filtered like any other.
+    bptree_insert(&bpt, ~0ULL, VALUE(2));
+    assert(bptree_filter_lookup(bpt, &f, ~0ULL) == VALUE(2));
+    assert(bptree_filter_build(&f, bpt, 10) == 0);
+    assert(bptree_filter_lookup(bpt, &f, ~0ULL) == VALUE(2));
+
+    // A tree has one filter at a time; snapshots have none.
+    struct bptree_filter g = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+    assert(bptree_filter_build(&g, bpt, 10) == -1);
+    if (!(bpt->flags & BPT_ARENA)) {
+        struct bptree* snap = bptree_snapshot(bpt);
+        assert(bptree_filter_build(&g, snap, 10) == -1);
+        bptree_insert(&bpt, ~0ULL - 1, VALUE(3));
+        assert(bptree_filter_may_contain(&f, ~0ULL - 1));
+        bptree_snapshot_release(snap);
+    }
+
+    // Moving the filter to another tree leaves this one without.
+    struct bptree* other = bptree_alloc(5, VALUE(5));
+    assert(bptree_filter_build(&f, other, 10) == 0);
+    bptree_insert(&other, 6, VALUE(6));
+    assert(bptree_filter_lookup(other, &f, 6) == VALUE(6));
+    assert(bptree_filter_build(&g, bpt, 10) == 0);
+    bptree_filter_free(&g);
+    bptree_free(bpt);
+
+    bptree_filter_free(&f);
+    assert(f.id == 0);
+    bptree_free(other);
+}
+
+void test_filter()
+{
+    check_filter(bptree_alloc(0, VALUE(1)));
+    check_filter(bptree_alloc_arena(0, VALUE(1), NULL));
+
+    // Concurrent trees cannot have filters; making one concurrent detaches
+    // its filter.
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    struct bptree_filter f = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+    for (uint64_t key=1; key < 1000; ++key) {
+        bptree_insert(&bpt, key, VALUE(key));
+    }
+    assert(bptree_filter_build(&f, bpt, 10) == 0);
+    bptree_make_concurrent(bpt);
+    assert(f.id == 0);
+    size_t nr_keys = f.nr_keys;
+    bptree_insert(&bpt, 5000, VALUE(5000));
+    assert(f.nr_keys == nr_keys);
+    assert(bptree_filter_build(&f, bpt, 10) == -1);
+    bptree_free(bpt);
+
+    // Numbers are given back as their trees go away.
+    for (int i=0; i < 2 * BPT_MAX_FILTERS; ++i) {
+        bpt = bptree_alloc(i, VALUE(1));
+        assert(bptree_filter_build(&f, bpt, 10) == 0);
+        bptree_free(bpt);
+    }
+    assert(f.id == 0);
+    bptree_filter_free(&f);
+}
+
+int collect_file(void* ctx, const uint64_t* keys, const uint64_t* vals,
+                 int n)
+{
+    vector<pair<uint64_t, uint64_t> >* out =
+        (vector<pair<uint64_t, uint64_t> >*) ctx;
+    for (int i=0; i < n; ++i) {
+        out->push_back(make_pair(keys[i], vals[i]));
+    }
+    return 0;
+}
+
+void verify_file(struct bptree_file* f, const map<uint64_t, uint64_t>& ref)
+{
+    vector<pair<uint64_t, uint64_t> > all;
+    assert(bptree_file_scan(f, 0, ~0ULL, collect_file, &all) == ref.size());
+    vector<pair<uint64_t, uint64_t> > expect(ref.begin(), ref.end());
+    assert(all == expect);
+
+    all.clear();
+    bptree_file_scan(f, 1000, 2000, collect_file, &all);
+    expect.assign(ref.lower_bound(1000), ref.lower_bound(2000));
+    assert(all == expect);
+
+    for (uint64_t key=0; key < 100000; key += 1 + rand() % 5) {
+        uint64_t val;
+        map<uint64_t, uint64_t>::const_iterator it = ref.find(key);
+        assert(bptree_file_lookup(f, key, &val) == (it != ref.end()));
+        assert(it == ref.end() || val == it->second);
+    }
+
+    struct bptree_file_stats st;
+    bptree_file_stats(f, &st);
+    assert(st.nr_keys == ref.size());
+}
+
+void check_file(const char* path, size_t pool, size_t reopen_pool)
+{
+    unlink(path);
+    struct bptree_file* f = bptree_file_open(path, pool);
+    assert(f);
+    map<uint64_t, uint64_t> ref;
+    for (int i=0; i < 100000; ++i) {
+        uint64_t key = rand() % 100000;
+        int fresh = !ref.count(key);
+        assert(bptree_file_insert(f, key, key * 3) == fresh);
+        ref.insert(make_pair(key, key * 3));
+    }
+    verify_file(f, ref);
+
+    for (int i=0; i < 60000; ++i) {
+        uint64_t key = rand() % 100000;
+        uint64_t val;
+        int found = ref.count(key);
+        assert(bptree_file_delete(f, key, &val) == found);
+        assert(!found || val == ref[key]);
+        ref.erase(key);
+    }
+    verify_file(f, ref);
+
+    struct bptree_file_stats st;
+    bptree_file_stats(f, &st);
+    assert(st.height > 1);
+    if (pool && pool < 100) {
+        assert(st.evictions > 0 && st.writes > 0);
+    }
+    assert(bptree_file_close(f) == 0);
+
+    // Everything is still there after a reopen, whichever way it is done.
+    f = bptree_file_open(path, reopen_pool);
+    assert(f);
+    verify_file(f, ref);
+
+    // Emptying the tree frees its pages for the next inserts to reuse.
+    bptree_file_stats(f, &st);
+    uint64_t pages = st.nr_pages;
+    uint64_t refill = ref.size() / 2;
+    for (map<uint64_t, uint64_t>::iterator it = ref.begin(); it != ref.end();
+         ++it) {
+        assert(bptree_file_delete(f, it->first, NULL));
+    }
+    ref.clear();
+    verify_file(f, ref);
+    bptree_file_stats(f, &st);
+    assert(st.height == 1);
+    for (uint64_t key=0; key < refill; ++key) {
+        bptree_file_insert(f, key, key);
+        ref[key] = key;
+    }
+    verify_file(f, ref);
+    bptree_file_stats(f, &st);
+    assert(st.nr_pages == pages);
+    assert(bptree_file_close(f) == 0);
+    unlink(path);
+}
+
+void test_file()
+{
+    char path[] = "/tmp/testbpt.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    check_file(path, 0, 0);
+    check_file(path, 0, 64);
+    check_file(path, BPT_FILE_MIN_FRAMES, 0);
+    check_file(path, 64, 4096);
+
+    // Other files are turned away.
+    FILE* junk = fopen(path, "w");
+    fprintf(junk, "not a tree");
+    fclose(junk);
+    errno = 0;
+    assert(!bptree_file_open(path, 0) && errno == EINVAL);
+    unlink(path);
+}
+
+void test_search()
+{
+    vector<bpt_rank_fn> kernels;
+    kernels.push_back(bpt_rank_scalar);
+    kernels.push_back(bpt_scan_scalar);
+#if BPT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(bpt_scan_avx2);
+        kernels.push_back(bpt_rank_avx2);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        kernels.push_back(bpt_scan_avx512);
+        kernels.push_back(bpt_rank_avx512);
+    }
+#endif
+
+    // Compare every kernel against bisection, including keys >= 2^63.
+    for (int n=0; n < 300; ++n) {
+        vector<uint64_t> keys;
+        uint64_t key = rand() % 3;
+        for (int i=0; i < n; ++i) {
+            key += 1 + rand() % 3;
+            keys.push_back(i % 2 ? key : key | (1ULL << 63));
+        }
+        sort(keys.begin(), keys.end());
+        for (int i=0; i < 100; ++i) {
+            uint64_t probe = rand() % (2 * n + 6);
+            if (rand() % 2) {
+                probe |= 1ULL << 63;
+            }
+            int rank = bpt_rank_bisect(keys.data(), n, probe);
+            for (size_t k=0; k < kernels.size(); ++k) {
+                assert(kernels[k](keys.data(), n, probe) == rank);
+            }
+        }
+    }
+}
+
+template <typename Tree, typename Compare>
+void check_template(Tree& tree, Compare comp)
+{
+    map<uint64_t, uint64_t, Compare> ref(comp);
+
+    // Interleave random inserts, deletes and lookups against a std::map.
+    for (int i=0; i < 200000; ++i) {
+        uint64_t key = rand() % 5000;
+        int op = rand() % 4;
+        if (op < 2) {
+            bool added = ref.insert(make_pair(key, key + 1)).second;
+            assert(tree.insert(key, key + 1) == added);
+        } else if (op == 2) {
+            uint64_t val = 0;
+            bool found = ref.erase(key);
+            assert(tree.erase(key, &val) == found);
+            assert(!found || val == key + 1);
+        } else {
+            const uint64_t* val = tree.lookup(key);
+            assert((val != NULL) == (ref.count(key) == 1));
+            assert(!val || *val == key + 1);
+        }
+    }
+    assert(tree.size() == ref.size());
+
+    typename map<uint64_t, uint64_t, Compare>::iterator it = ref.begin();
+    tree.for_each([&](uint64_t key, uint64_t val) {
+        assert(it != ref.end() && it->first == key && it->second == val);
+        ++it;
+    });
+    assert(it == ref.end());
+
+    // Drain the tree completely.
+    while (!ref.empty()) {
+        assert(tree.erase(ref.begin()->first));
+        ref.erase(ref.begin());
+    }
+    assert(tree.empty() && tree.height() == 0);
+}
+
+void test_template()
+{
+    typedef bpt::cache_line_fanout<uint64_t, uint64_t> line;
+    typedef bpt::fanout<uint64_t, uint64_t, 256> lines;
+    typedef bpt::page_fanout<uint64_t, uint64_t> page;
+    static_assert(bpt::bptree<uint64_t, uint64_t, line::value>::node_size
+                  <= 64, "Fanout overflows a cache line.");
+    static_assert(bpt::bptree<uint64_t, uint64_t, page::value>::node_size
+                  <= 4096, "Fanout overflows a page.");
+
+    bpt::bptree<uint64_t, uint64_t, line::value> t1;
+    check_template(t1, less<uint64_t>());
+    bpt::bptree<uint64_t, uint64_t, lines::value> t2;
+    check_template(t2, less<uint64_t>());
+    bpt::bptree<uint64_t, uint64_t, page::value> t3;
+    check_template(t3, less<uint64_t>());
+    bpt::bptree<uint64_t, uint64_t, 6, greater<uint64_t> > t4;
+    check_template(t4, greater<uint64_t>());
+
+    // Wider nodes make for much shallower trees.
+    for (uint64_t k=0; k < 100000; ++k) {
+        t1.insert(k, k);
+        t3.insert(k, k);
+    }
+    assert(t3.height() < t1.height());
+
+    // The C API is one instantiation of the template.
+    bpt::bptree<uint64_t, void*, ORDER> c;
+    for (uint64_t k=0; k < 10000; ++k) {
+        assert(c.insert(k, VALUE(k + 1)));
+    }
+    assert(!c.insert(42, NULL));
+    for (uint64_t k=0; k < 10000; ++k) {
+        assert(*c.lookup(k) == VALUE(k + 1));
+        assert(bptree_lookup(c.root(), k) == VALUE(k + 1));
+    }
+    assert(c.modify(7, MAGIC) && bptree_lookup(c.root(), 7) == MAGIC);
+    bptree_sane(c.root(), 1);
+}
+
+void test_bulk_load()
+{
+    const double fills[] = { 0.1, 0.5, 0.7, 1.0 };
+    const size_t sizes[] = { 1, 2, 3, 7, 8, 100, 1000, 123457 };
+
+    assert(bptree_bulk_load(NULL, NULL, 0, 1.0) == NULL);
+
+    for (size_t f=0; f < sizeof(fills) / sizeof(fills[0]); ++f) {
+        for (size_t s=0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+            size_t n = sizes[s];
+            vector<uint64_t> keys(n);
+            vector<void*> vals(n);
+            for (size_t i=0; i < n; ++i) {
+                keys[i] = 3 * i + 1;
+                vals[i] = VALUE(i + 1);
+            }
+
+            struct bptree* bpt =
+                bptree_bulk_load(keys.data(), vals.data(), n, fills[f]);
+            bptree_sane(bpt, 1);
+            for (size_t i=0; i < n; ++i) {
+                assert(bptree_lookup(bpt, keys[i]) == vals[i]);
+                assert(!bptree_exists(bpt, keys[i] + 1));
+            }
+
+            // The leaf chain visits every key in order.
+            size_t seen = 0;
+            for (struct bptree* leaf = bptree_search(bpt, 0); leaf;
+                 leaf = bptree_next(leaf)) {
+                for (int k=0; k < leaf->nr_keys; ++k) {
+                    assert(leaf->keys[k] == keys[seen++]);
+                }
+            }
+            assert(seen == n);
+
+            // The result is an ordinary tree.
+            for (size_t i=0; i < n; ++i) {
+                bptree_insert(&bpt, keys[i] + 1, VALUE(i));
+            }
+            bptree_sane(bpt, 1);
+            for (size_t i=0; i < n; ++i) {
+                assert(bptree_lookup(bpt, keys[i]) == vals[i]);
+                assert(bptree_lookup(bpt, keys[i] + 1) == VALUE(i));
+            }
+            bptree_free(bpt);
+        }
+    }
+}
+
+void test_lookup_batch()
+{
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 40000;
+        if (!bptree_exists(bpt, key)) {
+            bptree_insert(&bpt, key, VALUE(key + 1));
+        }
+    }
+
+    // Batches of every size, including partial groups, must agree with
+    // single lookups on hits and misses alike.
+    for (size_t n=0; n < 3 * BPT_LOOKUP_GROUP + 2; ++n) {
+        vector<uint64_t> keys(n);
+        vector<void*> vals(n, MAGIC);
+        for (size_t i=0; i < n; ++i) {
+            keys[i] = rand() % 41000;
+        }
+        bptree_lookup_batch(bpt, keys.data(), n, vals.data());
+        for (size_t i=0; i < n; ++i) {
+            assert(vals[i] == bptree_lookup(bpt, keys[i]));
+        }
+    }
+
+    // A tree that is a single leaf.
+    struct bptree* leaf = bptree_alloc(5, VALUE(5));
+    uint64_t keys[] = { 4, 5, 6 };
+    void* vals[3];
+    bptree_lookup_batch(leaf, keys, 3, vals);
+    assert(!vals[0] && vals[1] == VALUE(5) && !vals[2]);
+    bptree_free(leaf);
+    bptree_free(bpt);
+}
+
+struct scan_state {
+    vector<pair<uint64_t, void*> > seen;
+    size_t limit;
+};
+
+int collect_run(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    struct scan_state* state = (struct scan_state*) ctx;
+    for (int i=0; i < n; ++i) {
+        state->seen.push_back(make_pair(keys[i], vals[i]));
+    }
+    return state->seen.size() >= state->limit;
+}
+
+void test_range_scan()
+{
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    ref[0] = VALUE(1);
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 50000;
+        if (!ref.count(key)) {
+            bptree_insert(&bpt, key, VALUE(key + 1));
+            ref[key] = VALUE(key + 1);
+        }
+    }
+
+    for (int i=0; i < 500; ++i) {
+        uint64_t lo = rand() % 51000;
+        uint64_t hi = lo + rand() % (i % 2 ? 50 : 5000);
+        vector<pair<uint64_t, void*> > expect(ref.lower_bound(lo),
+                                              ref.lower_bound(hi));
+
+        // Cursor.
+        struct bptree_iter it;
+        uint64_t key;
+        void* val;
+        size_t k = 0;
+        bptree_iter_seek(&it, bpt, lo, hi);
+        while (bptree_iter_next(&it, &key, &val)) {
+            assert(k < expect.size());
+            assert(expect[k].first == key && expect[k].second == val);
+            ++k;
+        }
+        assert(k == expect.size());
+        assert(!bptree_iter_next(&it, &key, &val));
+
+        // Callback, run to completion.
+        struct scan_state state;
+        state.limit = ~(size_t) 0;
+        assert(bptree_scan(bpt, lo, hi, collect_run, &state) ==
+               expect.size());
+        assert(state.seen == expect);
+
+        // Callback, stopped early.
+        state.seen.clear();
+        state.limit = 10;
+        bptree_scan(bpt, lo, hi, collect_run, &state);
+        assert(state.seen.size() == expect.size() || state.seen.size() >= 10);
+        for (size_t j=0; j < state.seen.size(); ++j) {
+            assert(state.seen[j] == expect[j]);
+        }
+    }
+
+    // Unbounded scans reach the very end of the tree.
+    struct scan_state state;
+    state.limit = ~(size_t) 0;
+    assert(bptree_scan(bpt, 0, ~0ULL, collect_run, &state) == ref.size());
+    assert(bptree_scan(bpt, 10, 10, collect_run, &state) == 0);
+    bptree_free(bpt);
+}
+
+struct slab_counter {
+    int live;
+    int total;
+    map<void*, size_t> sizes;   // Of the live allocations.
+};
+
+void* counting_alloc(void* ctx, size_t size, size_t align)
+{
+    struct slab_counter* counter = (struct slab_counter*) ctx;
+    void* mem;
+    if (posix_memalign(&mem, align, size)) {
+        return NULL;
+    }
+    ++counter->live;
+    ++counter->total;
+    counter->sizes[mem] = size;
+    return mem;
+}
+
+// Frees must hand back the size each allocation was made with.
+void counting_free(void* ctx, void* ptr, size_t size)
+{
+    struct slab_counter* counter = (struct slab_counter*) ctx;
+    assert(counter->sizes.count(ptr) && counter->sizes[ptr] == size);
+    counter->sizes.erase(ptr);
+    --counter->live;
+    free(ptr);
+}
+
+void test_arena()
+{
+    struct slab_counter counter = { 0, 0, map<void*, size_t>() };
+    struct bptree_allocator allocator = {
+        counting_alloc, counting_free, &counter
+    };
+    struct bptree* bpt = bptree_alloc_arena(0, VALUE(1), &allocator);
+    assert(bpt->flags & BPT_ARENA);
+
+    // Every node should come out of the arena.
+    for (uint64_t i=1; i < 100000; ++i) {
+        uint64_t key = rand() % 1000000;
+        if (!bptree_exists(bpt, key)) {
+            bptree_insert(&bpt, key, VALUE(key + 1));
+        }
+    }
+    assert(counter.total > 2);
+    assert(bptree_lookup(bpt, 0) == VALUE(1));
+    for (int i=0; i < 10000; ++i) {
+        uint64_t key = rand() % 1000000;
+        void* val = bptree_lookup(bpt, key);
+        assert(!val || val == VALUE(key + 1));
+    }
+    bptree_sane(bpt, 1);
+
+    // Tearing the tree down releases every slab (and the arena itself).
+    bptree_free(bpt);
+    assert(counter.live == 0 && counter.sizes.empty());
+
+    // The default allocator is the system heap.
+    bpt = bptree_alloc_arena(0, NULL, NULL);
+    for (uint64_t i=1; i < 10000; ++i) {
+        bptree_insert(&bpt, i, VALUE(i));
+    }
+    assert(bptree_lookup(bpt, 9999) == VALUE(9999));
+    bptree_free(bpt);
+}
+
+#define NR_WORKERS 4
+#define KEYS_PER_WORKER 20000
+
+struct worker {
+    struct bptree* bpt;
+    int id;
+};
+
+int check_ascending(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    uint64_t* last = (uint64_t*) ctx;
+    for (int i=0; i < n; ++i) {
+        assert(keys[i] > *last || *last == 0);
+        assert(vals[i] == VALUE(keys[i] + 1));
+        *last = keys[i];
+    }
+    return 0;
+}
+
+void* concurrent_worker(void* arg)
+{
+    struct worker* w = (struct worker*) arg;
+    struct bptree* bpt = w->bpt;
+    uint64_t seed = w->id + 1;
+
+    // Each worker owns the keys congruent to its id, and reads everyone's.
+    for (uint64_t i=1; i <= KEYS_PER_WORKER; ++i) {
+        uint64_t key = i * NR_WORKERS + w->id;
+        bptree_insert(&bpt, key, VALUE(key + 1));
+        assert(bptree_lookup(bpt, key) == VALUE(key + 1));
+
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t probe = (seed >> 33) % (KEYS_PER_WORKER * NR_WORKERS);
+        void* val = bptree_lookup(bpt, probe);
+        assert(!val || val == VALUE(probe + 1));
+        if (i % 1000 == 0) {
+            uint64_t last = 0;
+            bptree_scan(bpt, probe, probe + 500, check_ascending, &last);
+        }
+    }
+
+    // Take out every other key again, checking that the rest survive.
+    for (uint64_t i=1; i <= KEYS_PER_WORKER; i += 2) {
+        uint64_t key = i * NR_WORKERS + w->id;
+        assert(bptree_delete(&bpt, key) == VALUE(key + 1));
+        assert(bptree_lookup(bpt, key) == NULL);
+        assert(bptree_lookup(bpt, key + NR_WORKERS) == VALUE(key + 1 + NR_WORKERS));
+        bptree_modify(bpt, key + NR_WORKERS, VALUE(key + 1 + NR_WORKERS));
+    }
+    assert(bpt == w->bpt);
+    return NULL;
+}
+
+void test_concurrent()
+{
+    for (int arena=0; arena < 2; ++arena) {
+        struct bptree* bpt = arena ? bptree_alloc_arena(0, VALUE(1), NULL) :
+                                     bptree_alloc(0, VALUE(1));
+        bptree_make_concurrent(bpt);
+
+        pthread_t threads[NR_WORKERS];
+        struct worker workers[NR_WORKERS];
+        for (int t=0; t < NR_WORKERS; ++t) {
+            workers[t].bpt = bpt;
+            workers[t].id = t;
+            assert(!pthread_create(&threads[t], NULL, concurrent_worker,
+                                   &workers[t]));
+        }
+        // Compact in small slices while the workers are busy.
+        for (int pass=0; pass < 20; ++pass) {
+            struct bptree_compaction c = { 0.9, 0, 0, 0, 0 };
+            while (bptree_compact_step(&bpt, &c, 64)) {
+            }
+        }
+        for (int t=0; t < NR_WORKERS; ++t) {
+            pthread_join(threads[t], NULL);
+        }
+
+        bptree_sane(bpt, 1);
+        for (uint64_t i=1; i <= KEYS_PER_WORKER; ++i) {
+            for (int t=0; t < NR_WORKERS; ++t) {
+                uint64_t key = i * NR_WORKERS + t;
+                assert(bptree_lookup(bpt, key) ==
+                       (i % 2 ? NULL : VALUE(key + 1)));
+            }
+        }
+        uint64_t last = 0;
+        assert(bptree_scan(bpt, 1, ~0ULL, check_ascending, &last) ==
+               KEYS_PER_WORKER * NR_WORKERS / 2);
+
+        // Draining the tree collapses it back down to the root leaf.
+        for (uint64_t i=2; i <= KEYS_PER_WORKER; i += 2) {
+            for (int t=0; t < NR_WORKERS; ++t) {
+                bptree_delete(&bpt, i * NR_WORKERS + t);
+            }
+        }
+        assert(bpt->is_leaf);
+        assert(bptree_lookup(bpt, 0) == VALUE(1));
+
+        // Once everyone is out of the tree, every retired node can go.
+        size_t freed = bptree_reclaim();
+        assert(arena || freed > 0);
+        assert(bptree_reclaim() == 0);
+        bptree_free(bpt);
+    }
+}
+
+void test_stats()
+{
+    struct bptree_stats st;
+    struct bptree* bpt = bptree_alloc(0, NULL);
+    bptree_stats(bpt, &st);
+    assert(st.height == 1 && st.nr_nodes == 1 && st.nr_leaves == 1);
+    assert(st.nr_keys == 1 && st.level_nodes[0] == 1);
+    uint64_t splits = st.splits, root_changes = st.root_changes;
+
+    for (uint64_t k=1; k < 10000; ++k) {
+        bptree_insert(&bpt, k, VALUE(k));
+    }
+    bptree_stats(bpt, &st);
+    assert(st.nr_keys == 10000);
+    assert(st.bytes == st.nr_nodes * sizeof(struct bptree));
+    assert(st.level_nodes[0] == 1);
+    assert(st.level_nodes[st.height - 1] == st.nr_leaves);
+    size_t total = 0;
+    for (int i=0; i < st.height; ++i) {
+        total += st.level_nodes[i];
+        assert(i == 0 || st.level_nodes[i] > st.level_nodes[i - 1]);
+    }
+    assert(total == st.nr_nodes);
+    assert(st.min_fill >= (double) (split(ORDER) - 1) / (ORDER - 1));
+    assert(st.min_fill <= 1 && st.avg_fill > 0 && st.avg_fill <= 1);
+
+    // Every split and every new root adds one node.
+#if BPT_STATS
+    assert(st.splits - splits + st.root_changes - root_changes ==
+           st.nr_nodes - 1);
+    assert(st.root_changes - root_changes == (uint64_t) st.height - 1);
+#endif
+    bptree_free(bpt);
+
+    // A full bulk-loaded tree is as shallow as it gets.
+    vector<uint64_t> keys(10000);
+    for (size_t i=0; i < keys.size(); ++i) {
+        keys[i] = i;
+    }
+    bpt = bptree_bulk_load(keys.data(), NULL, keys.size(), 1.0);
+    bptree_stats(bpt, &st);
+    assert(st.nr_keys == keys.size());
+    assert(st.nr_leaves == (keys.size() + ORDER - 2) / (ORDER - 1));
+    bptree_free(bpt);
+
+    // Arena trees are charged whole slabs.
+    bpt = bptree_alloc_arena(0, NULL, NULL);
+    bptree_stats(bpt, &st);
+    assert(st.bytes >= BPT_SLAB_SIZE);
+    bptree_free(bpt);
+}
+
+void test_insert_delete_iterate()
+{
+#if 0
+    vector<uint64_t> keys;
+    keys.push_back(0);
+    struct bptree* bpt = bptree_alloc(0, MAGIC);
+
+    for (int i=0; i < 1000000; ++i) {
+        keys.push_back(rand() % (~0UL - keys.back()));
+
+        if (i % 10000) {
+            for (uint64_t key : keys) {
+                assert(bptree_lookup(bpt, key) == MAGIC); 
+            }
+            bptree_sane(bpt, 1);
+        }
+    }
+#endif
+}
+
+void verify_snapshot(struct bptree* bpt, const map<uint64_t, void*>& ref)
+{
+    bptree_sane(bpt, 1);
+    struct bptree_iter it;
+    uint64_t key;
+    void* val;
+    map<uint64_t, void*>::const_iterator expect = ref.begin();
+    bptree_iter_seek(&it, bpt, 0, ~0ULL);
+    while (bptree_iter_next(&it, &key, &val)) {
+        assert(expect != ref.end());
+        assert(key == expect->first && val == expect->second);
+        ++expect;
+    }
+    if (expect != ref.end()) {
+        assert(expect->first == ~0ULL);
+        assert(bptree_lookup(bpt, ~0ULL) == expect->second);
+        ++expect;
+    }
+    assert(expect == ref.end());
+}
+
+void encode_small(void* ctx, void* val, void* out)
+{
+    ++*(size_t*) ctx;
+    uint32_t small = (uint32_t) (uintptr_t) val;
+    memcpy(out, &small, sizeof(small));
+}
+
+void* decode_small(void* ctx, const void* in)
+{
+    (void) ctx;
+    uint32_t small;
+    memcpy(&small, in, sizeof(small));
+    return VALUE((uintptr_t) small);
+}
+
+struct bptree* reload_snapshot(int fd, struct bptree* bpt,
+                               const struct bptree_codec* codec)
+{
+    assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    assert(bptree_save(bpt, fd, codec) == 0);
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    return bptree_load(fd, codec);
+}
+
+void check_snapshot(int fd, size_t n)
+{
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    ref[0] = VALUE(1);
+    while (ref.size() < n) {
+        uint64_t key = rand() % (n * 4) + 1;
+        bptree_insert(&bpt, key, VALUE(key * 3));
+        ref.insert(make_pair(key, VALUE(key * 3)));
+    }
+    bptree_insert(&bpt, ~0ULL, VALUE(2));
+    ref[~0ULL] = VALUE(2);
+
+    struct bptree* copy = reload_snapshot(fd, bpt, NULL);
+    assert(copy);
+    verify_snapshot(copy, ref);
+    bptree_free(copy);
+
+    size_t encoded = 0;
+    struct bptree_codec codec = {
+        sizeof(uint32_t), encode_small, decode_small, &encoded
+    };
+    copy = reload_snapshot(fd, bpt, &codec);
+    assert(copy && encoded == ref.size());
+    verify_snapshot(copy, ref);
+    bptree_free(copy);
+
+    // Values must be read back at the size they were written with.
+    assert(lseek(fd, 0, SEEK_SET) == 0);
+    errno = 0;
+    assert(!bptree_load(fd, NULL) && errno == EINVAL);
+
+    // A flipped byte anywhere is noticed, ...
+    off_t size = lseek(fd, 0, SEEK_END);
+    for (int i=0; i < 8; ++i) {
+        off_t at = i ? rand() % size : 0;
+        unsigned char byte;
+        assert(pread(fd, &byte, 1, at) == 1);
+        byte ^= 1 << (rand() % 8);
+        assert(pwrite(fd, &byte, 1, at) == 1);
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        errno = 0;
+        assert(!bptree_load(fd, &codec) && errno == EINVAL);
+        assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        assert(bptree_save(bpt, fd, &codec) == 0);
+    }
+
+    // ... as is a snapshot which ends early.
+    assert(ftruncate(fd, size - 1) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    errno = 0;
+    assert(!bptree_load(fd, &codec) && errno == EINVAL);
+    bptree_free(bpt);
+}
+
+struct saved_view {
+    struct bptree* view;
+    int fd;
+};
+
+void* save_view(void* arg)
+{
+    struct saved_view* s = (struct saved_view*) arg;
+    assert(bptree_save(s->view, s->fd, NULL) == 0);
+    return NULL;
+}
+
+// A view saves what it saw, even while its tree moves on under the save.
+void check_saved_view(int fd)
+{
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    ref[0] = VALUE(1);
+    for (uint64_t key=1; key < 1000; ++key) {
+        bptree_insert(&bpt, key, VALUE(key));
+        ref[key] = VALUE(key);
+    }
+    struct bptree* view = bptree_snapshot(bpt);
+    assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+
+    struct saved_view s = { view, fd };
+    pthread_t saver;
+    assert(!pthread_create(&saver, NULL, save_view, &s));
+    for (uint64_t key=1000; key < 3000; ++key) {
+        bptree_insert(&bpt, key, VALUE(key));
+    }
+    for (uint64_t key=1; key < 500; ++key) {
+        bptree_delete(&bpt, key);
+    }
+    pthread_join(saver, NULL);
+
+    // Once the tree has moved on, the view is saved again single-threaded.
+    for (int pass=0; pass < 2; ++pass) {
+        if (pass) {
+            assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+            save_view(&s);
+        }
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        struct bptree* copy = bptree_load(fd, NULL);
+        assert(copy);
+        verify_snapshot(copy, ref);
+        bptree_free(copy);
+    }
+    bptree_snapshot_release(view);
+    bptree_free(bpt);
+}
+
+void test_snapshot()
+{
+    char path[] = "/tmp/testbpt.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    unlink(path);
+
+    check_snapshot(fd, 1);
+    check_snapshot(fd, BPT_SNAPSHOT_BLOCK - 1);
+    check_snapshot(fd, 5 * BPT_SNAPSHOT_BLOCK);
+    check_snapshot(fd, 300000);
+    check_saved_view(fd);
+
+    // An emptied tree keeps its placeholder.
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(5, VALUE(5));
+    bptree_delete(&bpt, 5);
+    ref[0] = NULL;
+    struct bptree* copy = reload_snapshot(fd, bpt, NULL);
+    verify_snapshot(copy, ref);
+    bptree_free(copy);
+    bptree_free(bpt);
+
+    // Empty input is not a snapshot.
+    assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+    errno = 0;
+    assert(!bptree_load(fd, NULL) && errno == EINVAL);
+
+    // Nor is a header which promises more than the file holds, or blocks
+    // too large to be real, however well its checksum matches.
+    const uint64_t nr_keys[] = { 1ULL << 40, ~0ULL, 1000, 1 };
+    const uint32_t blocks[] = { 1024, 1024, 1024, ~0U };
+    for (int i=0; i < 4; ++i) {
+        unsigned char hdr[32];
+        uint64_t magic = 0x3150414e53545042ULL;
+        uint32_t version = 1, value_size = sizeof(void*);
+        memcpy(hdr, &magic, 8);
+        memcpy(hdr + 8, &version, 4);
+        memcpy(hdr + 12, &value_size, 4);
+        memcpy(hdr + 16, &nr_keys[i], 8);
+        memcpy(hdr + 24, &blocks[i], 4);
+        uint32_t crc = bptree_crc32c(0, hdr, 28);
+        memcpy(hdr + 28, &crc, 4);
+        assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        assert(write(fd, hdr, sizeof(hdr)) == sizeof(hdr));
+        assert(write(fd, hdr, sizeof(hdr)) == sizeof(hdr));
+        assert(lseek(fd, 0, SEEK_SET) == 0);
+        errno = 0;
+        assert(!bptree_load(fd, NULL) && errno == EINVAL);
+    }
+    close(fd);
+}
+
+int collect_tuples(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    vector<pair<uint64_t, void*> >* out = (vector<pair<uint64_t, void*> >*) ctx;
+    for (int i=0; i < n; ++i) {
+        out->push_back(make_pair(keys[i], vals[i]));
+    }
+    return 0;
+}
+
+// Check a snapshot through scans and lookups, and a live tree through its
+// leaf chain as well.
+void verify_view(struct bptree* bpt, const map<uint64_t, void*>& ref,
+                 int live)
+{
+    bptree_sane(bpt, 1);
+    vector<pair<uint64_t, void*> > all;
+    bptree_scan(bpt, 0, ~0ULL, collect_tuples, &all);
+    vector<pair<uint64_t, void*> > expect(ref.begin(), ref.end());
+    assert(all == expect);
+
+    all.clear();
+    bptree_scan(bpt, 1000, 3000, collect_tuples, &all);
+    expect.assign(ref.lower_bound(1000), ref.lower_bound(3000));
+    assert(all == expect);
+
+    for (uint64_t key=0; key < 12000; key += 1 + rand() % 7) {
+        map<uint64_t, void*>::const_iterator it = ref.find(key);
+        assert(bptree_lookup(bpt, key) ==
+               (it == ref.end() ? NULL : it->second));
+    }
+    if (live) {
+        struct bptree_iter iter;
+        uint64_t key;
+        void* val;
+        all.clear();
+        bptree_iter_seek(&iter, bpt, 0, ~0ULL);
+        while (bptree_iter_next(&iter, &key, &val)) {
+            all.push_back(make_pair(key, val));
+        }
+        expect.assign(ref.begin(), ref.end());
+        assert(all == expect);
+    }
+}
+
+// Random single-key updates, made to the tree and to ref.
+void change_view(struct bptree** bpt, map<uint64_t, void*>& ref, int n)
+{
+    for (int i=0; i < n; ++i) {
+        uint64_t key = rand() % 10000 + 1;
+        void* val = VALUE(rand() % 1000 + 1);
+        switch (rand() % 5) {
+        case 0:
+            bptree_insert(bpt, key, val);
+            ref.insert(make_pair(key, val));
+            break;
+        case 1:
+            bptree_upsert(bpt, key, val, NULL);
+            ref[key] = val;
+            break;
+        case 2:
+            bptree_modify(*bpt, key, val);
+            if (ref.count(key)) {
+                ref[key] = val;
+            }
+            break;
+        case 3:
+            if (ref.count(key) &&
+                bptree_cas(*bpt, key, ref[key], val, NULL) == BPTREE_UPDATED) {
+                ref[key] = val;
+            }
+            break;
+        default:
+            bptree_delete(bpt, key);
+            ref.erase(key);
+            break;
+        }
+    }
+}
+
+struct view_reader {
+    struct bptree* snap;
+    size_t count;
+    int rounds;
+};
+
+int count_tuples(void* ctx, const uint64_t* keys, void* const* vals, int n)
+{
+    (void) keys;
+    (void) vals;
+    *(size_t*) ctx += n;
+    return 0;
+}
+
+void* read_view(void* arg)
+{
+    struct view_reader* r = (struct view_reader*) arg;
+    for (int i=0; i < r->rounds; ++i) {
+        size_t n = 0;
+        assert(bptree_scan(r->snap, 0, ~0ULL, count_tuples, &n) == r->count);
+        assert(n == r->count);
+    }
+    bptree_snapshot_release(r->snap);
+    return NULL;
+}
+
+// The leaves a view holds the keys in [lo, hi) of ref in.
+size_t distinct_leaves(struct bptree* snap, const map<uint64_t, void*>& ref,
+                       uint64_t lo, uint64_t hi)
+{
+    set<struct bptree*> leaves;
+    map<uint64_t, void*>::const_iterator it = ref.lower_bound(lo);
+    for (; it != ref.end() && it->first < hi; ++it) {
+        leaves.insert(bptree_search(snap, it->first));
+    }
+    return leaves.size();
+}
+
+// How many of those the tree still holds them in too.
+size_t shared_leaves(struct bptree* snap, struct bptree* bpt,
+                     const map<uint64_t, void*>& ref, uint64_t lo, uint64_t hi)
+{
+    set<struct bptree*> leaves;
+    map<uint64_t, void*>::const_iterator it = ref.lower_bound(lo);
+    for (; it != ref.end() && it->first < hi; ++it) {
+        struct bptree* leaf = bptree_search(snap, it->first);
+        if (leaf == bptree_search(bpt, it->first)) {
+            leaves.insert(leaf);
+        }
+    }
+    return leaves.size();
+}
+
+void test_cow()
+{
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(0, VALUE(1));
+    ref[0] = VALUE(1);
+
+    // Fingers into a snapshot stay inside it, off the tree's leaf chain.
+    struct bptree* tree = bptree_alloc(1, VALUE(1));
+    for (uint64_t key=2; key <= 200; ++key) {
+        bptree_insert(&tree, key, VALUE(key));
+    }
+    struct bptree* view = bptree_snapshot(tree);
+    for (uint64_t key=50; key <= 200; ++key) {
+        bptree_modify(tree, key, VALUE(key + 1000));
+    }
+    struct bptree_finger vf;
+    bptree_finger_init(&vf);
+    for (uint64_t key=1; key <= 200; ++key) {
+        assert(bptree_finger_lookup(view, &vf, key) == VALUE(key));
+        assert(bptree_lookup(view, key) == VALUE(key));
+    }
+    bptree_snapshot_release(view);
+    bptree_free(tree);
+
+    // A lone leaf is copied whole.
+    struct bptree* snap = bptree_snapshot(bpt);
+    bptree_insert(&bpt, 5, VALUE(5));
+    assert(!bptree_lookup(snap, 5) && bptree_lookup(bpt, 5) == VALUE(5));
+    bptree_snapshot_release(snap);
+    bptree_delete(&bpt, 5);
+
+    // Snapshots taken between rounds of updates keep what they saw, while
+    // the tree and its leaf chain keep up with the updates.
+    vector<struct bptree*> snaps;
+    vector<map<uint64_t, void*> > refs;
+    for (int round=0; round < 8; ++round) {
+        change_view(&bpt, ref, 6000);
+        snaps.push_back(bptree_snapshot(bpt));
+        refs.push_back(ref);
+        verify_view(bpt, ref, 1);
+    }
+    change_view(&bpt, ref, 6000);
+    verify_view(bpt, ref, 1);
+    for (size_t i=0; i < snaps.size(); ++i) {
+        verify_view(snaps[i], refs[i], 0);
+    }
+
+    // Updates which may touch any part of the tree copy only what they
+    // reach, and the leaves elsewhere stay shared.
+    snap = bptree_snapshot(bpt);
+    map<uint64_t, void*> before(ref);
+    vector<uint64_t> batch;
+    for (uint64_t key=20000; key < 22000; key += 2) {
+        batch.push_back(key);
+        ref[key] = NULL;
+    }
+    bptree_insert_sorted_batch(&bpt, &batch[0], NULL, batch.size());
+    verify_view(bpt, ref, 1);
+    verify_view(snap, before, 0);
+    assert(shared_leaves(snap, bpt, before, 0, 5000) ==
+           distinct_leaves(snap, before, 0, 5000));
+    bptree_snapshot_release(snap);
+
+    snap = bptree_snapshot(bpt);
+    before = ref;
+    bptree_delete_range(&bpt, 2000, 4000, NULL, NULL);
+    ref.erase(ref.lower_bound(2000), ref.lower_bound(4000));
+    verify_view(bpt, ref, 1);
+    assert(shared_leaves(snap, bpt, before, 6000, 20000) ==
+           distinct_leaves(snap, before, 6000, 20000));
+    struct bptree_compaction c = { 0.9, 0, 0, 0, 0 };
+    bptree_compact_step(&bpt, &c, 1);
+    verify_view(bpt, ref, 1);
+    assert(shared_leaves(snap, bpt, before, 8000, 20000) ==
+           distinct_leaves(snap, before, 8000, 20000));
+    bptree_compact(&bpt, 0.9);
+    struct bptree_finger f;
+    bptree_finger_init(&f);
+    for (uint64_t key=30000; key < 30100; ++key) {
+        bptree_finger_insert(&bpt, &f, key, VALUE(key));
+        ref[key] = VALUE(key);
+    }
+    verify_view(bpt, ref, 1);
+    verify_view(snap, before, 0);
+    snaps.push_back(snap);
+    refs.push_back(before);
+
+    // Any mix of them, with a snapshot taken before each.
+    for (int round=0; round < 40; ++round) {
+        snaps.push_back(bptree_snapshot(bpt));
+        refs.push_back(ref);
+        uint64_t lo = rand() % 32000;
+        uint64_t hi = lo + rand() % (round % 2 ? 300 : 6000);
+        bptree_delete_range(&bpt, lo, hi, NULL, NULL);
+        ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+        batch.clear();
+        for (uint64_t key=rand() % 32000; batch.size() < 500;
+             key += rand() % 8 + 1) {
+            batch.push_back(key);
+            ref.insert(make_pair(key, (void*) NULL));
+        }
+        bptree_insert_sorted_batch(&bpt, &batch[0], NULL, batch.size());
+        if (c.done) {
+            c.level = 0;
+            c.next = 0;
+            c.done = 0;
+        }
+        bptree_compact_step(&bpt, &c, 64);
+        for (int i=0; i < 50; ++i) {
+            uint64_t key = rand() % 32000;
+            if (!ref.count(key)) {
+                bptree_finger_insert(&bpt, &f, key, VALUE(key));
+                ref[key] = VALUE(key);
+            }
+        }
+        verify_view(bpt, ref, 1);
+        verify_view(snaps.back(), refs.back(), 0);
+        if (round % 4 == 3) {
+            size_t i = rand() % snaps.size();
+            bptree_snapshot_release(snaps[i]);
+            snaps.erase(snaps.begin() + i);
+            refs.erase(refs.begin() + i);
+        }
+    }
+    for (size_t i=0; i < snaps.size(); ++i) {
+        verify_view(snaps[i], refs[i], 0);
+    }
+
+    // Releasing snapshots in any order leaves the rest intact.
+    while (!snaps.empty()) {
+        size_t i = rand() % snaps.size();
+        bptree_snapshot_release(snaps[i]);
+        snaps.erase(snaps.begin() + i);
+        refs.erase(refs.begin() + i);
+        for (size_t j=0; j < snaps.size(); ++j) {
+            verify_view(snaps[j], refs[j], 0);
+        }
+        change_view(&bpt, ref, 500);
+        verify_view(bpt, ref, 1);
+    }
+
+    // Readers scan a snapshot while the tree is updated, then release it.
+    pthread_t threads[4];
+    struct view_reader readers[4];
+    for (int i=0; i < 4; ++i) {
+        readers[i].snap = bptree_snapshot(bpt);
+        readers[i].count = ref.size();
+        readers[i].rounds = 200;
+        assert(!pthread_create(&threads[i], NULL, read_view, &readers[i]));
+    }
+    change_view(&bpt, ref, 50000);
+    for (int i=0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    verify_view(bpt, ref, 1);
+
+    // A snapshot outlives its tree.
+    snap = bptree_snapshot(bpt);
+    bptree_free(bpt);
+    verify_view(snap, ref, 0);
+    bptree_snapshot_release(snap);
+
+    // Concurrent and arena-backed trees cannot be snapshotted.
+    bpt = bptree_alloc_arena(0, NULL, NULL);
+    assert(!bptree_snapshot(bpt));
+    bptree_free(bpt);
+    bpt = bptree_alloc(0, NULL);
+    bptree_make_concurrent(bpt);
+    assert(!bptree_snapshot(bpt));
+    bptree_free(bpt);
+}
+
+void remove_wal(const char* path)
+{
+    string name(path);
+    unlink(name.c_str());
+    unlink((name + ".log").c_str());
+    unlink((name + ".tmp").c_str());
+}
+
+// A repeatable run of changes, made through w (if not NULL) and to ref.
+void change_wal(struct bptree_wal* w, map<uint64_t, void*>& ref,
+                uint64_t seed, int n)
+{
+    for (int i=0; i < n; ++i) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t key = (seed >> 33) % 5000 + 1;
+        void* val = VALUE(i + 1);
+        int present = ref.count(key);
+        switch ((seed >> 20) % 4) {
+        case 0:
+        case 1:
+            assert(!w || bptree_wal_insert(w, key, val) == !present);
+            ref.insert(make_pair(key, val));
+            break;
+        case 2:
+            assert(!w || bptree_wal_modify(w, key, val) == present);
+            if (present) {
+                ref[key] = val;
+            }
+            break;
+        default:
+            assert(!w || bptree_wal_delete(w, key) ==
+                   (present ? ref[key] : NULL));
+            ref.erase(key);
+            break;
+        }
+    }
+}
+
+void verify_wal(struct bptree_wal* w, map<uint64_t, void*>& ref)
+{
+    for (uint64_t key=0; key <= 5001; ++key) {
+        assert(bptree_wal_lookup(w, key) ==
+               (ref.count(key) ? ref[key] : NULL));
+    }
+}
+
+void check_wal(const char* path, enum bptree_durability durability,
+               const struct bptree_codec* codec)
+{
+    map<uint64_t, void*> ref;
+    struct bptree_wal_stats st;
+    remove_wal(path);
+    struct bptree_wal* w = bptree_wal_open(path, codec, durability);
+    assert(w);
+    assert(bptree_wal_lookup(w, 1) == NULL);
+    change_wal(w, ref, 1, 20000);
+    verify_wal(w, ref);
+    bptree_wal_stats(w, &st);
+    uint64_t records = st.records;
+    bptree_wal_close(w);
+
+    // Everything comes back from the log alone, ...
+    w = bptree_wal_open(path, codec, durability);
+    verify_wal(w, ref);
+    bptree_wal_stats(w, &st);
+    assert(st.replayed == records);
+
+    // ... and from a checkpoint and the log after it.
+    assert(bptree_wal_checkpoint(w) == 0);
+    change_wal(w, ref, 2, 1000);
+    bptree_wal_stats(w, &st);
+    records = st.records;
+    bptree_wal_close(w);
+    w = bptree_wal_open(path, codec, durability);
+    verify_wal(w, ref);
+    bptree_wal_stats(w, &st);
+    assert(st.replayed == records);
+    bptree_wal_close(w);
+
+    // Changes survive a crash once they have returned (or, for asynchronous
+    // logs, once they are synced).
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        map<uint64_t, void*> mine(ref);
+        w = bptree_wal_open(path, codec, durability);
+        change_wal(w, mine, 3, 5000);
+        assert(bptree_wal_checkpoint(w) == 0);
+        change_wal(w, mine, 4, 5000);
+        if (durability == BPT_DURABLE_ASYNC) {
+            bptree_wal_sync(w);
+        }
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    change_wal(NULL, ref, 3, 5000);
+    change_wal(NULL, ref, 4, 5000);
+    w = bptree_wal_open(path, codec, durability);
+    assert(w);
+    verify_wal(w, ref);
+    bptree_wal_close(w);
+
+    // A record torn by a crash is dropped, and later ones follow the last
+    // good one.
+    string log = string(path) + ".log";
+    FILE* fp = fopen(log.c_str(), "a");
+    fwrite("\x01\x02\x03\x04\x01\x05\x06", 1, 7, fp);
+    fclose(fp);
+    w = bptree_wal_open(path, codec, durability);
+    assert(w);
+    verify_wal(w, ref);
+    change_wal(w, ref, 5, 1000);
+    bptree_wal_close(w);
+    w = bptree_wal_open(path, codec, durability);
+    verify_wal(w, ref);
+
+    // Emptying the tree and checkpointing leaves no checkpoint behind.
+    for (uint64_t key=0; key <= 5001; ++key) {
+        bptree_wal_delete(w, key);
+    }
+    assert(bptree_wal_checkpoint(w) == 0);
+    assert(access(path, F_OK) != 0);
+    bptree_wal_insert(w, 7, VALUE(7));
+    bptree_wal_close(w);
+    w = bptree_wal_open(path, codec, durability);
+    assert(bptree_wal_lookup(w, 7) == VALUE(7));
+    assert(bptree_wal_checkpoint(w) == 0);
+    bptree_wal_close(w);
+
+    // The value size has to match the one the files were written with.
+    struct bptree_codec other = { 2, NULL, NULL, NULL };
+    errno = 0;
+    assert(!bptree_wal_open(path, &other, durability) && errno == EINVAL);
+    remove_wal(path);
+}
+
+struct wal_worker {
+    struct bptree_wal* w;
+    uint64_t base;
+};
+
+void* wal_writer(void* arg)
+{
+    struct wal_worker* ww = (struct wal_worker*) arg;
+    for (uint64_t i=0; i < 500; ++i) {
+        assert(bptree_wal_insert(ww->w, ww->base + i, VALUE(i + 1)));
+    }
+    return NULL;
+}
+
+// Checkpoints, from two threads at once, between the writers' inserts.
+void* wal_checkpointer(void* arg)
+{
+    struct wal_worker* ww = (struct wal_worker*) arg;
+    for (int i=0; i < 10; ++i) {
+        assert(bptree_wal_checkpoint(ww->w) == 0);
+        bptree_wal_lookup(ww->w, ww->base);
+    }
+    return NULL;
+}
+
+void test_wal()
+{
+    char path[] = "/tmp/testbpt.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    size_t encoded = 0;
+    struct bptree_codec codec = {
+        sizeof(uint32_t), encode_small, decode_small, &encoded
+    };
+    check_wal(path, BPT_DURABLE_OP, NULL);
+    check_wal(path, BPT_DURABLE_GROUP, NULL);
+    check_wal(path, BPT_DURABLE_ASYNC, NULL);
+    check_wal(path, BPT_DURABLE_GROUP, &codec);
+    assert(encoded > 0);
+
+    // Concurrent writers share syncs, and checkpoints may run among them.
+    remove_wal(path);
+    struct bptree_wal* w = bptree_wal_open(path, NULL, BPT_DURABLE_GROUP);
+    pthread_t threads[10];
+    struct wal_worker workers[10];
+    for (int i=0; i < 10; ++i) {
+        workers[i].w = w;
+        workers[i].base = i * 1000;
+        assert(!pthread_create(&threads[i], NULL,
+                               i < 8 ? wal_writer : wal_checkpointer,
+                               &workers[i]));
+    }
+    for (int i=0; i < 10; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    struct bptree_wal_stats st;
+    bptree_wal_stats(w, &st);
+    assert(st.records == 4000 && st.syncs <= st.records);
+    bptree_wal_close(w);
+    w = bptree_wal_open(path, NULL, BPT_DURABLE_GROUP);
+    for (uint64_t i=0; i < 8000; ++i) {
+        assert(bptree_wal_lookup(w, i) == (i % 1000 < 500 ?
+                                           VALUE(i % 1000 + 1) : NULL));
+    }
+    bptree_wal_close(w);
+    remove_wal(path);
+}
+
+// Check a packed copy of sorted, distinct keys against the keys themselves.
+void check_pack(const vector<uint64_t>& keys)
+{
+    vector<void*> vals;
+    for (size_t i=0; i < keys.size(); ++i) {
+        vals.push_back(VALUE(i + 1));
+    }
+    struct bptree_packed* p =
+        bptree_pack_sorted(keys.data(), vals.data(), keys.size());
+    struct bptree_packed_stats st;
+    bptree_packed_stats(p, &st);
+    assert(st.nr_keys == keys.size());
+    assert(st.nr_leaves == (keys.size() + BPT_PACK_LEAF - 1) / BPT_PACK_LEAF);
+    assert(st.leaves_by_width[0] + st.leaves_by_width[1] +
+           st.leaves_by_width[2] + st.leaves_by_width[3] == st.nr_leaves);
+
+    for (size_t i=0; i < keys.size(); ++i) {
+        void* val = NULL;
+        assert(bptree_packed_find(p, keys[i], &val) && val == vals[i]);
+        uint64_t below = keys[i] - 1;
+        if (keys[i] > 0 && (i == 0 || keys[i - 1] != below)) {
+            assert(!bptree_packed_find(p, below, NULL));
+        }
+        uint64_t above = keys[i] + 1;
+        if (keys[i] < ~0ULL && (i + 1 == keys.size() ||
+                                keys[i + 1] != above)) {
+            assert(!bptree_packed_lookup(p, above));
+        }
+    }
+
+    vector<pair<uint64_t, void*> > all;
+    assert(bptree_packed_scan(p, 0, ~0ULL, collect_tuples, &all) ==
+           all.size());
+    size_t n = keys.size() - (keys.back() == ~0ULL);
+    assert(all.size() == n);
+    for (size_t i=0; i < n; ++i) {
+        assert(all[i].first == keys[i] && all[i].second == vals[i]);
+    }
+    for (int round=0; round < 100; ++round) {
+        size_t a = rand() % keys.size();
+        size_t b = a + rand() % (keys.size() - a);
+        uint64_t lo = keys[a] + rand() % 2;
+        uint64_t hi = keys[b] + rand() % 2;
+        all.clear();
+        bptree_packed_scan(p, lo, hi, collect_tuples, &all);
+        vector<uint64_t>::const_iterator first =
+            lower_bound(keys.begin(), keys.end(), lo);
+        vector<uint64_t>::const_iterator last =
+            lower_bound(keys.begin(), keys.end(), hi);
+        assert(all.size() == (size_t) (lo < hi ? last - first : 0));
+        for (size_t i=0; i < all.size(); ++i) {
+            assert(all[i].first == first[i]);
+        }
+    }
+    bptree_packed_free(p);
+}
+
+void test_pack()
+{
+    assert(!bptree_pack_sorted(NULL, NULL, 0));
+    assert(!bptree_packed_find(NULL, 0, NULL));
+
+    size_t sizes[] = { 1, 63, 64, 65, 10000, 200000 };
+    uint64_t gaps[] = { 1, 3, 1000, 1ULL << 24 };
+    for (int s=0; s < 6; ++s) {
+        for (int g=0; g < 4; ++g) {
+            vector<uint64_t> keys;
+            uint64_t key = rand() % 1000;
+            for (size_t i=0; i < sizes[s]; ++i) {
+                keys.push_back(key);
+                key += 1 + rand() % gaps[g];
+            }
+            check_pack(keys);
+        }
+
+        set<uint64_t> wide;
+        wide.insert(0);
+        wide.insert(~0ULL);
+        while (wide.size() < sizes[s]) {
+            wide.insert(((uint64_t) rand() << 42) ^
+                        ((uint64_t) rand() << 21) ^ rand());
+        }
+        check_pack(vector<uint64_t>(wide.begin(), wide.end()));
+    }
+
+    // Dense keys take one byte each, and every leaf is as narrow as its
+    // span allows.
+    vector<uint64_t> keys;
+    for (uint64_t i=0; i < 100000; ++i) {
+        keys.push_back(1ULL << 40 | i);
+    }
+    struct bptree_packed* p =
+        bptree_pack_sorted(keys.data(), NULL, keys.size());
+    struct bptree_packed_stats st;
+    bptree_packed_stats(p, &st);
+    assert(st.leaves_by_width[0] == st.nr_leaves);
+    assert(st.key_bytes < keys.size() * 2);
+    assert(bptree_packed_find(p, 1ULL << 40, NULL));
+    assert(!bptree_packed_find(p, 0, NULL));
+    bptree_packed_free(p);
+
+    keys.clear();
+    for (uint64_t i=0; i < 256; ++i) {
+        keys.push_back(i << (i < 64 ? 1 : i < 128 ? 9 : i < 192 ? 17 : 40));
+    }
+    p = bptree_pack_sorted(keys.data(), NULL, keys.size());
+    bptree_packed_stats(p, &st);
+    for (int w=0; w < 4; ++w) {
+        assert(st.leaves_by_width[w] == 1);
+    }
+    bptree_packed_free(p);
+    check_pack(keys);
+
+    // Trees and snapshots pack to the same tuples.
+    map<uint64_t, void*> ref;
+    struct bptree* bpt = bptree_alloc(~0ULL, VALUE(7));
+    ref[~0ULL] = VALUE(7);
+    for (int i=0; i < 20000; ++i) {
+        uint64_t key = rand() % 100000;
+        bptree_insert(&bpt, key, VALUE(key + 1));
+        ref.insert(make_pair(key, VALUE(key + 1)));
+    }
+    struct bptree* snap = bptree_snapshot(bpt);
+    for (int i=0; i < 5000; ++i) {
+        bptree_insert(&bpt, 100000 + i, NULL);
+    }
+    struct bptree_packed* trees[2] = { bptree_pack(snap), bptree_pack(bpt) };
+    bptree_packed_stats(trees[0], &st);
+    assert(st.nr_keys == ref.size());
+    bptree_packed_stats(trees[1], &st);
+    assert(st.nr_keys == ref.size() + 5000);
+    for (map<uint64_t, void*>::iterator it=ref.begin(); it != ref.end();
+         ++it) {
+        for (int t=0; t < 2; ++t) {
+            void* val = NULL;
+            assert(bptree_packed_find(trees[t], it->first, &val));
+            assert(val == it->second);
+        }
+    }
+    assert(!bptree_packed_find(trees[0], 100000, NULL));
+    assert(bptree_packed_find(trees[1], 100000, NULL));
+    bptree_packed_free(trees[0]);
+    bptree_packed_free(trees[1]);
+    bptree_snapshot_release(snap);
+    bptree_free(bpt);
+}
+
+int main()
+{
+    srand(time(NULL));
+
+    printf("test_search...\n");
+    test_search();
+
+    printf("test_inserts...\n");
+    test_inserts();
+
+    printf("test_modify...\n");
+    test_modify();
+
+    printf("test_upsert...\n");
+    test_upsert();
+
+    printf("test_iterate...\n");
+    test_iterate();
+
+    printf("test_template...\n");
+    test_template();
+
+    printf("test_bulk_load...\n");
+    test_bulk_load();
+
+    printf("test_lookup_batch...\n");
+    test_lookup_batch();
+
+    printf("test_range_scan...\n");
+    test_range_scan();
+
+    printf("test_arena...\n");
+    test_arena();
+
+    printf("test_stats...\n");
+    test_stats();
+
+    printf("test_concurrent...\n");
+    test_concurrent();
+
+    printf("test_deletes...\n");
+    test_deletes();
+
+    printf("test_delete_random...\n");
+    test_delete_random();
+
+    printf("test_delete_range...\n");
+    test_delete_range();
+
+    printf("test_sorted_batch...\n");
+    test_sorted_batch();
+
+    printf("test_finger...\n");
+    test_finger();
+
+    printf("test_fill...\n");
+    test_fill();
+
+    printf("test_compact...\n");
+    test_compact();
+
+    printf("test_order_stats...\n");
+    test_order_stats();
+
+    printf("test_filter...\n");
+    test_filter();
+
+    printf("test_cow...\n");
+    test_cow();
+
+    printf("test_file...\n");
+    test_file();
+
+    printf("test_snapshot...\n");
+    test_snapshot();
+
+    printf("test_wal...\n");
+    test_wal();
+
+    printf("test_pack...\n");
+    test_pack();
 
     printf("test_insert_delete_iterate...\n");
     test_insert_delete_iterate();